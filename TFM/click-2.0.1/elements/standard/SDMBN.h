@@ -41,6 +41,13 @@ typedef struct SDMBNExt {
 
 #define SDMBN_EXT_MAX_CHUNKS    0x01
 
+#define SDMBN_BASE64_LEGACY     0   // one character per nibble
+#define SDMBN_BASE64_V1         1   // RFC 4648 base64, version-prefixed
+
+#define SDMBN_BASE64_IMPL_SCALAR    0
+#define SDMBN_BASE64_IMPL_SSSE3     1
+#define SDMBN_BASE64_IMPL_AVX2      2
+
 typedef struct {
     int (*init)();
     int (*cleanup)();
@@ -61,6 +68,9 @@ typedef struct {
     
 } SDMBNLocals;
 
+// Coalesces states sent for one get call into few large writes
+typedef struct SDMBNBatch SDMBNBatch;
+
 typedef struct {
     int injected;
     int stop;
@@ -78,6 +88,13 @@ int sdmbn_send_allflows(int id, char *state, int seq);
 int sdmbn_send_multiflow(int id, PerflowKey *key, char *state, int hashkey, 
         int seq);
 int sdmbn_send_config(int id, char *state, int seq);
+SDMBNBatch *sdmbn_batch_open(int id);
+int sdmbn_send_perflow_batch(SDMBNBatch *batch, PerflowKey *key, 
+        char *state, int hashkey, int seq);
+int sdmbn_send_multiflow_batch(SDMBNBatch *batch, PerflowKey *key, 
+        char *state, int hashkey, int seq);
+int sdmbn_batch_flush(SDMBNBatch *batch);
+int sdmbn_batch_close(SDMBNBatch *batch);
 
 void sdmbn_notify_packet_received(char *type, struct timeval *recv_time);
 void sdmbn_notify_flow_created();
@@ -90,7 +107,18 @@ void sdmbn_postprocess_packet(const struct pcap_pkthdr *hdr,
         const unsigned char *pkt, ProcessContext *context);
 
 char *sdmbn_base64_encode(void *blob, int size);
+char *sdmbn_base64_encode_version(void *blob, int size, int version);
 void *sdmbn_base64_decode(char *blob);
+void *sdmbn_base64_decode_len(char *blob, int *size);
+void sdmbn_base64_set_version(int version);
+int sdmbn_base64_get_version();
+int sdmbn_base64_set_impl(int impl);
+
+void sdmbn_state_set_binary(int enable);
+int sdmbn_state_binary();
+
+int sdmbn_trace_enable(int enable);
+int sdmbn_trace_dump(const char *path);
 #endif
 
 #ifdef __cplusplus
@@ -18,16 +18,19 @@
 
 #include <click/config.h>
 #include "srcmark.hh"
+#include "tfmtag.hh"
 #include <click/args.hh>
 #include <click/error.hh>
 CLICK_DECLS
 
 Srcmark::Srcmark()
+    : _header(false)
 {
 }
 int
 Srcmark::initialize(ErrorHandler *errh)
 {
+    return 0;
 }
 Srcmark::~Srcmark()
 {
@@ -35,7 +38,15 @@ Srcmark::~Srcmark()
 int
 Srcmark::configure(Vector<String> &conf, ErrorHandler *errh)
 {
-    return Args(conf, this, errh).read_mp("LENGTH", k).complete();
+    int anno = TFM_TAG_ANNO_OFFSET;
+    if (Args(conf, this, errh)
+        .read_mp("LENGTH", k)
+        .read("ANNO", AnnoArg(1), anno)
+        .read("HEADER", _header)
+        .complete() < 0)
+        return -1;
+    _anno = anno;
+    return 0;
 }
 
 void 
@@ -50,16 +61,11 @@ Srcmark::push(int port, Packet *p)
 inline Packet *
 Srcmark::smaction(Packet *p)
 {
-    assert(p->has_network_header());
-    WritablePacket *q;
-    if (!(q = p->uniqueify()))
-	return 0;
-    click_ip *ip = q->ip_header();
-    uint16_t old_hw = (reinterpret_cast<uint16_t *>(ip))[0];
-    //inpkt  normal:tos:flag = 0:0  ->  inflypkt:tos:flag = 0:1, redirect:tos:flag = 1:0->lastinfly tos:flag = 1:1      
-    ip->ip_off = (ip->ip_off | htons(0x8000));   
-    click_update_in_cksum(&ip->ip_sum, old_hw, reinterpret_cast<uint16_t *>(ip)[0]);
-    return q;
+    //inpkt  normal:tos:flag = 0:0  ->  inflypkt:tos:flag = 0:1, redirect:tos:flag = 1:0->lastinfly tos:flag = 1:1
+    if (_header)
+        return tfm_tag_header(p, TFM_TAG_INFLY);
+    tfm_tag_anno(p, _anno, TFM_TAG_INFLY);
+    return p;
 }
 
 CLICK_ENDDECLS
@@ -2,24 +2,36 @@
 #ifndef CLICK_SRCMARK_HH
 #define CLICK_SRCMARK_HH
 #include <click/element.hh>
-#include <click/standard/storage.hh>
 CLICK_DECLS
 
 /*
  * =c
- * Strip(LENGTH)
+ * Srcmark(LENGTH [, I<keywords> ANNO, HEADER])
  * =s basicmod
- * strips bytes from front of packets
+ * tags packets as in-flight
  * =d
- * Deletes the first LENGTH bytes from each packet.
- * =e
- * Use this to get rid of the Ethernet header:
+ * Tags every packet as in-flight on the source side of a migration.  By
+ * default only the migration tag annotation is set; Tagwrite puts it into
+ * the IP header where the packet leaves the box.  LENGTH is unused.
  *
- *   Strip(14)
- * =a StripToNetworkHeader, StripIPHeader, EtherEncap, IPEncap, Truncate
+ * Keyword arguments are:
+ *
+ * =over 8
+ *
+ * =item ANNO
+ *
+ * Annotation byte holding the tag.  Must match Tagwrite.
+ *
+ * =item HEADER
+ *
+ * Boolean.  If true, set the reserved IP flag directly instead of the
+ * annotation, copying shared packets.  Default false.
+ *
+ * =back
+ * =a Tagwrite, Tagredirect, Tfm
  */
 
-class Srcmark : public Element,public Storage { public:
+class Srcmark : public Element { public:
 
     Srcmark();
     ~Srcmark();
@@ -34,11 +46,11 @@ class Srcmark : public Element,public Storage { public:
     //Packet *simple_action(Packet *);
     void push(int port, Packet *p);
     inline Packet *smaction(Packet *p);
-    //buffer B1 and B2 ,push and release
-    //B1 buffer infly pkts, B2 buffer redirect pkts
     private:
 
     int k;
+    uint8_t _anno;
+    bool _header;
 };
 
 CLICK_ENDDECLS
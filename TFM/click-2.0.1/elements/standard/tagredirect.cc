@@ -18,16 +18,19 @@
 
 #include <click/config.h>
 #include "tagredirect.hh"
+#include "tfmtag.hh"
 #include <click/args.hh>
 #include <click/error.hh>
 CLICK_DECLS
 
 Tagredirect::Tagredirect()
+    : _header(false)
 {
 }
 int
 Tagredirect::initialize(ErrorHandler *errh)
 {
+    return 0;
 }
 Tagredirect::~Tagredirect()
 {
@@ -35,7 +38,15 @@ Tagredirect::~Tagredirect()
 int
 Tagredirect::configure(Vector<String> &conf, ErrorHandler *errh)
 {
-    return Args(conf, this, errh).read_mp("open", open).complete();
+    int anno = TFM_TAG_ANNO_OFFSET;
+    if (Args(conf, this, errh)
+        .read_mp("open", open)
+        .read("ANNO", AnnoArg(1), anno)
+        .read("HEADER", _header)
+        .complete() < 0)
+        return -1;
+    _anno = anno;
+    return 0;
 }
 
 void 
@@ -47,17 +58,15 @@ Tagredirect::push(int port, Packet *p)
     }
     else
     {
-        assert(p->has_network_header());
-        WritablePacket *q;
-        if (!(q = p->uniqueify()))
-        return;
-        click_ip *ip = q->ip_header();
-        uint16_t old_hw = (reinterpret_cast<uint16_t *>(ip))[0];
-        //inpkt  normal:tos:flag = 0:0  ->  inflypkt:tos:flag = 0:1, redirect:tos:flag = 1:0->lastinfly tos:flag = 1:1      
-        //ip->ip_off = (ip->ip_off & 0x7fff);   
-        ip->ip_tos = (ip->ip_tos | 0x01);   
-        click_update_in_cksum(&ip->ip_sum, old_hw, reinterpret_cast<uint16_t *>(ip)[0]);
-        output(0).push(q);
+        //inpkt  normal:tos:flag = 0:0  ->  inflypkt:tos:flag = 0:1, redirect:tos:flag = 1:0->lastinfly tos:flag = 1:1
+        if (_header)
+        {
+            if ((p = tfm_tag_header(p, TFM_TAG_REDIRECT)))
+                output(0).push(p);
+            return;
+        }
+        tfm_tag_anno(p, _anno, TFM_TAG_REDIRECT);
+        output(0).push(p);
     }
     return;
 }
@@ -2,24 +2,40 @@
 #ifndef CLICK_TAGREDIRECT_HH
 #define CLICK_TAGREDIRECT_HH
 #include <click/element.hh>
-#include <click/standard/storage.hh>
 CLICK_DECLS
 
 /*
  * =c
- * Strip(LENGTH)
+ * Tagredirect(open [, I<keywords> ANNO, HEADER])
  * =s basicmod
- * strips bytes from front of packets
+ * tags packets as redirected
  * =d
- * Deletes the first LENGTH bytes from each packet.
- * =e
- * Use this to get rid of the Ethernet header:
+ * While open is true, tags every packet as redirected; otherwise packets
+ * pass unchanged.  By default only the migration tag annotation is set;
+ * Tagwrite puts it into the IP header where the packet leaves the box.
  *
- *   Strip(14)
- * =a StripToNetworkHeader, StripIPHeader, EtherEncap, IPEncap, Truncate
+ * Keyword arguments are:
+ *
+ * =over 8
+ *
+ * =item ANNO
+ *
+ * Annotation byte holding the tag.  Must match Tagwrite.
+ *
+ * =item HEADER
+ *
+ * Boolean.  If true, set bit 0 of the IP TOS directly instead of the
+ * annotation, copying shared packets.  Default false.
+ *
+ * =back
+ *
+ * =h tagopen write-only
+ *
+ * Sets open.
+ * =a Tagwrite, Srcmark, Tfm
  */
 
-class Tagredirect : public Element,public Storage { public:
+class Tagredirect : public Element { public:
 
     Tagredirect();
     ~Tagredirect();
@@ -34,11 +50,11 @@ class Tagredirect : public Element,public Storage { public:
     //Packet *simple_action(Packet *);
     void push(int port, Packet *p);
     void add_handlers();
-    //buffer B1 and B2 ,push and release
-    //B1 buffer infly pkts, B2 buffer redirect pkts
     private:
     static int write_handler(const String&, Element*, void*, ErrorHandler*);
     int open;
+    uint8_t _anno;
+    bool _header;
 };
 
 CLICK_ENDDECLS
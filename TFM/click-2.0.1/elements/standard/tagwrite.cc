@@ -0,0 +1,54 @@
+// -*- mode: c++; c-basic-offset: 4 -*-
+/*
+ * tagwrite.{cc,hh} -- element writes migration tags into IP headers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Click LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Click LICENSE file; the license in that file is
+ * legally binding.
+ */
+
+#include <click/config.h>
+#include "tagwrite.hh"
+#include "tfmtag.hh"
+#include <click/args.hh>
+#include <click/error.hh>
+CLICK_DECLS
+
+Tagwrite::Tagwrite()
+{
+}
+
+Tagwrite::~Tagwrite()
+{
+}
+
+int
+Tagwrite::configure(Vector<String> &conf, ErrorHandler *errh)
+{
+    int anno = TFM_TAG_ANNO_OFFSET;
+    if (Args(conf, this, errh)
+        .read_p("ANNO", AnnoArg(1), anno).complete() < 0)
+        return -1;
+    _anno = anno;
+    return 0;
+}
+
+Packet *
+Tagwrite::simple_action(Packet *p)
+{
+    uint8_t bits = p->anno_u8(_anno);
+    if (!bits)
+        return p;
+    p->set_anno_u8(_anno, 0);
+    return tfm_tag_header(p, bits);
+}
+
+CLICK_ENDDECLS
+EXPORT_ELEMENT(Tagwrite)
+ELEMENT_MT_SAFE(Tagwrite)
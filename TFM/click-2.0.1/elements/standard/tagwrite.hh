@@ -0,0 +1,47 @@
+// -*- mode: c++; c-basic-offset: 4 -*-
+#ifndef CLICK_TAGWRITE_HH
+#define CLICK_TAGWRITE_HH
+#include <click/element.hh>
+CLICK_DECLS
+
+/*
+ * =c
+ * Tagwrite([ANNO])
+ * =s basicmod
+ * writes migration tag annotations into IP headers
+ * =d
+ * Expects IP packets with the network header set.  ORs the migration tag
+ * annotation set by Srcmark, Tagredirect or Tfm into the IP header: the
+ * redirect bit into bit 0 of the TOS and the in-flight bit into the reserved
+ * IP flag, with one incremental checksum update.  The packet is only copied
+ * if it is shared and its header actually changes.  The annotation is then
+ * cleared.
+ *
+ * Place Tagwrite where tagged packets leave the box, for example in front of
+ * ToDevice or ToDump.  ANNO selects the one-byte annotation holding the tag;
+ * it must match the upstream elements.
+ * =e
+ *   ... -> Srcmark(0) -> Tagwrite -> ToDevice(eth1);
+ * =a Srcmark, Tagredirect, Tfm
+ */
+
+class Tagwrite : public Element { public:
+
+    Tagwrite();
+    ~Tagwrite();
+
+    const char *class_name() const		{ return "Tagwrite"; }
+    const char *port_count() const		{ return PORTS_1_1; }
+
+    int configure(Vector<String> &, ErrorHandler *);
+
+    Packet *simple_action(Packet *);
+
+  private:
+
+    uint8_t _anno;
+
+};
+
+CLICK_ENDDECLS
+#endif
@@ -10,7 +10,7 @@
  * to deal in the Software without restriction, subject to the conditions
  * listed in the Click LICENSE file. These conditions include: you must
  * preserve this copyright notice, and you cannot mention the copyright
- * holders in advertising related to the Software without their permission.
+ * holders in advertising related to the Software without their permission.
  * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
  * notice is a summary of the Click LICENSE file; the license in that file is
  * legally binding.
@@ -18,306 +18,692 @@
 
 #include <click/config.h>
 #include "tfm.hh"
+#include "tfmtag.hh"
 #include <click/args.hh>
 #include <click/error.hh>
 #include <click/glue.hh>
+#include <click/straccum.hh>
+#include <click/standard/scheduleinfo.hh>
+#include <clicknet/ip.h>
+#include <clicknet/udp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
-#include <json/json.h>
 CLICK_DECLS
 
-Tfm::Tfm()
-    : _q1(0),_q2(0)
+// the flow cache is only a shortcut; drop it rather than let it grow
+#define FLOW_CACHE_MAX 65536
+// delay before reconnecting to the controller
+#define CTRL_RETRY_MSEC 1000
+
+// monotonic clock in nanoseconds, used for all Tfm measurements
+static inline uint64_t
+tfm_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Tfm::FlowTuple::FlowTuple(const Packet *p)
+{
+    const click_ip *iph = p->ip_header();
+    uint16_t sport = 0, dport = 0;
+    proto = iph->ip_p;
+    if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && IP_FIRSTFRAG(iph))
+    {
+        const uint8_t *th = reinterpret_cast<const uint8_t *>(iph) + (iph->ip_hl << 2);
+        if (th + 4 <= p->end_data())
+        {
+            sport = reinterpret_cast<const uint16_t *>(th)[0];
+            dport = reinterpret_cast<const uint16_t *>(th)[1];
+        }
+    }
+    flow = IPFlowID(IPAddress(iph->ip_src), sport, IPAddress(iph->ip_dst), dport);
+}
+
+bool
+Tfm::FlowPattern::match(const FlowTuple &t) const
+{
+    return t.flow.saddr().matches_prefix(src, src_mask)
+        && t.flow.daddr().matches_prefix(dst, dst_mask)
+        && (!proto || proto == t.proto)
+        && (!sport || sport == t.flow.sport())
+        && (!dport || dport == t.flow.dport());
+}
+
+int
+Tfm::FlowPattern::specificity() const
+{
+    int n = 0;
+    if (src_mask)
+        n += src_mask.mask_to_prefix_len();
+    if (dst_mask)
+        n += dst_mask.mask_to_prefix_len();
+    if (proto)
+        n += 8;
+    if (sport)
+        n += 16;
+    if (dport)
+        n += 16;
+    return n;
+}
+
+String
+Tfm::FlowPattern::unparse() const
+{
+    StringAccum sa;
+    sa << src.unparse_with_mask(src_mask) << ' '
+       << dst.unparse_with_mask(dst_mask) << ' '
+       << (int) proto << ' ' << ntohs(sport) << ' ' << ntohs(dport);
+    return sa.take_string();
+}
+
+void
+Tfm::Stat::add(const Stat &x)
+{
+    normal_num += x.normal_num;
+    infly_num += x.infly_num;
+    redirect_num += x.redirect_num;
+    lastinfly_num += x.lastinfly_num;
+    drops += x.drops;
+}
+
+Tfm::Session::Session(int i, int o, const FlowPattern &fp, int nthreads)
+    : id(i), op(o), pattern(fp), released(0), reordered(0), timeout_drops(0),
+      stats(nthreads, ThreadStat())
 {
     current_state = S_NORMAL;
-    b_stateinstalled = 0;
-    tstart = 0;
-    tfinish = 0;
-    bptime = 0;
-    sockfd = 0;
-    //nb1 = 0;
-    //nb2=0;
+    finished = 0;
+    timed_out = 0;
+    discard = 0;
+    drain = 0;
+    memset(t_state, 0, sizeof(t_state));
+    t_finish = t_drained = 0;
+    b1_hwm = 0;
+    b2_hwm = 0;
+    b1.initialize(nthreads);
+    b2.initialize(nthreads);
 }
+
+Tfm::Stat
+Tfm::Session::stat() const
+{
+    return merge(stats);
+}
+
+Tfm::Tfm()
+    : _nthreads(1), _header(false), _capacity(10000000), _capacity_bytes(0),
+      _burst(32), _rate(0), _task(this), _timer(&_task), _drain_cursor(0),
+      _released(0), _ctrl_addr(inet_addr("10.21.2.185")), _ctrl_port(7790),
+      _ctrl_fd(-1), _ctrl_state(CTRL_CLOSED), _ctrl_wpos(0), _ctrl_acks(0),
+      _ctrl_task(this), _ctrl_timer(this), _order(ORDER_NONE),
+      _reordered(0), _timeout_drop(false), _timeouts(0)
+{
+    _buffered = 0;
+    _buffered_bytes = 0;
+    _overflows = 0;
+    _buffered_hwm = 0;
+}
+
+Tfm::~Tfm()
+{
+}
+
+int
+Tfm::configure(Vector<String> &conf, ErrorHandler *errh)
+{
+    int anno = TFM_TAG_ANNO_OFFSET;
+    String order = "NONE", policy = "RELEASE";
+    if (Args(conf, this, errh)
+        .read_mp("LENGTH", k)
+        .read("CAPACITY", _capacity)
+        .read("CAPACITY_BYTES", _capacity_bytes)
+        .read("BURST", _burst)
+        .read("RATE", _rate)
+        .read("HOST", _ctrl_addr)
+        .read("PORT", IPPortArg(IP_PROTO_TCP), _ctrl_port)
+        .read("ANNO", AnnoArg(1), anno)
+        .read("HEADER", _header)
+        .read("ORDER", WordArg(), order)
+        .read("TIMEOUT", _timeout)
+        .read("TIMEOUT_POLICY", WordArg(), policy)
+        .complete() < 0)
+        return -1;
+    _anno = anno;
+    order = order.upper();
+    if (order == "NONE")
+        _order = ORDER_NONE;
+    else if (order == "UDPSEQ")
+        _order = ORDER_UDPSEQ;
+    else if (order == "TCPSEQ")
+        _order = ORDER_TCPSEQ;
+    else
+        return errh->error("ORDER must be NONE, UDPSEQ or TCPSEQ");
+    policy = policy.upper();
+    if (policy == "RELEASE" || policy == "DROP")
+        _timeout_drop = (policy == "DROP");
+    else
+        return errh->error("TIMEOUT_POLICY must be RELEASE or DROP");
+    return 0;
+}
+
 int
 Tfm::initialize(ErrorHandler *errh)
 {
-    B1head = 0;
-    B1tail = 0;
-    B2head = 0;
-    B2tail = 0;
-    capacity = 10000000;
-    assert(!_q1 || !_q2 );
-    _q1 = (Packet **) CLICK_LALLOC(sizeof(Packet *) * capacity);
-    _q2 = (Packet **) CLICK_LALLOC(sizeof(Packet *) * capacity);
-    if (_q1 == 0 || _q2 == 0)
-        return errh->error("out of memory");
+    if (_burst == 0)
+        return errh->error("BURST must be positive");
+    _nthreads = master()->nthreads();
+    if (_nthreads < 1)
+        _nthreads = 1;
+    _pool.initialize(_nthreads);
+    _stats.resize(_nthreads);
+    _flow_cache.resize(_nthreads);
+    if (_rate)
+        _tb.assign(_rate, _burst);
+    ScheduleInfo::initialize_task(this, &_task, false, errh);
+    _timer.initialize(this);
+    ScheduleInfo::initialize_task(this, &_ctrl_task, false, errh);
+    _ctrl_timer.initialize(this);
+    if (_ctrl_port)
+        ctrl_connect();
     return 0;
 }
-Tfm::~Tfm()
+
+void
+Tfm::cleanup(CleanupStage)
 {
-    CLICK_LFREE(_q1, sizeof(Packet *) * capacity);
-    CLICK_LFREE(_q2, sizeof(Packet *) * capacity);
+    while (!_sessions.empty())
+    {
+        Session *s = _sessions.back();
+        _sessions.pop_back();
+        clear_session(s);
+        delete s;
+    }
+    flush_flow_cache();
+    ctrl_close();
 }
 
-void 
-Tfm::conn_write_append_newline(char *buf, int len)
+// Controller channel.  The connection is opened at initialization, kept
+// open, and reopened after CTRL_RETRY_MSEC whenever it fails.  Finish acks
+// are collected by _ctrl_task and written from there or from selected(),
+// never from push().
+
+void
+Tfm::ctrl_connect()
 {
-    int tmplen = htonl(len);
-    write(sockfd, &tmplen, sizeof(tmplen));
-    int result = write(sockfd, (void *)buf, len);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(_ctrl_port);
+    sin.sin_addr = _ctrl_addr.in_addr();
+
+    if ((_ctrl_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        click_chatter("%s: socket: %s", declaration().c_str(), strerror(errno));
+        ctrl_retry();
+        return;
+    }
+    fcntl(_ctrl_fd, F_SETFL, O_NONBLOCK);
+    fcntl(_ctrl_fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(_ctrl_fd, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+        ctrl_connected();
+    else if (errno == EINPROGRESS)
+    {
+        //writable once the connection completes
+        _ctrl_state = CTRL_CONNECTING;
+        add_select(_ctrl_fd, SELECT_WRITE);
+    }
+    else
+    {
+        click_chatter("%s: connect: %s", declaration().c_str(), strerror(errno));
+        ctrl_retry();
+    }
 }
-void 
-Tfm::send_finish_ack()
+
+void
+Tfm::ctrl_connected()
 {
-    char jsonstr[100] = "{\"id\":1,\"type\":\"tfm-migrate-finish\",\"count\":1}";
-    conn_write_append_newline(jsonstr, strlen(jsonstr));
+    _ctrl_state = CTRL_CONNECTED;
+    //a message cut by the previous connection is sent again in full
+    _ctrl_wpos = 0;
+    remove_select(_ctrl_fd, SELECT_WRITE);
+    add_select(_ctrl_fd, SELECT_READ);
+    click_chatter("%s: connected to controller %s:%d", declaration().c_str(),
+                  _ctrl_addr.unparse().c_str(), _ctrl_port);
+    ctrl_flush();
 }
-int
-Tfm::conn_active_open()
-{
-    int fd, recvbytes;
-    struct hostent *host;
-    struct sockaddr_in serv_addr;
- 
-    if (( fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        printf("socket error!");
-        return 0;
+
+void
+Tfm::ctrl_close()
+{
+    if (_ctrl_fd >= 0)
+    {
+        remove_select(_ctrl_fd, SELECT_READ | SELECT_WRITE);
+        close(_ctrl_fd);
+        _ctrl_fd = -1;
     }
-    bzero(&serv_addr,sizeof(serv_addr));
-    serv_addr.sin_family= AF_INET;
-    serv_addr.sin_port = htons(7790);
-    serv_addr.sin_addr.s_addr= inet_addr("10.21.2.185");
- 
-    if (connect(fd, (struct sockaddr *)&serv_addr,sizeof(struct sockaddr)) == -1) {
-        printf("connect error!");
-        return 0;
-    }  
-    return fd;
+    _ctrl_state = CTRL_CLOSED;
 }
 
-int
-Tfm::configure(Vector<String> &conf, ErrorHandler *errh)
+void
+Tfm::ctrl_retry()
 {
-    return Args(conf, this, errh).read_mp("LENGTH", k).complete();
+    ctrl_close();
+    _ctrl_timer.schedule_after_msec(CTRL_RETRY_MSEC);
 }
 
-void 
-Tfm::push(int port, Packet *p)
+void
+Tfm::ctrl_flush()
 {
-    /*
-    float delays_state_ins = 0;
-    delays_state_ins = (float)Timestamp::now().nsec()/1000000 - tstart;
-    if (delays_state_ins > MS_DELAY && tfinish == 0)
+    while (_ctrl_state == CTRL_CONNECTED && !_ctrl_outq.empty())
     {
-        printf("delays_state_ins is %f\n",delays_state_ins);
-        b_stateinstalled = 1;
-        tfinish = 1;
+        const String &m = _ctrl_outq.front();
+        ssize_t w = write(_ctrl_fd, m.data() + _ctrl_wpos, m.length() - _ctrl_wpos);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                add_select(_ctrl_fd, SELECT_WRITE);
+                return;
+            }
+            click_chatter("%s: write: %s", declaration().c_str(), strerror(errno));
+            ctrl_retry();
+            return;
+        }
+        _ctrl_wpos += w;
+        if (_ctrl_wpos == m.length())
+        {
+            _ctrl_outq.erase(_ctrl_outq.begin());
+            _ctrl_wpos = 0;
+        }
     }
-    */
-    if (port == 0)
+    if (_ctrl_state == CTRL_CONNECTED)
+        remove_select(_ctrl_fd, SELECT_WRITE);
+}
+
+//messages are framed by a 4-byte length in network byte order
+void
+Tfm::ctrl_send(const String &msg)
+{
+    uint32_t len = htonl(msg.length());
+    StringAccum sa;
+    sa.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    sa << msg;
+    _ctrl_outq.push_back(sa.take_string());
+    ctrl_flush();
+}
+
+void
+Tfm::selected(int fd, int mask)
+{
+    if (fd != _ctrl_fd)
+        return;
+
+    if (_ctrl_state == CTRL_CONNECTING)
     {
-	stat.normal_num++;
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            err = errno;
+        if (err)
+        {
+            click_chatter("%s: connect: %s", declaration().c_str(), strerror(err));
+            ctrl_retry();
+        }
+        else
+            ctrl_connected();
+        return;
     }
-    else if (port == 1)
+
+    if (mask & SELECT_READ)
     {
-	stat.redirect_num++;
+        //the controller does not talk back; reading only detects a close
+        char buf[256];
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                       && errno != EINTR))
+        {
+            click_chatter("%s: controller connection closed", declaration().c_str());
+            ctrl_retry();
+            return;
+        }
     }
-    else if (port == 2)
+    if (mask & SELECT_WRITE)
+        ctrl_flush();
+}
+
+void
+Tfm::run_timer(Timer *t)
+{
+    if (t == &_ctrl_timer)
     {
-	stat.infly_num++;
+        if (_ctrl_state == CTRL_CLOSED)
+            ctrl_connect();
+        return;
     }
-    else
+    for (int i = 0; i < _sessions.size(); i++)
+        if (t == &_sessions[i]->deadline)
+        {
+            expire(_sessions[i]);
+            break;
+        }
+}
+
+bool
+Tfm::run_control()
+{
+    bool any = report_sessions("tfm-migrate-finish", &Session::finished);
+    if (report_sessions("tfm-migrate-timeout", &Session::timed_out))
+        any = true;
+    return any;
+}
+
+//one message per controller operation covers every session whose event is
+//pending; the controller looks the operation up by the message id
+bool
+Tfm::report_sessions(const char *type, atomic_uint32_t Session::*event)
+{
+    Vector<Session *> pending;
+    for (int i = 0; i < _sessions.size(); i++)
     {
-	stat.lastinfly_num++;
+        Session *s = _sessions[i];
+        if ((s->*event).compare_swap(EVENT_PENDING, EVENT_SENT) == EVENT_PENDING)
+            pending.push_back(s);
     }
-   
-    int event = 0;
-    if(b_stateinstalled==1)
+    if (pending.empty())
+        return false;
+
+    for (int i = 0; i < pending.size(); i++)
     {
-        if( current_state > S_INSD_MFSTART-1)
-        {}
+        if (!pending[i])
+            continue;
+        int op = pending[i]->op, count = 0, first = -1;
+        StringAccum ids;
+        for (int j = i; j < pending.size(); j++)
+        {
+            if (!pending[j] || pending[j]->op != op)
+                continue;
+            if (count)
+                ids << ',';
+            else
+                first = pending[j]->id;
+            ids << pending[j]->id;
+            count++;
+            pending[j] = 0;
+        }
+
+        StringAccum sa;
+        sa << "{\"id\":" << op << ",\"type\":\"" << type
+           << "\",\"count\":" << count;
+        if (count == 1)
+            sa << ",\"session\":" << first << '}';
         else
+            sa << ",\"sessions\":[" << ids << "]}";
+        if (event == &Session::finished)
+            _ctrl_acks += count;
+        ctrl_send(sa.take_string());
+    }
+    return true;
+}
+
+inline int
+Tfm::thread_slot() const
+{
+    int tid = click_current_processor();
+    return (tid >= 0 && tid < _nthreads ? tid : 0);
+}
+
+Tfm::Stat
+Tfm::merge(const Vector<ThreadStat> &v)
+{
+    Stat x;
+    memset(&x, 0, sizeof(x));
+    for (int i = 0; i < v.size(); i++)
+        x.add(v[i].s);
+    return x;
+}
+
+void
+Tfm::flush_flow_cache()
+{
+    for (int i = 0; i < _flow_cache.size(); i++)
+        _flow_cache[i].clear();
+}
+
+Tfm::Session *
+Tfm::find_session(int id) const
+{
+    for (int i = 0; i < _sessions.size(); i++)
+        if (_sessions[i]->id == id)
+            return _sessions[i];
+    return 0;
+}
+
+Tfm::Session *
+Tfm::lookup_session(Packet *p)
+{
+    if (_sessions.empty())
+        return 0;
+
+    FlowTuple t(p);
+    FlowCache &cache = _flow_cache[thread_slot()];
+    FlowCache::iterator it = cache.find(t);
+    if (it != cache.end())
+        return it.value();
+
+    Session *s = 0;
+    for (int i = 0; i < _sessions.size(); i++)
+        if (_sessions[i]->pattern.match(t))
         {
-            b_stateinstalled = 0;
-            ReleaseB1();
-            if(current_state == S_RCVLINFLY)
-            {
-                ReleaseB2();
-                //printf("Stateinstalled->Release B1\n");
-            }
-            current_state += E_STATEINSTALLED;
-            //printf("Stateinstalled->Release B1\n");
-            bptime = 1;
+            s = _sessions[i];
+            break;
+        }
+    if (cache.size() >= FLOW_CACHE_MAX)
+        cache.clear();
+    cache.set(t, s);
+    return s;
+}
+
+Tfm::Session *
+Tfm::start_session(int id, int op, const FlowPattern &fp, ErrorHandler *errh)
+{
+    if (Session *s = find_session(id))
+        return s;
+
+    Session *s = new Session(id, op, fp, _nthreads);
+    if (!s)
+    {
+        errh->error("out of memory");
+        return 0;
+    }
+
+    int spec = fp.specificity(), i = 0;
+    while (i < _sessions.size() && _sessions[i]->pattern.specificity() >= spec)
+        i++;
+    _sessions.insert(_sessions.begin() + i, s);
+    flush_flow_cache();
+
+    s->t_state[S_MFSTART] = tfm_now_ns();
+    s->current_state = S_MFSTART;
+    if (_timeout)
+    {
+        s->deadline.assign(this);
+        s->deadline.initialize(this);
+        s->deadline.schedule_after(_timeout);
+    }
+    return s;
+}
+
+void
+Tfm::remove_session(Session *s)
+{
+    Reset(s);
+    for (int i = 0; i < _sessions.size(); i++)
+        if (_sessions[i] == s)
+        {
+            _sessions.erase(_sessions.begin() + i);
+            break;
         }
+    flush_flow_cache();
+    clear_session(s);
+    delete s;
+}
+
+void
+Tfm::push(int port, Packet *p)
+{
+    //port0->normal pkts,port1->redirectpkts,port2->inflypkts,port3->lastinflypkts
+    Stat &stat = _stats[thread_slot()].s;
+    if (port == 0)
+    {
+        stat.normal_num++;
+        output(0).push(p);
+        return;
     }
-    //if a normal pkt,just output without state transition
-    if (current_state == S_NORMAL || port == 0)
+    else if (port == 1)
+        stat.redirect_num++;
+    else if (port == 2)
+        stat.infly_num++;
+    else
+        stat.lastinfly_num++;
+
+    //packets of flows that are not migrating just pass through
+    Session *s = lookup_session(p);
+    if (!s)
     {
         output(0).push(p);
         return;
     }
-    //port0->normal pkts,port1->redirectpkts,port2->inflypkts,port3->lastinflypkts
-    //printf("port == %d\n",port);
-    switch (current_state)
+    session_push(s, port, p);
+}
+
+void
+Tfm::session_push(Session *s, int port, Packet *p)
+{
+    Stat &stat = s->stats[thread_slot()].s;
+    if (port == 1)
+        stat.redirect_num++;
+    else if (port == 2)
+        stat.infly_num++;
+    else
+        stat.lastinfly_num++;
+
+    //act on a snapshot of the state; a buffer filled from a stale snapshot
+    //is picked up again by enqueue()
+    switch (s->current_state.value())
     {
         case S_MFSTART:
-      	    //printf("___________________\nstate:S_MFSTART\n");
-            if (port == 1)
-            {
-                    //printf("Notify Controller to update flowtable");
-                    //buffer pkts to B2
-                PushB2(p);
-                event=E_RCVRDPKT;
-            }	
-            else if (port == 2)
-            {
-                    //buffer pkts to B1
-                PushB1(p);
-            }	
-            else
-            {
-                //printf("Notify Controller to update flowtable");
-                //drop last in-fly pkts
-                //printf("drop lastinflypkt");
-                p->kill();
-                event = 5;
-            }	
-            break;
         case S_RCVRDPKT:
-      	    //printf("___________________\nstate:S_RCVRDPKT\n");
-            if (port == 1)
-            {
-                    //buffer pkts to B2
-                PushB2(p);
-            }	
-            else if (port == 2)
-            {
-                    //buffer pkts 1o B1
-                PushB1(p);
-            }	
-            else
-            {
-                    //drop last in-fly pkts
-                //printf("drop lastinflypkt");
-                event = E_RCVLINFLY;
-                p->kill();
-            }	
-            break;
         case S_RCVLINFLY:
-      	    //printf("___________________\nstate:S_RCVLINFLY\n");
             if (port == 1)
             {
-                    //buffer pkts to B2
-                PushB2(p);
-            }	
+                //buffer pkts to B2
+                PushB2(s, p);
+                advance(s, E_RCVRDPKT);
+            }
             else if (port == 2)
             {
-                    //buffer pkts to B1
-                PushB1(p);
-            }	
+                //buffer pkts to B1
+                PushB1(s, p);
+            }
             else
             {
-                    //buffer pkts to B1
-                //printf("drop lastinflypkt");
+                //drop last in-fly pkts
                 p->kill();
-            }	
+                advance(s, E_RCVLINFLY);
+            }
             break;
         case S_INSD_MFSTART:
-      	    //printf("___________________\nstate:S_INSD_MFSTART\n");
+        case S_INSD_RCVRDPKT:
             if (port == 1)
             {
-                //printf("Notify Controller to update flowtable\n");
-                PushB2(p);
-                event=E_RCVRDPKT;
-            }	
+                PushB2(s, p);
+                advance(s, E_RCVRDPKT);
+            }
             else if (port == 2)
-            {
-                output(0).push(Cleartag(p));
-            }	
+                forward(s, p);
             else
             {
-                //printf("Notify Controller to update flowtable\n");
-                    //buffer pkts to B1
-                ReleaseB2();
-                //printf("drop lastinflypkt\n");
                 p->kill();
-                event = 5;
-            }	
-            break;
-        case S_INSD_RCVRDPKT:
-      	    //printf("___________________\nstate:S_INSD_RCVRDPKT\n");
-            if (port == 1)
-            {
-                    //buffer pkts pto B1
-                PushB2(p);
-            }	
-            else if (port == 2)
-            {
-                    //buffer pkts to B1
-                output(0).push(Cleartag(p));
-            }	
-            else 
-            { //buffer pkts to B1 printf("drop lastinflypkt");
-                ReleaseB2();
-                event = E_RCVLINFLY;
-            }	
+                advance(s, E_RCVLINFLY);
+            }
             break;
         case S_INSD_RCVLINFLY:
-      	    //printf("___________________\nstate:S_INSD_RCVLINFLY\n");
-            if (tfinish == 0)
+            if (s->finished.compare_swap(0, EVENT_PENDING) == 0)
             {
-                //connection with controller is available
-                if (sockfd != 0)
-                {
-                    send_finish_ack();
-                }
-                tfinish = (float)Timestamp::now().nsec()/1000000-tstart;
-                printf("move time is %f\n",tfinish);
-                printf("normal_pkts_num: %d\n",stat.normal_num);
-                printf("infly_pkts_num: %d\n",stat.infly_num);
-                printf("redirect_pkts_num: %d\n",stat.redirect_num);
-                printf("lastinfly_pkts_num: %d\n",stat.lastinfly_num);
+                s->t_finish = tfm_now_ns();
+                //the ack is sent by the controller task
+                if (_ctrl_port)
+                    _ctrl_task.reschedule();
             }
             if (port == 3)
-            {
-                    //buffer pkts to B1
-                //printf("drop lastinflypkt\n");
-            }	
+                p->kill();
             else
-            {
-                output(0).push(Cleartag(p));
-            }	
+                forward(s, p);
             break;
         default:
+            p->kill();
             break;
     }
-    current_state+=event;
-    if (bptime == 1 || event != 0)
-    {
-        printf("current state %s, time is %f\n",Printstate(current_state), (float)Timestamp::now().nsec()/1000000);
-        bptime = 0;
-    }
 }
-inline char * 
-Tfm::Printstate(int i)
+
+//state = installed (E_STATEINSTALLED or 0) + phase, phase moves
+//S_MFSTART -> S_RCVRDPKT -> S_RCVLINFLY. Applies the event to the current
+//state with compare-and-swap; the thread whose swap succeeds starts the
+//releases the new state calls for.
+bool
+Tfm::advance(Session *s, int event)
 {
-        char *state = "";
-        if(i==0) state = "S_NORMAL"; 
-        else if(i==1) state = "S_MFSTART"; 
-        else if(i==3) state = "S_RCVRDPKT"; 
-        else if(i==6) state = "S_RCVLINFLY";
-        else if(i==9) state = "S_INSD_MFSTART"; 
-        else if(i==11) state = "S_INSD_RCVRDPKT"; 
-        else if(i==14) state = "S_INSD_RCVLINFLY";
-        else state = "error";
-        return state;
+    uint32_t old_state, new_state;
+    do {
+        old_state = s->current_state;
+        if (old_state == S_NORMAL)
+            return false;
+        uint32_t installed = (old_state >= S_INSD_MFSTART ? E_STATEINSTALLED : 0);
+        uint32_t phase = old_state - installed;
+        if (event == E_STATEINSTALLED)
+        {
+            if (installed)
+                return false;
+            installed = E_STATEINSTALLED;
+        }
+        else if (event == E_RCVRDPKT)
+        {
+            if (phase != S_MFSTART)
+                return false;
+            phase = S_RCVRDPKT;
+        }
+        else
+        {
+            if (phase == S_RCVLINFLY)
+                return false;
+            phase = S_RCVLINFLY;
+        }
+        new_state = installed + phase;
+    } while (s->current_state.compare_swap(old_state, new_state) != old_state);
+    s->t_state[new_state] = tfm_now_ns();
+
+    int which = 0;
+    if (new_state >= S_INSD_MFSTART && old_state < S_INSD_MFSTART)
+        which |= DRAIN_B1;
+    if (new_state == S_INSD_RCVLINFLY)
+        which |= DRAIN_B2;
+    if (which)
+        start_drain(s, which);
+    return true;
 }
 
 inline Packet *
@@ -338,165 +724,644 @@ Tfm::Cleartag(Packet *p)
     */
     return p;
 }
-inline void 
-Tfm::Reset(bool reset)
+
+void
+Tfm::Reset(Session *s)
 {
-    if(reset == 0) {}
+    ReleaseB1(s);
+    ReleaseB2(s);
+    s->drain = 0;
+    s->current_state = S_NORMAL;
+}
+
+//The session missed its deadline: end the migration as if the state had
+//been installed and the last in-flight packet seen, so the buffers are
+//released, or dropped under TIMEOUT_POLICY DROP, and later packets of the
+//session are forwarded.  The controller is told by a timeout event.
+void
+Tfm::expire(Session *s)
+{
+    uint32_t state = s->current_state;
+    if (state == S_NORMAL || state == S_INSD_RCVLINFLY)
+        return;
+    if (_timeout_drop)
+        s->discard = 1;
+    //the timeout event replaces the finish ack
+    s->finished.compare_swap(0, EVENT_SENT);
+    advance(s, E_STATEINSTALLED);
+    advance(s, E_RCVLINFLY);
+    _timeouts++;
+    s->timed_out = EVENT_PENDING;
+    if (_ctrl_port)
+        _ctrl_task.reschedule();
+}
+
+//hands a released packet on, or drops it if its session timed out under
+//TIMEOUT_POLICY DROP
+inline void
+Tfm::emit(Session *s, Packet *p)
+{
+    if (s->discard)
+    {
+        s->timeout_drops++;
+        p->kill();
+    }
     else
+        output(0).push(Cleartag(p));
+}
+
+bool
+Tfm::enqueue(Session *s, int which, Packet *p)
+{
+    TfmPacketQueue &q = (which == DRAIN_B1 ? s->b1 : s->b2);
+    uint32_t len = p->length();
+    //reserve room first so concurrent producers cannot overshoot the limits
+    uint32_t npackets = _buffered.fetch_and_add(1);
+    uint32_t nbytes = _buffered_bytes.fetch_and_add(len);
+    if ((_capacity && npackets >= _capacity)
+        || (_capacity_bytes && nbytes + len > _capacity_bytes)
+        || !q.push(p, tfm_now_ns(), _pool))
     {
-        ReleaseB1();
-        ReleaseB2();
-        current_state = 0;
-        b_stateinstalled = 0;
+        //buffer limit reached, hand the packet to the overflow output
+        _buffered--;
+        _buffered_bytes -= len;
+        s->stats[thread_slot()].s.drops++;
+        _overflows++;
+        checked_output_push(1, p);
+        return false;
     }
-    return;
+    update_max(_buffered_hwm, npackets + 1);
+    update_max(which == DRAIN_B1 ? s->b1_hwm : s->b2_hwm, q.size());
 
+    //the task may have emptied this buffer and stopped draining it after
+    //the state snapshot was taken; restart the drain if the state says so
+    uint32_t state = s->current_state;
+    bool release = (which == DRAIN_B1 ? state >= S_INSD_MFSTART
+                    : state == S_INSD_RCVLINFLY);
+    if (release && !(s->drain & which))
+        start_drain(s, which);
+    return true;
 }
-inline bool
-Tfm::PushB1(Packet *p)
+
+//racing producers may each store a smaller maximum; retry until ours holds
+void
+Tfm::update_max(atomic_uint32_t &m, uint32_t v)
 {
-    assert(p);
-    Storage::index_type h = B1head, t = B1tail, nt = next_i(t);
-    if (nt != h) {
-        _q1[t] = p;
-        packet_memory_barrier(_q1[t], B1tail);
-        B1tail = nt;
-        return true;
-    } else {
-        p->kill();
+    uint32_t old;
+    while ((old = m) < v && m.compare_swap(old, v) != old)
+        /* retry */;
+}
+
+//called by the single consumer, which also owns the histograms
+inline Packet *
+Tfm::dequeue(Session *s, TfmPacketQueue &q, uint64_t now)
+{
+    uint64_t stamp;
+    Packet *p = q.pop(_pool, &stamp);
+    if (p)
+    {
+        _buffered--;
+        _buffered_bytes -= p->length();
+        uint64_t delay = (now > stamp ? now - stamp : 0);
+        s->latency.add(delay);
+        _latency.add(delay);
+    }
+    return p;
+}
+
+void
+Tfm::start_drain(Session *s, int which)
+{
+    s->drain |= which;
+    _task.reschedule();
+}
+
+//while a session drains, later packets queue behind the buffered ones
+void
+Tfm::forward(Session *s, Packet *p)
+{
+    uint32_t drain = s->drain;
+    if (drain & DRAIN_B2)
+        enqueue(s, DRAIN_B2, p);
+    else if (drain & DRAIN_B1)
+        enqueue(s, DRAIN_B1, p);
+    else
+        output(0).push(Cleartag(p));
+}
+
+//pops from one draining buffer; clears its drain flag once it is empty
+Packet *
+Tfm::release_one(Session *s, int which, uint64_t now)
+{
+    if (!(s->drain & which))
+        return 0;
+    TfmPacketQueue &q = (which == DRAIN_B1 ? s->b1 : s->b2);
+    if (Packet *p = dequeue(s, q, now))
+        return p;
+    s->drain &= ~which;
+    //a producer that saw the flag still set has queued behind it
+    if (!q.empty())
+        start_drain(s, which);
+    if (!s->drain)
+    {
+        s->t_drained = now;
+        s->discard = 0;
+    }
+    return 0;
+}
+
+//B1 is released completely before B2, as the synchronous release did
+Packet *
+Tfm::next_release(Session *s, uint64_t now)
+{
+    if (Packet *p = release_one(s, DRAIN_B1, now))
+        return p;
+    return release_one(s, DRAIN_B2, now);
+}
+
+//sequence number used by ORDER: the StoreUDPTimeSeqRecord sequence at the
+//start of the UDP payload, or the TCP sequence number
+bool
+Tfm::packet_seq(const Packet *p, uint32_t &seq) const
+{
+    const click_ip *iph = p->ip_header();
+    if (!IP_FIRSTFRAG(iph))
+        return false;
+    const uint8_t *th = reinterpret_cast<const uint8_t *>(iph) + (iph->ip_hl << 2);
+    const uint8_t *field;
+    if (_order == ORDER_UDPSEQ && iph->ip_p == IP_PROTO_UDP)
+        field = th + sizeof(click_udp);
+    else if (_order == ORDER_TCPSEQ && iph->ip_p == IP_PROTO_TCP)
+        field = th + 4;
+    else
+        return false;
+    if (field + 4 > p->end_data())
+        return false;
+    seq = ntohl(*reinterpret_cast<const uint32_t *>(field));
+    return true;
+}
+
+//which draining buffer the ordered release takes from next: the one whose
+//head comes first in its flow's sequence when both heads belong to one
+//flow, else the one whose head was buffered first
+int
+Tfm::merge_next(Session *s) const
+{
+    uint64_t stamp1 = 0, stamp2 = 0;
+    Packet *p1 = (s->drain & DRAIN_B1 ? s->b1.peek(&stamp1) : 0);
+    Packet *p2 = (s->drain & DRAIN_B2 ? s->b2.peek(&stamp2) : 0);
+    if (!p1 || !p2)
+        return (p2 ? DRAIN_B2 : DRAIN_B1);
+    uint32_t seq1, seq2;
+    if (packet_seq(p1, seq1) && packet_seq(p2, seq2)
+        && FlowTuple(p1) == FlowTuple(p2))
+        return ((int32_t) (seq2 - seq1) < 0 ? DRAIN_B2 : DRAIN_B1);
+    return (stamp2 < stamp1 ? DRAIN_B2 : DRAIN_B1);
+}
+
+//Ordered release.  Merges B1 and B2 into a batch of up to quota packets,
+//taking the head that merge_next() picks at every step, so the packets of
+//a flow split across both buffers come out in sequence.  The batch is then
+//sorted per flow by sequence number, keeping the slots each flow occupies,
+//for packets a head-to-head merge cannot order: a flow whose B2 packets
+//sit behind another flow's.  Sequence numbers compare in serial-number
+//arithmetic; packets without one keep their place.  Returns the number of
+//packets released.
+uint32_t
+Tfm::release_ordered(Session *s, uint32_t quota, uint64_t now)
+{
+    Vector<Packet *> &batch = _batch;
+    batch.clear();
+    while ((uint32_t) batch.size() < quota)
+    {
+        if (_rate && !_tb.contains(batch.size() + 1))
+            break;
+        int which = merge_next(s);
+        Packet *p = release_one(s, which, now);
+        //an empty B1 only leaves the merge here, once B2 is empty too
+        if (!p && which == DRAIN_B1)
+            p = release_one(s, DRAIN_B2, now);
+        if (!p)
+            break;
+        batch.push_back(p);
+    }
+
+    //chain the batch positions of each flow
+    int n = batch.size();
+    Vector<int> next(n, -1), first, last;
+    Vector<uint32_t> seq(n, 0);
+    _order_flows.clear();
+    for (int i = 0; i < n; i++)
+    {
+        if (!packet_seq(batch[i], seq[i]))
+            continue;
+        FlowTuple t(batch[i]);
+        HashTable<FlowTuple, int>::iterator it = _order_flows.find(t);
+        if (it == _order_flows.end())
+        {
+            _order_flows.set(t, first.size());
+            first.push_back(i);
+            last.push_back(i);
+        }
+        else
+        {
+            next[last[it.value()]] = i;
+            last[it.value()] = i;
+        }
+    }
+
+    //insertion sort each flow in place; the merge leaves them nearly sorted
+    Vector<int> pos;
+    for (int f = 0; f < first.size(); f++)
+    {
+        pos.clear();
+        for (int i = first[f]; i >= 0; i = next[i])
+            pos.push_back(i);
+        for (int a = 1; a < pos.size(); a++)
+        {
+            Packet *p = batch[pos[a]];
+            uint32_t k = seq[pos[a]];
+            int b = a;
+            for (; b > 0 && (int32_t) (k - seq[pos[b - 1]]) < 0; b--)
+            {
+                batch[pos[b]] = batch[pos[b - 1]];
+                seq[pos[b]] = seq[pos[b - 1]];
+            }
+            if (b != a)
+            {
+                batch[pos[b]] = p;
+                seq[pos[b]] = k;
+                s->reordered += a - b;
+                _reordered += a - b;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (_rate)
+            _tb.remove(1);
+        emit(s, batch[i]);
+    }
+    s->released += n;
+    return n;
+}
+
+bool
+Tfm::run_task(Task *t)
+{
+    if (t == &_ctrl_task)
+        return run_control();
+
+    int n = _sessions.size(), ndraining = 0;
+    for (int i = 0; i < n; i++)
+        if (_sessions[i]->drain)
+            ndraining++;
+    if (!ndraining)
         return false;
-        printf("B1 is overloaded");
+
+    uint32_t budget = _burst, sent = 0;
+    if (_rate)
+    {
+        _tb.refill();
+        if (!_tb.contains(1))
+        {
+            _timer.schedule_after(Timestamp::make_jiffies(_tb.time_until_contains(1)));
+            return false;
+        }
     }
+
+    uint64_t now = tfm_now_ns();
+    //visit draining sessions round-robin so one large backlog does not
+    //hold back the others
+    for (int i = 0; i < n && sent < budget && ndraining; i++)
+    {
+        Session *s = _sessions[(_drain_cursor + i) % n];
+        if (!s->drain)
+            continue;
+        uint32_t quota = (budget - sent + ndraining - 1) / ndraining;
+        if (_order)
+        {
+            sent += release_ordered(s, quota, now);
+            quota = 0;
+        }
+        while (quota && (!_rate || _tb.contains(1)))
+        {
+            Packet *p = next_release(s, now);
+            if (!p)
+                break;
+            if (_rate)
+                _tb.remove(1);
+            s->released++;
+            sent++;
+            quota--;
+            emit(s, p);
+        }
+        if (!s->drain)
+            ndraining--;
+    }
+    _drain_cursor = (_drain_cursor + 1) % n;
+    _released += sent;
+
+    bool more = false;
+    for (int i = 0; i < n && !more; i++)
+        more = _sessions[i]->drain;
+    if (more)
+    {
+        if (_rate && !_tb.contains(1))
+            _timer.schedule_after(Timestamp::make_jiffies(_tb.time_until_contains(1)));
+        else
+            _task.fast_reschedule();
+    }
+    return sent > 0;
 }
-inline int
-Tfm::ReleaseB1()
+
+void
+Tfm::clear_session(Session *s)
+{
+    _buffered -= s->b1.size() + s->b2.size();
+    _buffered_bytes -= s->b1.bytes() + s->b2.bytes();
+    s->b1.clear(_pool);
+    s->b2.clear(_pool);
+}
+
+bool
+Tfm::PushB1(Session *s, Packet *p)
+{
+    assert(p);
+    return enqueue(s, DRAIN_B1, p);
+}
+
+int
+Tfm::ReleaseB1(Session *s)
 {
-    Storage::index_type h = B1head, t = B1tail;
     int release_num = 0;
-    while (h != t) {
-        Packet *p = _q1[h];
-        //printf("push");
-        packet_memory_barrier(_q1[h], B1head);
-        B1head = next_i(h);
-        h = B1head;
-        assert(p);
-        release_num ++;
-        output(0).push(Cleartag(p));
+    uint64_t now = tfm_now_ns();
+    while (Packet *p = dequeue(s, s->b1, now))
+    {
+        release_num++;
+        emit(s, p);
     }
     return release_num;
 }
+
 inline Packet *
 Tfm::smaction(Packet *p)
 {
-    assert(p->has_network_header());
-    WritablePacket *q;
-    if (!(q = p->uniqueify()))
-	return 0;
-    click_ip *ip = q->ip_header();
-    uint16_t old_hw = (reinterpret_cast<uint16_t *>(ip))[0];
-    //inpkt  normal:tos:flag = 0:0  ->  inflypkt:tos:flag = 0:1, redirect:tos:flag = 1:0->lastinfly tos:flag = 1:1      
-    ip->ip_off = (ip->ip_off | htons(0x8000));   
-    click_update_in_cksum(&ip->ip_sum, old_hw, reinterpret_cast<uint16_t *>(ip)[0]);
-    return q;
+    //inpkt  normal:tos:flag = 0:0  ->  inflypkt:tos:flag = 0:1, redirect:tos:flag = 1:0->lastinfly tos:flag = 1:1
+    if (_header)
+        return tfm_tag_header(p, TFM_TAG_INFLY);
+    tfm_tag_anno(p, _anno, TFM_TAG_INFLY);
+    return p;
 }
+
 //buffer redirect pkts
-inline bool
-Tfm::PushB2(Packet *p)
+bool
+Tfm::PushB2(Session *s, Packet *p)
 {
     assert(p);
-    p = smaction(p);
-    Storage::index_type h = B2head, t = B2tail, nt = next_i(t);
-    if (nt != h) {
-        _q2[t] = p;
-        packet_memory_barrier(_q2[t], B2tail);
-        //printf("buffer redirect pkts");
-        B2tail = nt;
-        return true;
-    } else {
-        p->kill();
+    if (!(p = smaction(p)))
         return false;
-        printf("B2 is overloaded");
-    }
+    return enqueue(s, DRAIN_B2, p);
 }
-inline int
-Tfm::ReleaseB2()
+
+int
+Tfm::ReleaseB2(Session *s)
 {
-    Storage::index_type h = B2head, t = B2tail;
     int release_num = 0;
-    while (h != t) {
-        Packet *p = _q2[h];
-        //printf("push");
-        packet_memory_barrier(_q2[h], B2head);
-        B2head = next_i(h);
-        h = B2head;
-        assert(p);
-        release_num ++;
-        output(0).push(Cleartag(p));
+    uint64_t now = tfm_now_ns();
+    while (Packet *p = dequeue(s, s->b2, now))
+    {
+        release_num++;
+        emit(s, p);
     }
     return release_num;
 }
+
 void
 Tfm::add_handlers()
 {
-    add_read_handler("state", read_handler, 0);
-    add_write_handler("mfstart", write_handler, 0);
-    add_write_handler("stateinstall", write_handler, 1);
-    add_write_handler("reset", write_handler, 2);
+    set_handler("state", Handler::OP_READ | Handler::READ_PARAM, state_handler);
+    add_read_handler("sessions", read_handler, h_sessions);
+    add_read_handler("buffered", read_handler, h_buffered);
+    add_read_handler("overflows", read_handler, h_overflows);
+    add_read_handler("drain", read_handler, h_drain);
+    add_read_handler("controller", read_handler, h_controller);
+    add_read_handler("timeline", read_handler, h_timeline);
+    add_read_handler("latency", read_handler, h_latency);
+    add_read_handler("highwater", read_handler, h_highwater);
+    add_read_handler("reordered", read_handler, h_reordered);
+    add_read_handler("timeouts", read_handler, h_timeouts);
+    add_task_handlers(&_task);
+    add_write_handler("mfstart", write_handler, h_mfstart);
+    add_write_handler("stateinstall", write_handler, h_stateinstall);
+    add_write_handler("reset", write_handler, h_reset);
+}
+
+int
+Tfm::parse_session(const String &s, Element *e, bool pattern, int &id,
+                   int &op, FlowPattern &fp, bool &legacy, ErrorHandler *errh)
+{
+    // a bare boolean is the single-session syntax of older controllers
+    bool value;
+    if (BoolArg().parse(cp_uncomment(s), value))
+    {
+        legacy = true;
+        id = value ? DEFAULT_SESSION : -1;
+        op = DEFAULT_OPERATION;
+        return 0;
+    }
+
+    legacy = false;
+    Vector<String> conf;
+    cp_argvec(s, conf);
+    uint16_t sport = 0, dport = 0;
+    Args args(conf, e, errh);
+    op = DEFAULT_OPERATION;
+    args.read_mp("SESSION", id);
+    if (pattern)
+        args.read("OPERATION", op)
+            .read("SRC", IPPrefixArg(true), fp.src, fp.src_mask)
+            .read("DST", IPPrefixArg(true), fp.dst, fp.dst_mask)
+            .read("PROTO", fp.proto)
+            .read("SPORT", sport)
+            .read("DPORT", dport);
+    if (args.complete() < 0)
+        return -1;
+    if (id < 0)
+        return errh->error("session id must be nonnegative");
+    if (op <= 0)
+        return errh->error("operation id must be positive");
+    fp.sport = htons(sport);
+    fp.dport = htons(dport);
+    return 0;
 }
 
 int
 Tfm::write_handler(const String &s, Element *e, void *vparam,
-                             ErrorHandler *errh)
+                   ErrorHandler *errh)
 {
     Tfm *is = (Tfm *)e;
     int which = reinterpret_cast<intptr_t>(vparam);
+    int id = -1, op;
+    bool legacy = false;
+    FlowPattern fp;
+    if (parse_session(s, e, which == h_mfstart, id, op, fp, legacy, errh) < 0)
+        return -1;
+
     switch (which) {
-      case 0:
-        bool mfstart;
-        if (!BoolArg().parse(s, mfstart))
-            return errh->error("mfstart parameter must be boolean");
-        if(is->current_state == S_NORMAL)
+      case h_mfstart:
+        if (id >= 0 && !is->start_session(id, op, fp, errh))
+            return -ENOMEM;
+        return 0;
+      case h_stateinstall: {
+        Session *sess = is->find_session(legacy ? (int) DEFAULT_SESSION : id);
+        if (sess)
         {
-            is->current_state = mfstart;
-            is->bptime = 1;
-	    is->sockfd = is->conn_active_open();
-            is->tstart = (float)Timestamp::now().nsec()/1000000;
-            printf("current state %s, time is %f\n",is->Printstate(is->current_state), is->tstart);
+            if (id >= 0)
+                is->advance(sess, E_STATEINSTALLED);
         }
+        else if (!legacy)
+            return errh->error("no session %d", id);
         return 0;
-      case 1:
-        bool stateinstall;
-        if (!BoolArg().parse(s, stateinstall))
-            return errh->error("stateinstall parameter must be boolean");
-        is->b_stateinstalled = stateinstall;
-        return 0;
-      case 2:
-        bool reset;
-        if (!BoolArg().parse(s, reset))
-            return errh->error("reset parameter must be boolean");
-        is->Reset(reset);
+      }
+      case h_reset:
+        if (legacy)
+        {
+            if (id >= 0)
+                while (!is->_sessions.empty())
+                    is->remove_session(is->_sessions.back());
+        }
+        else if (Session *sess = is->find_session(id))
+            is->remove_session(sess);
+        else
+            return errh->error("no session %d", id);
         return 0;
       default:
         return errh->error("internal error");
     }
 }
+
+int
+Tfm::state_handler(int, String &s, Element *e, const Handler *,
+                   ErrorHandler *errh)
+{
+    Tfm *is = static_cast<Tfm *>(e);
+    int id = DEFAULT_SESSION;
+    if (s && !IntArg().parse(cp_uncomment(s), id))
+        return errh->error("expected session id");
+    Session *sess = is->find_session(id);
+    s = getstate(sess ? sess->current_state.value() : S_NORMAL);
+    return 0;
+}
+
+void
+Tfm::unparse_latency(StringAccum &sa, const String &name,
+                     const TfmHistogram &h)
+{
+    sa << name << ' ' << h.count() << ' ' << h.quantile(0.5) << ' '
+       << h.quantile(0.99) << ' ' << h.quantile(0.999) << ' ' << h.max()
+       << '\n';
+}
+
 String
 Tfm::read_handler(Element *e, void *thunk)
 {
     Tfm *is = static_cast<Tfm *>(e);
-    int which = reinterpret_cast<intptr_t>(thunk);
-    switch (which)
+    StringAccum sa;
+    switch (reinterpret_cast<intptr_t>(thunk))
     {
-        case 0:     return is->getstate(is->current_state);
+        case h_sessions:
+            for (int i = 0; i < is->_sessions.size(); i++)
+            {
+                Session *s = is->_sessions[i];
+                Stat st = s->stat();
+                sa << s->id << ' ' << getstate(s->current_state) << ' '
+                   << s->pattern.unparse() << ' '
+                   << s->b1.size() << ' ' << s->b2.size() << ' '
+                   << st.redirect_num << ' ' << st.infly_num << ' '
+                   << st.lastinfly_num << ' ' << st.drops << '\n';
+            }
+            break;
+        case h_buffered:
+            sa << is->_buffered.value() << ' ' << is->_buffered_bytes.value() << ' '
+               << (uint64_t) is->_pool.allocated() * sizeof(TfmSegment);
+            break;
+        case h_overflows:
+            sa << is->_overflows.value();
+            break;
+        case h_drain:
+            sa << "released " << is->_released << '\n';
+            for (int i = 0; i < is->_sessions.size(); i++)
+            {
+                Session *s = is->_sessions[i];
+                if (!s->drain && !s->released)
+                    continue;
+                sa << s->id << ' ' << s->released << ' '
+                   << (s->drain & DRAIN_B1 ? s->b1.size() : 0) << ' '
+                   << (s->drain & DRAIN_B2 ? s->b2.size() : 0) << '\n';
+            }
+            break;
+        case h_controller: {
+            static const char * const states[] = { "closed", "connecting", "connected" };
+            sa << is->_ctrl_addr << ':' << is->_ctrl_port << ' '
+               << (is->_ctrl_port ? states[is->_ctrl_state] : "disabled") << ' '
+               << is->_ctrl_outq.size() << ' ' << is->_ctrl_acks;
+            break;
+        }
+        case h_timeline:
+            for (int i = 0; i < is->_sessions.size(); i++)
+            {
+                Session *s = is->_sessions[i];
+                uint64_t t0 = s->t_state[S_MFSTART];
+                sa << s->id << " start " << t0;
+                for (int st = S_MFSTART + 1; st <= S_INSD_RCVLINFLY; st++)
+                    if (s->t_state[st])
+                        sa << ' ' << getstate(st) << ' ' << (s->t_state[st] - t0);
+                if (s->t_finish)
+                    sa << " finish " << (s->t_finish - t0);
+                if (s->t_drained)
+                    sa << " drained " << (s->t_drained - t0);
+                sa << '\n';
+            }
+            break;
+        case h_latency:
+            unparse_latency(sa, "all", is->_latency);
+            for (int i = 0; i < is->_sessions.size(); i++)
+                unparse_latency(sa, String(is->_sessions[i]->id),
+                                is->_sessions[i]->latency);
+            break;
+        case h_highwater:
+            sa << "all " << is->_buffered_hwm.value() << '\n';
+            for (int i = 0; i < is->_sessions.size(); i++)
+            {
+                Session *s = is->_sessions[i];
+                sa << s->id << ' ' << s->b1_hwm.value() << ' '
+                   << s->b2_hwm.value() << '\n';
+            }
+            break;
+        case h_reordered:
+            sa << "all " << is->_reordered << '\n';
+            for (int i = 0; i < is->_sessions.size(); i++)
+                sa << is->_sessions[i]->id << ' '
+                   << is->_sessions[i]->reordered << '\n';
+            break;
+        case h_timeouts:
+            sa << "all " << is->_timeouts << '\n';
+            for (int i = 0; i < is->_sessions.size(); i++)
+            {
+                Session *s = is->_sessions[i];
+                if (s->timed_out)
+                    sa << s->id << ' ' << s->timeout_drops << '\n';
+            }
+            break;
         default:
             return "error";
     }
+    return sa.take_string();
 }
-/*void
-Tfm::add_handlers()
-{
-    add_data_handlers("stateinstalled", Handler::OP_READ | Handler::OP_WRITE | Handler::CHECKBOX | Handler::CALM, &b_stateinstalled);
-}*/
+
 CLICK_ENDDECLS
+ELEMENT_REQUIRES(userlevel TfmBuffer)
 EXPORT_ELEMENT(Tfm)
 ELEMENT_MT_SAFE(Tfm)
@@ -2,21 +2,211 @@
 #ifndef CLICK_TFM_HH
 #define CLICK_TFM_HH
 #include <click/element.hh>
-#include <click/standard/storage.hh>
+#include <click/hashtable.hh>
+#include <click/ipaddress.hh>
+#include <click/ipflowid.hh>
+#include <click/straccum.hh>
+#include <click/timestamp.hh>
+#include <click/vector.hh>
+#include <click/atomic.hh>
+#include <click/task.hh>
+#include <click/timer.hh>
+#include <click/tokenbucket.hh>
+#include "tfmbuffer.hh"
+#include "tfmhistogram.hh"
 CLICK_DECLS
 
 /*
  * =c
- * Strip(LENGTH)
+ * Tfm(LENGTH [, I<keywords> CAPACITY, CAPACITY_BYTES, BURST, RATE, HOST, PORT,
+ * ANNO, HEADER, ORDER, TIMEOUT, TIMEOUT_POLICY])
  * =s basicmod
- * strips bytes from front of packets
+ * buffers and releases packets of migrating flows
  * =d
- * Deletes the first LENGTH bytes from each packet.
- * =e
- * Use this to get rid of the Ethernet header:
+ * Runs the destination side of a flow migration.  Input 0 carries normal
+ * packets, input 1 redirected packets, input 2 in-flight packets and input 3
+ * last-in-flight packets.
  *
- *   Strip(14)
- * =a StripToNetworkHeader, StripIPHeader, EtherEncap, IPEncap, Truncate
+ * Migrations are tracked as independent sessions.  Each session owns a flow
+ * pattern, its own migration state machine, its own B1 (in-flight) and B2
+ * (redirect) buffers and its own counters, so packets of flows that are not
+ * migrating, or that belong to another session, are not held back.
+ * Packets on inputs 1-3 that match no session are forwarded unchanged.
+ *
+ * Buffers are built from fixed-size segments of packet pointers taken from
+ * per-thread pools, so memory follows the number of packets actually held.
+ * When a buffer limit is reached the packet is counted as an overflow and
+ * emitted on output 1, or dropped if output 1 is not connected.
+ *
+ * Buffers are not released inside push().  A transition that releases B1 or
+ * B2 hands the buffer to a task, which drains at most BURST packets per run,
+ * optionally paced to RATE packets per second.  Until a session's buffers
+ * are drained, its later packets are queued behind them, so the release
+ * order is the same as an immediate release.  With ORDER, B1 and B2 are
+ * instead released together, merged head to head so the packets of a flow
+ * split across them come out by sequence number.
+ *
+ * Inputs may be driven by different threads.  Session states change by
+ * compare-and-swap, counters are kept per thread and summed when read, and
+ * each buffer has a lock-free lane per producer thread.  Packets from one
+ * input keep their order; the write handlers are exclusive, so sessions are
+ * only added and removed while packet processing is stopped.
+ *
+ * When a session completes, Tfm reports it to the controller at HOST:PORT
+ * with a "tfm-migrate-finish" message carrying the id of the controller
+ * operation that started it.  The TCP connection is opened at
+ * initialization, kept open, and reopened after a failure; messages wait in
+ * a queue while it is down.  All socket I/O happens in a task and in the
+ * selector, and sessions finishing close together share one message.
+ *
+ * With TIMEOUT, a session that has not completed TIMEOUT after mfstart is
+ * ended as if its state had been installed and its last in-flight packet
+ * seen.  Its buffers are released, or dropped under TIMEOUT_POLICY DROP,
+ * later packets are forwarded, and the controller receives a
+ * "tfm-migrate-timeout" message instead of the finish ack.
+ *
+ * Keyword arguments are:
+ *
+ * =over 8
+ *
+ * =item CAPACITY
+ *
+ * Integer.  Maximum number of packets held in all buffers of the element.
+ * Zero means no limit.  Default 10000000.
+ *
+ * =item CAPACITY_BYTES
+ *
+ * Integer.  Maximum number of bytes held in all buffers of the element, at
+ * most 4294967295.  Zero means no limit.  Default 0.
+ *
+ * =item BURST
+ *
+ * Integer.  Maximum number of buffered packets released per task run.
+ * Default 32.
+ *
+ * =item RATE
+ *
+ * Integer.  If nonzero, buffered packets are released at no more than RATE
+ * packets per second, with bursts of at most BURST packets.  Default 0.
+ *
+ * =item HOST
+ *
+ * IP address.  Controller address.  Default 10.21.2.185.
+ *
+ * =item PORT
+ *
+ * Port number.  Controller TCP port; zero disables the controller channel.
+ * Default 7790.
+ *
+ * =item ANNO
+ *
+ * Annotation byte holding the migration tag that marks buffered redirect
+ * packets as in-flight.  Must match Tagwrite.
+ *
+ * =item HEADER
+ *
+ * Boolean.  If true, set the reserved IP flag of buffered redirect packets
+ * directly instead of the annotation, copying shared packets.  Default
+ * false.
+ *
+ * =item ORDER
+ *
+ * NONE, UDPSEQ or TCPSEQ.  If not NONE, buffered packets are released in
+ * sequence order per flow, merging B1 and B2 and then sorting each burst.
+ * The sequence number is the one StoreUDPTimeSeqRecord writes at the start
+ * of the UDP payload (UDPSEQ) or the TCP sequence number (TCPSEQ).  Packets
+ * without one keep their place.
+ * Default NONE.
+ *
+ * =item TIMEOUT
+ *
+ * Time in seconds.  Deadline for a session to complete, counted from
+ * mfstart.  Zero means no deadline.  Default 0.
+ *
+ * =item TIMEOUT_POLICY
+ *
+ * RELEASE or DROP.  What happens to the buffered packets of a session that
+ * missed its deadline.  With DROP, packets released until its buffers are
+ * empty are dropped and counted.  Default RELEASE.
+ *
+ * =back
+ *
+ * =h mfstart write-only
+ *
+ * Starts a migration session.  The argument is a keyword list:
+ * "SESSION id [, OPERATION id] [, SRC prefix] [, DST prefix] [, PROTO proto]
+ * [, SPORT port] [, DPORT port]".  Omitted fields match anything.  OPERATION
+ * is the controller's id for the migration, echoed in the reports of the
+ * session; default 1.  A bare boolean starts the default session 0, which
+ * matches every flow, for operation 1.
+ *
+ * =h stateinstall write-only
+ *
+ * Reports that the state of a session has been installed.  Takes
+ * "SESSION id", or a bare boolean for the default session.
+ *
+ * =h reset write-only
+ *
+ * Releases the buffers of a session and removes it.  Takes "SESSION id", or
+ * a bare boolean to reset every session.
+ *
+ * =h state read-only
+ *
+ * Returns the state of the session given as parameter (default 0).
+ *
+ * =h sessions read-only
+ *
+ * Returns one line per session: id, state, flow pattern, buffer occupancy
+ * and per-port packet counts.
+ *
+ * =h buffered read-only
+ *
+ * Returns the packets and bytes held in all buffers and the memory used by
+ * buffer segments.
+ *
+ * =h overflows read-only
+ *
+ * Returns the number of packets that did not fit in the buffers.
+ *
+ * =h drain read-only
+ *
+ * Returns the total number of packets released from buffers, followed by
+ * one line per session: id, packets released, and packets still waiting in
+ * B1 and B2.
+ *
+ * =h controller read-only
+ *
+ * Returns the controller address, the connection state, the number of
+ * queued messages and the number of sessions acknowledged.
+ *
+ * =h timeline read-only
+ *
+ * Returns one line per session: id, the monotonic time in nanoseconds at
+ * which the session started, then each state entered, "finish" and
+ * "drained" followed by its offset in nanoseconds from the start.
+ *
+ * =h latency read-only
+ *
+ * Returns the time packets spent in the buffers, in nanoseconds.  One line
+ * for all sessions ("all") and one per session id: count, p50, p99, p99.9
+ * and maximum.  Quantiles are accurate to 1/8 of their value.
+ *
+ * =h highwater read-only
+ *
+ * Returns the most packets ever held in all buffers ("all"), then one line
+ * per session: id and the most packets ever held in B1 and in B2.
+ *
+ * =h reordered read-only
+ *
+ * Returns how many places ORDER moved released packets back in total
+ * ("all"), then one line per session: id and the same count.
+ *
+ * =h timeouts read-only
+ *
+ * Returns the number of sessions that missed their deadline ("all"), then
+ * one line per such session: id and the packets dropped by TIMEOUT_POLICY.
+ *
+ * =a Srcmark, Tagredirect, Tagwrite
  */
 
 #define S_NORMAL 0
@@ -30,87 +220,224 @@ CLICK_DECLS
 #define E_STATEINSTALLED 8
 #define E_RCVRDPKT 2
 #define E_RCVLINFLY 3
-#define MS_DELAY 50
-class Tfm : public Element,public Storage { 
+class Tfm : public Element {
     public:
 
     Tfm();
     ~Tfm();
 
     const char *class_name() const		{ return "Tfm"; }
-    const char *port_count() const		{ return "-/1"; }
+    const char *port_count() const		{ return "-/1-2"; }
     const char *processing() const              { return PUSH; }
 
     int configure(Vector<String> &, ErrorHandler *);
     int initialize(ErrorHandler*);
+    void cleanup(CleanupStage);
 
-    //Packet *simple_action(Packet *);
     void push(int port, Packet *p);
-    //buffer B1 and B2 ,push and release
-    //B1 buffer infly pkts, B2 buffer redirect pkts
-    inline bool PushB1(Packet*);
-    inline int ReleaseB1();
-    inline bool PushB2(Packet*);
-    inline int ReleaseB2();
-    inline void Reset(bool);
-    inline Packet *Cleartag(Packet *);
+    bool run_task(Task *);
+    void run_timer(Timer *);
+    void selected(int fd, int mask);
     void add_handlers();
-    inline Packet *smaction(Packet *);
-    inline char *Printstate(int i);
-    inline int conn_active_open();
-    inline void send_finish_ack();
-    inline void conn_write_append_newline(char *buf, int len);
-  private:
-    int b_stateinstalled;
-    int current_state;
-    float tstart;
-    float tfinish;
-    int bptime;
-    int sockfd;
+
+    // 5-tuple of a packet, used to cache the session lookup per flow
+    struct FlowTuple {
+        IPFlowID flow;
+        uint8_t proto;
+        FlowTuple() : proto(0) {}
+        explicit FlowTuple(const Packet *p);
+        hashcode_t hashcode() const {
+            return flow.hashcode() ^ proto;
+        }
+        bool operator==(const FlowTuple &x) const {
+            return flow == x.flow && proto == x.proto;
+        }
+    };
+
+    // flow group a session migrates; zero mask/port/proto means "any"
+    struct FlowPattern {
+        IPAddress src;
+        IPAddress src_mask;
+        IPAddress dst;
+        IPAddress dst_mask;
+        uint16_t sport;         // network byte order
+        uint16_t dport;         // network byte order
+        uint8_t proto;
+        FlowPattern() : sport(0), dport(0), proto(0) {}
+        bool match(const FlowTuple &t) const;
+        int specificity() const;
+        String unparse() const;
+    };
+
     struct Stat
     {
-	int normal_num;
-	int infly_num;
-	int redirect_num;
-	int lastinfly_num;
+        uint32_t normal_num;
+        uint32_t infly_num;
+        uint32_t redirect_num;
+        uint32_t lastinfly_num;
+        uint32_t drops;
+        void add(const Stat &x);
     };
-    struct Stat stat;
-   // Packet* B1[100];
-    //Packet* B2[100];
-    //int nb1;
-    //int nb2;
+
+    // one Stat per thread, padded so threads do not share cache lines
+    struct ThreadStat {
+        Stat s;
+        char pad[64 - sizeof(Stat)];
+        ThreadStat() { memset(&s, 0, sizeof(s)); }
+    };
+
+    struct Session {
+        int id;
+        int op;     // controller operation id echoed in reports
+        FlowPattern pattern;
+        atomic_uint32_t current_state;
+        atomic_uint32_t finished;   // 0, EVENT_PENDING or EVENT_SENT
+        atomic_uint32_t timed_out;  // 0, EVENT_PENDING or EVENT_SENT
+        atomic_uint32_t discard;    // drop released packets (timeout)
+        atomic_uint32_t drain;  // DRAIN_B1 | DRAIN_B2 while releasing
+        uint32_t released;
+        uint64_t reordered;
+        uint32_t timeout_drops;
+        Timer deadline;
+        // monotonic ns at which each state was entered, 0 if never
+        uint64_t t_state[S_INSD_RCVLINFLY + 1];
+        uint64_t t_finish;
+        uint64_t t_drained;
+        atomic_uint32_t b1_hwm;
+        atomic_uint32_t b2_hwm;
+        TfmHistogram latency;   // enqueue to release, ns
+        Vector<ThreadStat> stats;
+        //B1 buffer infly pkts, B2 buffer redirect pkts
+        TfmPacketQueue b1;
+        TfmPacketQueue b2;
+        Session(int i, int o, const FlowPattern &fp, int nthreads);
+        Stat stat() const;
+    };
+
+  private:
+
+    enum { DEFAULT_SESSION = 0, DEFAULT_OPERATION = 1 };
+    enum { h_mfstart, h_stateinstall, h_reset };
+    enum { h_sessions, h_buffered, h_overflows, h_drain, h_controller,
+           h_timeline, h_latency, h_highwater, h_reordered, h_timeouts };
+    enum { ORDER_NONE, ORDER_UDPSEQ, ORDER_TCPSEQ };
+    enum { CTRL_CLOSED, CTRL_CONNECTING, CTRL_CONNECTED };
+    enum { EVENT_PENDING = 1, EVENT_SENT = 2 };
+    enum { DRAIN_B1 = 1, DRAIN_B2 = 2 };
+
     int k;
-   // int k;
-   // static int b_lastinfly;
-   // static int i;
-  protected:
-    index_type capacity;
-    //Buffer B1 
-    Packet* volatile * _q1;
-    //index_type B1capacity;
-    volatile index_type B1head;
-    volatile index_type B1tail;
-    //Buffer B2
-    Packet* volatile * _q2;
-    //index_type B2capacity;
-    volatile index_type B2head;
-    volatile index_type B2tail;
+    int _nthreads;
+    uint8_t _anno;
+    bool _header;
+    uint32_t _capacity;
+    uint32_t _capacity_bytes;
+    atomic_uint32_t _buffered;
+    atomic_uint32_t _buffered_bytes;
+    atomic_uint32_t _overflows;
+    atomic_uint32_t _buffered_hwm;
+    TfmHistogram _latency;
+    TfmSegmentPool _pool;
+    uint32_t _burst;
+    uint32_t _rate;
+    TokenBucket _tb;
+    Task _task;
+    Timer _timer;
+    int _drain_cursor;
+    uint64_t _released;
+
+    IPAddress _ctrl_addr;
+    uint16_t _ctrl_port;
+    int _ctrl_fd;
+    int _ctrl_state;
+    // framed messages waiting for the controller; _ctrl_wpos bytes of the
+    // first one are already written
+    Vector<String> _ctrl_outq;
+    int _ctrl_wpos;
+    uint32_t _ctrl_acks;
+    Task _ctrl_task;
+    Timer _ctrl_timer;
+
+    int _order;
+    uint64_t _reordered;
+    // scratch space of release_ordered()
+    Vector<Packet *> _batch;
+    HashTable<FlowTuple, int> _order_flows;
+
+    Timestamp _timeout;
+    bool _timeout_drop;
+    uint32_t _timeouts;
+
+    Vector<ThreadStat> _stats;
+
+    typedef HashTable<FlowTuple, Session *> FlowCache;
+
+    // sessions ordered from most to least specific pattern
+    Vector<Session *> _sessions;
+    // per-thread flow -> session caches, flushed whenever the session set
+    // changes
+    Vector<FlowCache> _flow_cache;
+
+    int thread_slot() const;
+    static Stat merge(const Vector<ThreadStat> &v);
+
+    Session *find_session(int id) const;
+    Session *lookup_session(Packet *p);
+    Session *start_session(int id, int op, const FlowPattern &fp,
+                           ErrorHandler *errh);
+    void remove_session(Session *s);
+    void flush_flow_cache();
+
+    void session_push(Session *s, int port, Packet *p);
+    bool advance(Session *s, int event);
+    bool enqueue(Session *s, int which, Packet *p);
+    inline Packet *dequeue(Session *s, TfmPacketQueue &q, uint64_t now);
+    static void update_max(atomic_uint32_t &m, uint32_t v);
+    void start_drain(Session *s, int which);
+    void forward(Session *s, Packet *p);
+    Packet *release_one(Session *s, int which, uint64_t now);
+    Packet *next_release(Session *s, uint64_t now);
+    bool packet_seq(const Packet *p, uint32_t &seq) const;
+    int merge_next(Session *s) const;
+    uint32_t release_ordered(Session *s, uint32_t quota, uint64_t now);
+    void clear_session(Session *s);
+    bool PushB1(Session *s, Packet *p);
+    int ReleaseB1(Session *s);
+    bool PushB2(Session *s, Packet *p);
+    int ReleaseB2(Session *s);
+    void Reset(Session *s);
+    inline Packet *Cleartag(Packet *);
+    inline Packet *smaction(Packet *);
+    void ctrl_connect();
+    void ctrl_connected();
+    void ctrl_close();
+    void ctrl_retry();
+    void ctrl_flush();
+    void ctrl_send(const String &msg);
+    bool run_control();
+    bool report_sessions(const char *type, atomic_uint32_t Session::*event);
+    void expire(Session *s);
+    inline void emit(Session *s, Packet *p);
+
+    static int parse_session(const String &s, Element *e, bool pattern,
+                             int &id, int &op, FlowPattern &fp, bool &legacy,
+                             ErrorHandler *errh);
     static int write_handler(const String&, Element*, void*, ErrorHandler*);
+    static int state_handler(int, String&, Element*, const Handler*,
+                             ErrorHandler*);
     static String read_handler(Element*, void*);
-    index_type next_i(index_type i) const {
-        return (i!=capacity ? i+1 : 0);
-    }
-    String getstate(int i) const {
-        if(i==0) return "S_NORMAL"; 
-        else if(i==1) return "S_MFSTART"; 
-        else if(i==3) return "S_RCVRDPKT"; 
+    static void unparse_latency(StringAccum &sa, const String &name,
+                                const TfmHistogram &h);
+    static const char *getstate(int i) {
+        if(i==0) return "S_NORMAL";
+        else if(i==1) return "S_MFSTART";
+        else if(i==3) return "S_RCVRDPKT";
         else if(i==6) return "S_RCVLINFLY";
-        else if(i==9) return "S_INSD_MFSTART"; 
-        else if(i==11) return "S_INSD_RCVRDPKT"; 
+        else if(i==9) return "S_INSD_MFSTART";
+        else if(i==11) return "S_INSD_RCVRDPKT";
         else if(i==14) return "S_INSD_RCVLINFLY";
         else return "error";
     }
-    
+
 };
 
 CLICK_ENDDECLS
@@ -0,0 +1,215 @@
+// -*- mode: c++; c-basic-offset: 4 -*-
+/*
+ * tfmbuffer.{cc,hh} -- segmented packet buffers for Tfm
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Click LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Click LICENSE file; the license in that file is
+ * legally binding.
+ */
+
+#include <click/config.h>
+#include "tfmbuffer.hh"
+#include <click/glue.hh>
+CLICK_DECLS
+
+TfmSegmentPool::TfmSegmentPool()
+    : _depot(0), _ndepot(0)
+{
+    _allocated = 0;
+}
+
+TfmSegmentPool::~TfmSegmentPool()
+{
+    for (int i = 0; i < _caches.size(); i++)
+        while (TfmSegment *seg = _caches[i].free) {
+            _caches[i].free = seg->next;
+            delete seg;
+        }
+    while (TfmSegment *seg = _depot) {
+        _depot = seg->next;
+        delete seg;
+    }
+}
+
+void
+TfmSegmentPool::initialize(int nthreads)
+{
+    _caches.resize(nthreads > 0 ? nthreads : 1);
+}
+
+inline TfmSegmentPool::Cache *
+TfmSegmentPool::cache()
+{
+    // threads without a cache of their own go straight to the depot
+    int tid = click_current_processor();
+    return (tid >= 0 && tid < _caches.size() ? &_caches[tid] : 0);
+}
+
+TfmSegment *
+TfmSegmentPool::alloc()
+{
+    TfmSegment *seg = 0;
+    Cache *c = cache();
+    if (c && c->free) {
+        seg = c->free;
+        c->free = seg->next;
+        c->nfree--;
+    } else if (_depot) {
+        _lock.acquire();
+        if ((seg = _depot)) {
+            _depot = seg->next;
+            _ndepot--;
+        }
+        _lock.release();
+    }
+    if (!seg) {
+        if (!(seg = new TfmSegment))
+            return 0;
+        _allocated++;
+    }
+    seg->next = 0;
+    seg->head = seg->tail = 0;
+    return seg;
+}
+
+void
+TfmSegmentPool::free(TfmSegment *seg)
+{
+    Cache *c = cache();
+    if (c && c->nfree < cache_max) {
+        seg->next = c->free;
+        c->free = seg;
+        c->nfree++;
+        return;
+    }
+    _lock.acquire();
+    if (_ndepot < depot_max) {
+        seg->next = _depot;
+        _depot = seg;
+        _ndepot++;
+        seg = 0;
+    }
+    _lock.release();
+    if (seg) {
+        delete seg;
+        _allocated--;
+    }
+}
+
+void
+TfmPacketQueue::initialize(int nlanes)
+{
+    _lanes.resize(nlanes > 0 ? nlanes : 1);
+}
+
+inline TfmPacketQueue::Lane &
+TfmPacketQueue::lane()
+{
+    // packets pushed from outside the driver threads share lane 0
+    int tid = click_current_processor();
+    return _lanes[tid >= 0 && tid < _lanes.size() ? tid : 0];
+}
+
+uint32_t
+TfmPacketQueue::size() const
+{
+    uint32_t n = 0;
+    for (int i = 0; i < _lanes.size(); i++)
+        n += _lanes[i]._packets;
+    return n;
+}
+
+uint32_t
+TfmPacketQueue::bytes() const
+{
+    uint32_t n = 0;
+    for (int i = 0; i < _lanes.size(); i++)
+        n += _lanes[i]._bytes;
+    return n;
+}
+
+bool
+TfmPacketQueue::push(Packet *p, uint64_t stamp, TfmSegmentPool &pool)
+{
+    Lane &l = lane();
+    if (!l._tail || l._tail->tail == TfmSegment::capacity) {
+        TfmSegment *seg = pool.alloc();
+        if (!seg)
+            return false;
+        if (l._tail)
+            l._tail->next = seg;
+        else
+            l._head = seg;
+        l._tail = seg;
+    }
+    l._tail->q[l._tail->tail] = p;
+    l._tail->stamp[l._tail->tail++] = stamp;
+    l._bytes += p->length();
+    // the packet is visible to the consumer once the count is raised
+    l._packets++;
+    return true;
+}
+
+Packet *
+TfmPacketQueue::pop(TfmSegmentPool &pool, uint64_t *stamp)
+{
+    for (int i = 0; i < _lanes.size(); i++, _next = (_next + 1) % _lanes.size()) {
+        Lane &l = _lanes[_next];
+        if (!l._packets)
+            continue;
+        // a full segment is never written again, and the producer has
+        // already linked the next one
+        if (l._head->head == TfmSegment::capacity) {
+            TfmSegment *seg = l._head;
+            l._head = seg->next;
+            pool.free(seg);
+        }
+        if (stamp)
+            *stamp = l._head->stamp[l._head->head];
+        Packet *p = l._head->q[l._head->head++];
+        l._bytes -= p->length();
+        l._packets--;
+        return p;
+    }
+    return 0;
+}
+
+Packet *
+TfmPacketQueue::peek(uint64_t *stamp) const
+{
+    for (int i = 0; i < _lanes.size(); i++) {
+        const Lane &l = _lanes[(_next + i) % _lanes.size()];
+        if (!l._packets)
+            continue;
+        // pop() would free a full head segment and move to the next one
+        const TfmSegment *seg = l._head;
+        if (seg->head == TfmSegment::capacity)
+            seg = seg->next;
+        if (stamp)
+            *stamp = seg->stamp[seg->head];
+        return seg->q[seg->head];
+    }
+    return 0;
+}
+
+void
+TfmPacketQueue::clear(TfmSegmentPool &pool)
+{
+    while (Packet *p = pop(pool))
+        p->kill();
+    for (int i = 0; i < _lanes.size(); i++) {
+        Lane &l = _lanes[i];
+        if (l._head)
+            pool.free(l._head);
+        l._head = l._tail = 0;
+    }
+}
+
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(TfmBuffer)
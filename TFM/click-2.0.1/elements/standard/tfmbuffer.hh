@@ -0,0 +1,113 @@
+// -*- mode: c++; c-basic-offset: 4 -*-
+#ifndef CLICK_TFMBUFFER_HH
+#define CLICK_TFMBUFFER_HH
+#include <click/packet.hh>
+#include <click/sync.hh>
+#include <click/atomic.hh>
+#include <click/vector.hh>
+CLICK_DECLS
+
+/*
+ * Elastic packet buffers for Tfm.
+ *
+ * A TfmPacketQueue is a FIFO of packet pointers stored in fixed-size
+ * TfmSegments chained head to tail.  Segments come from a TfmSegmentPool,
+ * which keeps a small free list per thread and a shared depot behind a
+ * spinlock; surplus segments are returned to the system, so buffer memory
+ * follows the number of packets actually held.
+ *
+ * A queue may be fed by several threads and drained by one.  Every producer
+ * thread appends to a lane of its own, so pushes need no locks; packets keep
+ * their order within a lane, and the consumer empties lanes one at a time.
+ */
+
+struct TfmSegment {
+    enum { capacity = 31 };     // 512 bytes per segment on 64-bit hosts
+    TfmSegment *next;
+    uint32_t head;
+    uint32_t tail;
+    Packet *q[capacity];
+    uint64_t stamp[capacity];   // enqueue time of each packet
+};
+
+class TfmSegmentPool { public:
+
+    TfmSegmentPool();
+    ~TfmSegmentPool();
+
+    void initialize(int nthreads);
+
+    TfmSegment *alloc();
+    void free(TfmSegment *seg);
+
+    // segments currently allocated from the system
+    uint32_t allocated() const          { return _allocated; }
+
+  private:
+
+    enum { cache_max = 64, depot_max = 1024 };
+
+    struct Cache {
+        TfmSegment *free;
+        int nfree;
+        Cache() : free(0), nfree(0) {}
+    };
+
+    Vector<Cache> _caches;
+    Spinlock _lock;
+    TfmSegment *_depot;
+    int _ndepot;
+    atomic_uint32_t _allocated;
+
+    Cache *cache();
+
+};
+
+class TfmPacketQueue { public:
+
+    TfmPacketQueue()
+        : _next(0) {
+    }
+
+    // one lane per producer thread
+    void initialize(int nlanes);
+
+    bool empty() const                  { return size() == 0; }
+    uint32_t size() const;
+    uint32_t bytes() const;
+
+    // producer side; returns false if no segment could be allocated
+    bool push(Packet *p, uint64_t stamp, TfmSegmentPool &pool);
+    // consumer side; stores the stamp given to push() in *stamp
+    Packet *pop(TfmSegmentPool &pool, uint64_t *stamp = 0);
+    // consumer side; the packet pop() returns next, left in the queue,
+    // unless a producer fills an emptier lane in between
+    Packet *peek(uint64_t *stamp = 0) const;
+    // only when no thread is pushing or popping
+    void clear(TfmSegmentPool &pool);
+
+  private:
+
+    // _head and the segment head index belong to the consumer, _tail and
+    // the segment tail index to the lane's producer; the atomic counters
+    // publish packets from one to the other
+    struct Lane {
+        TfmSegment *_head;
+        TfmSegment *_tail;
+        atomic_uint32_t _packets;
+        atomic_uint32_t _bytes;
+        Lane() : _head(0), _tail(0) {
+            _packets = 0;
+            _bytes = 0;
+        }
+    };
+
+    Vector<Lane> _lanes;
+    int _next;                  // lane the consumer is draining
+
+    Lane &lane();
+
+};
+
+CLICK_ENDDECLS
+#endif
@@ -0,0 +1,81 @@
+// -*- mode: c++; c-basic-offset: 4 -*-
+#ifndef CLICK_TFMHISTOGRAM_HH
+#define CLICK_TFMHISTOGRAM_HH
+#include <click/glue.hh>
+#include <click/integers.hh>
+CLICK_DECLS
+
+/*
+ * Log-linear histogram of 64-bit values, used by Tfm for buffering delays
+ * in nanoseconds.  Each power of two is split into 2^sub_bits linear
+ * buckets, so any recorded value is known to within 1/8 of itself; values
+ * below 2^sub_bits are exact.  Not thread safe: one writer at a time.
+ */
+
+class TfmHistogram { public:
+
+    enum { sub_bits = 3, nsub = 1 << sub_bits,
+           nbuckets = (64 - sub_bits + 1) << sub_bits };
+
+    TfmHistogram() {
+        clear();
+    }
+
+    void clear() {
+        memset(_b, 0, sizeof(_b));
+        _count = _max = 0;
+    }
+
+    void add(uint64_t v) {
+        _b[bucket(v)]++;
+        _count++;
+        if (v > _max)
+            _max = v;
+    }
+
+    uint64_t count() const              { return _count; }
+    uint64_t max() const                { return _max; }
+
+    // upper bound of the bucket holding quantile q (0 <= q <= 1)
+    uint64_t quantile(double q) const {
+        if (!_count)
+            return 0;
+        uint64_t rank = (uint64_t) (q * _count);
+        if (rank >= _count)
+            rank = _count - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < nbuckets; i++)
+            if ((seen += _b[i]) > rank)
+                return (bucket_high(i) < _max ? bucket_high(i) : _max);
+        return _max;
+    }
+
+    static int bucket(uint64_t v) {
+        if (v < nsub)
+            return v;
+        int msb = ffs_msb(v) - 1;
+        return ((msb - sub_bits + 1) << sub_bits)
+            + ((v >> (msb - sub_bits)) & (nsub - 1));
+    }
+
+    static uint64_t bucket_low(int i) {
+        if (i < nsub)
+            return i;
+        int e = i >> sub_bits;
+        return (uint64_t) (nsub + (i & (nsub - 1))) << (e - 1);
+    }
+
+    static uint64_t bucket_high(int i) {
+        return (i + 1 < nbuckets ? bucket_low(i + 1) - 1 : ~(uint64_t) 0);
+    }
+
+  private:
+
+    uint32_t _b[nbuckets];
+    uint64_t _count;
+    uint64_t _max;
+
+};
+
+CLICK_ENDDECLS
+#endif
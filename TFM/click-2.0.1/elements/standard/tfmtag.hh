@@ -0,0 +1,62 @@
+// -*- mode: c++; c-basic-offset: 4 -*-
+#ifndef CLICK_TFMTAG_HH
+#define CLICK_TFMTAG_HH
+#include <click/packet.hh>
+#include <clicknet/ip.h>
+CLICK_DECLS
+
+/*
+ * Migration tags.  On the wire a packet is tagged by bit 0 of the IP TOS
+ * (redirect) and the reserved IP flag (in-flight):
+ *
+ *   normal tos:flag = 0:0, in-flight 0:1, redirect 1:0, last in-flight 1:1
+ *
+ * Inside a box Srcmark, Tagredirect and Tfm only set the same bits in a
+ * one-byte annotation, which needs no packet copy.  Tagwrite ORs the
+ * annotation into the IP header where the packet leaves the box.
+ */
+
+// default annotation byte; elements take an ANNO keyword to move it
+#define TFM_TAG_ANNO_OFFSET	19
+
+enum { TFM_TAG_REDIRECT = 0x01, TFM_TAG_INFLY = 0x02 };
+
+inline void
+tfm_tag_anno(Packet *p, int anno, uint8_t bits)
+{
+    p->set_anno_u8(anno, p->anno_u8(anno) | bits);
+}
+
+// ORs tag bits into the IP header, updating the checksum.  The packet is
+// only made writable if a bit actually changes.  Returns null if it could
+// not be made writable (the packet is then freed).
+inline Packet *
+tfm_tag_header(Packet *p, uint8_t bits)
+{
+    assert(p->has_network_header());
+    const click_ip *iph = p->ip_header();
+    bool tos = (bits & TFM_TAG_REDIRECT) && !(iph->ip_tos & 0x01);
+    bool off = (bits & TFM_TAG_INFLY) && !(iph->ip_off & htons(IP_RF));
+    if (!tos && !off)
+        return p;
+
+    WritablePacket *q;
+    if (!(q = p->uniqueify()))
+        return 0;
+    click_ip *ip = q->ip_header();
+    uint16_t *tos_hw = reinterpret_cast<uint16_t *>(ip);
+    // the checksum is a one's complement sum, so the TOS word and ip_off
+    // add up to a single old and new value for one incremental update
+    uint32_t old_sum = *tos_hw + ip->ip_off;
+    if (tos)
+        ip->ip_tos |= 0x01;
+    if (off)
+        ip->ip_off |= htons(IP_RF);
+    uint32_t new_sum = *tos_hw + ip->ip_off;
+    click_update_in_cksum(&ip->ip_sum, (old_sum & 0xFFFF) + (old_sum >> 16),
+                          (new_sum & 0xFFFF) + (new_sum >> 16));
+    return q;
+}
+
+CLICK_ENDDECLS
+#endif
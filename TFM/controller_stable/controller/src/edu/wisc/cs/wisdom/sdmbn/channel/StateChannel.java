@@ -27,6 +27,7 @@ import edu.wisc.cs.wisdom.sdmbn.json.GetMultiflowMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetPerflowAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetPerflowMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.MigrateFinishAckMessage;
+import edu.wisc.cs.wisdom.sdmbn.json.MigrateTimeoutMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.Message;
 import edu.wisc.cs.wisdom.sdmbn.json.MessageException;
 import edu.wisc.cs.wisdom.sdmbn.json.PutAllflowsMessage;
@@ -113,6 +114,8 @@ public class StateChannel extends BaseChannel
 		{ op.receiveDelMultiflowAck((DelMultiflowAckMessage)msg); }
 		else if (msg instanceof MigrateFinishAckMessage) 
 		{ op.receiveMigrateFinishAck((MigrateFinishAckMessage)msg); }
+		else if (msg instanceof MigrateTimeoutMessage) 
+		{ op.receiveMigrateTimeout((MigrateTimeoutMessage)msg); }
 		else if (msg instanceof EventsAckMessage) 
 		{
 			EventsAckMessage eventsAck = (EventsAckMessage)msg;
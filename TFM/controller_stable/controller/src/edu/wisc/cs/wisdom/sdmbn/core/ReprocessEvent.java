@@ -4,6 +4,8 @@ import java.io.IOException;
 import java.util.Arrays;
 import java.util.concurrent.Callable;
 
+import javax.xml.bind.DatatypeConverter;
+
 import net.floodlightcontroller.core.IOFSwitch;
 
 import org.openflow.protocol.OFPacketOut;
@@ -146,8 +148,17 @@ public class ReprocessEvent implements Callable<Boolean>
 		{ log.error(e.toString()); }
 	}
 		
+	// Prefix of blobs in standard base64 (SDMBN_BASE64_V1 in libsdmbn)
+	private static final String BASE64_V1_PREFIX = "~1";
+
 	public static byte[] base64_decode(String encodedPkt) 
 	{
+		if (encodedPkt.startsWith(BASE64_V1_PREFIX))
+		{ 
+			return DatatypeConverter.parseBase64Binary(
+					encodedPkt.substring(BASE64_V1_PREFIX.length())); 
+		}
+
 		byte [] decodedPacket = new byte[encodedPkt.length() / 2];
 		for (int i = 0; i < encodedPkt.length()/2; i++)
 		{
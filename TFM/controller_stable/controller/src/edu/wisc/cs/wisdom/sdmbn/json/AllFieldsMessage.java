@@ -17,11 +17,16 @@ public class AllFieldsMessage extends Message
 	public int seq;
 	public String header;
 	public String packet;
+	public Long after;
+	public Long drain;
+	public Long quiesce;
 	
 	public Message cast() throws MessageException
 	{
 		if (this.type.equals(Message.RESPONSE_MIGRATE_FINISH_ACK))
 		{ return new MigrateFinishAckMessage(this); }
+		if (this.type.equals(Message.RESPONSE_MIGRATE_TIMEOUT))
+		{ return new MigrateTimeoutMessage(this); }
 		if (this.type.equals(Message.COMMAND_DELETE_MULTIFLOW))
 		{ return new DelMultiflowMessage(this); }
 		if (this.type.equals(Message.COMMAND_DELETE_PERFLOW))
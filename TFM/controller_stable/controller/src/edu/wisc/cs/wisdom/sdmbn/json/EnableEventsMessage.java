@@ -6,6 +6,8 @@ public class EnableEventsMessage extends Message
 {
 	public PerflowKey key;
 	public String action;
+	public Long after;   // optional install barrier; null leaves it unset
+	public Long drain;
 	
 	public EnableEventsMessage()
 	{ super(Message.COMMAND_ENABLE_EVENTS); }
@@ -21,8 +23,10 @@ public class EnableEventsMessage extends Message
 		}
 		this.key = msg.key;
 		this.action = msg.action;
+		this.after = msg.after;
+		this.drain = msg.drain;
 	}
 	
 	public String toString()
-	{ return "{id="+id+",type=\""+type+"\",key="+key+"\",action=\""+action+"\"}"; }
+	{ return "{id="+id+",type=\""+type+"\",key="+key+"\",action=\""+action+"\",after="+after+",drain="+drain+"}"; }
 }
@@ -2,6 +2,9 @@ package edu.wisc.cs.wisdom.sdmbn.json;
 
 public class EventsAckMessage extends Message 
 {
+	public Long quiesce;    // microseconds the install barrier took
+	public Long after;      // packet the filter applies after
+	
 	public EventsAckMessage()
 	{ super(Message.RESPONSE_EVENTS_ACK); }
 	
@@ -14,8 +17,10 @@ public class EventsAckMessage extends Message
 					String.format("Cannot construct %s from message of type %s",
 							this.getClass().getSimpleName(), msg.type), msg); 
 		}
+		this.quiesce = msg.quiesce;
+		this.after = msg.after;
 	}
 	
 	public String toString()
-	{ return "{id="+id+",type=\""+type+"\"}"; }
+	{ return "{id="+id+",type=\""+type+"\",quiesce="+quiesce+",after="+after+"}"; }
 }
@@ -0,0 +1,24 @@
+package edu.wisc.cs.wisdom.sdmbn.json;
+
+public class MigrateTimeoutMessage extends Message 
+{
+	public int count;
+	
+	public MigrateTimeoutMessage()
+	{ super(Message.RESPONSE_MIGRATE_TIMEOUT); }
+	
+	public MigrateTimeoutMessage(AllFieldsMessage msg) throws MessageException
+	{
+		super(msg);
+		if (!msg.type.equals(Message.RESPONSE_MIGRATE_TIMEOUT))
+		{
+			throw new MessageException(
+					String.format("Cannot construct %s from message of type %s",
+							this.getClass().getSimpleName(), msg.type), msg); 
+		}
+		this.count = msg.count;
+	}
+	
+	public String toString()
+	{ return "{id="+id+",type=\""+type+"\",count="+count+"}"; }
+}
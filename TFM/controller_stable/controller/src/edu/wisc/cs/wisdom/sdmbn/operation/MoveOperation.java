@@ -27,6 +27,7 @@ import edu.wisc.cs.wisdom.sdmbn.json.GetMultiflowAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetMultiflowMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetPerflowAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.MigrateFinishAckMessage;
+import edu.wisc.cs.wisdom.sdmbn.json.MigrateTimeoutMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetPerflowMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.Message;
 import edu.wisc.cs.wisdom.sdmbn.json.MessageException;
@@ -263,7 +264,9 @@ public class MoveOperation extends Operation
         {
 	    log.info("TFM start to migrate");
 	    this.moveStart = System.currentTimeMillis();
-            String r1 = dsttfm.sendCommand("write tfm.mfstart 1");
+            // the finish report echoes the operation id given here
+            String r1 = dsttfm.sendCommand("write tfm.mfstart SESSION 0, OPERATION "
+                    + this.getId());
             //update flowtable ,send from src and dst 
             //r1 = srctfm.sendCommand("write eth.src e8:61:1f:10:6c:d1");
             //r1 = srctfm.sendCommand("write eth.dst e8:61:1f:10:6d:53");
@@ -325,6 +328,14 @@ public class MoveOperation extends Operation
         long moveTime = moveEnd - this.moveStart;
         log.info(String.format("here[MOVE_TIME] elapse=%d, start=%d, end=%d",moveTime, this.moveStart, moveEnd));
     }
+
+    // tfm gave up waiting and released (or dropped) the buffered packets
+    public void receiveMigrateTimeout(MigrateTimeoutMessage msg) 
+    {
+        long moveEnd = System.currentTimeMillis();
+        log.warn(String.format("Move (%d) timed out in tfm: sessions=%d, elapse=%d",
+                this.getId(), msg.count, moveEnd - this.moveStart));
+    }
     private void receiveStateMessage(StateMessage msg)
     {
 	
@@ -14,6 +14,7 @@ import edu.wisc.cs.wisdom.sdmbn.json.DelMultiflowAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.EventsAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetPerflowAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.MigrateFinishAckMessage;
+import edu.wisc.cs.wisdom.sdmbn.json.MigrateTimeoutMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetMultiflowAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetAllflowsAckMessage;
 import edu.wisc.cs.wisdom.sdmbn.json.GetConfigAckMessage;
@@ -91,6 +92,7 @@ public abstract class Operation
 	public abstract int execute();
 	
         public void receiveMigrateFinishAck(MigrateFinishAckMessage msg) {}
+        public void receiveMigrateTimeout(MigrateTimeoutMessage msg) {}
 	public void receiveStatePerflow(StatePerflowMessage msg) {}
 	public void receiveStateMultiflow(StateMultiflowMessage msg) {}
 	public void receiveStateAllflows(StateAllflowsMessage msg) {}
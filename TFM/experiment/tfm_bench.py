@@ -0,0 +1,155 @@
+#!/usr/bin/python
+#
+# Runs tfm_bench.click and reports throughput, buffering latency and peak
+# memory of the Tfm migration engine.
+#
+# usage: tfm_bench.py [-c click] [-j threads] [-f flows] [-s sessions]
+#                     [-d duration] [VAR=value ...]
+#
+# Extra VAR=value arguments are passed to the configuration unchanged
+# (PAYLOAD, BURST, T_MFSTART, T_LASTINFLY, T_STATEINSTALL).
+
+from __future__ import division
+from __future__ import print_function
+import os
+import re
+import sys
+import time
+import getopt
+import subprocess
+
+here = os.path.dirname(os.path.abspath(__file__))
+config = os.path.join(here, 'tfm_bench.click')
+
+
+def usage():
+    print('usage: %s [-c click] [-j threads] [-f flows] [-s sessions] '
+          '[-d duration] [VAR=value ...]' % sys.argv[0], file=sys.stderr)
+    sys.exit(1)
+
+
+def rss_kb(pid):
+    try:
+        for line in open('/proc/%d/status' % pid):
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    except (IOError, ValueError):
+        pass
+    return 0
+
+
+# Script prints "element.handler:\nvalue\n" for each read instruction
+def parse(output):
+    result = {}
+    key = None
+    for line in output.splitlines():
+        m = re.match(r'^elapsed (\S+)$', line)
+        if m:
+            result['elapsed'] = float(m.group(1))
+            key = None
+            continue
+        m = re.match(r'^(\w+)\.(\w+):$', line)
+        if m:
+            key = m.group(1) + '.' + m.group(2)
+            result[key] = ''
+            continue
+        if key is not None:
+            result[key] += line + '\n'
+    return result
+
+
+# Tfm's latency handler: one "name count p50 p99 p999 max" line for all
+# sessions, then one per session
+def latency(text):
+    for line in text.splitlines():
+        w = line.split()
+        if len(w) == 6 and w[0] == 'all':
+            return dict(zip(('count', 'p50', 'p99', 'p999', 'max'), w[1:]))
+    return {}
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'c:j:f:s:d:h')
+    except getopt.GetoptError:
+        usage()
+
+    click = os.environ.get('CLICK', 'click')
+    threads = 1
+    flows = 1024
+    sessions = 1
+    duration = 5
+    for o, a in opts:
+        if o == '-c':
+            click = a
+        elif o == '-j':
+            threads = int(a)
+        elif o == '-f':
+            flows = int(a)
+        elif o == '-s':
+            sessions = int(a)
+        elif o == '-d':
+            duration = float(a)
+        else:
+            usage()
+
+    # session i migrates 10.i.0.0/16, and the migrating sources draw from
+    # one prefix covering all of them
+    if sessions < 1 or sessions > 256 or sessions & (sessions - 1):
+        print('sessions must be a power of two <= 256', file=sys.stderr)
+        sys.exit(1)
+    mignet = '10.0.0.0/%d' % (16 - (sessions.bit_length() - 1))
+
+    cmd = [click]
+    if threads > 1:
+        cmd += ['-j', str(threads)]
+    cmd += [config, 'FLOWS=%d' % flows, 'SESSIONS=%d' % sessions,
+            'MIGNET=%s' % mignet, 'DURATION=%s' % duration] + args
+
+    print(' '.join(cmd))
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT,
+                            universal_newlines=True)
+
+    # sample memory while Click runs; the output is small enough to sit in
+    # the pipe until it exits
+    peak = 0
+    while proc.poll() is None:
+        peak = max(peak, rss_kb(proc.pid))
+        time.sleep(0.05)
+    output = proc.stdout.read()
+    if proc.returncode != 0:
+        sys.stderr.write(output)
+        sys.exit(proc.returncode)
+
+    r = parse(output)
+    if 'elapsed' not in r or 'out.count' not in r:
+        sys.stderr.write(output)
+        print('could not parse click output', file=sys.stderr)
+        sys.exit(1)
+
+    elapsed = r['elapsed']
+    out = int(r['out.count'])
+    overflow = int(r.get('overflow.count', '0'))
+    lat = latency(r.get('tfm.latency', ''))
+
+    print('flows           %d x 4 ports' % flows)
+    print('sessions        %d (%s)' % (sessions, mignet))
+    print('threads         %d' % threads)
+    print('elapsed         %.3f s' % elapsed)
+    print('forwarded       %d packets, %.3f Mpps' % (out, out / elapsed / 1e6))
+    print('overflow        %d packets' % overflow)
+    print('average delay   %s s' % r.get('delay.average_time', '?').strip())
+    for q in ('count', 'p50', 'p99', 'p999', 'max'):
+        if q in lat:
+            print('buffered %-6s %s%s' % (q, lat[q], q != 'count' and ' ns' or ''))
+    print('highwater       %s' % ' '.join(r.get('tfm.highwater', '?').split()))
+    print('left buffered   %s' % r.get('tfm.buffered', '?').strip())
+    print('peak rss        %d kB' % peak)
+    if r.get('tfm.timeline'):
+        print('timeline')
+        sys.stdout.write(r['tfm.timeline'])
+
+
+if __name__ == '__main__':
+    main()
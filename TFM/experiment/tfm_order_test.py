@@ -0,0 +1,89 @@
+#!/usr/bin/python
+#
+# Checks that Tfm's ORDER release merges B1 and B2 per flow: runs
+# tfm_order_test.click with one flow whose in-flight packets carry the even
+# sequence numbers and whose redirected packets carry the odd ones, and
+# checks that the flow comes out in sequence.
+#
+# usage: tfm_order_test.py [-c click] [-n packets] [VAR=value ...]
+#
+# Extra VAR=value arguments are passed to the configuration unchanged
+# (BURST).
+
+from __future__ import print_function
+import os
+import sys
+import getopt
+import shutil
+import tempfile
+import subprocess
+
+here = os.path.dirname(os.path.abspath(__file__))
+config = os.path.join(here, 'tfm_order_test.click')
+
+
+def usage():
+    print('usage: %s [-c click] [-n packets] [VAR=value ...]' % sys.argv[0],
+          file=sys.stderr)
+    sys.exit(1)
+
+
+def write_dump(path, seqs):
+    f = open(path, 'w')
+    f.write('!data ip_src ip_dst sport dport ip_proto tcp_seq\n')
+    for seq in seqs:
+        f.write('10.0.0.1 10.1.0.1 1234 80 T %d\n' % seq)
+    f.close()
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'c:n:h')
+    except getopt.GetoptError:
+        usage()
+
+    click = os.environ.get('CLICK', 'click')
+    n = 200
+    for o, a in opts:
+        if o == '-c':
+            click = a
+        elif o == '-n':
+            n = int(a)
+        else:
+            usage()
+
+    tmp = tempfile.mkdtemp()
+    try:
+        infly = os.path.join(tmp, 'infly.dump')
+        redirect = os.path.join(tmp, 'redirect.dump')
+        lastinfly = os.path.join(tmp, 'lastinfly.dump')
+        write_dump(infly, range(0, 2 * n, 2))
+        write_dump(redirect, range(1, 2 * n, 2))
+        write_dump(lastinfly, [2 * n])
+
+        cmd = [click, config, 'INFLY=' + infly, 'REDIRECT=' + redirect,
+               'LASTINFLY=' + lastinfly] + args
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                                universal_newlines=True)
+        output = proc.communicate()[0]
+        if proc.returncode != 0:
+            sys.exit(proc.returncode)
+    finally:
+        shutil.rmtree(tmp)
+
+    seqs = [int(line) for line in output.splitlines()
+            if line and not line.startswith('!')]
+    if seqs != list(range(2 * n)):
+        for i, seq in enumerate(seqs):
+            if seq != i:
+                print('packet %d has sequence number %d' % (i, seq),
+                      file=sys.stderr)
+                break
+        print('%d of %d packets released, out of order' % (len(seqs), 2 * n),
+              file=sys.stderr)
+        sys.exit(1)
+    print('%d packets of B1 and B2 released in sequence' % len(seqs))
+
+
+if __name__ == '__main__':
+    main()
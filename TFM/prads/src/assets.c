@@ -13,19 +13,105 @@
 extern globalconfig config;
 static asset *passet[BUCKET_SIZE];
 
+/* passet is guarded by striped locks: bucket h by asset_locks[h % ASSET_LOCKS],
+ * so lookups for different hosts rarely wait for each other */
+#define ASSET_LOCKS 64
+#define ASSET_LOCK(hash) (&asset_locks[(hash) % ASSET_LOCKS])
+static pthread_mutex_t asset_locks[ASSET_LOCKS];
+
+/* a serialized asset waiting to be sent */
+typedef struct _asset_state {
+    PerflowKey key;
+    char *state;
+} asset_state;
+
 long overall_mserz_time = 0;
 long overall_mdeserz_time = 0;
 long overall_mstate_size =0;
 
+void asset_init()
+{
+    int i;
+    for (i = 0; i < ASSET_LOCKS; i++)
+        pthread_mutex_init(&asset_locks[i], NULL);
+}
+
+/* the passet bucket of the asset of a host */
+static uint64_t addr_hash(int af, struct in6_addr *ip)
+{
+    if (af == AF_INET6)
+        return ASSET_HASH6(*ip);
+    return ASSET_HASH4(IP4ADDR(ip));
+}
+
+/* the passet bucket an asset lives in */
+static uint64_t asset_hash(asset *masset)
+{
+    return addr_hash(masset->af, &masset->ip_addr);
+}
+
+/* whether masset is still linked in passet[hash], whose stripe is held;
+ * masset itself is not read, as it may have been freed */
+static int asset_linked(asset *masset, uint64_t hash)
+{
+    asset *rec;
+    for (rec = passet[hash]; rec != NULL; rec = rec->next)
+        if (rec == masset)
+            return 1;
+    return 0;
+}
+
+/* The assets of a connection are those of its two endpoints.  Locks both
+ * endpoint stripes, lower one first so two callers can never wait on each
+ * other; *second is NULL when both hosts share a stripe. */
+static void conn_stripes_lock(connection *conn, pthread_mutex_t **first,
+                              pthread_mutex_t **second)
+{
+    pthread_mutex_t *tmp;
+
+    *first = ASSET_LOCK(addr_hash(conn->af, &conn->s_ip));
+    *second = ASSET_LOCK(addr_hash(conn->af, &conn->d_ip));
+    if (*first == *second) {
+        *second = NULL;
+    } else if (*second < *first) {
+        tmp = *first;
+        *first = *second;
+        *second = tmp;
+    }
+    pthread_mutex_lock(*first);
+    if (*second != NULL)
+        pthread_mutex_lock(*second);
+}
+
+static void conn_stripes_unlock(pthread_mutex_t *first, pthread_mutex_t *second)
+{
+    if (second != NULL)
+        pthread_mutex_unlock(second);
+    pthread_mutex_unlock(first);
+}
+
+/* masset if it is still linked at an endpoint of conn, whose stripes are
+ * held, else NULL: a delete may have freed it since conn pointed at it */
+static asset *conn_asset_pinned(connection *conn, asset *masset)
+{
+    if (masset == NULL)
+        return NULL;
+    if (asset_linked(masset, addr_hash(conn->af, &conn->s_ip))
+        || asset_linked(masset, addr_hash(conn->af, &conn->d_ip)))
+        return masset;
+    return NULL;
+}
+
 void update_asset(packetinfo *pi)
 {
     
     if (asset_lookup(pi) == SUCCESS) {
         if (pi->asset != NULL) {
-            pthread_mutex_lock(&AssetEntryLock);
+            pthread_mutex_t *lock = ASSET_LOCK(asset_hash(pi->asset));
+            pthread_mutex_lock(lock);
             pi->asset->vlan = pi->vlan;
             pi->asset->last_seen = pi->pheader->ts.tv_sec;
-            pthread_mutex_unlock(&AssetEntryLock);
+            pthread_mutex_unlock(lock);
         } else {
             printf("\nBAD ERROR in update_asset\n");
         }
@@ -104,7 +190,7 @@ asset* get_asset_per_sip(uint32_t sip)
     asset *masset = NULL;
      
     hash = ASSET_HASH4(sip);
-    pthread_mutex_lock(&AssetEntryLock);        
+    pthread_mutex_lock(ASSET_LOCK(hash));
     masset = passet[hash];
     while (masset != NULL) {
         if (masset->af == AF_INET && CMP_ADDR4( &masset->ip_addr, sip))
@@ -115,13 +201,13 @@ asset* get_asset_per_sip(uint32_t sip)
                 curr->c_asset = masset;
                 *state = ser_ialize(head_tra, "connection", curr, NULL, 0);
             }*/
-            pthread_mutex_unlock(&AssetEntryLock); 
+            pthread_mutex_unlock(ASSET_LOCK(hash));
             return masset;
         }
         masset = masset->next;
     }
     
-    pthread_mutex_unlock(&AssetEntryLock); 
+    pthread_mutex_unlock(ASSET_LOCK(hash));
     return masset;
 }
 
@@ -322,8 +408,8 @@ void put_asset_per_sip(uint32_t sip, asset* in_asset, connection *cxt)
         // Push the struct into the list
         INFO_PRINT("[put_asset_per_sip]: Asset structure not found"); 
         uint64_t hash;
-        pthread_mutex_lock(&AssetEntryLock);
         hash = ASSET_HASH4(sip);
+        pthread_mutex_lock(ASSET_LOCK(hash));
         in_asset->next = passet[hash];
 
         if (passet[hash] != NULL)
@@ -332,7 +418,7 @@ void put_asset_per_sip(uint32_t sip, asset* in_asset, connection *cxt)
         passet[hash] = in_asset;
         in_asset->ref = 0;
         
-        pthread_mutex_unlock(&AssetEntryLock); 
+        pthread_mutex_unlock(ASSET_LOCK(hash));
         return;
     }
     
@@ -419,7 +505,7 @@ uint8_t asset_lookup(packetinfo *pi)
                 ip = PI_IP4SRC(pi);
             }
             hash = ASSET_HASH4(ip);
-            pthread_mutex_lock(&AssetEntryLock); 
+            pthread_mutex_lock(ASSET_LOCK(hash));
             masset = passet[hash];
             while (masset != NULL) {
                 //if (memcmp(&ip_addr,&rec->ip_addr,16)) {
@@ -428,27 +514,27 @@ uint8_t asset_lookup(packetinfo *pi)
                 {
                     pi->asset = masset;
                     update_cxt_asset(pi,masset);
-                    pthread_mutex_unlock(&AssetEntryLock);
+                    pthread_mutex_unlock(ASSET_LOCK(hash));
                     return SUCCESS;
                 }
                 masset = masset->next;
             }
-            pthread_mutex_unlock(&AssetEntryLock); 
+            pthread_mutex_unlock(ASSET_LOCK(hash));
             return ERROR;
         } else if (pi->af == AF_INET6) {
             hash = ASSET_HASH6(PI_IP6SRC(pi));
-            pthread_mutex_lock(&AssetEntryLock);
+            pthread_mutex_lock(ASSET_LOCK(hash));
             masset = passet[hash];
             while (masset != NULL) {
                 if (masset->af == AF_INET6 &&
                     CMP_ADDR6(&masset->ip_addr, &PI_IP6SRC(pi))){
                     pi->asset = masset;
-                    pthread_mutex_unlock(&AssetEntryLock); 
+                    pthread_mutex_unlock(ASSET_LOCK(hash));
                     return SUCCESS;
                 }
                 masset = masset->next;
             }
-            pthread_mutex_unlock(&AssetEntryLock); 
+            pthread_mutex_unlock(ASSET_LOCK(hash));
             return ERROR;
         }
         return ERROR;
@@ -754,7 +840,7 @@ void add_asset(packetinfo *pi)
         hash = ASSET_HASH6(PI_IP6SRC(pi));
     }
 
-    pthread_mutex_lock(&AssetEntryLock); 
+    pthread_mutex_lock(ASSET_LOCK(hash));
     masset->next = passet[hash];
 
     if (passet[hash] != NULL)
@@ -764,8 +850,8 @@ void add_asset(packetinfo *pi)
     masset->services = NULL;
     masset->macentry = NULL;
     passet[hash] = masset;
-    pthread_mutex_unlock(&AssetEntryLock); 
     update_cxt_asset(pi, masset);
+    pthread_mutex_unlock(ASSET_LOCK(hash));
 
 #ifdef DEBUGG
     /* verbose info for sanity checking */
@@ -985,8 +1071,8 @@ void clear_asset_list()
     asset *rec = NULL;
     int akey;
 
-    pthread_mutex_lock(&AssetEntryLock); 
     for (akey = 0; akey < BUCKET_SIZE; akey++) {
+        pthread_mutex_lock(ASSET_LOCK(akey));
         rec = passet[akey];
         while (rec != NULL) {
             serv_asset *tmp_sa = NULL;
@@ -1013,8 +1099,8 @@ void clear_asset_list()
             rec = rec->next;
             del_asset(tmp, &passet[akey]);
         }
+        pthread_mutex_unlock(ASSET_LOCK(akey));
     }
-    pthread_mutex_unlock(&AssetEntryLock); 
     dlog("asset memory has been cleared\n");
 }
 
@@ -1033,8 +1119,8 @@ void update_asset_list()
     serv_asset *tmp_sa = NULL;
     os_asset *tmp_oa = NULL;
 
-    pthread_mutex_lock(&AssetEntryLock); 
     for (akey = 0; akey < BUCKET_SIZE; akey++) {
+        pthread_mutex_lock(ASSET_LOCK(akey));
         rec = passet[akey];
         while (rec != NULL) {
             /* Checks if something has been updated in the asset since last time */
@@ -1083,8 +1169,8 @@ void update_asset_list()
                 rec = rec->next;
             }
         }
+        pthread_mutex_unlock(ASSET_LOCK(akey));
     }
-    pthread_mutex_unlock(&AssetEntryLock); 
 }
 
 ///// SDMBN Local Multiflow State Handlers ///////////////////////////////////
@@ -1106,7 +1192,7 @@ int local_get_multiflow(PerflowKey *key, int id)
         //INFO_PRINT("Getting the asset for IP %d", key->nw_src);
         hash = ASSET_HASH4(key->nw_src);
 
-        pthread_mutex_lock(&AssetEntryLock); 
+        pthread_mutex_lock(ASSET_LOCK(hash));
         masset = passet[hash];
         while (masset != NULL) 
         {
@@ -1118,15 +1204,17 @@ int local_get_multiflow(PerflowKey *key, int id)
         	}
         	masset = masset->next;
         }
-        pthread_mutex_unlock(&AssetEntryLock); 	
         // No Asset found with the input key
         if (masset == NULL)
-        { return 0; }
+        {
+            pthread_mutex_unlock(ASSET_LOCK(hash));
+            return 0;
+        }
         
         struct timeval start_serialize, end_serialize;
         gettimeofday(&start_serialize, NULL);
 
-        state = ser_ialize(head_tra, "asset", masset, NULL, 0);
+        state = sbin_ialize(head_sbin, head_tra, "asset", masset);
         //char *state = ser_ialize(head_tra, "asset", ast, NULL, 0);
         //pthread_rwlock_unlock(&rwlock);
         gettimeofday(&end_serialize, NULL);
@@ -1155,6 +1243,9 @@ int local_get_multiflow(PerflowKey *key, int id)
         { /* FIXME: Handle IPv6 */ }
         int hashkey = astkey.nw_src;
 
+        // The serialized state is our snapshot; send it unlocked
+        pthread_mutex_unlock(ASSET_LOCK(hash));
+
         // Send multiflow state
         int result = sdmbn_send_multiflow(id, &astkey, state, hashkey, count);
         if (result < 0)
@@ -1172,10 +1263,14 @@ int local_get_multiflow(PerflowKey *key, int id)
     //INFO_PRINT("multiflow key is NULL");
 all:
 	printf("SRC_IP is wildcarded, getting all multiflow states");
+    // Each bucket is serialized under its lock and sent after letting go
+    asset_state *states = NULL;
+    int size = 0, n, i;
     int h = 0;
     for (h = 0; h < BUCKET_SIZE; h++)
     {
-        pthread_mutex_lock(&AssetEntryLock); 
+        n = 0;
+        pthread_mutex_lock(ASSET_LOCK(h));
         asset *curr = passet[h];
         while (curr != NULL)
         {
@@ -1185,7 +1280,7 @@ all:
 
 
             //pthread_rwlock_wrlock(&rwlock);
-            char *state = ser_ialize(head_tra, "asset", curr, NULL, 0);
+            char *state = sbin_ialize(head_sbin, head_tra, "asset", curr);
             //pthread_rwlock_unlock(&rwlock);
 
             gettimeofday(&end_serialize, NULL);
@@ -1199,36 +1294,56 @@ all:
 			printf("STATS: MULTIFLOW: TIME TO SERIALIZE CURRENT = %ldus\n", total);
 			printf("STATS: MULTIFLOW: TIME TO SERIALIZE OVERALL = %ldus\n", overall_mserz_time);
 
+            if (n == size)
+            {
+                asset_state *grown = realloc(states,
+                        (size ? size * 2 : 16) * sizeof(asset_state));
+                if (NULL == grown)
+                {
+                    free(state);
+                    break;
+                }
+                states = grown;
+                size = size ? size * 2 : 16;
+            }
+
             // Construct key
-            PerflowKey astkey;
-            astkey.wildcards = WILDCARD_ALL;
+            PerflowKey *astkey = &states[n].key;
+            astkey->wildcards = WILDCARD_ALL;
             if (AF_INET == curr->af)
             {
-                astkey.dl_type = 0x0800;
-                astkey.nw_src = curr->ip_addr.s6_addr32[0];
-                astkey.wildcards &= ~(WILDCARD_NW_SRC | WILDCARD_DL_TYPE);
+                astkey->dl_type = 0x0800;
+                astkey->nw_src = curr->ip_addr.s6_addr32[0];
+                astkey->wildcards &= ~(WILDCARD_NW_SRC | WILDCARD_DL_TYPE);
             }
             else
             { /* FIXME: Handle IPv6 */ }
-            int hashkey = astkey.nw_src;
+            states[n].state = state;
+            n++;
+
+            // Move on to next asset
+            curr = curr->next;
+        }
+        pthread_mutex_unlock(ASSET_LOCK(h));
+
+        for (i = 0; i < n; i++)
+        {
+            int hashkey = states[i].key.nw_src;
 
             // Send multiflow state
-            int result = sdmbn_send_multiflow(id, &astkey, state, hashkey, 
-                    count);
+            int result = sdmbn_send_multiflow(id, &states[i].key,
+                    states[i].state, hashkey, count);
             if (result < 0)
             { }
 
             // Clean-up
-            free(state);
+            free(states[i].state);
 
             // Increment count
             count++;
-
-            // Move on to next asset
-            curr = curr->next;
         }
-        pthread_mutex_unlock(&AssetEntryLock); 
     }
+    free(states);
 
     return count;
 }
@@ -1243,7 +1358,7 @@ int local_put_multiflow(int hashkey, PerflowKey *key, char *state)
     struct timeval start_deserialize, end_deserialize;
     gettimeofday(&start_deserialize, NULL);
 
-    asset *ast = ser_parse(head_tra, "asset", state, NULL);
+    asset *ast = sbin_parse(head_sbin, head_tra, "asset", state);
     gettimeofday(&end_deserialize, NULL);
 	long sec = end_deserialize.tv_sec - start_deserialize.tv_sec;
 	long usec = end_deserialize.tv_usec - start_deserialize.tv_usec;
@@ -1263,9 +1378,9 @@ int del_all_multiflows()
     int count = 0;
     asset *rec = NULL;
     int akey;
-    pthread_mutex_lock(&AssetEntryLock);
     for (akey = 0; akey < BUCKET_SIZE; akey++) 
     {
+        pthread_mutex_lock(ASSET_LOCK(akey));
         rec = passet[akey];
         while (rec != NULL) 
         {
@@ -1298,39 +1413,57 @@ int del_all_multiflows()
             del_asset(tmp, &passet[akey]);
             count++;
         }
+        pthread_mutex_unlock(ASSET_LOCK(akey));
     }
-    pthread_mutex_unlock(&AssetEntryLock);
     dlog("asset memory has been cleared\n");
     return count;
 }
 
-int find_del_asset(asset *masset)
+/* deletes the unreferenced IPv4 assets conn points at and unlinks them
+ * from conn, whose shard lock the caller holds */
+static int del_conn_asset(connection *conn, asset **slot)
 {
-    uint32_t sip;
-    uint64_t hash;
+    asset *masset = conn_asset_pinned(conn, *slot);
     if (masset == NULL)
+    {
+        *slot = NULL;
+        return 0;
+    }
+    if (IP4ADDR(&masset->ip_addr) == 0 || masset->ref > 0)
     { return 0; }
-    sip = IP4ADDR(&masset->ip_addr);
-    if (sip == 0)
-    { return 0; }
-    if (masset->ref > 0)
-    { return 0; }
-
-    hash = ASSET_HASH4(sip);
-    // Clean-up
-    pthread_mutex_lock(&AssetEntryLock);  
-    del_asset(masset,&passet[hash]);
-    pthread_mutex_unlock(&AssetEntryLock);
+    del_asset(masset, &passet[asset_hash(masset)]);
+    *slot = NULL;
     return 1;
 }
 
+int find_del_conn_assets(connection *conn)
+{
+    pthread_mutex_t *first, *second;
+    int count;
+
+    // Another delete may already have freed them, so only touch assets
+    // still linked under the stripes of conn's endpoints
+    conn_stripes_lock(conn, &first, &second);
+    count = del_conn_asset(conn, &conn->c_asset);
+    count += del_conn_asset(conn, &conn->s_asset);
+    conn_stripes_unlock(first, second);
+    return count;
+}
+
 char* serialize_conn_asset(connection *conn, int msgid)
 { 
     asset *c_asset = NULL, *s_asset = NULL;
+    pthread_mutex_t *first = NULL, *second = NULL;
+
+    // conn is a copy taken under its shard lock, and deletes on the control
+    // lane may have freed its assets since, so keep only those still linked
+    // under the stripes of its endpoints
+    conn_stripes_lock(conn, &first, &second);
+    c_asset = conn_asset_pinned(conn, conn->c_asset);
+    s_asset = conn_asset_pinned(conn, conn->s_asset);
+    conn->c_asset = c_asset;
+    conn->s_asset = s_asset;
 
-    c_asset = conn->c_asset;
-    s_asset = conn->s_asset;
-    pthread_mutex_lock(&AssetEntryLock);  
     if (c_asset != NULL)
     {
     	if (c_asset->sdmbn_msgid == msgid)
@@ -1353,11 +1486,11 @@ char* serialize_conn_asset(connection *conn, int msgid)
         s_asset->sdmbn_msgid = msgid;
     }
 
-    char *state = ser_ialize(head_tra, "connection", conn, NULL, 0);
+    char *state = sbin_ialize(head_sbin, head_tra, "connection", conn);
     // restore the asset pointers
     conn->c_asset = c_asset;
     conn->s_asset = s_asset;
-    pthread_mutex_unlock(&AssetEntryLock); 
+    conn_stripes_unlock(first, second);
     return state;
 }
 
@@ -3,6 +3,7 @@
 
 #define ASSET_HASH6(ip) ( (ip).s6_addr32[3] % BUCKET_SIZE )
 
+void asset_init();
 void add_asset(packetinfo *pi);
 void del_asset(asset * passet, asset ** bucket_ptr);
 void del_os_asset(os_asset ** prev_os, os_asset * passet);
@@ -18,7 +19,7 @@ uint8_t asset_lookup(packetinfo *pi);
 asset* get_asset_per_sip(uint32_t sip);
 void put_asset_per_sip(uint32_t sip, asset* in_asset, connection *cxt);
 char* serialize_conn_asset(connection *conn, int msgid);
-int find_del_asset(asset *masset);
+int find_del_conn_assets(connection *conn);
 int decr_asset_ref(asset *masset);
 int incr_asset_ref(asset *masset);
 int del_all_multiflows();
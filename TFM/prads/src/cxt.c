@@ -4,6 +4,9 @@
 #include "common.h"
 #include "prads.h"
 #include "cxt.h"
+#include "cxt_table.h"
+#include "cxt_wheel.h"
+#include "cxt_index.h"
 #include "sys_func.h"
 #include "config.h"
 #include "output-plugins/log.h"
@@ -17,10 +20,50 @@ static void local_raise_reprocess(connection *cxt, packetinfo *pi);
 extern globalconfig config;
 
 uint64_t cxtrackerid;
-connection *bucket[BUCKET_SIZE];
-//connection *bucket_backup[BUCKET_SIZE];
-
 
+/* The connection table is split by hash into shards with a lock each, so
+ * the packet thread only waits for whoever holds its own flow's shard.
+ * Bits 40-43 of the hash pick the shard; the tables index buckets with the
+ * low bits and take fingerprints from the top 16. */
+#define CXT_SHARDS 16
+#define CXT_SHARD(hash) (&shards[((hash) >> 40) & (CXT_SHARDS - 1)])
+
+typedef struct _cxt_shard {
+    pthread_mutex_t lock;
+    cxt_table table;
+    cxt_wheel wheel;                    /* expiry of the shard's connections */
+    cxt_index index;                    /* its connections by address */
+} __attribute__((aligned(64))) cxt_shard;
+
+static cxt_shard shards[CXT_SHARDS];
+
+/* scans over the connection table let packets in this often */
+#define CXT_SCAN_BATCH 64
+
+enum { CXT_WALK_ALL, CXT_WALK_TUPLE, CXT_WALK_HOSTS };
+
+/* a walk over the connections of every shard in turn, or over only those
+ * an SDMBN key can match (cxt_walk_begin_key); the current shard is locked
+ * between cxt_walk_next calls */
+typedef struct _cxt_walk {
+    int mode;
+    int shard;                          /* locked, -1 for none */
+    cxt_scan scan;                      /* CXT_WALK_ALL */
+    uint64_t steps;
+
+    /* CXT_WALK_TUPLE: one connection, or two with tp_flip, from the table */
+    int tuple, tuples;
+    struct in6_addr src, dst;
+    uint16_t sp[2], dp[2];
+    uint8_t proto;
+    connection *found;
+
+    /* CXT_WALK_HOSTS: the connections from (or to) a range of addresses */
+    int by_dst;
+    uint64_t first, last, host;         /* host order */
+    int open;
+    cxt_cursor cursor;
+} cxt_walk;
 
 long overall_pserz_time = 0;
 long overall_pdeserz_time = 0;
@@ -28,7 +71,252 @@ long overall_pstate_size = 0;
 
 void cxt_init()
 {
+    uint64_t key;
+    int fd, i;
+
     cxtrackerid = 0;
+
+    /* key the connection hash */
+    key = ((uint64_t)time(NULL) << 32) ^ getpid();
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &key, sizeof(key)) != sizeof(key))
+            key ^= (uint64_t)(uintptr_t)&key;
+        close(fd);
+    }
+    cxt_hash_seed(key);
+
+    for (i = 0; i < CXT_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        cxt_wheel_init(&shards[i].wheel, time(NULL));
+        if (cxt_table_init(&shards[i].table,
+                CXT_DEFAULT_HASHSIZE / CXT_TABLE_SLOTS / CXT_SHARDS) < 0
+            || cxt_index_init(&shards[i].index,
+                CXT_DEFAULT_HASHSIZE / CXT_SHARDS) < 0) {
+            elog("[!] Failed to allocate the connection table\n");
+            exit(1);
+        }
+    }
+}
+
+static void cxt_walk_begin(cxt_walk *walk)
+{
+    walk->mode = CXT_WALK_ALL;
+    walk->shard = 0;
+    pthread_mutex_lock(&shards[0].lock);
+    cxt_table_scan_begin(&shards[0].table, &walk->scan);
+}
+
+/* network-order mask of a prefix length */
+static uint32_t cxt_prefix_mask(int bits)
+{
+    if (bits <= 0)
+        return 0;
+    if (bits >= 32)
+        return 0xFFFFFFFF;
+    return htonl(0xFFFFFFFF << (32 - bits));
+}
+
+/* starts a walk over the connections that can match an SDMBN key: a table
+ * lookup when the key names one connection, the host index when it names
+ * hosts or a narrow prefix, every connection otherwise.  'get' is set when
+ * the key is matched as local_get_perflow does, with tp_dst, tp_flip and
+ * masks; the delete handlers match tp_src and whole addresses only.  The
+ * caller still checks every connection returned against the key. */
+static void cxt_walk_begin_key(cxt_walk *walk, PerflowKey *key, int get)
+{
+    int src_bits = 0, dst_bits = 0, bits;
+    uint32_t mask;
+
+    memset(walk, 0, sizeof(*walk));
+    if (!(key->wildcards & WILDCARD_NW_SRC))
+        src_bits = (get && !(key->wildcards & WILDCARD_NW_SRC_MASK))
+                   ? key->nw_src_mask : 32;
+    if (!(key->wildcards & WILDCARD_NW_DST))
+        dst_bits = (get && !(key->wildcards & WILDCARD_NW_DST_MASK))
+                   ? key->nw_dst_mask : 32;
+
+    /* a full 5-tuple: look it up, and its port-flipped twin with tp_flip.
+     * With tp_flip and equal ports any peer port matches, so that one
+     * goes to the index instead */
+    if (get && src_bits >= 32 && dst_bits >= 32
+        && !(key->wildcards
+             & (WILDCARD_NW_PROTO | WILDCARD_TP_SRC | WILDCARD_TP_DST))
+        && !(key->tp_flip && key->tp_src == key->tp_dst)) {
+        walk->mode = CXT_WALK_TUPLE;
+        walk->shard = -1;
+        walk->src.s6_addr32[0] = key->nw_src;
+        walk->dst.s6_addr32[0] = key->nw_dst;
+        walk->sp[0] = walk->dp[1] = key->tp_src;
+        walk->dp[0] = walk->sp[1] = key->tp_dst;
+        walk->tuples = key->tp_flip ? 2 : 1;
+        walk->proto = key->nw_proto;
+        return;
+    }
+
+    /* hosts or a narrow prefix: the lists of the addresses it covers */
+    bits = src_bits >= dst_bits ? src_bits : dst_bits;
+    if (bits >= CXT_INDEX_MIN_BITS) {
+        mask = bits >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> bits);
+        walk->mode = CXT_WALK_HOSTS;
+        walk->by_dst = src_bits < dst_bits;
+        walk->first = ntohl(walk->by_dst ? key->nw_dst : key->nw_src) & mask;
+        walk->last = walk->first | (~mask & 0xFFFFFFFF);
+        walk->host = walk->first;
+        walk->shard = 0;
+        pthread_mutex_lock(&shards[0].lock);
+        return;
+    }
+
+    cxt_walk_begin(walk);
+}
+
+static connection *cxt_walk_next_tuple(cxt_walk *walk)
+{
+    cxt_shard *shard;
+    connection *cxt;
+    uint64_t hash;
+    int t, sc;
+
+    while (walk->tuple < walk->tuples) {
+        t = walk->tuple++;
+        if (walk->shard >= 0)
+            pthread_mutex_unlock(&shards[walk->shard].lock);
+        hash = cxt_hash(AF_INET, &walk->src, walk->sp[t], &walk->dst,
+                        walk->dp[t], walk->proto);
+        shard = CXT_SHARD(hash);
+        walk->shard = shard - shards;
+        pthread_mutex_lock(&shard->lock);
+        cxt = cxt_table_find(&shard->table, hash, AF_INET, &walk->src,
+                             walk->sp[t], &walk->dst, walk->dp[t],
+                             walk->proto, &sc);
+        if (cxt != NULL && cxt != walk->found) {
+            walk->found = cxt;
+            return cxt;
+        }
+    }
+    if (walk->shard >= 0)
+        pthread_mutex_unlock(&shards[walk->shard].lock);
+    walk->shard = -1;
+    return NULL;
+}
+
+static connection *cxt_walk_next_host(cxt_walk *walk)
+{
+    cxt_shard *shard;
+    cxt_host *host;
+    connection *cxt;
+
+    while (walk->shard >= 0 && walk->shard < CXT_SHARDS) {
+        shard = &shards[walk->shard];
+        /* the cursor survives the lock being dropped */
+        if (++walk->steps % CXT_SCAN_BATCH == 0) {
+            pthread_mutex_unlock(&shard->lock);
+            pthread_mutex_lock(&shard->lock);
+        }
+        if (walk->open) {
+            cxt = cxt_index_step(&shard->index, &walk->cursor);
+            if (cxt != NULL)
+                return cxt;
+            cxt_index_close(&shard->index, &walk->cursor);
+            walk->open = 0;
+            walk->host++;
+        } else if (walk->host <= walk->last) {
+            host = cxt_index_host(&shard->index, htonl(walk->host));
+            if (host != NULL) {
+                cxt_index_open(&shard->index, &walk->cursor, host,
+                               walk->by_dst);
+                walk->open = 1;
+            } else {
+                walk->host++;
+            }
+        } else {
+            pthread_mutex_unlock(&shard->lock);
+            if (++walk->shard < CXT_SHARDS) {
+                walk->host = walk->first;
+                pthread_mutex_lock(&shards[walk->shard].lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* next connection of a walk, letting the packet thread at the shard now and
+ * then; NULL once every shard is done, with no lock held */
+static connection *cxt_walk_next(cxt_walk *walk)
+{
+    cxt_shard *shard;
+    connection *cxt;
+
+    if (walk->mode == CXT_WALK_TUPLE)
+        return cxt_walk_next_tuple(walk);
+    if (walk->mode == CXT_WALK_HOSTS)
+        return cxt_walk_next_host(walk);
+
+    while (walk->shard < CXT_SHARDS) {
+        shard = &shards[walk->shard];
+        if (walk->scan.returned > 0
+                && walk->scan.returned % CXT_SCAN_BATCH == 0) {
+            pthread_mutex_unlock(&shard->lock);
+            pthread_mutex_lock(&shard->lock);
+        }
+        cxt = cxt_table_scan_next(&shard->table, &walk->scan);
+        if (cxt != NULL)
+            return cxt;
+
+        cxt_table_scan_end(&shard->table, &walk->scan);
+        pthread_mutex_unlock(&shard->lock);
+        if (++walk->shard < CXT_SHARDS) {
+            shard = &shards[walk->shard];
+            pthread_mutex_lock(&shard->lock);
+            cxt_table_scan_begin(&shard->table, &walk->scan);
+        }
+    }
+    return NULL;
+}
+
+/* lets go of the current shard in the middle of a walk; the scan or cursor
+ * stays open, so nothing is missed or returned twice when it is taken again */
+static void cxt_walk_unlock(cxt_walk *walk)
+{
+    pthread_mutex_unlock(&shards[walk->shard].lock);
+}
+
+static void cxt_walk_lock(cxt_walk *walk)
+{
+    pthread_mutex_lock(&shards[walk->shard].lock);
+}
+
+/* the first second a connection counts as ended or expired, and which */
+static time_t cxt_deadline(connection *cxt, int *status)
+{
+    time_t idle = TCP_TIMEOUT;
+
+    *status = CX_EXPIRE;
+    if (cxt->proto == IP_PROTO_TCP) {
+        /* FIN from both sides or RST from either side */
+        if ((cxt->s_tcpFlags & TF_FIN && cxt->d_tcpFlags & TF_FIN)
+            || cxt->s_tcpFlags & TF_RST || cxt->d_tcpFlags & TF_RST) {
+            *status = CX_ENDED;
+            idle = 5;
+        }
+    } else if (cxt->proto == IP_PROTO_UDP || cxt->proto == IP_PROTO_ICMP
+               || cxt->proto == IP6_PROTO_ICMP) {
+        idle = 60;
+    }
+    return cxt->last_pkt_time + idle + 1;
+}
+
+/* arms a connection that has seen a packet; later deadlines are left for
+ * end_sessions to find, only closer ones (FIN/RST) move it */
+static void cxt_rearm(cxt_shard *shard, connection *cxt)
+{
+    int status;
+    time_t when = cxt_deadline(cxt, &status);
+
+    if (cxt->timer == 0
+        || (cxt->timer != CXT_TIMER_DUE && when < cxt->timer))
+        cxt_wheel_arm(&shard->wheel, cxt, when);
 }
 
 /* freshly smelling connection :d */
@@ -37,10 +325,9 @@ connection *cxt_new(packetinfo *pi)
     struct in6_addr ips;
     struct in6_addr ipd;
     connection *cxt;
-    cxtrackerid++;
     cxt = (connection *) calloc(1, sizeof(connection));
     assert(cxt);
-    cxt->cxid = cxtrackerid;
+    cxt->cxid = __sync_add_and_fetch(&cxtrackerid, 1);
 
     sdmbn_notify_flow_created();
 
@@ -158,8 +445,9 @@ int cx_track(packetinfo *pi) {
     uint16_t dst_port = pi->d_port;
     int af = pi->af;
     connection *cxt = NULL;
-    connection *head = NULL;
-    uint32_t hash;
+    cxt_shard *shard;
+    uint64_t hash;
+    int sc;
     int result = 0;
 
     if(af== AF_INET6){
@@ -174,62 +462,36 @@ int cx_track(packetinfo *pi) {
         ip_dst = &ipd;
     }
 
-    // find the right connection bucket
-    if (af == AF_INET) {
-        hash = CXT_HASH4(IP4ADDR(ip_src),IP4ADDR(ip_dst),src_port,dst_port,pi->proto);
-    } else if (af == AF_INET6) {
-        hash = CXT_HASH6(ip_src,ip_dst,src_port,dst_port,pi->proto);
-    }
-
-    pthread_mutex_lock(&ConnEntryLock);
-    cxt = bucket[hash];
-    head = cxt;
-
-    // search through the bucket
-    while (cxt != NULL) {
-        // Two-way compare of given connection against connection table
-        if (af == AF_INET) {
-            if (CMP_CXT4(cxt,IP4ADDR(ip_src),src_port,IP4ADDR(ip_dst),dst_port)){
-                // Client sends first packet (TCP/SYN - UDP?) hence this is a client
-                local_raise_reprocess(cxt, pi);
-                result = cxt_update_client(cxt, pi);
-                pthread_mutex_unlock(&ConnEntryLock);
-                return result;
-
-            } else if (CMP_CXT4(cxt,IP4ADDR(ip_dst),dst_port,IP4ADDR(ip_src),src_port)) {
-                // This is a server (Maybe not when we start up but in the long run)
-                local_raise_reprocess(cxt, pi);
-                result = cxt_update_server(cxt, pi);
-                pthread_mutex_unlock(&ConnEntryLock);
-                return result;
-            }
-        } else if (af == AF_INET6) {
-            if (CMP_CXT6(cxt,ip_src,src_port,ip_dst,dst_port)){
-                result = cxt_update_client(cxt, pi);
-                pthread_mutex_unlock(&ConnEntryLock);
-                return result;
-            } else if (CMP_CXT6(cxt,ip_dst,dst_port,ip_src,src_port)){
-                result = cxt_update_server(cxt, pi);
-                pthread_mutex_unlock(&ConnEntryLock);
-                return result;
-            }
+    hash = cxt_hash(af, ip_src, src_port, ip_dst, dst_port, pi->proto);
+
+    shard = CXT_SHARD(hash);
+    pthread_mutex_lock(&shard->lock);
+    cxt = cxt_table_find(&shard->table, hash, af, ip_src, src_port, ip_dst,
+                         dst_port, pi->proto, &sc);
+    if (cxt != NULL) {
+        if (af == AF_INET)
+            local_raise_reprocess(cxt, pi);
+        if (sc == SC_CLIENT) {
+            // Client sends first packet (TCP/SYN - UDP?) hence this is a client
+            result = cxt_update_client(cxt, pi);
+        } else {
+            // This is a server (Maybe not when we start up but in the long run)
+            result = cxt_update_server(cxt, pi);
         }
-        cxt = cxt->next;
+        cxt_rearm(shard, cxt);
+        pthread_mutex_unlock(&shard->lock);
+        return result;
     }
-    // bucket turned upside down didn't yeild anything. new connection
+
+    // table didn't yeild anything. new connection
     cxt = cxt_new(pi);
     log_connection(cxt, CX_NEW);
-
-    /* * New connections are pushed on to the head of bucket[s_hash] */
-    cxt->next = head;
-    if (head != NULL) {
-        // are we doubly linked?
-        head->prev = cxt;
-    }
-    bucket[hash] = cxt;
+    cxt_table_insert(&shard->table, hash, cxt);
+    cxt_index_insert(&shard->index, cxt);
+    cxt_rearm(shard, cxt);
     pi->cxt = cxt;
 
-    pthread_mutex_unlock(&ConnEntryLock);
+    pthread_mutex_unlock(&shard->lock);
     /* * Return value should be 1, telling to do client service fingerprinting */
     return 1;
 }
@@ -242,9 +504,15 @@ void reverse_pi_cxt(packetinfo *pi)
     struct in6_addr tmp_ip;
     uint16_t tmp_port;
     connection *cxt;
+    cxt_shard *shard;
 
     cxt = pi->cxt;
 
+    /* the table hashes both directions alike, but the host index does not */
+    shard = CXT_SHARD(cxt_hash_cxt(cxt));
+    pthread_mutex_lock(&shard->lock);
+    cxt_index_remove(&shard->index, cxt);
+
     /* First we chang the cxt */
     /* cp src to tmp */
     tmpFlags = cxt->s_tcpFlags;
@@ -270,6 +538,8 @@ void reverse_pi_cxt(packetinfo *pi)
     /* Not taking any chances :P */
     cxt->c_asset = cxt->s_asset = NULL;
     cxt->check = 0x00;
+    cxt_index_insert(&shard->index, cxt);
+    pthread_mutex_unlock(&shard->lock);
 
     /* Then we change pi */
     if (pi->sc == SC_CLIENT)
@@ -279,117 +549,67 @@ void reverse_pi_cxt(packetinfo *pi)
 }
 
 /*
- This sub marks sessions as ENDED on different criterias:
-
- XXX: May be the fugliest code in PRADS :-(
+ This sub marks sessions as ENDED or EXPIRED once they are due: FIN from
+ both sides or RST from either side and 5 seconds quiet, or idle for longer
+ than their protocol's timeout.  Only connections armed for now or earlier
+ are looked at; those that saw packets since they were armed go back on
+ the wheel.
 */
 
 void end_sessions()
 {
-
     connection *cxt;
-    int iter;
-    int cxstatus = CX_NONE;
-    int ended, expired = 0;
-    uint32_t curcxt = 0;
-    time_t check_time = time(NULL);
+    cxt_shard *shard;
+    int i, popped, cxstatus;
+    time_t when, check_time = time(NULL);
 
     log_rotate(check_time);
-    for (iter = 0; iter < BUCKET_SIZE; iter++) {
-        cxt = bucket[iter];
-        while (cxt != NULL) {
-            curcxt++;
-            /* TCP */
-            if (cxt->proto == IP_PROTO_TCP) {
-                /* * FIN from both sides */
-                if (cxt->s_tcpFlags & TF_FIN && cxt->d_tcpFlags & TF_FIN
-                    && (check_time - cxt->last_pkt_time) > 5) {
-                    cxstatus = CX_ENDED;
-                } /* * RST from either side */
-                else if ((cxt->s_tcpFlags & TF_RST
-                          || cxt->d_tcpFlags & TF_RST)
-                          && (check_time - cxt->last_pkt_time) > 5) {
-                    cxstatus = CX_ENDED;
-                }
-                else if ((check_time - cxt->last_pkt_time) > TCP_TIMEOUT) {
-                    cxstatus = CX_EXPIRE;
-                }
-            }
-            /* UDP */
-            else if (cxt->proto == IP_PROTO_UDP
-                     && (check_time - cxt->last_pkt_time) > 60) {
-                cxstatus = CX_EXPIRE;
-            }
-            /* ICMP */
-            else if (cxt->proto == IP_PROTO_ICMP
-                     || cxt->proto == IP6_PROTO_ICMP) {
-                if ((check_time - cxt->last_pkt_time) > 60) {
-                    cxstatus = CX_EXPIRE;
-                }
-            }
-            /* All Other protocols */
-            else if ((check_time - cxt->last_pkt_time) > TCP_TIMEOUT) {
-                cxstatus = CX_EXPIRE;
-            }
-
-            if (cxstatus == CX_ENDED || cxstatus == CX_EXPIRE) {
-                /* remove from the hash */
-                if (cxt->prev)
-                    cxt->prev->next = cxt->next;
-                if (cxt->next)
-                    cxt->next->prev = cxt->prev;
-                connection *tmp = cxt;
-
-                log_connection(cxt, cxstatus);
-                cxstatus = CX_NONE;
-
-                cxt = cxt->prev;
-
-                del_connection(tmp, &bucket[iter]);
-                if (cxt == NULL) {
-                    bucket[iter] = NULL;
-                }
+    for (i = 0; i < CXT_SHARDS; i++) {
+        shard = &shards[i];
+        popped = 0;
+        pthread_mutex_lock(&shard->lock);
+        while ((cxt = cxt_wheel_pop(&shard->wheel, check_time)) != NULL) {
+            when = cxt_deadline(cxt, &cxstatus);
+            if (when > check_time) {
+                cxt_wheel_arm(&shard->wheel, cxt, when);
             } else {
-                cxt = cxt->prev;
+                log_connection(cxt, cxstatus);
+                if (cxstatus == CX_ENDED)
+                    config.pr_s.cxt_ended++;
+                else
+                    config.pr_s.cxt_expired++;
+                del_connection(cxt);
+            }
+            /* let the packet thread in now and then */
+            if (++popped % CXT_SCAN_BATCH == 0) {
+                pthread_mutex_unlock(&shard->lock);
+                pthread_mutex_lock(&shard->lock);
             }
-        } // end while cxt
-    } // end for buckets
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
 }
 
 void log_connection_all()
 {
-    int i;
     connection *cxt;
+    cxt_walk walk;
     if(! (config.cflags & CONFIG_CXWRITE))
         return;
-    for(i = 0; i < BUCKET_SIZE; i++) {
-        cxt = bucket[i];
-        while(cxt) {
-            log_connection(cxt, CX_HUMAN);
-            cxt = cxt->next;
-        }
-    }
+    cxt_walk_begin(&walk);
+    while ((cxt = cxt_walk_next(&walk)) != NULL)
+        log_connection(cxt, CX_HUMAN);
 }
 
-void del_connection(connection * cxt, connection ** bucket_ptr)
+/* removes a connection from the table and frees it; caller holds the lock
+ * of the connection's shard */
+void del_connection(connection * cxt)
 {
-    connection *prev = cxt->prev;       /* OLDER connections */
-    connection *next = cxt->next;       /* NEWER connections */
-
-    if (prev == NULL) {
-        // beginning of list
-        *bucket_ptr = next;
-        // not only entry
-        if (next)
-            next->prev = NULL;
-    } else if (next == NULL) {
-        // at end of list!
-        prev->next = NULL;
-    } else {
-        // a node.
-        prev->next = next;
-        next->prev = prev;
-    }
+    cxt_shard *shard = CXT_SHARD(cxt_hash_cxt(cxt));
+
+    cxt_table_remove(&shard->table, cxt);
+    cxt_index_remove(&shard->index, cxt);
+    cxt_wheel_disarm(&shard->wheel, cxt);
 
     cxt->c_asset = NULL;
     cxt->s_asset = NULL;
@@ -406,46 +626,34 @@ void del_connection(connection * cxt, connection ** bucket_ptr)
 void end_all_sessions()
 {
     connection *cxt;
-    int cxkey;
-    FILE *cxtFile = NULL;
+    cxt_walk walk;
 
     log_rotate(time(NULL));
-    for (cxkey = 0; cxkey < BUCKET_SIZE; cxkey++) {
-        cxt = bucket[cxkey];
-        while (cxt != NULL) {
-            connection *tmp = cxt;
-
-            log_connection(cxt, CX_ENDED);
-            cxt = cxt->next;
-            del_connection(tmp, &bucket[cxkey]);
-            if (cxt == NULL) {
-                bucket[cxkey] = NULL;
-            }
-        }
-    }
-    if (cxtFile != NULL) {
-        fclose(cxtFile);
+    cxt_walk_begin(&walk);
+    while ((cxt = cxt_walk_next(&walk)) != NULL) {
+        log_connection(cxt, CX_ENDED);
+        del_connection(cxt);
     }
 }
 
 void cxt_log_buckets(int dummy)
 {
-    connection *cxt = NULL;
     FILE *logfile = NULL;
     int i;
-    int len;
 
     logfile = fopen("/tmp/prads-buckets.log", "w");
     if (!logfile)
         return;
 
     dlog("Recieved SIGUSR1 - Dumping bucketlist to logfile\n");
-    for (i = 0; i < BUCKET_SIZE; i++) {
-        len = 0;
-        for (cxt = bucket[i]; cxt; cxt = cxt->next)
-            len++;
-        if (len > 0)
-            fprintf(logfile, "%d in bucket[%5d]\n", len, i);
+    for (i = 0; i < CXT_SHARDS; i++) {
+        fprintf(logfile, "shard %d:\n", i);
+        pthread_mutex_lock(&shards[i].lock);
+        cxt_table_stats(&shards[i].table, logfile);
+        fprintf(logfile, "%lu connections armed for expiry\n",
+                (unsigned long)shards[i].wheel.armed);
+        fprintf(logfile, "%u hosts indexed\n", shards[i].index.hosts);
+        pthread_mutex_unlock(&shards[i].lock);
     }
 
     fflush(logfile);
@@ -590,112 +798,27 @@ static void local_raise_reprocess(connection *cxt, packetinfo *pi)
 
 
 ///// SDMBN Local Perflow State Handlers /////////////////////////////////////
-int local_get_perflow(PerflowKey *key, int id, int raiseEvents)
+// Serializes and sends connections copied out of the table, with no shard
+// locked; returns the new count
+static int send_perflow_snapshots(SDMBNBatch *batch, connection *snaps,
+        int n, int id, int count)
 {
-    if (NULL == key)
-    { return -1; }
-
-    int count = 0;
-    int h = 0;
-    for (h = 0; h < BUCKET_SIZE; h++)
+    int i;
+    for (i = 0; i < n; i++)
     {
-        pthread_mutex_lock(&ConnEntryLock);
-        connection *curr = bucket[h];
-
-        // if (bucket_backup[h] == NULL) {
-        //     bucket_backup[h] = bucket[h];
-        // }else if(bucket_backup[h] == bucket[h]){
-        //     break;
-        // }else{
-        //     bucket_backup[h] = bucket[h];
-        // }
-        //
-
-
+        connection *curr = &snaps[i];
 
-        while (curr != NULL)
-        {
-
-
-
-            // Check dl_type
-            if (!(key->wildcards & WILDCARD_DL_TYPE) &&
-                    ntohs(curr->hw_proto) != key->dl_type)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_proto
-            if (!(key->wildcards & WILDCARD_NW_PROTO) &&
-                    curr->proto != key->nw_proto)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check tp_src
-            if (!(key->wildcards & WILDCARD_TP_SRC) &&
-                !(curr->s_port == key->tp_src ||
-                    (key->tp_flip && curr->d_port == key->tp_src)))
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check tp_dst
-            if (!(key->wildcards & WILDCARD_TP_DST) &&
-                !(curr->d_port == key->tp_dst ||
-                    (key->tp_flip && curr->s_port == key->tp_dst)))
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            int nw_src_mask = 0xFFFFFFFF;
-            if (!(key->wildcards & WILDCARD_NW_SRC_MASK))
-            { nw_src_mask = nw_src_mask << (32 - key->nw_src_mask); }
-
-            // Check nw_src
-            // ugly hack :(
-            // the way we do ip4/6 is DIRTY
-            if (!(key->wildcards & WILDCARD_NW_SRC) &&
-                    (nw_src_mask & curr->s_ip.s6_addr32[0]) != key->nw_src)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            int nw_dst_mask = 0xFFFFFFFF;
-            if (!(key->wildcards & WILDCARD_NW_DST_MASK))
-            { nw_dst_mask = nw_dst_mask << (32 - key->nw_dst_mask); }
-
-            // Check nw_dst
-            // ugly hack :(
-            // the way we do ip4/6 is DIRTY
-            if (!(key->wildcards & WILDCARD_NW_DST) &&
-                    (nw_dst_mask & curr->d_ip.s6_addr32[0]) != key->nw_dst)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Mark connection as returned with this get call
-            if (raiseEvents)
-            	curr->gotten = id;
-            else
-            	curr->gotten = -1;
-
-
-            // Prepare to send perflow state
-            int hashkey = curr->cxid;
+        // Prepare to send perflow state
+        int hashkey = curr->cxid;
 
-            // Serialize conn and asset structure into a single character
-            // stream.
+        // Serialize conn and asset structure into a single character
+        // stream.
 			struct timeval start_serialize, end_serialize;
    			gettimeofday(&start_serialize, NULL);
 
 			char *state = (char *)serialize_conn_asset(curr, id);
+			if (NULL == state)
+			{ continue; }
 
 			gettimeofday(&end_serialize, NULL);
 			long sec = end_serialize.tv_sec - start_serialize.tv_sec;
@@ -707,45 +830,133 @@ int local_get_perflow(PerflowKey *key, int id, int raiseEvents)
 			printf("STATS: PERFLOW STATE SIZE OVERALL = %zu\n", overall_pstate_size);
 			printf("STATS: PERFLOW: TIME TO SERIALIZE CURRENT = %ldus\n", total);
 			printf("STATS: PERFLOW: TIME TO SERIALIZE OVERALL = %ldus\n", overall_pserz_time);
-            printf("serializing connection struct with multi flow\n %s\n\n",state);
-
-            if (NULL == state)
-            { continue; }
-
-            // Construct key
-            PerflowKey connkey;
-            if (AF_INET == curr->af)
-            {
-                connkey.nw_src = curr->s_ip.s6_addr32[0];
-                connkey.nw_src_mask = 32;
-                connkey.nw_dst = curr->d_ip.s6_addr32[0];
-                connkey.nw_dst_mask = 32;
-            }
-            else
-            { /* FIXME: Handle IPv6 */ }
-            connkey.tp_src = curr->s_port;
-            connkey.tp_dst = curr->d_port;
-            connkey.dl_type = curr->hw_proto;
-            connkey.nw_proto = curr->proto;
-            connkey.wildcards = WILDCARD_NONE;
-
-            // Send perflow state
-            int result = sdmbn_send_perflow(id, &connkey, state, hashkey,
-                    count);
-            if (result < 0)
-            { }
-
-            // Increment count
-            count++;
-
-            // Clean-up
-            free(state);
-
-            // Move on to next connection
-            curr = curr->next;
+        printf("serializing connection struct with multi flow\n %s\n\n",state);
+
+        // Construct key
+        PerflowKey connkey;
+        if (AF_INET == curr->af)
+        {
+            connkey.nw_src = curr->s_ip.s6_addr32[0];
+            connkey.nw_src_mask = 32;
+            connkey.nw_dst = curr->d_ip.s6_addr32[0];
+            connkey.nw_dst_mask = 32;
+        }
+        else
+        { /* FIXME: Handle IPv6 */ }
+        connkey.tp_src = curr->s_port;
+        connkey.tp_dst = curr->d_port;
+        connkey.dl_type = curr->hw_proto;
+        connkey.nw_proto = curr->proto;
+        connkey.wildcards = WILDCARD_NONE;
+
+        // Send perflow state
+        int result = sdmbn_send_perflow_batch(batch, &connkey, state, 
+                hashkey, count);
+        if (result < 0)
+        { }
+
+        // Increment count
+        count++;
+
+        // Clean-up
+        free(state);
+    }
+    return count;
+}
+
+int local_get_perflow(PerflowKey *key, int id, int raiseEvents)
+{
+    if (NULL == key)
+    { return -1; }
+
+    // States go out in large coalesced writes rather than one per flow
+    SDMBNBatch *batch = sdmbn_batch_open(id);
+    if (NULL == batch)
+    { return -1; }
+
+    // Matches are copied out under the shard lock, a batch at a time
+    connection *snaps = malloc(CXT_SCAN_BATCH * sizeof(connection));
+    if (NULL == snaps)
+    {
+        sdmbn_batch_close(batch);
+        return -1;
+    }
+
+    // Prefixes are matched in network order, like the addresses
+    uint32_t nw_src_mask = 0xFFFFFFFF;
+    if (!(key->wildcards & WILDCARD_NW_SRC_MASK))
+    { nw_src_mask = cxt_prefix_mask(key->nw_src_mask); }
+    uint32_t nw_dst_mask = 0xFFFFFFFF;
+    if (!(key->wildcards & WILDCARD_NW_DST_MASK))
+    { nw_dst_mask = cxt_prefix_mask(key->nw_dst_mask); }
+
+    int count = 0, n = 0;
+    connection *curr;
+    cxt_walk walk;
+    cxt_walk_begin_key(&walk, key, 1);
+    while ((curr = cxt_walk_next(&walk)) != NULL)
+    {
+        // Check dl_type
+        if (!(key->wildcards & WILDCARD_DL_TYPE) &&
+                ntohs(curr->hw_proto) != key->dl_type)
+        { continue; }
+
+        // Check nw_proto
+        if (!(key->wildcards & WILDCARD_NW_PROTO) &&
+                curr->proto != key->nw_proto)
+        { continue; }
+
+        // Check tp_src
+        if (!(key->wildcards & WILDCARD_TP_SRC) &&
+            !(curr->s_port == key->tp_src ||
+                (key->tp_flip && curr->d_port == key->tp_src)))
+        { continue; }
+
+        // Check tp_dst
+        if (!(key->wildcards & WILDCARD_TP_DST) &&
+            !(curr->d_port == key->tp_dst ||
+                (key->tp_flip && curr->s_port == key->tp_dst)))
+        { continue; }
+
+        // Check nw_src
+        // ugly hack :(
+        // the way we do ip4/6 is DIRTY
+        if (!(key->wildcards & WILDCARD_NW_SRC) &&
+                (nw_src_mask & curr->s_ip.s6_addr32[0])
+                    != (nw_src_mask & key->nw_src))
+        { continue; }
+
+        // Check nw_dst
+        // ugly hack :(
+        // the way we do ip4/6 is DIRTY
+        if (!(key->wildcards & WILDCARD_NW_DST) &&
+                (nw_dst_mask & curr->d_ip.s6_addr32[0])
+                    != (nw_dst_mask & key->nw_dst))
+        { continue; }
+
+        // Mark connection as returned with this get call
+        if (raiseEvents)
+        	curr->gotten = id;
+        else
+        	curr->gotten = -1;
+
+
+        // Copy it out; it is serialized and sent once the shard is let go
+        snaps[n++] = *curr;
+        if (n == CXT_SCAN_BATCH)
+        {
+            cxt_walk_unlock(&walk);
+            count = send_perflow_snapshots(batch, snaps, n, id, count);
+            n = 0;
+            cxt_walk_lock(&walk);
         }
-        pthread_mutex_unlock(&ConnEntryLock);
     }
+    count = send_perflow_snapshots(batch, snaps, n, id, count);
+    free(snaps);
+
+    // Remaining states must reach the controller before the get ack
+    if (sdmbn_batch_close(batch) < 0)
+    { return -1; }
 
     return count;
 }
@@ -766,7 +977,7 @@ int local_put_perflow(int hashkey, PerflowKey *key, char *state)
 	struct timeval start_deserialize, end_deserialize;
    	gettimeofday(&start_deserialize, NULL);
 
-    cxt = ser_parse(head_tra, "connection", state, NULL);
+    cxt = sbin_parse(head_sbin, head_tra, "connection", state);
 
 	gettimeofday(&end_deserialize, NULL);
 	long sec = end_deserialize.tv_sec - start_deserialize.tv_sec;
@@ -778,56 +989,23 @@ int local_put_perflow(int hashkey, PerflowKey *key, char *state)
 
 
 
-    // Clear any mark of connection being gotten
-    cxt->gotten = 0;
-
-    struct in6_addr ips;
-    struct in6_addr ipd;
-
-    int af = AF_INET; //TODO Add support for IPv6
-    connection *head = NULL;
-    uint32_t hash;
-
-    if (AF_INET == af)
-    {
-        // ugly hack :(
-        // the way we do ip4/6 is DIRTY
-        ips.s6_addr32[0] = key->nw_src;
-        ipd.s6_addr32[0] = key->nw_dst;
-    }
-    else
-    { return -1; }
-
-    // find the right connection bucket
-    if (af == AF_INET)
-    {
-        hash = CXT_HASH4(IP4ADDR(&ips), IP4ADDR(&ipd), key->tp_src,
-                key->tp_dst, key->nw_proto);
-    }
-    /*else if (af == AF_INET6)
-    { hash = CXT_HASH6(ip_src,ip_dst,src_port,dst_port,pi->proto); }*/
-    else
+    if (NULL == cxt)
     { return -1; }
 
-    pthread_mutex_lock(&ConnEntryLock);
-    head = bucket[hash];
+    // Clear any mark of connection being gotten, and of the sender's
+    // expiry wheel
+    cxt->gotten = 0;
+    cxt->timer = 0;
 
     // allocating a new connection ID
-    // TODO add locks
-    cxtrackerid++;
-    cxt->cxid = cxtrackerid;
-
-    // Add to linked list
-    cxt->prev = NULL;
-    if (head != NULL)
-    {
-        head->prev = cxt;
-        cxt->next = head;
-    }
-    else
-    { cxt->next = NULL; }
-    bucket[hash] = cxt;
-    pthread_mutex_unlock(&ConnEntryLock);
+    cxt->cxid = __sync_add_and_fetch(&cxtrackerid, 1);
+    uint64_t hash = cxt_hash_cxt(cxt);
+    cxt_shard *shard = CXT_SHARD(hash);
+    pthread_mutex_lock(&shard->lock);
+    cxt_table_insert(&shard->table, hash, cxt);
+    cxt_index_insert(&shard->index, cxt);
+    cxt_rearm(shard, cxt);
+    pthread_mutex_unlock(&shard->lock);
 
     // If asset structure is present push it into the asset list.
     if (cxt->c_asset || cxt->s_asset)
@@ -849,88 +1027,54 @@ int local_del_perflow(PerflowKey *key, int id)
     { return -1; }
 
     int count = 0;
-    int h = 0;
-    for (h = 0; h < BUCKET_SIZE; h++)
+    connection *curr;
+    cxt_walk walk;
+    cxt_walk_begin_key(&walk, key, 0);
+    while ((curr = cxt_walk_next(&walk)) != NULL)
     {
-        pthread_mutex_lock(&ConnEntryLock);
-        connection *curr = bucket[h];
-        while (curr != NULL)
-        {
-            // Check dl_type
-            if (!(key->wildcards & WILDCARD_DL_TYPE) &&
-                    ntohs(curr->hw_proto) != key->dl_type)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_proto
-            if (!(key->wildcards & WILDCARD_NW_PROTO) &&
-                    curr->proto != key->nw_proto)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check tp_src
-            if (!(key->wildcards & WILDCARD_TP_SRC) &&
-                    curr->s_port != key->tp_src && curr->d_port != key->tp_src)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_src
-            // ugly hack :(
-            // the way we do ip4/6 is DIRTY
-            if (!(key->wildcards & WILDCARD_NW_SRC) &&
-                    curr->s_ip.s6_addr32[0] != key->nw_src)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_dst
-            // ugly hack :(
-            // the way we do ip4/6 is DIRTY
-            if (!(key->wildcards & WILDCARD_NW_DST) &&
-                    curr->d_ip.s6_addr32[0] != key->nw_dst)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Mark connection as returned with this get call
-            curr->gotten = id;
-
-            int hashkey = curr->cxid;
-            char *state = NULL;
-
+        // Check dl_type
+        if (!(key->wildcards & WILDCARD_DL_TYPE) &&
+                ntohs(curr->hw_proto) != key->dl_type)
+        { continue; }
+
+        // Check nw_proto
+        if (!(key->wildcards & WILDCARD_NW_PROTO) &&
+                curr->proto != key->nw_proto)
+        { continue; }
+
+        // Check tp_src
+        if (!(key->wildcards & WILDCARD_TP_SRC) &&
+                curr->s_port != key->tp_src && curr->d_port != key->tp_src)
+        { continue; }
+
+        // Check nw_src
+        // ugly hack :(
+        // the way we do ip4/6 is DIRTY
+        if (!(key->wildcards & WILDCARD_NW_SRC) &&
+                curr->s_ip.s6_addr32[0] != key->nw_src)
+        { continue; }
 
-            // Increment count
-            count++;
+        // Check nw_dst
+        // ugly hack :(
+        // the way we do ip4/6 is DIRTY
+        if (!(key->wildcards & WILDCARD_NW_DST) &&
+                curr->d_ip.s6_addr32[0] != key->nw_dst)
+        { continue; }
 
+        // Mark connection as returned with this get call
+        curr->gotten = id;
 
-            // TODO: Delete state the right way
-            // HACK: DELETE THE CONNECTION WE SENT
-            if (curr->prev)
-            { curr->prev->next = curr->next; }
-            else
-            { bucket[h]=curr->next; }
+        int hashkey = curr->cxid;
+        char *state = NULL;
 
-            if (curr->next)
-            { curr->next->prev = curr->prev; }
 
-            connection *delete = curr;
+        // Increment count
+        count++;
 
-            // Move on to next connection
-            curr = curr->next;
 
-            // TODO: Delete state the right way
-            // HACK: DELETE THE CONNECTION WE SENT
-            del_connection(delete, &bucket[h]);
-        }
-        pthread_mutex_unlock(&ConnEntryLock);
+        // TODO: Delete state the right way
+        // HACK: DELETE THE CONNECTION WE SENT
+        del_connection(curr);
     }
 
     return count;
@@ -946,72 +1090,48 @@ int local_del_multiflow(PerflowKey *key, int id, int force)
     // Key is present
     // Search for the assetd pertaining to the key
     int count = 0;
-    int h = 0;
-    for (h = 0; h < BUCKET_SIZE; h++)
+    connection *curr;
+    cxt_walk walk;
+    cxt_walk_begin_key(&walk, key, 0);
+    while ((curr = cxt_walk_next(&walk)) != NULL)
     {
-        pthread_mutex_lock(&ConnEntryLock);
-        connection *curr = bucket[h];
-        while (curr != NULL)
-        {
-            // Check dl_type
-            if (!(key->wildcards & WILDCARD_DL_TYPE) &&
-                    ntohs(curr->hw_proto) != key->dl_type)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_proto
-            if (!(key->wildcards & WILDCARD_NW_PROTO) &&
-                    curr->proto != key->nw_proto)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check tp_src
-            if (!(key->wildcards & WILDCARD_TP_SRC) &&
-                    curr->s_port != key->tp_src && curr->d_port!=key->tp_src)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_src
-            // ugly hack :(
-            // the way we do ip4/6 is DIRTY
-            if (!(key->wildcards & WILDCARD_NW_SRC) &&
-                    curr->s_ip.s6_addr32[0] != key->nw_src)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Check nw_dst
-            // ugly hack :(
-            // the way we do ip4/6 is DIRTY
-            if (!(key->wildcards & WILDCARD_NW_DST) &&
-                    curr->d_ip.s6_addr32[0] != key->nw_dst)
-            {
-                curr = curr->next;
-                continue;
-            }
-
-            // Mark connection as returned with this get call
-            curr->gotten = id;
+        // Check dl_type
+        if (!(key->wildcards & WILDCARD_DL_TYPE) &&
+                ntohs(curr->hw_proto) != key->dl_type)
+        { continue; }
+
+        // Check nw_proto
+        if (!(key->wildcards & WILDCARD_NW_PROTO) &&
+                curr->proto != key->nw_proto)
+        { continue; }
+
+        // Check tp_src
+        if (!(key->wildcards & WILDCARD_TP_SRC) &&
+                curr->s_port != key->tp_src && curr->d_port!=key->tp_src)
+        { continue; }
+
+        // Check nw_src
+        // ugly hack :(
+        // the way we do ip4/6 is DIRTY
+        if (!(key->wildcards & WILDCARD_NW_SRC) &&
+                curr->s_ip.s6_addr32[0] != key->nw_src)
+        { continue; }
 
-            int hashkey = curr->cxid;
-            char *state = NULL;
+        // Check nw_dst
+        // ugly hack :(
+        // the way we do ip4/6 is DIRTY
+        if (!(key->wildcards & WILDCARD_NW_DST) &&
+                curr->d_ip.s6_addr32[0] != key->nw_dst)
+        { continue; }
 
-            // Del asset and Increment count
-            count += find_del_asset(curr->c_asset);
-            count += find_del_asset(curr->s_asset);
+        // Mark connection as returned with this get call
+        curr->gotten = id;
 
-            // Move on to next connection
-            curr = curr->next;
+        int hashkey = curr->cxid;
+        char *state = NULL;
 
-        }
-        pthread_mutex_unlock(&ConnEntryLock);
+        // Del asset and Increment count
+        count += find_del_conn_assets(curr);
     }
 
     return count;
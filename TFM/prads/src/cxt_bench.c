@@ -0,0 +1,260 @@
+/*
+ * cxt_bench -- lookups/sec of the connection table against the old chains.
+ *
+ * Fills both with the same IPv4 connections and looks every one of them up
+ * from alternating directions.  The chains are the bucket[BUCKET_SIZE]
+ * lists hashed with CXT_HASH4 that cxt.c used before the cuckoo table.
+ * Then inserts half of the connections while two scans walk the other
+ * half, and checks that the scans return each of those exactly once and
+ * the stash stays small.
+ *
+ * usage: cxt_bench [connections] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "prads.h"
+#include "cxt_table.h"
+
+#define CXT_HASH4(src,dst,sp,dp,pr) \
+   (( src + dst + sp + dp + pr) % BUCKET_SIZE)
+
+static connection *bucket[BUCKET_SIZE];
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static connection *chain_find(connection *c, uint32_t src, uint16_t sp,
+                              uint32_t dst, uint16_t dp)
+{
+    for (; c != NULL; c = c->next)
+        if (CMP_CXT4(c, src, sp, dst, dp) || CMP_CXT4(c, dst, dp, src, sp))
+            return c;
+    return NULL;
+}
+
+/* scanning: 16 NATed clients opening every port towards one server */
+static void fill_nat(connection *cxts, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        cxts[i].s_ip.s6_addr32[0] = htonl(0x0a000001 + i % 16);
+        cxts[i].d_ip.s6_addr32[0] = htonl(0xc0a80101);
+        cxts[i].s_port = htons(1024 + (i / 16) % 64512);
+        cxts[i].d_port = htons(443 + i / (16 * 64512));
+    }
+}
+
+static void fill_random(connection *cxts, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        cxts[i].s_ip.s6_addr32[0] = random();
+        cxts[i].d_ip.s6_addr32[0] = random();
+        cxts[i].s_port = random();
+        cxts[i].d_port = random();
+    }
+}
+
+static void run(const char *name, connection *cxts, int n, int rounds)
+{
+    cxt_table table;
+    double start, chain_time, table_time;
+    long found = 0, longest = 0;
+    int i, r, sc;
+
+    for (i = 0; i < n; i++) {
+        cxts[i].af = AF_INET;
+        cxts[i].proto = IP_PROTO_TCP;
+    }
+
+    /* the old chains */
+    memset(bucket, 0, sizeof(bucket));
+    for (i = 0; i < n; i++) {
+        connection *c = &cxts[i];
+        uint32_t h = CXT_HASH4(IP4ADDR(&c->s_ip), IP4ADDR(&c->d_ip),
+                               c->s_port, c->d_port, c->proto);
+        c->next = bucket[h];
+        bucket[h] = c;
+    }
+    for (i = 0; i < BUCKET_SIZE; i++) {
+        long len = 0;
+        connection *c;
+        for (c = bucket[i]; c; c = c->next)
+            len++;
+        if (len > longest)
+            longest = len;
+    }
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            connection *c = &cxts[i];
+            uint32_t src = IP4ADDR(&c->s_ip), dst = IP4ADDR(&c->d_ip);
+            uint16_t sp = c->s_port, dp = c->d_port;
+            uint32_t h = CXT_HASH4(src, dst, sp, dp, c->proto);
+            if (i & 1)
+                found += chain_find(bucket[h], dst, dp, src, sp) == c;
+            else
+                found += chain_find(bucket[h], src, sp, dst, dp) == c;
+        }
+    }
+    chain_time = now() - start;
+
+    /* the cuckoo table, grown from its smallest size */
+    cxt_table_init(&table, 0);
+    start = now();
+    for (i = 0; i < n; i++)
+        cxt_table_insert(&table, cxt_hash_cxt(&cxts[i]), &cxts[i]);
+    double insert_time = now() - start;
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            connection *c = &cxts[i];
+            uint64_t h = cxt_hash_cxt(c);
+            if (i & 1)
+                found += cxt_table_find(&table, h, AF_INET, &c->d_ip,
+                        c->d_port, &c->s_ip, c->s_port, c->proto, &sc) == c;
+            else
+                found += cxt_table_find(&table, h, AF_INET, &c->s_ip,
+                        c->s_port, &c->d_ip, c->d_port, c->proto, &sc) == c;
+        }
+    }
+    table_time = now() - start;
+
+    if (found != 2L * n * rounds) {
+        fprintf(stderr, "%s: %ld of %ld lookups found their connection\n",
+                name, found, 2L * n * rounds);
+        exit(1);
+    }
+    printf("%-7s chains %8.2f Mlookups/s (longest %ld)  table %8.2f "
+           "Mlookups/s  %6.2f Minserts/s\n", name,
+           (double)n * rounds / chain_time / 1e6, longest,
+           (double)n * rounds / table_time / 1e6,
+           n / insert_time / 1e6);
+    cxt_table_stats(&table, stdout);
+
+    /* everything must come out again */
+    for (i = 0; i < n; i++)
+        if (cxt_table_remove(&table, &cxts[i]) < 0) {
+            fprintf(stderr, "%s: connection %d missing\n", name, i);
+            exit(1);
+        }
+    cxt_table_destroy(&table);
+}
+
+static int returned_by(connection *cxts, int n, int *seen, connection *c)
+{
+    if (c < cxts || c >= cxts + n) {
+        fprintf(stderr, "scan returned a stranger\n");
+        exit(1);
+    }
+    return ++seen[c - cxts];
+}
+
+/* inserts under two open scans, which must still return what they began
+ * with exactly once */
+static void scan_inserts(connection *cxts, int n)
+{
+    cxt_table table;
+    cxt_scan a, b;
+    connection *c;
+    int *seen_a = calloc(n, sizeof(int)), *seen_b = calloc(n, sizeof(int));
+    int i, sc, half = n / 2;
+    uint32_t stashed = 0;
+    long found = 0;
+    double start, insert_time, find_time;
+
+    for (i = 0; i < n; i++) {
+        cxts[i].af = AF_INET;
+        cxts[i].proto = IP_PROTO_TCP;
+    }
+    cxt_table_init(&table, 0);
+    for (i = 0; i < half; i++)
+        cxt_table_insert(&table, cxt_hash_cxt(&cxts[i]), &cxts[i]);
+
+    cxt_table_scan_begin(&table, &a);
+    for (i = 0; i < half / 4; i++)
+        returned_by(cxts, n, seen_a, cxt_table_scan_next(&table, &a));
+    cxt_table_scan_begin(&table, &b);
+    start = now();
+    for (i = half; i < n; i++) {
+        cxt_table_insert(&table, cxt_hash_cxt(&cxts[i]), &cxts[i]);
+        c = cxt_table_scan_next(&table, &a);
+        if (c && returned_by(cxts, n, seen_a, c) > 1)
+            break;
+        c = cxt_table_scan_next(&table, &b);
+        if (c && returned_by(cxts, n, seen_b, c) > 1)
+            break;
+        if (table.stash_len > stashed)
+            stashed = table.stash_len;
+    }
+    insert_time = now() - start;
+
+    /* lookups of the new connections while the scans are still open */
+    start = now();
+    for (i = half; i < n; i++) {
+        c = &cxts[i];
+        found += cxt_table_find(&table, cxt_hash_cxt(c), AF_INET, &c->s_ip,
+                c->s_port, &c->d_ip, c->d_port, c->proto, &sc) == c;
+    }
+    find_time = now() - start;
+
+    while ((c = cxt_table_scan_next(&table, &a)) != NULL)
+        returned_by(cxts, n, seen_a, c);
+    while ((c = cxt_table_scan_next(&table, &b)) != NULL)
+        returned_by(cxts, n, seen_b, c);
+    printf("scan    %8.2f Minserts/s  %8.2f Mlookups/s under 2 scans, "
+           "stash at most %u\n", (n - half) / insert_time / 1e6,
+           (n - half) / find_time / 1e6, stashed);
+    cxt_table_stats(&table, stdout);
+    cxt_table_scan_end(&table, &b);
+    cxt_table_scan_end(&table, &a);
+
+    for (i = 0; i < n; i++) {
+        if (seen_a[i] > 1 || seen_b[i] > 1
+            || (i < half && (seen_a[i] != 1 || seen_b[i] != 1))) {
+            fprintf(stderr, "scan: connection %d returned %d and %d times\n",
+                    i, seen_a[i], seen_b[i]);
+            exit(1);
+        }
+    }
+    if (found != n - half) {
+        fprintf(stderr, "scan: %ld of %d lookups found their connection\n",
+                found, n - half);
+        exit(1);
+    }
+    for (i = 0; i < n; i++)
+        if (cxt_table_remove(&table, &cxts[i]) < 0) {
+            fprintf(stderr, "scan: connection %d missing\n", i);
+            exit(1);
+        }
+    cxt_table_destroy(&table);
+    free(seen_a);
+    free(seen_b);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    connection *cxts = calloc(n, sizeof(connection));
+
+    srandom(1);
+    cxt_hash_seed(0x5eed);
+    printf("%d connections, %d rounds\n", n, rounds);
+    fill_random(cxts, n);
+    run("random", cxts, n, rounds);
+    memset(cxts, 0, n * sizeof(connection));
+    fill_nat(cxts, n);
+    run("nat", cxts, n, rounds);
+    memset(cxts, 0, n * sizeof(connection));
+    fill_random(cxts, n);
+    scan_inserts(cxts, n);
+    free(cxts);
+    return 0;
+}
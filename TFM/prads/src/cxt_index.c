@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "cxt_index.h"
+#include "cxt_table.h"
+
+static inline uint32_t cxt_index_bucket(cxt_index *x, uint32_t addr)
+{
+    return cxt_hash_addr(addr) & x->mask;
+}
+
+int cxt_index_init(cxt_index *x, uint32_t buckets)
+{
+    uint32_t n = CXT_INDEX_MIN_BUCKETS;
+
+    while (n < buckets)
+        n <<= 1;
+    x->buckets = calloc(n, sizeof(cxt_host *));
+    if (x->buckets == NULL)
+        return -1;
+    x->mask = n - 1;
+    x->hosts = 0;
+    x->cursors = NULL;
+    return 0;
+}
+
+void cxt_index_destroy(cxt_index *x)
+{
+    cxt_host *host, *next;
+    uint32_t i;
+
+    for (i = 0; i <= x->mask; i++) {
+        for (host = x->buckets[i]; host != NULL; host = next) {
+            next = host->next;
+            free(host);
+        }
+    }
+    free(x->buckets);
+    x->buckets = NULL;
+}
+
+/* doubles the buckets once there are more hosts than buckets; stays put
+ * if the memory is not there */
+static void cxt_index_grow(cxt_index *x)
+{
+    cxt_host **bigger, *host, *next;
+    uint32_t i, mask = x->mask * 2 + 1;
+
+    bigger = calloc(mask + 1, sizeof(cxt_host *));
+    if (bigger == NULL)
+        return;
+    for (i = 0; i <= x->mask; i++) {
+        for (host = x->buckets[i]; host != NULL; host = next) {
+            next = host->next;
+            host->next = bigger[cxt_hash_addr(host->addr) & mask];
+            bigger[cxt_hash_addr(host->addr) & mask] = host;
+        }
+    }
+    free(x->buckets);
+    x->buckets = bigger;
+    x->mask = mask;
+}
+
+cxt_host *cxt_index_host(cxt_index *x, uint32_t addr)
+{
+    cxt_host *host;
+
+    for (host = x->buckets[cxt_index_bucket(x, addr)]; host != NULL;
+         host = host->next)
+        if (host->addr == addr)
+            return host;
+    return NULL;
+}
+
+static cxt_host *cxt_index_add_host(cxt_index *x, uint32_t addr)
+{
+    cxt_host *host = cxt_index_host(x, addr);
+    uint32_t i;
+
+    if (host != NULL)
+        return host;
+    if (x->hosts > x->mask)
+        cxt_index_grow(x);
+    host = calloc(1, sizeof(cxt_host));
+    assert(host);
+    host->addr = addr;
+    i = cxt_index_bucket(x, addr);
+    host->next = x->buckets[i];
+    x->buckets[i] = host;
+    x->hosts++;
+    return host;
+}
+
+static void cxt_index_drop_host(cxt_index *x, cxt_host *host)
+{
+    cxt_host **pp = &x->buckets[cxt_index_bucket(x, host->addr)];
+
+    while (*pp != host)
+        pp = &(*pp)->next;
+    *pp = host->next;
+    free(host);
+    x->hosts--;
+}
+
+void cxt_index_insert(cxt_index *x, connection *cxt)
+{
+    cxt_host *host;
+
+    host = cxt_index_add_host(x, cxt->s_ip.s6_addr32[0]);
+    cxt->s_prev = NULL;
+    cxt->s_next = host->src;
+    if (host->src != NULL)
+        host->src->s_prev = cxt;
+    host->src = cxt;
+
+    host = cxt_index_add_host(x, cxt->d_ip.s6_addr32[0]);
+    cxt->d_prev = NULL;
+    cxt->d_next = host->dst;
+    if (host->dst != NULL)
+        host->dst->d_prev = cxt;
+    host->dst = cxt;
+}
+
+void cxt_index_remove(cxt_index *x, connection *cxt)
+{
+    cxt_host *host;
+    cxt_cursor *c;
+
+    for (c = x->cursors; c != NULL; c = c->next)
+        if (c->cxt == cxt)
+            c->cxt = c->by_dst ? cxt->d_next : cxt->s_next;
+
+    host = cxt_index_host(x, cxt->s_ip.s6_addr32[0]);
+    assert(host);
+    if (cxt->s_prev != NULL)
+        cxt->s_prev->s_next = cxt->s_next;
+    else
+        host->src = cxt->s_next;
+    if (cxt->s_next != NULL)
+        cxt->s_next->s_prev = cxt->s_prev;
+    if (host->src == NULL && host->dst == NULL)
+        cxt_index_drop_host(x, host);
+
+    host = cxt_index_host(x, cxt->d_ip.s6_addr32[0]);
+    assert(host);
+    if (cxt->d_prev != NULL)
+        cxt->d_prev->d_next = cxt->d_next;
+    else
+        host->dst = cxt->d_next;
+    if (cxt->d_next != NULL)
+        cxt->d_next->d_prev = cxt->d_prev;
+    if (host->src == NULL && host->dst == NULL)
+        cxt_index_drop_host(x, host);
+
+    cxt->s_prev = cxt->s_next = cxt->d_prev = cxt->d_next = NULL;
+}
+
+void cxt_index_open(cxt_index *x, cxt_cursor *c, cxt_host *host, int by_dst)
+{
+    c->by_dst = by_dst;
+    c->cxt = by_dst ? host->dst : host->src;
+    c->next = x->cursors;
+    x->cursors = c;
+}
+
+connection *cxt_index_step(cxt_index *x, cxt_cursor *c)
+{
+    connection *cxt = c->cxt;
+
+    if (cxt != NULL)
+        c->cxt = c->by_dst ? cxt->d_next : cxt->s_next;
+    return cxt;
+}
+
+void cxt_index_close(cxt_index *x, cxt_cursor *c)
+{
+    cxt_cursor **pp = &x->cursors;
+
+    while (*pp != c)
+        pp = &(*pp)->next;
+    *pp = c->next;
+}
@@ -0,0 +1,50 @@
+#ifndef CXT_INDEX_H
+#define CXT_INDEX_H
+
+#include <stdint.h>
+#include "prads.h"
+
+/* Host index for SDMBN requests: the connections of each address, as
+ * source and as destination.  A request naming hosts or a narrow prefix
+ * reads the lists of those hosts instead of every connection.  Connections
+ * are linked through cxt->s_prev/s_next and cxt->d_prev/d_next, so adding
+ * and removing one is O(1) however busy its hosts are.  Addresses are keyed
+ * by s6_addr32[0], as stored, which is what SDMBN keys match against.
+ *
+ * Callers serialize access themselves (the shard locks in cxt.c).  A cursor
+ * over a host's list stays valid while the lock is dropped: removing the
+ * connection it is about to return moves it on. */
+
+#define CXT_INDEX_MIN_BUCKETS 256
+#define CXT_INDEX_MIN_BITS    20        /* narrowest prefix worth reading */
+
+typedef struct _cxt_host {
+    struct _cxt_host *next;             /* hash chain */
+    uint32_t addr;                      /* network order */
+    connection *src;                    /* connections with s_ip == addr */
+    connection *dst;                    /* connections with d_ip == addr */
+} cxt_host;
+
+typedef struct _cxt_cursor {
+    struct _cxt_cursor *next;           /* other open cursors of the index */
+    connection *cxt;                    /* returned next, NULL at the end */
+    int by_dst;                         /* walking host->dst, not host->src */
+} cxt_cursor;
+
+typedef struct _cxt_index {
+    cxt_host **buckets;
+    uint32_t mask;                      /* bucket count - 1 */
+    uint32_t hosts;
+    cxt_cursor *cursors;
+} cxt_index;
+
+int cxt_index_init(cxt_index *x, uint32_t buckets);
+void cxt_index_destroy(cxt_index *x);
+void cxt_index_insert(cxt_index *x, connection *cxt);
+void cxt_index_remove(cxt_index *x, connection *cxt);
+cxt_host *cxt_index_host(cxt_index *x, uint32_t addr);
+void cxt_index_open(cxt_index *x, cxt_cursor *c, cxt_host *host, int by_dst);
+connection *cxt_index_step(cxt_index *x, cxt_cursor *c);
+void cxt_index_close(cxt_index *x, cxt_cursor *c);
+
+#endif // CXT_INDEX_H
@@ -0,0 +1,192 @@
+/*
+ * cxt_race -- gets racing packets and multiflow deletes.
+ *
+ * Runs the real get, delete and asset code.  A packet thread creates and
+ * touches connections and gives them fresh assets, and a control thread
+ * keeps deleting assets, all of them or those of a random connection,
+ * while the main thread gets every connection over and over.  A get must
+ * send each of the connections that live through it exactly once, and
+ * connections whose assets were freed under it must serialize without
+ * touching them; build with -fsanitize=address to catch the latter.
+ *
+ * usage: cxt_race [gets] [connections]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <SDMBN.h>
+#include "prads.h"
+#include "cxt.h"
+#include "assets.h"
+#include "config.h"
+#include "mac.h"
+#include "output-plugins/log.h"
+#include "state_bin.h"
+#include "SDMBNLocal.h"
+
+#define STABLE 1000
+
+globalconfig config;
+time_t tstamp;
+
+static int *seen;
+static int conns = 40000;
+static volatile int stop;
+
+/* no logging or MAC lookups in here */
+void log_connection(connection *cxt, int cxstatus) {}
+void log_rotate(time_t t) {}
+void log_asset_arp(asset *main) {}
+void log_asset_os(asset *main, os_asset *os, connection *cxt) {}
+void log_asset_service(asset *main, serv_asset *service, connection *cxt) {}
+mac_entry *match_mac(mac_entry **db, const uint8_t mac[], uint8_t mask)
+{
+    return NULL;
+}
+void print_mac(const uint8_t *mac) {}
+
+/* the controller end of a get: counts what reaches it */
+SDMBNBatch *sdmbn_batch_open(int id)
+{
+    return (SDMBNBatch *)&seen;
+}
+
+int sdmbn_batch_close(SDMBNBatch *batch)
+{
+    return 0;
+}
+
+int sdmbn_send_perflow_batch(SDMBNBatch *batch, PerflowKey *key,
+                             char *state, int hashkey, int count)
+{
+    if (hashkey < 1 || hashkey > conns)
+        return -1;
+    seen[hashkey]++;
+    return 0;
+}
+
+int sdmbn_send_multiflow(int id, PerflowKey *key, char *state, int hashkey,
+                         int seq)
+{
+    return 0;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint32_t client(int i)
+{
+    return htonl(0x0a000000 + i);
+}
+
+static void packet(int i, int give_asset)
+{
+    struct pcap_pkthdr h;
+    ip4_header ip;
+    packetinfo pi;
+
+    memset(&pi, 0, sizeof(pi));
+    memset(&ip, 0, sizeof(ip));
+    h.ts.tv_sec = time(NULL);
+    ip.ip_src = client(i);
+    ip.ip_dst = htonl(0xc0a80101);
+    pi.af = AF_INET;
+    pi.ip4 = &ip;
+    pi.pheader = &h;
+    pi.proto = IP_PROTO_TCP;
+    pi.s_port = htons(1024 + i % 60000);
+    pi.d_port = htons(80);
+    pi.packet_bytes = 100;
+    cx_track(&pi);
+    if (give_asset)
+        add_asset(&pi);
+}
+
+static void *packets(void *arg)
+{
+    unsigned r = 1;
+
+    while (!stop) {
+        r = r * 1103515245 + 12345;
+        packet((r >> 8) % conns, r & 0x10);
+    }
+    return NULL;
+}
+
+static void *deletes(void *arg)
+{
+    unsigned r = 7;
+    PerflowKey key;
+
+    memset(&key, 0, sizeof(key));
+    key.wildcards = WILDCARD_ALL & ~WILDCARD_NW_SRC;
+    while (!stop) {
+        r = r * 1103515245 + 12345;
+        if (r & 0x100) {
+            local_del_multiflow(NULL, 2, 1);
+        } else {
+            key.nw_src = client((r >> 12) % conns);
+            local_del_multiflow(&key, 2, 1);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int gets = 100, i, round, missed;
+    pthread_t p, d;
+    PerflowKey key;
+    double start;
+
+    if (argc > 1)
+        gets = atoi(argv[1]);
+    if (argc > 2)
+        conns = atoi(argv[2]);
+    seen = calloc(conns + 1, sizeof(int));
+    /* the get path prints every state it sends */
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+
+    setup_serialize_translators();
+    asset_init();
+    cxt_init();
+    /* the first STABLE connections stay for the whole run */
+    for (i = 0; i < STABLE; i++)
+        packet(i, 1);
+
+    pthread_create(&p, NULL, packets, NULL);
+    pthread_create(&d, NULL, deletes, NULL);
+    memset(&key, 0, sizeof(key));
+    key.wildcards = WILDCARD_ALL;
+    start = now();
+    for (round = 0; round < gets; round++) {
+        memset(seen, 0, (conns + 1) * sizeof(int));
+        local_get_perflow(&key, round + 3, 0);
+        for (i = 1, missed = 0; i <= conns; i++) {
+            if (seen[i] > 1) {
+                fprintf(stderr, "get %d sent connection %d %d times\n",
+                        round, i, seen[i]);
+                return 1;
+            }
+            if (i <= STABLE && seen[i] != 1)
+                missed++;
+        }
+        if (missed) {
+            fprintf(stderr, "get %d missed %d connections\n", round, missed);
+            return 1;
+        }
+    }
+    stop = 1;
+    pthread_join(p, NULL);
+    pthread_join(d, NULL);
+    fprintf(stderr, "%d gets in %.3fs, each connection once\n", gets,
+            now() - start);
+    return 0;
+}
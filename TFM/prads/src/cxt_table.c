@@ -0,0 +1,531 @@
+#include <assert.h>
+#include <string.h>
+#include "common.h"
+#include "prads.h"
+#include "cxt_table.h"
+
+static uint64_t cxt_hash_key = 0x9e3779b97f4a7c15ULL;
+
+/* keys the connection hash, so remote hosts cannot aim for one bucket */
+void cxt_hash_seed(uint64_t key)
+{
+    cxt_hash_key = key;
+}
+
+static inline uint64_t cxt_mix(uint64_t h, uint64_t v)
+{
+    h = (h ^ v) * 0x9fb21c651e98df25ULL;
+    return h ^ (h >> 29);
+}
+
+static inline uint64_t cxt_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+/* like the old CXT_HASH4, the same for both directions of a connection:
+ * the endpoints are ordered before they are hashed */
+uint64_t cxt_hash(int af, const struct in6_addr *src, uint16_t sp,
+                  const struct in6_addr *dst, uint16_t dp, uint8_t proto)
+{
+    const struct in6_addr *tmp_ip;
+    uint16_t tmp_port;
+    int words = (af == AF_INET6) ? 4 : 1;   /* ip4 lives in s6_addr32[0] */
+    int cmp = memcmp(src, dst, words * sizeof(uint32_t));
+    int i;
+    uint64_t h;
+
+    if (cmp > 0 || (cmp == 0 && sp > dp)) {
+        tmp_ip = src; src = dst; dst = tmp_ip;
+        tmp_port = sp; sp = dp; dp = tmp_port;
+    }
+
+    h = cxt_mix(cxt_hash_key, ((uint64_t)af << 40) | ((uint64_t)proto << 32)
+                | ((uint32_t)sp << 16) | dp);
+    for (i = 0; i < words; i++)
+        h = cxt_mix(h, ((uint64_t)src->s6_addr32[i] << 32)
+                    | dst->s6_addr32[i]);
+    return cxt_final(h);
+}
+
+uint64_t cxt_hash_cxt(const connection *cxt)
+{
+    return cxt_hash(cxt->af, &cxt->s_ip, cxt->s_port, &cxt->d_ip,
+                    cxt->d_port, cxt->proto);
+}
+
+/* a single address, under the same key */
+uint32_t cxt_hash_addr(uint32_t addr)
+{
+    return cxt_final(cxt_mix(cxt_hash_key, addr));
+}
+
+/* fingerprints come from the top bits, bucket numbers from the bottom */
+static inline uint16_t cxt_fp(uint64_t hash)
+{
+    uint16_t fp = hash >> 48;
+    return fp ? fp : 1;
+}
+
+/* the other bucket a connection may live in; its own inverse */
+static inline uint32_t cxt_alt(uint32_t i, uint16_t fp, uint32_t mask)
+{
+    return (i ^ (fp * 0x5bd1e995U)) & mask;
+}
+
+static inline int cxt_match(const connection *cxt, int af,
+                            const struct in6_addr *src, uint16_t sp,
+                            const struct in6_addr *dst, uint16_t dp,
+                            uint8_t proto)
+{
+    if (cxt->af != af || cxt->proto != proto)
+        return 0;
+    if (af == AF_INET6) {
+        if (CMP_CXT6(cxt, src, sp, dst, dp))
+            return SC_CLIENT;
+        if (CMP_CXT6(cxt, dst, dp, src, sp))
+            return SC_SERVER;
+    } else {
+        if (CMP_CXT4(cxt, IP4ADDR(src), sp, IP4ADDR(dst), dp))
+            return SC_CLIENT;
+        if (CMP_CXT4(cxt, IP4ADDR(dst), dp, IP4ADDR(src), sp))
+            return SC_SERVER;
+    }
+    return 0;
+}
+
+static int cxt_array_alloc(cxt_array *a, uint32_t buckets)
+{
+    void *mem;
+    if (posix_memalign(&mem, sizeof(cxt_bucket), buckets * sizeof(cxt_bucket)))
+        return -1;
+    memset(mem, 0, buckets * sizeof(cxt_bucket));
+    a->buckets = mem;
+    a->mask = buckets - 1;
+    return 0;
+}
+
+static inline uint64_t cxt_array_slots(const cxt_array *a)
+{
+    return a->buckets ? (uint64_t)(a->mask + 1) * CXT_TABLE_SLOTS : 0;
+}
+
+/* the parts of a table a scan walks through, in order */
+#define CXT_SCAN_OLD    0
+#define CXT_SCAN_CUR    1
+#define CXT_SCAN_STASH  2
+#define CXT_SCAN_SIDE   3
+#define CXT_SCAN_DONE   4
+
+/* the first bucket of an array that no open scan has reached; residents
+ * of the buckets from there on may still move without a scan missing them
+ * or returning them twice */
+static uint64_t cxt_scan_frontier(cxt_table *t, cxt_array *a, int region)
+{
+    uint64_t first = 0, b;
+    cxt_scan *scan;
+
+    for (scan = t->scans; scan != NULL; scan = scan->next) {
+        if (scan->region > region)
+            return (uint64_t)a->mask + 1;
+        if (scan->region < region)
+            continue;
+        b = (scan->pos + CXT_TABLE_SLOTS - 1) / CXT_TABLE_SLOTS;
+        if (b > first)
+            first = b;
+    }
+    return first;
+}
+
+static inline int cxt_table_full(cxt_table *t, uint64_t extra)
+{
+    return (t->count + extra) * 100
+           > cxt_array_slots(&t->cur) * CXT_TABLE_MAX_LOAD;
+}
+
+static inline uint32_t cxt_table_rand(cxt_table *t)
+{
+    t->rand ^= t->rand << 13;
+    t->rand ^= t->rand >> 17;
+    t->rand ^= t->rand << 5;
+    return t->rand;
+}
+
+static inline int cxt_bucket_put(cxt_bucket *b, uint16_t fp, connection *cxt)
+{
+    int s;
+    for (s = 0; s < CXT_TABLE_SLOTS; s++) {
+        if (b->fp[s] == 0) {
+            b->fp[s] = fp;
+            b->cxt[s] = cxt;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Places cxt in bucket i or its alternative, kicking residents to their
+ * own alternatives up to kicks times.  Only residents of buckets from
+ * frontier on are kicked, and only to such buckets.  Returns NULL once
+ * everything has a slot, or the connection left without one. */
+static connection *cxt_array_place(cxt_table *t, cxt_array *a, uint32_t i,
+                                   uint16_t fp, connection *cxt, int kicks,
+                                   uint64_t frontier)
+{
+    int k;
+    for (k = 0; ; k++) {
+        uint32_t j = cxt_alt(i, fp, a->mask);
+        if (cxt_bucket_put(&a->buckets[i], fp, cxt)
+            || cxt_bucket_put(&a->buckets[j], fp, cxt))
+            return NULL;
+        if (k == kicks)
+            return cxt;
+
+        /* swap with a random resident of either bucket */
+        uint32_t r = cxt_table_rand(t);
+        uint32_t victim = (r & 1) ? j : i;
+        if (victim < frontier)
+            victim = (victim == i) ? j : i;
+        if (victim < frontier)
+            return cxt;
+        cxt_bucket *b = &a->buckets[victim];
+        int s = (r >> 1) % CXT_TABLE_SLOTS;
+        uint16_t vfp = b->fp[s];
+        connection *vcxt = b->cxt[s];
+        if (cxt_alt(victim, vfp, a->mask) < frontier)
+            continue;
+        b->fp[s] = fp;
+        b->cxt[s] = cxt;
+        fp = vfp;
+        cxt = vcxt;
+        i = cxt_alt(victim, fp, a->mask);
+        t->kicks++;
+    }
+}
+
+static void cxt_stash_push(cxt_table *t, connection *cxt)
+{
+    if (t->stash_len == t->stash_size) {
+        t->stash_size = t->stash_size ? t->stash_size * 2 : 16;
+        t->stash = realloc(t->stash, t->stash_size * sizeof(connection *));
+        assert(t->stash);
+    }
+    t->stash[t->stash_len++] = cxt;
+}
+
+/* moves up to n old buckets into cur */
+static void cxt_table_migrate(cxt_table *t, uint32_t n)
+{
+    while (n-- > 0 && t->old.buckets != NULL) {
+        cxt_bucket *b = &t->old.buckets[t->migrated];
+        int s;
+        for (s = 0; s < CXT_TABLE_SLOTS; s++) {
+            if (b->fp[s] == 0)
+                continue;
+            uint64_t hash = cxt_hash_cxt(b->cxt[s]);
+            connection *homeless = cxt_array_place(t, &t->cur,
+                    hash & t->cur.mask, b->fp[s], b->cxt[s],
+                    CXT_TABLE_MAX_KICKS, 0);
+            if (homeless)
+                cxt_stash_push(t, homeless);
+            b->fp[s] = 0;
+            b->cxt[s] = NULL;
+        }
+        if (t->migrated++ == t->old.mask) {
+            free(t->old.buckets);
+            t->old.buckets = NULL;
+            t->migrated = 0;
+        }
+    }
+}
+
+/* doubles the table; the old buckets move over incrementally */
+static void cxt_table_grow(cxt_table *t)
+{
+    cxt_array bigger;
+
+    /* a second resize cannot wait for the first one */
+    cxt_table_migrate(t, UINT32_MAX);
+    if (cxt_array_alloc(&bigger, (t->cur.mask + 1) * 2) < 0)
+        return;
+    t->old = t->cur;
+    t->cur = bigger;
+    t->migrated = 0;
+    t->resizes++;
+}
+
+/* retries stashed connections; compacts the holes scans leave behind */
+static void cxt_table_unstash(cxt_table *t)
+{
+    uint32_t i, len = t->stash_len;
+    t->stash_len = 0;
+    for (i = 0; i < len; i++) {
+        connection *cxt = t->stash[i];
+        if (cxt == NULL)
+            continue;
+        uint64_t hash = cxt_hash_cxt(cxt);
+        connection *homeless = cxt_array_place(t, &t->cur, hash & t->cur.mask,
+                cxt_fp(hash), cxt, CXT_TABLE_MAX_KICKS, 0);
+        if (homeless)
+            t->stash[t->stash_len++] = homeless;
+    }
+}
+
+/* once the last scan has closed, the side array is moved into cur like the
+ * old buckets of a resize, after cur has grown if it must */
+static void cxt_table_merge_side(cxt_table *t)
+{
+    if (cxt_table_full(t, 0))
+        cxt_table_grow(t);
+    if (t->old.buckets)
+        return;
+    t->old = t->side;
+    t->migrated = 0;
+    t->side.buckets = NULL;
+    t->side.mask = 0;
+}
+
+/* incremental work done on updates while no scan is open */
+static void cxt_table_maintain(cxt_table *t)
+{
+    if (t->scanners)
+        return;
+    if (t->old.buckets)
+        cxt_table_migrate(t, CXT_TABLE_MIGRATE_STEP);
+    else if (t->side.buckets)
+        cxt_table_merge_side(t);
+    else if (t->stash_len)
+        cxt_table_unstash(t);
+}
+
+int cxt_table_init(cxt_table *t, uint32_t buckets)
+{
+    uint32_t n = CXT_TABLE_MIN_BUCKETS;
+    while (n < buckets)
+        n <<= 1;
+    memset(t, 0, sizeof(*t));
+    t->rand = 2463534242U;
+    return cxt_array_alloc(&t->cur, n);
+}
+
+void cxt_table_destroy(cxt_table *t)
+{
+    free(t->cur.buckets);
+    free(t->old.buckets);
+    free(t->side.buckets);
+    free(t->stash);
+    memset(t, 0, sizeof(*t));
+}
+
+static connection *cxt_array_find(cxt_array *a, uint64_t hash, uint16_t fp,
+                                  int af, const struct in6_addr *src,
+                                  uint16_t sp, const struct in6_addr *dst,
+                                  uint16_t dp, uint8_t proto, int *sc)
+{
+    uint32_t i = hash & a->mask;
+    int n, s;
+    for (n = 0; n < 2; n++) {
+        cxt_bucket *b = &a->buckets[i];
+        for (s = 0; s < CXT_TABLE_SLOTS; s++) {
+            if (b->fp[s] != fp)
+                continue;
+            if ((*sc = cxt_match(b->cxt[s], af, src, sp, dst, dp, proto)))
+                return b->cxt[s];
+        }
+        i = cxt_alt(i, fp, a->mask);
+    }
+    return NULL;
+}
+
+/* finds the connection a packet belongs to; *sc tells whether the packet
+ * came from its client (SC_CLIENT) or server (SC_SERVER) */
+connection *cxt_table_find(cxt_table *t, uint64_t hash, int af,
+                           const struct in6_addr *src, uint16_t sp,
+                           const struct in6_addr *dst, uint16_t dp,
+                           uint8_t proto, int *sc)
+{
+    uint16_t fp = cxt_fp(hash);
+    connection *cxt;
+    uint32_t i;
+
+    cxt = cxt_array_find(&t->cur, hash, fp, af, src, sp, dst, dp, proto, sc);
+    if (cxt == NULL && t->old.buckets)
+        cxt = cxt_array_find(&t->old, hash, fp, af, src, sp, dst, dp, proto,
+                             sc);
+    if (cxt == NULL && t->side.buckets)
+        cxt = cxt_array_find(&t->side, hash, fp, af, src, sp, dst, dp, proto,
+                             sc);
+    for (i = 0; cxt == NULL && i < t->stash_len; i++)
+        if (t->stash[i] && (*sc = cxt_match(t->stash[i], af, src, sp, dst,
+                                            dp, proto)))
+            cxt = t->stash[i];
+    return cxt;
+}
+
+/* a connection left without a slot while scans are open and the stash is
+ * full; returns it if the side array has no room either */
+static connection *cxt_table_side_place(cxt_table *t, connection *cxt)
+{
+    uint64_t hash = cxt_hash_cxt(cxt);
+
+    if (t->side.buckets == NULL
+        && cxt_array_alloc(&t->side, t->cur.mask + 1) < 0)
+        return cxt;
+    return cxt_array_place(t, &t->side, hash & t->side.mask, cxt_fp(hash),
+            cxt, CXT_TABLE_MAX_KICKS,
+            cxt_scan_frontier(t, &t->side, CXT_SCAN_SIDE));
+}
+
+void cxt_table_insert(cxt_table *t, uint64_t hash, connection *cxt)
+{
+    connection *homeless;
+
+    cxt_table_maintain(t);
+    if (!t->scanners && !t->old.buckets && cxt_table_full(t, 1))
+        cxt_table_grow(t);
+
+    homeless = cxt_array_place(t, &t->cur, hash & t->cur.mask, cxt_fp(hash),
+            cxt, CXT_TABLE_MAX_KICKS,
+            cxt_scan_frontier(t, &t->cur, CXT_SCAN_CUR));
+    if (homeless && t->scanners && t->stash_len >= CXT_TABLE_STASH_MAX)
+        homeless = cxt_table_side_place(t, homeless);
+    if (homeless) {
+        cxt_stash_push(t, homeless);
+        if (!t->scanners && !t->old.buckets)
+            cxt_table_grow(t);
+    }
+    t->count++;
+}
+
+static int cxt_array_remove(cxt_array *a, uint64_t hash, uint16_t fp,
+                            connection *cxt)
+{
+    uint32_t i = hash & a->mask;
+    int n, s;
+    for (n = 0; n < 2; n++) {
+        cxt_bucket *b = &a->buckets[i];
+        for (s = 0; s < CXT_TABLE_SLOTS; s++) {
+            if (b->fp[s] == fp && b->cxt[s] == cxt) {
+                b->fp[s] = 0;
+                b->cxt[s] = NULL;
+                return 1;
+            }
+        }
+        i = cxt_alt(i, fp, a->mask);
+    }
+    return 0;
+}
+
+static int cxt_stash_remove(cxt_table *t, connection *cxt)
+{
+    uint32_t i;
+    for (i = 0; i < t->stash_len; i++) {
+        if (t->stash[i] != cxt)
+            continue;
+        if (t->scanners)
+            t->stash[i] = NULL;
+        else
+            t->stash[i] = t->stash[--t->stash_len];
+        return 1;
+    }
+    return 0;
+}
+
+int cxt_table_remove(cxt_table *t, connection *cxt)
+{
+    uint64_t hash = cxt_hash_cxt(cxt);
+    uint16_t fp = cxt_fp(hash);
+
+    if (!cxt_array_remove(&t->cur, hash, fp, cxt)
+        && !(t->old.buckets && cxt_array_remove(&t->old, hash, fp, cxt))
+        && !(t->side.buckets && cxt_array_remove(&t->side, hash, fp, cxt))
+        && !cxt_stash_remove(t, cxt))
+        return -1;
+    t->count--;
+    cxt_table_maintain(t);
+    return 0;
+}
+
+void cxt_table_scan_begin(cxt_table *t, cxt_scan *scan)
+{
+    t->scanners++;
+    scan->region = CXT_SCAN_OLD;
+    scan->pos = 0;
+    scan->returned = 0;
+    scan->next = t->scans;
+    t->scans = scan;
+}
+
+/* old buckets first, then current ones, then the stash and the side array */
+connection *cxt_table_scan_next(cxt_table *t, cxt_scan *scan)
+{
+    while (scan->region < CXT_SCAN_DONE) {
+        cxt_array *a = NULL;
+        connection *cxt;
+        uint64_t p;
+        if (scan->region == CXT_SCAN_OLD)
+            a = &t->old;
+        else if (scan->region == CXT_SCAN_CUR)
+            a = &t->cur;
+        else if (scan->region == CXT_SCAN_SIDE)
+            a = &t->side;
+        if (scan->pos >= (a ? cxt_array_slots(a) : t->stash_len)) {
+            scan->region++;
+            scan->pos = 0;
+            continue;
+        }
+        p = scan->pos++;
+        if (a)
+            cxt = a->buckets[p / CXT_TABLE_SLOTS].cxt[p % CXT_TABLE_SLOTS];
+        else
+            cxt = t->stash[p];
+        if (cxt) {
+            scan->returned++;
+            return cxt;
+        }
+    }
+    return NULL;
+}
+
+void cxt_table_scan_end(cxt_table *t, cxt_scan *scan)
+{
+    cxt_scan **prev;
+
+    assert(t->scanners > 0);
+    t->scanners--;
+    for (prev = &t->scans; *prev != scan; prev = &(*prev)->next)
+        assert(*prev != NULL);
+    *prev = scan->next;
+}
+
+void cxt_table_stats(cxt_table *t, FILE *out)
+{
+    uint64_t used[CXT_TABLE_SLOTS + 1];
+    uint32_t i, stashed = 0;
+    int s, n;
+
+    memset(used, 0, sizeof(used));
+    for (i = 0; i <= t->cur.mask; i++) {
+        for (s = 0, n = 0; s < CXT_TABLE_SLOTS; s++)
+            n += (t->cur.buckets[i].fp[s] != 0);
+        used[n]++;
+    }
+    for (i = 0; i < t->stash_len; i++)
+        stashed += (t->stash[i] != NULL);
+
+    fprintf(out, "%lu connections in %u buckets (%.1f%% of slots)\n",
+            (unsigned long)t->count, t->cur.mask + 1,
+            100.0 * t->count
+            / (cxt_array_slots(&t->cur) + cxt_array_slots(&t->side)));
+    fprintf(out, "%u stashed, %lu resizes, %lu kicks%s%s\n", stashed,
+            (unsigned long)t->resizes, (unsigned long)t->kicks,
+            t->old.buckets ? ", resize in progress" : "",
+            t->side.buckets ? ", side array in use" : "");
+    for (n = 0; n <= CXT_TABLE_SLOTS; n++)
+        fprintf(out, "%lu buckets with %d connections\n",
+                (unsigned long)used[n], n);
+}
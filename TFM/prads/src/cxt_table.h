@@ -0,0 +1,85 @@
+#ifndef CXT_TABLE_H
+#define CXT_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "prads.h"
+
+/* Connection table: a bucketized cuckoo hash.  Each connection lives in
+ * one of two 64-byte buckets chosen by a keyed hash of its sorted
+ * endpoints, next to a 16-bit fingerprint, so a lookup reads at most two
+ * cache lines and only dereferences connections whose fingerprint
+ * matches.  When a bucket pair is full, residents are kicked to their
+ * other bucket; when that fails or the table fills up it doubles, and the
+ * old buckets are moved over a few at a time by later inserts and deletes.
+ * A connection that finds no slot waits in a small stash.
+ *
+ * Callers serialize access themselves (the shard locks in cxt.c).  A scan
+ * may drop the lock between connections: connections present for the whole
+ * scan are returned exactly once, and removing the one just returned is
+ * allowed.  While scans are open the table does not grow, and residents
+ * are only kicked between buckets no open scan has reached.  Connections
+ * that still find no slot once the stash is full go to a side array, which
+ * is moved into the table like a resize once the last scan closes. */
+
+#define CXT_TABLE_SLOTS         6       /* connections per bucket */
+#define CXT_TABLE_MIN_BUCKETS   1024
+#define CXT_TABLE_MAX_KICKS     128     /* displacements before giving up */
+#define CXT_TABLE_MIGRATE_STEP  4       /* old buckets moved per update */
+#define CXT_TABLE_MAX_LOAD      90      /* percent of slots used before growing */
+#define CXT_TABLE_STASH_MAX     16      /* stashed before scans use the side array */
+
+typedef struct _cxt_bucket {
+    uint16_t fp[CXT_TABLE_SLOTS];       /* 0 marks a free slot */
+    uint32_t __pad__;
+    connection *cxt[CXT_TABLE_SLOTS];
+} __attribute__((aligned(64))) cxt_bucket;
+
+typedef struct _cxt_array {
+    cxt_bucket *buckets;
+    uint32_t mask;                      /* bucket count - 1 */
+} cxt_array;
+
+typedef struct _cxt_scan {
+    int region;                         /* old, cur, stash, side, done */
+    uint64_t pos;                       /* next slot in the region */
+    uint64_t returned;
+    struct _cxt_scan *next;             /* other open scans of the table */
+} cxt_scan;
+
+typedef struct _cxt_table {
+    cxt_array cur;
+    cxt_array old;                      /* being moved to cur, or no buckets */
+    cxt_array side;                     /* overflow while scans are open */
+    uint32_t migrated;                  /* old buckets moved so far */
+    uint32_t scanners;                  /* open scans */
+    cxt_scan *scans;
+    connection **stash;                 /* connections without a slot */
+    uint32_t stash_len;                 /* includes holes left during scans */
+    uint32_t stash_size;
+    uint64_t count;
+    uint64_t resizes;
+    uint64_t kicks;
+    uint32_t rand;
+} cxt_table;
+
+void cxt_hash_seed(uint64_t key);
+uint64_t cxt_hash(int af, const struct in6_addr *src, uint16_t sp,
+                  const struct in6_addr *dst, uint16_t dp, uint8_t proto);
+uint64_t cxt_hash_cxt(const connection *cxt);
+uint32_t cxt_hash_addr(uint32_t addr);
+
+int cxt_table_init(cxt_table *t, uint32_t buckets);
+void cxt_table_destroy(cxt_table *t);
+connection *cxt_table_find(cxt_table *t, uint64_t hash, int af,
+                           const struct in6_addr *src, uint16_t sp,
+                           const struct in6_addr *dst, uint16_t dp,
+                           uint8_t proto, int *sc);
+void cxt_table_insert(cxt_table *t, uint64_t hash, connection *cxt);
+int cxt_table_remove(cxt_table *t, connection *cxt);
+void cxt_table_scan_begin(cxt_table *t, cxt_scan *scan);
+connection *cxt_table_scan_next(cxt_table *t, cxt_scan *scan);
+void cxt_table_scan_end(cxt_table *t, cxt_scan *scan);
+void cxt_table_stats(cxt_table *t, FILE *out);
+
+#endif // CXT_TABLE_H
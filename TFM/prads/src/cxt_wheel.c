@@ -0,0 +1,98 @@
+#include <string.h>
+#include "cxt_wheel.h"
+
+#define CXT_WHEEL_MASK (CXT_WHEEL_SLOTS - 1)
+
+void cxt_wheel_init(cxt_wheel *w, time_t now)
+{
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+static connection **cxt_wheel_head(cxt_wheel *w, connection *cxt)
+{
+    if (cxt->timer == CXT_TIMER_DUE)
+        return &w->due;
+    return &w->slot[cxt->timer & CXT_WHEEL_MASK];
+}
+
+static void cxt_wheel_link(connection **head, connection *cxt)
+{
+    cxt->prev = NULL;
+    cxt->next = *head;
+    if (*head != NULL)
+        (*head)->prev = cxt;
+    *head = cxt;
+}
+
+static void cxt_wheel_unlink(connection **head, connection *cxt)
+{
+    if (cxt->prev != NULL)
+        cxt->prev->next = cxt->next;
+    else
+        *head = cxt->next;
+    if (cxt->next != NULL)
+        cxt->next->prev = cxt->prev;
+    cxt->prev = cxt->next = NULL;
+}
+
+/* (re)arms a connection to be looked at in second 'when'; times already
+ * passed go to the next slot a tick will visit */
+void cxt_wheel_arm(cxt_wheel *w, connection *cxt, time_t when)
+{
+    if (cxt->timer != 0)
+        cxt_wheel_unlink(cxt_wheel_head(w, cxt), cxt);
+    else
+        w->armed++;
+    if (when < w->now)
+        when = w->now;
+    cxt->timer = when;
+    cxt_wheel_link(cxt_wheel_head(w, cxt), cxt);
+}
+
+void cxt_wheel_disarm(cxt_wheel *w, connection *cxt)
+{
+    if (cxt->timer == 0)
+        return;
+    cxt_wheel_unlink(cxt_wheel_head(w, cxt), cxt);
+    cxt->timer = 0;
+    w->armed--;
+}
+
+/* moves the connections of one slot that are due by 'now' to the due list */
+static void cxt_wheel_collect(cxt_wheel *w, uint32_t i, time_t now)
+{
+    connection *cxt = w->slot[i], *next;
+
+    for (; cxt != NULL; cxt = next) {
+        next = cxt->next;
+        if (cxt->timer > now)
+            continue;
+        cxt_wheel_unlink(&w->slot[i], cxt);
+        cxt->timer = CXT_TIMER_DUE;
+        cxt_wheel_link(&w->due, cxt);
+    }
+}
+
+/* next connection armed for 'now' or earlier, disarmed; NULL once the wheel
+ * has caught up.  Popping can be interrupted and resumed at any point. */
+connection *cxt_wheel_pop(cxt_wheel *w, time_t now)
+{
+    connection *cxt;
+
+    while (w->due == NULL && w->now <= now) {
+        /* more than a turn behind: every slot is visited once */
+        if (now - w->now >= CXT_WHEEL_SLOTS)
+            w->now = now - CXT_WHEEL_SLOTS + 1;
+        cxt_wheel_collect(w, w->now & CXT_WHEEL_MASK, now);
+        w->now++;
+    }
+
+    cxt = w->due;
+    if (cxt == NULL)
+        return NULL;
+    cxt_wheel_unlink(&w->due, cxt);
+    cxt->timer = 0;
+    w->armed--;
+    return cxt;
+}
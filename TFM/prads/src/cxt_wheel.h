@@ -0,0 +1,33 @@
+#ifndef CXT_WHEEL_H
+#define CXT_WHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+#include "prads.h"
+
+/* Connection expiry: a timing wheel with one slot per second.  A connection
+ * is linked through cxt->prev/next into the slot for cxt->timer, the second
+ * it should next be looked at, so a tick only touches the slots it passes
+ * and the connections that are due.  Deadlines more than one turn away
+ * share a slot with nearer ones and are skipped until their turn comes.
+ *
+ * Moving a connection on every packet is not needed: callers only re-arm
+ * when a deadline comes closer, and re-arm connections that pop before their
+ * real deadline.  Callers serialize access (the shard locks in cxt.c). */
+
+#define CXT_WHEEL_SLOTS 512             /* seconds, power of 2 > TCP_TIMEOUT */
+#define CXT_TIMER_DUE   ((time_t)-1)    /* cxt->timer once on the due list */
+
+typedef struct _cxt_wheel {
+    connection *slot[CXT_WHEEL_SLOTS];
+    connection *due;                    /* popped from a slot, not returned */
+    time_t now;                         /* slots before this second are done */
+    uint64_t armed;
+} cxt_wheel;
+
+void cxt_wheel_init(cxt_wheel *w, time_t now);
+void cxt_wheel_arm(cxt_wheel *w, connection *cxt, time_t when);
+void cxt_wheel_disarm(cxt_wheel *w, connection *cxt);
+connection *cxt_wheel_pop(cxt_wheel *w, time_t now);
+
+#endif // CXT_WHEEL_H
@@ -0,0 +1,251 @@
+/*
+ * cxt_wheel_test -- connection expiry on the timing wheel against a naive
+ * sweep.
+ *
+ * Drives the real cxt.c with a fake clock (link with -Wl,--wrap=time).
+ * Random TCP, UDP and ICMP flows see packets, some with RST, while the
+ * clock moves by a few seconds, by minutes, or by more than a turn of the
+ * wheel.  After each end_sessions exactly the flows a sweep over all of
+ * them finds idle past their timeout must have been logged, ended or
+ * expired as the sweep says.  Then times a tick with nothing due against
+ * a walk over the whole table, which is what a tick used to cost.
+ *
+ * usage: cxt_wheel_test [connections]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <SDMBN.h>
+#include "prads.h"
+#include "cxt.h"
+#include "cxt_wheel.h"
+#include "config.h"
+#include "mac.h"
+#include "sys_func.h"
+#include "output-plugins/log.h"
+
+#define FLOWS   20000
+#define STEPS   3000
+
+globalconfig config;
+time_t tstamp;
+
+static time_t clock_now = 1400000000;
+static long live_cxts;
+
+/* the model */
+static uint16_t ports[FLOWS];
+static uint8_t protos[FLOWS];
+static time_t last[FLOWS];
+static int live[FLOWS], rst[FLOWS], logged[FLOWS];
+static int *flow_of;            /* cxid -> flow */
+static int flow_of_size;
+
+time_t __wrap_time(time_t *t)
+{
+    if (t != NULL)
+        *t = clock_now;
+    return clock_now;
+}
+
+void sdmbn_notify_flow_created()
+{
+    live_cxts++;
+}
+
+void sdmbn_notify_flow_destroyed()
+{
+    live_cxts--;
+}
+
+/* records which flows end_sessions ends, and how */
+void log_connection(connection *cxt, int cxstatus)
+{
+    if (flow_of == NULL || (cxstatus != CX_ENDED && cxstatus != CX_EXPIRE))
+        return;
+    logged[flow_of[cxt->cxid]] = cxstatus;
+}
+
+void log_rotate(time_t t) {}
+void log_asset_arp(asset *main) {}
+void log_asset_os(asset *main, os_asset *os, connection *cxt) {}
+void log_asset_service(asset *main, serv_asset *service, connection *cxt) {}
+mac_entry *match_mac(mac_entry **db, const uint8_t mac[], uint8_t mask)
+{
+    return NULL;
+}
+void print_mac(const uint8_t *mac) {}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static connection *packet(int i, uint8_t proto, uint16_t port, int with_rst)
+{
+    struct pcap_pkthdr h;
+    ip4_header ip;
+    tcp_header tcp;
+    packetinfo pi;
+
+    memset(&pi, 0, sizeof(pi));
+    memset(&ip, 0, sizeof(ip));
+    memset(&tcp, 0, sizeof(tcp));
+    h.ts.tv_sec = clock_now;
+    ip.ip_src = htonl(0x0a000000 + i);
+    ip.ip_dst = htonl(0xc0a80101);
+    pi.af = AF_INET;
+    pi.ip4 = &ip;
+    pi.pheader = &h;
+    pi.proto = proto;
+    pi.s_port = port;
+    pi.d_port = htons(53);
+    pi.packet_bytes = 100;
+    if (proto == IP_PROTO_TCP) {
+        pi.tcph = &tcp;
+        if (with_rst)
+            tcp.t_flags = TF_RST;
+    }
+    cx_track(&pi);
+    return pi.cxt;
+}
+
+static void model_packet(int i, int with_rst)
+{
+    connection *cxt = packet(i, protos[i], ports[i], with_rst);
+
+    if (!live[i]) {
+        if ((int)cxt->cxid >= flow_of_size) {
+            flow_of_size = cxt->cxid * 2;
+            flow_of = realloc(flow_of, flow_of_size * sizeof(int));
+        }
+        flow_of[cxt->cxid] = i;
+        live[i] = 1;
+        rst[i] = 0;
+    }
+    last[i] = clock_now;
+    if (with_rst && protos[i] == IP_PROTO_TCP)
+        rst[i] = 1;
+}
+
+/* what a sweep over every flow ends at this tick */
+static int model_due(int i, int *status)
+{
+    time_t idle = 60;
+
+    *status = CX_EXPIRE;
+    if (protos[i] == IP_PROTO_TCP) {
+        idle = TCP_TIMEOUT;
+        if (rst[i]) {
+            idle = 5;
+            *status = CX_ENDED;
+        }
+    }
+    return clock_now - last[i] > idle;
+}
+
+static void model(void)
+{
+    long n_live, ended = 0, expired = 0;
+    int i, step, ticks = 0, status, r;
+
+    srandom(5);
+    for (i = 0; i < FLOWS; i++) {
+        ports[i] = random();
+        r = random() % 3;
+        protos[i] = r == 0 ? IP_PROTO_TCP : r == 1 ? IP_PROTO_UDP
+                                                   : IP_PROTO_ICMP;
+    }
+    for (step = 0; step < STEPS; step++) {
+        for (i = random() % 200; i > 0; i--)
+            model_packet(random() % FLOWS, random() % 50 == 0);
+
+        r = random() % 100;
+        if (r < 80)
+            clock_now += random() % 5;
+        else if (r < 98)
+            clock_now += random() % 120;
+        else
+            clock_now += CXT_WHEEL_SLOTS + random() % 800;
+        if (random() % 4 != 0)
+            continue;
+
+        ticks++;
+        memset(logged, 0, sizeof(logged));
+        end_sessions();
+        for (i = 0, n_live = 0; i < FLOWS; i++) {
+            if (!live[i])
+                continue;
+            if (!model_due(i, &status)) {
+                n_live++;
+                if (logged[i]) {
+                    fprintf(stderr, "tick %d: flow %d ended early\n", ticks, i);
+                    exit(1);
+                }
+                continue;
+            }
+            if (logged[i] != status) {
+                fprintf(stderr, "tick %d: flow %d logged %d, want %d\n",
+                        ticks, i, logged[i], status);
+                exit(1);
+            }
+            live[i] = 0;
+            if (status == CX_ENDED)
+                ended++;
+            else
+                expired++;
+        }
+        if (live_cxts != n_live || config.pr_s.cxt_ended != ended
+            || config.pr_s.cxt_expired != expired) {
+            fprintf(stderr, "tick %d: %ld live, %u ended, %u expired; "
+                    "want %ld, %ld, %ld\n", ticks, live_cxts,
+                    config.pr_s.cxt_ended, config.pr_s.cxt_expired,
+                    n_live, ended, expired);
+            exit(1);
+        }
+    }
+    printf("model   %d ticks match the sweep: %ld ended, %ld expired\n",
+           ticks, ended, expired);
+    end_all_sessions();
+    free(flow_of);
+    flow_of = NULL;
+}
+
+static void bench(int n)
+{
+    double start, tick, walk;
+    int i;
+
+    for (i = 0; i < n; i++)
+        packet(FLOWS + i, IP_PROTO_TCP, random(), 0);
+    clock_now += 60;
+    start = now();
+    end_sessions();
+    tick = now() - start;
+
+    /* every connection visited, as end_sessions used to */
+    config.cflags |= CONFIG_CXWRITE;
+    start = now();
+    log_connection_all();
+    walk = now() - start;
+    config.cflags &= ~CONFIG_CXWRITE;
+
+    printf("%d connections, none due: tick %.3f ms, full walk %.3f ms\n",
+           n, tick * 1e3, walk * 1e3);
+    end_all_sessions();
+}
+
+int main(int argc, char **argv)
+{
+    int n = 1000000;
+
+    if (argc > 1)
+        n = atoi(argv[1]);
+    cxt_init();
+    model();
+    bench(n);
+    return 0;
+}
@@ -65,6 +65,14 @@ servicelist *services[MAX_PORTS];
 int inpacket, gameover, intr_flag;
 int nets = 1;
 
+/* got_packet runs on the pcap thread and on the libsdmbn threads that
+ * release buffered packets and reprocess events.  tstamp, inpacket,
+ * intr_flag, the config.pr_s counters and the work check_interrupt does
+ * all assume one packet at a time, so the packet handler holds this lock.
+ * packet_owner is set on the thread holding it. */
+static pthread_mutex_t packet_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int packet_owner;
+
 fmask network[MAX_NETS];
 
 // static strings for comparison
@@ -125,6 +133,40 @@ static void close_writeiface(pcap_t *live)
 
 /* F U N C T I O N S  ********************************************************/
 
+static void packet_enter()
+{
+    pthread_mutex_lock(&packet_lock);
+    packet_owner = 1;
+}
+
+static void packet_leave()
+{
+    packet_owner = 0;
+    pthread_mutex_unlock(&packet_lock);
+}
+
+/* Signal handlers call this before touching the tables.  It returns 1 if
+ * no packet is being handled, taking packet_lock unless this thread already
+ * holds it (check_interrupt between packets).  Otherwise the handler leaves
+ * its work in intr_flag for check_interrupt.  *taken tells idle_leave
+ * whether to release the lock. */
+static int idle_enter(int *taken)
+{
+    *taken = 0;
+    if (packet_owner)
+        return inpacket == 0;
+    if (pthread_mutex_trylock(&packet_lock) != 0)
+        return 0;
+    packet_owner = *taken = 1;
+    return 1;
+}
+
+static void idle_leave(int taken)
+{
+    if (taken)
+        packet_leave();
+}
+
 void got_packet(u_char * useless, const struct pcap_pkthdr *pheader,
                 const u_char * packet)
 {
@@ -134,6 +176,7 @@ void got_packet(u_char * useless, const struct pcap_pkthdr *pheader,
     if (context.stop)
     { return; }
 
+    packet_enter();
     struct timeval recv_time;
     gettimeofday(&recv_time, NULL);
     config.pr_s.got_packets++;
@@ -191,6 +234,7 @@ void got_packet(u_char * useless, const struct pcap_pkthdr *pheader,
         }
 //        fprintf(stderr, "Wrote packet of length %d to network interface after processing\n", bytes);
     }
+    packet_leave();
 
     // SDMBN post-process packet
     sdmbn_postprocess_packet(pheader, packet, &context);
@@ -1086,8 +1130,9 @@ nets_end:
 
 void game_over()
 {
+    int taken;
 
-    if (inpacket == 0) {
+    if (idle_enter(&taken)) {
         end_sessions(); /* Need to have correct human output when reading -r pcap */
         clear_asset_list();
         end_all_sessions();
@@ -1096,6 +1141,7 @@ void game_over()
         unload_tcp_sigs();
         end_logging();
         free(head_tra);
+        sbin_free(head_sbin);
         if(!ISSET_CONFIG_QUIET(config)){
            print_prads_stats();
            if(!config.pcap_file)
@@ -1112,11 +1158,14 @@ void game_over()
 
 void reparse_conf()
 {
-    if(inpacket == 0) {
+    int taken;
+
+    if (idle_enter(&taken)) {
         olog("Reparsing config file...");
         parse_config_file(config.file);
         end_sessions();
         intr_flag = 0;
+        idle_leave(taken);
         return;
     }
     intr_flag = 4;
@@ -1140,9 +1189,11 @@ void check_interrupt()
 
 void set_end_sessions()
 {
+    int taken;
+
     intr_flag = 3;
 
-    if (inpacket == 0) {
+    if (idle_enter(&taken)) {
         tstamp = time(NULL);
         end_sessions();
         /* if no cxtracking is turned on - dont log to disk */
@@ -1151,6 +1202,7 @@ void set_end_sessions()
         /* if (log_assets == 1) update_asset_list(); */
         update_asset_list();
         intr_flag = 0;
+        idle_leave(taken);
         alarm(SIG_ALRM);
     }
     // install self again
@@ -1177,6 +1229,8 @@ void print_prads_stats()
     olog("-- Total Other transport packets received :%12u\n",config.pr_s.othert_recv);
     olog("--\n");
     olog("-- Total sessions tracked                 :%12lu\n", cxtrackerid);
+    olog("-- Total sessions ended by FIN/RST        :%12u\n",config.pr_s.cxt_ended);
+    olog("-- Total sessions timed out               :%12u\n",config.pr_s.cxt_expired);
     olog("-- Total assets detected                  :%12u\n",config.pr_s.assets);
     olog("-- Total TCP OS fingerprints detected     :%12u\n",config.pr_s.tcp_os_assets);
     olog("-- Total UDP OS fingerprints detected     :%12u\n",config.pr_s.udp_os_assets);
@@ -1524,6 +1578,7 @@ int main(int argc, char *argv[])
     pcap_freecode(&cfilter);
 
     cxt_init();
+    asset_init();
 
     // Initialize SDMBN
     SDMBNLocals locals;
@@ -1539,11 +1594,6 @@ int main(int argc, char *argv[])
     locals.device = config.dev;
     sdmbn_init(&locals);
 
-    // Connection Table Lock
-    pthread_mutex_init(&ConnEntryLock, NULL);
-    // Asset Table Lock
-    pthread_mutex_init(&AssetEntryLock, NULL);
-    
     setup_serialize_translators();
 
     // Open interface for writing packets after processing, if requested
@@ -1606,98 +1656,3 @@ int local_put_allflows(int hashkey, char *state)
 
     return 1;
 }
-
-
-
-ser_tra_t* setup_serialize_translators()
-{
- 
-    // printf("[Debug]: Setting up serializer translator/n");
-    ser_tra_t *tra1, *tra2, *tra3, *tra4;
-    ser_field_t * field;
-
-    // translator for connection
-    head_tra = ser_new_tra("connection",sizeof(connection),NULL);
-    ser_new_field(head_tra,"time_t",0,"start_time",offsetof(connection,start_time));
-    ser_new_field(head_tra,"time_t",0,"last_pkt_time",offsetof(connection,last_pkt_time));
-    ser_new_field(head_tra,"uint32_t",0,"cxid",offsetof(connection,cxid));
-    ser_new_field(head_tra,"uint8_t",0,"reversed",offsetof(connection,reversed));
-    ser_new_field(head_tra,"uint32_t",0,"af",offsetof(connection,af));
-    ser_new_field(head_tra,"uint16_t",0,"hw_proto",offsetof(connection,hw_proto));
-    ser_new_field(head_tra,"uint8_t",0,"proto",offsetof(connection,proto));
-    ser_new_field(head_tra,"in6",0,"s_ip",offsetof(connection,s_ip));
-    ser_new_field(head_tra,"in6",0,"d_ip",offsetof(connection,d_ip));
-    ser_new_field(head_tra,"uint16_t",0,"s_port",offsetof(connection,s_port));
-    ser_new_field(head_tra,"uint16_t",0,"d_port",offsetof(connection,d_port));
-    ser_new_field(head_tra,"uint32_t",0,"s_total_pkts",offsetof(connection,s_total_pkts));
-    ser_new_field(head_tra,"uint32_t",0,"s_total_bytes",offsetof(connection,s_total_bytes));
-    ser_new_field(head_tra,"uint32_t",0,"d_total_pkts",offsetof(connection,d_total_pkts));
-    ser_new_field(head_tra,"uint32_t",0,"d_total_bytes",offsetof(connection,d_total_bytes));
-    ser_new_field(head_tra,"uint8_t",0,"s_tcpFlags",offsetof(connection,s_tcpFlags));
-    ser_new_field(head_tra,"uint8_t",0,"__pad__",offsetof(connection,__pad__));
-    ser_new_field(head_tra,"uint8_t",0,"d_tcpFlags",offsetof(connection,d_tcpFlags));
-    ser_new_field(head_tra,"uint8_t",0,"check",offsetof(connection,check));
-    ser_new_field(head_tra,"asset",1,"c_asset",offsetof(connection,c_asset));
-    ser_new_field(head_tra,"asset",1,"s_asset",offsetof(connection,s_asset));
-    ser_new_field(head_tra,"uint32_t",0,"gotten",offsetof(connection,gotten));
- 
-    // translator for asset
-    tra0 = ser_new_tra("asset",sizeof(asset),head_tra);
-    //ser_new_field(tra0,"asset",1,"prev",offsetof(asset,prev));
-    ser_new_field(tra0,"time_t",0,"first_seen",offsetof(asset,first_seen));
-    ser_new_field(tra0,"time_t",0,"last_seen",offsetof(asset,last_seen));
-    ser_new_field(tra0,"ushort",0,"i_attempts",offsetof(asset,i_attempts));
-    ser_new_field(tra0,"int",0,"af",offsetof(asset,af));
-    ser_new_field(tra0,"uint16_t",0,"vlan",offsetof(asset,vlan));
-    ser_new_field(tra0,"in6",0,"ip_addr",offsetof(asset,ip_addr));
-    ser_new_field(tra0,"serv_asset",1,"services",offsetof(asset,services));
-    ser_new_field(tra0,"os_asset",1,"os",offsetof(asset,os));
-    
-    // translator for bstring
-    tra1 = ser_new_tra("tagstr",sizeof(tagstr),tra0);
-    ser_new_field(tra1,"int",0,"mlen",offsetof(tagstr,mlen));
-    ser_new_field(tra1,"int",0,"slen",offsetof(tagstr,slen));
-    ser_new_field(tra1,"string",0,"data",offsetof(tagstr,data));
-    
-    // translator for serv_asset
-    tra2 = ser_new_tra("serv_asset",sizeof(serv_asset),tra1);
-    ser_new_field(tra2,"serv_asset",1,"prev",offsetof(serv_asset,prev));
-    ser_new_field(tra2,"serv_asset",1,"next",offsetof(serv_asset,next));
-    ser_new_field(tra2,"time_t",0,"first_seen",offsetof(serv_asset,first_seen));
-    ser_new_field(tra2,"time_t",0,"last_seen",offsetof(serv_asset,last_seen));
-    ser_new_field(tra2,"ushort",0,"i_attempts",offsetof(serv_asset,i_attempts));
-    ser_new_field(tra2,"ushort",0,"proto",offsetof(serv_asset,proto));
-    ser_new_field(tra2,"uint16_t",0,"port",offsetof(serv_asset,port));
-    ser_new_field(tra2,"uint8_t",0,"ttl",offsetof(serv_asset,ttl));
-    ser_new_field(tra2,"tagstr",1,"service",offsetof(serv_asset,service));
-    ser_new_field(tra2,"tagstr",1,"application",offsetof(serv_asset,application));
-    ser_new_field(tra2,"int",0,"role",offsetof(serv_asset,role));
-    ser_new_field(tra2,"int",0,"unknown",offsetof(serv_asset,unknown));
-    
-    // translator for os_asset
-    tra3 = ser_new_tra("os_asset",sizeof(os_asset),tra2);
-    ser_new_field(tra3,"serv_asset",1,"prev",offsetof(os_asset,prev));
-    ser_new_field(tra3,"serv_asset",1,"next",offsetof(os_asset,next));
-    ser_new_field(tra3,"time_t",0,"first_seen",offsetof(os_asset,first_seen));
-    ser_new_field(tra3,"time_t",0,"last_seen",offsetof(os_asset,last_seen));
-    ser_new_field(tra3,"ushort",0,"i_attempts",offsetof(os_asset,i_attempts));
-    ser_new_field(tra3,"tagstr",1,"vendor",offsetof(os_asset,vendor));
-    ser_new_field(tra3,"tagstr",1,"os",offsetof(os_asset,os));
-    ser_new_field(tra3,"uint8_t",0,"detection",offsetof(os_asset,detection));
-    ser_new_field(tra3,"tagstr",1,"raw_fp",offsetof(os_asset,raw_fp));
-    ser_new_field(tra3,"tagstr",1,"matched_fp",offsetof(os_asset,matched_fp));
-    ser_new_field(tra3,"string",0,"match_os",offsetof(os_asset,match_os));
-    ser_new_field(tra3,"string",0,"match_desc",offsetof(os_asset,match_desc));
-    ser_new_field(tra3,"int16_t",0,"port",offsetof(os_asset,port));
-    ser_new_field(tra3,"int16_t",0,"mtu",offsetof(os_asset,mtu));
-    ser_new_field(tra3,"int8_t",0,"ttl",offsetof(os_asset,ttl));
-    ser_new_field(tra3,"int32_t",0,"uptime",offsetof(os_asset,uptime));
- 
-    //translator for in6_addr
-    tra4 = ser_new_tra("in6", sizeof(uint8_t) * 4, tra3);
-    field = ser_new_field(tra4, "uint8_t", 0, "value", 0);
-    field->repeat = 4;
-    // #ifdef SER_DEBUG
-    //   ser_tra_list(tra0); 
-    //#endif
-}
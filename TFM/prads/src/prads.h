@@ -30,6 +30,7 @@
 #include <pcre.h>
 
 #include "serialize.h"
+#include "state_bin.h"
 #include <pthread.h>
 /*  D E F I N E S  ************************************************************/
 #ifndef RELEASE
@@ -183,8 +184,6 @@
 
 #define TRANSFER_MULTI_FLOW            1 // transfer multi flow in per flow state
 
-pthread_mutex_t ConnEntryLock;
-pthread_mutex_t AssetEntryLock;
 /*  D A T A  S T R U C T U R E S  *********************************************/
 
 /*
@@ -538,6 +537,11 @@ typedef struct _connection {
     struct   _asset *c_asset;     /* pointer to src asset */
     struct   _asset *s_asset;     /* pointer to server asset */
     uint32_t gotten;              /* last SDMBN get call that returned this. 0: not moved, -1: moved but don't raise event, >0: moved, raise event */
+    time_t   timer;               /* second the expiry wheel looks at it next, 0 if not armed */
+    struct   _connection *s_prev; /* connections from the same source address */
+    struct   _connection *s_next;
+    struct   _connection *d_prev; /* connections to the same destination address */
+    struct   _connection *d_next;
 } connection;
 #define CXT_DONT_CHECK_SERVER     0x01  /* Dont check server packets */
 #define CXT_DONT_CHECK_CLIENT     0x02  /* Dont check client packets */
@@ -807,6 +811,8 @@ typedef struct _prads_stat {
     uint32_t tcp_clients;   /* total number of tcp clients detected */
     uint32_t udp_services;  /* total number of udp services detected */
     uint32_t udp_clients;   /* total number of tcp clients detected */
+    uint32_t cxt_ended;     /* total number of sessions ended by FIN/RST */
+    uint32_t cxt_expired;   /* total number of sessions timed out */
 } prads_stat;
 
 typedef struct _tagstr {
@@ -816,6 +822,7 @@ typedef struct _tagstr {
 }tagstr;
 
 ser_tra_t *tra0,*head_tra; 
+sbin_schema *head_sbin;   /* head_tra compiled by sbin_compile */
 
 #ifdef NO_VECTOR_TYPES
 typedef struct _fmask {
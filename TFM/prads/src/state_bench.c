@@ -0,0 +1,456 @@
+/*
+ * state_bench -- round trips and speed of the binary connection state
+ * against ser_ialize/ser_parse.
+ *
+ * Builds connections with client and server assets carrying service and
+ * OS lists, and checks that every one comes back from sbin_ialize and
+ * sbin_parse exactly as it went in, and as ser_parse rebuilds it from
+ * ser_ialize.  Damaged encodings must be refused, not crash.  Then times
+ * both encodings over the same connections.
+ *
+ * usage: state_bench [connections] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <SDMBN.h>
+#include "prads.h"
+#include "state_bin.h"
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void fail(const char *what, int i)
+{
+    fprintf(stderr, "connection %d: %s\n", i, what);
+    exit(1);
+}
+
+static char *random_text(int max)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .:/-_*";
+    int i, len = random() % (max + 1);
+    char *s = malloc(len + 1);
+
+    for (i = 0; i < len; i++)
+        s[i] = chars[random() % (sizeof(chars) - 1)];
+    s[len] = '\0';
+    return s;
+}
+
+static bstring random_bstr(int max)
+{
+    bstring b;
+    char *s;
+
+    if (random() % 8 == 0)
+        return NULL;
+    s = random_text(max);
+    b = bfromcstr(s);
+    free(s);
+    return b;
+}
+
+static asset *random_asset(void)
+{
+    asset *a = calloc(1, sizeof(asset));
+    serv_asset *sa, *last = NULL;
+    os_asset *oa, *olast = NULL;
+    int i, n;
+
+    a->first_seen = 1400000000 + random() % 100000000;
+    a->last_seen = a->first_seen + random() % 1000;
+    a->i_attempts = random();
+    a->af = AF_INET;
+    a->vlan = random() % 4096;
+    a->ip_addr.s6_addr32[0] = random();
+
+    for (i = 0, n = random() % 6; i < n; i++) {
+        sa = calloc(1, sizeof(serv_asset));
+        sa->first_seen = a->first_seen;
+        sa->last_seen = a->last_seen + i;
+        sa->i_attempts = random();
+        sa->proto = random() % 2 ? IP_PROTO_TCP : IP_PROTO_UDP;
+        sa->port = random();
+        sa->ttl = random();
+        sa->service = random_bstr(12);
+        sa->application = random_bstr(60);
+        sa->role = random() % 2 ? SC_SERVER : SC_CLIENT;
+        sa->unknown = -(random() % 3);
+        sa->prev = last;
+        if (last != NULL)
+            last->next = sa;
+        else
+            a->services = sa;
+        last = sa;
+    }
+    for (i = 0, n = random() % 3; i < n; i++) {
+        oa = calloc(1, sizeof(os_asset));
+        oa->first_seen = a->first_seen;
+        oa->last_seen = a->last_seen - i;
+        oa->i_attempts = random();
+        oa->vendor = random_bstr(12);
+        oa->os = random_bstr(20);
+        oa->detection = random();
+        oa->raw_fp = random_bstr(80);
+        oa->matched_fp = random_bstr(80);
+        oa->match_os = random() % 4 ? random_text(20) : NULL;
+        oa->match_desc = random() % 4 ? random_text(40) : NULL;
+        oa->port = random();
+        oa->mtu = random();
+        oa->ttl = random();
+        oa->uptime = random();
+        oa->prev = olast;
+        if (olast != NULL)
+            olast->next = oa;
+        else
+            a->os = oa;
+        olast = oa;
+    }
+    return a;
+}
+
+static connection *random_connection(void)
+{
+    connection *c = calloc(1, sizeof(connection));
+
+    c->start_time = 1400000000 + random() % 100000000;
+    c->last_pkt_time = c->start_time + random() % 3600;
+    c->cxid = random();
+    c->reversed = random() % 2;
+    c->af = AF_INET;
+    c->hw_proto = htons(ETHERNET_TYPE_IP);
+    c->proto = random() % 2 ? IP_PROTO_TCP : IP_PROTO_UDP;
+    c->s_ip.s6_addr32[0] = random();
+    c->d_ip.s6_addr32[0] = random();
+    c->s_port = random();
+    c->d_port = random();
+    c->s_total_pkts = random() % 10 ? random() % 100 : random();
+    c->s_total_bytes = random();
+    c->d_total_pkts = random() % 100;
+    c->d_total_bytes = random() % 100000;
+    c->s_tcpFlags = random();
+    c->d_tcpFlags = random();
+    c->check = random();
+    c->gotten = random() % 2 ? 0 : (uint32_t)-1;
+    if (random() % 4)
+        c->c_asset = random_asset();
+    if (random() % 4)
+        c->s_asset = random() % 8 ? random_asset() : c->c_asset;
+    return c;
+}
+
+static void free_asset(asset *a)
+{
+    serv_asset *sa, *sn;
+    os_asset *oa, *on;
+
+    for (sa = a->services; sa != NULL; sa = sn) {
+        sn = sa->next;
+        bdestroy(sa->service);
+        bdestroy(sa->application);
+        free(sa);
+    }
+    for (oa = a->os; oa != NULL; oa = on) {
+        on = oa->next;
+        bdestroy(oa->vendor);
+        bdestroy(oa->os);
+        bdestroy(oa->raw_fp);
+        bdestroy(oa->matched_fp);
+        free(oa->match_os);
+        free(oa->match_desc);
+        free(oa);
+    }
+    free(a);
+}
+
+static void free_connection(connection *c)
+{
+    if (c->c_asset != NULL)
+        free_asset(c->c_asset);
+    if (c->s_asset != NULL && c->s_asset != c->c_asset)
+        free_asset(c->s_asset);
+    free(c);
+}
+
+/* frees a decoded connection whatever shape damage gave its lists: every
+ * structure reachable, once */
+static void free_graph(connection *c)
+{
+    struct { void *ptr; int kind; } *todo = malloc(4096 * sizeof(*todo));
+    void **seen = malloc(4096 * sizeof(void *));
+    int ntodo = 0, nseen = 0, i;
+    serv_asset *sa;
+    os_asset *oa;
+    asset *a;
+
+#define VISIT(p, k) do { if ((p) != NULL) { todo[ntodo].ptr = (p); \
+                         todo[ntodo++].kind = (k); } } while (0)
+    VISIT(c->c_asset, 0);
+    VISIT(c->s_asset, 0);
+    while (ntodo > 0) {
+        void *ptr = todo[--ntodo].ptr;
+        int kind = todo[ntodo].kind;
+        for (i = 0; i < nseen && seen[i] != ptr; i++)
+            ;
+        if (i < nseen)
+            continue;
+        seen[nseen++] = ptr;
+        if (kind == 0) {
+            a = ptr;
+            VISIT(a->services, 1);
+            VISIT(a->os, 2);
+        } else if (kind == 1) {
+            sa = ptr;
+            VISIT(sa->prev, 1);
+            VISIT(sa->next, 1);
+            bdestroy(sa->service);
+            bdestroy(sa->application);
+        } else {
+            oa = ptr;
+            VISIT(oa->prev, 2);
+            VISIT(oa->next, 2);
+            bdestroy(oa->vendor);
+            bdestroy(oa->os);
+            bdestroy(oa->raw_fp);
+            bdestroy(oa->matched_fp);
+            free(oa->match_os);
+            free(oa->match_desc);
+        }
+    }
+#undef VISIT
+    for (i = 0; i < nseen; i++)
+        free(seen[i]);
+    free(seen);
+    free(todo);
+    free(c);
+}
+
+static int same_bstr(bstring a, bstring b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return a->slen == b->slen && memcmp(a->data, b->data, a->slen) == 0;
+}
+
+static int same_str(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* the fields the translators carry, and the shape of the lists */
+static const char *diff_asset(asset *a, asset *b)
+{
+    serv_asset *sa, *sb;
+    os_asset *oa, *ob;
+
+    if (a == NULL || b == NULL)
+        return a == b ? NULL : "asset missing";
+    if (a->first_seen != b->first_seen || a->last_seen != b->last_seen
+        || a->i_attempts != b->i_attempts || a->af != b->af
+        || a->vlan != b->vlan
+        || a->ip_addr.s6_addr32[0] != b->ip_addr.s6_addr32[0])
+        return "asset fields";
+    for (sa = a->services, sb = b->services; sa && sb;
+         sa = sa->next, sb = sb->next) {
+        if (sa->first_seen != sb->first_seen
+            || sa->last_seen != sb->last_seen
+            || sa->i_attempts != sb->i_attempts || sa->proto != sb->proto
+            || sa->port != sb->port || sa->ttl != sb->ttl
+            || sa->role != sb->role || sa->unknown != sb->unknown
+            || !same_bstr(sa->service, sb->service)
+            || !same_bstr(sa->application, sb->application))
+            return "service fields";
+        if ((sa->prev == NULL) != (sb->prev == NULL)
+            || (sb->prev != NULL && sb->prev->next != sb))
+            return "service list links";
+    }
+    if (sa != NULL || sb != NULL)
+        return "service list length";
+    for (oa = a->os, ob = b->os; oa && ob; oa = oa->next, ob = ob->next) {
+        if (oa->first_seen != ob->first_seen
+            || oa->last_seen != ob->last_seen
+            || oa->i_attempts != ob->i_attempts
+            || oa->detection != ob->detection || oa->port != ob->port
+            || oa->mtu != ob->mtu || oa->ttl != ob->ttl
+            || oa->uptime != ob->uptime
+            || !same_bstr(oa->vendor, ob->vendor)
+            || !same_bstr(oa->os, ob->os)
+            || !same_bstr(oa->raw_fp, ob->raw_fp)
+            || !same_bstr(oa->matched_fp, ob->matched_fp)
+            || !same_str(oa->match_os, ob->match_os)
+            || !same_str(oa->match_desc, ob->match_desc))
+            return "os fields";
+        if ((oa->prev == NULL) != (ob->prev == NULL)
+            || (ob->prev != NULL && ob->prev->next != ob))
+            return "os list links";
+    }
+    if (oa != NULL || ob != NULL)
+        return "os list length";
+    return NULL;
+}
+
+static const char *diff_connection(connection *a, connection *b)
+{
+    if (b == NULL)
+        return "not parsed";
+    if (a->start_time != b->start_time
+        || a->last_pkt_time != b->last_pkt_time || a->cxid != b->cxid
+        || a->reversed != b->reversed || a->af != b->af
+        || a->hw_proto != b->hw_proto || a->proto != b->proto
+        || a->s_ip.s6_addr32[0] != b->s_ip.s6_addr32[0]
+        || a->d_ip.s6_addr32[0] != b->d_ip.s6_addr32[0]
+        || a->s_port != b->s_port || a->d_port != b->d_port
+        || a->s_total_pkts != b->s_total_pkts
+        || a->s_total_bytes != b->s_total_bytes
+        || a->d_total_pkts != b->d_total_pkts
+        || a->d_total_bytes != b->d_total_bytes
+        || a->s_tcpFlags != b->s_tcpFlags || a->d_tcpFlags != b->d_tcpFlags
+        || a->check != b->check || a->gotten != b->gotten)
+        return "connection fields";
+    if ((a->c_asset == a->s_asset) != (b->c_asset == b->s_asset))
+        return "shared asset";
+    if (diff_asset(a->c_asset, b->c_asset) != NULL)
+        return diff_asset(a->c_asset, b->c_asset);
+    return diff_asset(a->s_asset, b->s_asset);
+}
+
+/* every prefix and a few hundred single-byte changes of an encoding */
+static long damage(connection *c)
+{
+    uint8_t *buf, *copy;
+    size_t len, cut;
+    connection *d;
+    long accepted = 0;
+    int i;
+
+    buf = sbin_encode(head_sbin, "connection", c, &len);
+    copy = malloc(len);
+    for (cut = 0; cut < len; cut++) {
+        memcpy(copy, buf, cut);
+        if (sbin_decode(head_sbin, "connection", copy, cut) != NULL)
+            fail("truncated encoding accepted", (int)cut);
+    }
+    for (i = 0; i < 300; i++) {
+        memcpy(copy, buf, len);
+        copy[random() % len] ^= 1 << (random() % 8);
+        d = sbin_decode(head_sbin, "connection", copy, len);
+        if (d != NULL) {
+            accepted++;
+            free_graph(d);
+        }
+    }
+    free(copy);
+    free(buf);
+    return accepted;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    connection **cxts = calloc(n, sizeof(connection *));
+    char **states = calloc(n, sizeof(char *));
+    double start, ser_out, ser_in, bin_out, bin_in;
+    size_t ser_bytes = 0, bin_bytes = 0;
+    long flipped = 0;
+    const char *diff;
+    connection *back;
+    int i, r;
+
+    srandom(1);
+    sdmbn_base64_set_version(SDMBN_BASE64_V1);
+    sdmbn_state_set_binary(1);
+    setup_serialize_translators();
+    if (head_sbin == NULL) {
+        fprintf(stderr, "translators do not compile\n");
+        return 1;
+    }
+    printf("schema: %u types, %u values, hash %08x\n", head_sbin->ntypes,
+           head_sbin->nfields, head_sbin->hash);
+    for (i = 0; i < n; i++)
+        cxts[i] = random_connection();
+
+    /* round trips, both ways, and the text path rebuilding the same */
+    for (i = 0; i < n; i++) {
+        char *state = sbin_ialize(head_sbin, head_tra, "connection", cxts[i]);
+        if (state == NULL || state[0] != '~')
+            fail("not encoded", i);
+        back = sbin_parse(head_sbin, head_tra, "connection", state);
+        if ((diff = diff_connection(cxts[i], back)) != NULL)
+            fail(diff, i);
+        free_connection(back);
+        free(state);
+
+        state = ser_ialize(head_tra, "connection", cxts[i], NULL, 0);
+        back = sbin_parse(head_sbin, head_tra, "connection", state);
+        if ((diff = diff_connection(cxts[i], back)) != NULL)
+            fail(diff, i);
+        free_connection(back);
+        free(state);
+
+        if (i < 200)
+            flipped += damage(cxts[i]);
+    }
+    printf("%d connections round trip; %ld of %d damaged encodings "
+           "decoded\n", n, flipped, 200 * 300);
+
+    start = now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < n; i++) {
+            free(states[i]);
+            states[i] = ser_ialize(head_tra, "connection", cxts[i], NULL, 0);
+        }
+    ser_out = now() - start;
+    start = now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < n; i++) {
+            if (r == 0)
+                ser_bytes += strlen(states[i]);
+            free_connection(ser_parse(head_tra, "connection", states[i],
+                                      NULL));
+        }
+    ser_in = now() - start;
+
+    start = now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < n; i++) {
+            free(states[i]);
+            states[i] = sbin_ialize(head_sbin, head_tra, "connection",
+                                    cxts[i]);
+        }
+    bin_out = now() - start;
+    start = now();
+    for (r = 0; r < rounds; r++)
+        for (i = 0; i < n; i++) {
+            if (r == 0)
+                bin_bytes += strlen(states[i]);
+            free_connection(sbin_parse(head_sbin, head_tra, "connection",
+                                       states[i]));
+        }
+    bin_in = now() - start;
+
+    printf("%-7s %10s %10s %12s\n", "", "out us", "in us", "bytes");
+    printf("%-7s %10.2f %10.2f %12.1f\n", "text",
+           ser_out * 1e6 / n / rounds, ser_in * 1e6 / n / rounds,
+           (double)ser_bytes / n);
+    printf("%-7s %10.2f %10.2f %12.1f\n", "binary",
+           bin_out * 1e6 / n / rounds, bin_in * 1e6 / n / rounds,
+           (double)bin_bytes / n);
+
+    for (i = 0; i < n; i++) {
+        free(states[i]);
+        free_connection(cxts[i]);
+    }
+    free(states);
+    free(cxts);
+    return 0;
+}
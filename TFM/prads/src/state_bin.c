@@ -0,0 +1,764 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <SDMBN.h>
+#include "prads.h"
+#include "state_bin.h"
+
+#define SBIN_MAGIC0   'P'
+#define SBIN_MAGIC1   'S'
+#define SBIN_HEADER   7                 /* magic, version, schema hash */
+
+/* sdmbn_base64 V1 output starts with '~'; ser_ialize output with the
+ * name of a type */
+#define SBIN_TEXT_MARK '~'
+
+/* the primitives serialize.c knows, resolved once by sbin_compile */
+static const struct {
+    const char *name;
+    uint8_t size;
+    uint8_t kind;
+} sbin_prims[] = {
+    { "string",   sizeof(char *),        SBIN_STRING },
+    { "bool",     sizeof(bool),          SBIN_UINT },
+    { "char",     sizeof(char),          SBIN_SINT },
+    { "short",    sizeof(short),         SBIN_SINT },
+    { "ushort",   sizeof(unsigned short), SBIN_UINT },
+    { "int",      sizeof(int),           SBIN_SINT },
+    { "uint",     sizeof(unsigned int),  SBIN_UINT },
+    { "long",     sizeof(long),          SBIN_SINT },
+    { "ulong",    sizeof(unsigned long), SBIN_UINT },
+    { "size_t",   sizeof(size_t),        SBIN_UINT },
+    { "time_t",   sizeof(time_t),        SBIN_SINT },
+    { "intptr_t", sizeof(intptr_t),      SBIN_SINT },
+    { "uint8_t",  sizeof(uint8_t),       SBIN_RAW },
+    { "uint16_t", sizeof(uint16_t),      SBIN_UINT },
+    { "uint32_t", sizeof(uint32_t),      SBIN_UINT },
+    { "int8_t",   sizeof(int8_t),        SBIN_RAW },
+    { "int16_t",  sizeof(int16_t),       SBIN_SINT },
+    { "int32_t",  sizeof(int32_t),       SBIN_SINT },
+    { "float",    sizeof(float),         SBIN_RAW },
+    { "double",   sizeof(double),        SBIN_RAW },
+    { "ldouble",  sizeof(long double),   SBIN_RAW },
+};
+#define SBIN_NPRIMS (int)(sizeof(sbin_prims) / sizeof(sbin_prims[0]))
+
+static int sbin_prim(const char *name)
+{
+    int i;
+    for (i = 0; i < SBIN_NPRIMS; i++)
+        if (strcmp(sbin_prims[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+static int sbin_tra_index(ser_tra_t *first, const char *id)
+{
+    int i;
+    for (i = 0; first != NULL; first = first->next, i++)
+        if (strcmp(first->id, id) == 0)
+            return i;
+    return -1;
+}
+
+static ser_tra_t *sbin_tra(ser_tra_t *first, int index)
+{
+    while (index-- > 0)
+        first = first->next;
+    return first;
+}
+
+/* appends a value to the type being compiled, joining runs of raw bytes */
+static int sbin_add(sbin_schema *s, uint32_t first, uint32_t offset,
+                    uint16_t size, uint8_t kind, uint16_t type)
+{
+    sbin_field *f;
+
+    if (kind == SBIN_RAW && s->nfields > first) {
+        f = &s->fields[s->nfields - 1];
+        if (f->kind == SBIN_RAW && f->offset + f->size == offset
+            && f->size + size <= UINT16_MAX) {
+            f->size += size;
+            return 0;
+        }
+    }
+    if ((s->nfields & (s->nfields + 1)) == 0) {
+        f = realloc(s->fields, (s->nfields * 2 + 1) * sizeof(sbin_field));
+        if (f == NULL)
+            return -1;
+        s->fields = f;
+    }
+    f = &s->fields[s->nfields++];
+    f->offset = offset;
+    f->size = size;
+    f->kind = kind;
+    f->type = type;
+    return 0;
+}
+
+/* adds the fields of 'tra', placed at 'base', inlining embedded
+ * structures; only what serialize.c can describe without custom code */
+static int sbin_flatten(sbin_schema *s, ser_tra_t *first, uint32_t start,
+                        ser_tra_t *tra, uint32_t base, int depth)
+{
+    ser_field_t *field;
+    ser_tra_t *inner;
+    uint32_t offset;
+    size_t r;
+    int p, t;
+
+    if (tra->atype != ser_flat || tra->custom != NULL
+        || depth > SBIN_MAX_DEPTH)
+        return -1;
+    for (field = tra->first_field; field != NULL; field = field->next) {
+        p = sbin_prim(field->type);
+        t = sbin_tra_index(first, field->type);
+        for (r = 0; r < field->repeat; r++) {
+            if (field->ref) {
+                /* pointers to structures only */
+                if (p >= 0 || t < 0)
+                    return -1;
+                offset = base + field->offset + r * sizeof(void *);
+                if (sbin_add(s, start, offset, sizeof(void *),
+                             strcmp(field->type, "tagstr") == 0
+                             ? SBIN_BSTRING : SBIN_REF, t) < 0)
+                    return -1;
+            } else if (p >= 0) {
+                offset = base + field->offset + r * sbin_prims[p].size;
+                if (sbin_add(s, start, offset, sbin_prims[p].size,
+                             sbin_prims[p].kind, 0) < 0)
+                    return -1;
+            } else {
+                if (t < 0)
+                    return -1;
+                inner = sbin_tra(first, t);
+                offset = base + field->offset + r * inner->size;
+                if (sbin_flatten(s, first, start, inner, offset,
+                                 depth + 1) < 0)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static uint32_t sbin_fnv(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len--)
+        h = (h ^ *p++) * 16777619;
+    return h;
+}
+
+sbin_schema *sbin_compile(ser_tra_t *first)
+{
+    sbin_schema *s;
+    ser_tra_t *tra;
+    sbin_field *f;
+    uint32_t i, j;
+
+    s = calloc(1, sizeof(sbin_schema));
+    if (s == NULL)
+        return NULL;
+    for (tra = first; tra != NULL; tra = tra->next)
+        s->ntypes++;
+    s->types = calloc(s->ntypes ? s->ntypes : 1, sizeof(sbin_type));
+    if (s->types == NULL || s->ntypes > UINT16_MAX)
+        goto fail;
+
+    s->hash = 2166136261u;
+    for (i = 0, tra = first; tra != NULL; tra = tra->next, i++) {
+        s->types[i].id = tra->id;
+        s->types[i].size = tra->size;
+        s->types[i].first = s->nfields;
+        if (sbin_flatten(s, first, s->nfields, tra, 0, 0) < 0)
+            goto fail;
+        s->types[i].nfields = s->nfields - s->types[i].first;
+
+        /* both ends must lay the values out alike */
+        s->hash = sbin_fnv(s->hash, tra->id, strlen(tra->id) + 1);
+        for (j = s->types[i].first; j < s->nfields; j++) {
+            f = &s->fields[j];
+            s->hash = sbin_fnv(s->hash, &f->size, sizeof(f->size));
+            s->hash = sbin_fnv(s->hash, &f->kind, sizeof(f->kind));
+            s->hash = sbin_fnv(s->hash, &f->type, sizeof(f->type));
+        }
+    }
+    return s;
+
+fail:
+    sbin_free(s);
+    return NULL;
+}
+
+void sbin_free(sbin_schema *s)
+{
+    if (s == NULL)
+        return;
+    free(s->types);
+    free(s->fields);
+    free(s);
+}
+
+///// Encoding ////////////////////////////////////////////////////////////
+
+typedef struct _sbin_buf {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    int failed;
+} sbin_buf;
+
+typedef struct _sbin_obj {
+    void *ptr;
+    uint32_t type;
+} sbin_obj;
+
+typedef struct _sbin_objs {
+    sbin_obj *obj;
+    uint32_t n;
+    uint32_t size;
+} sbin_objs;
+
+static uint8_t *sbin_room(sbin_buf *b, size_t n)
+{
+    uint8_t *data;
+    size_t size;
+
+    if (b->len + n > b->size) {
+        size = b->size * 2;
+        while (size < b->len + n)
+            size *= 2;
+        data = realloc(b->data, size);
+        if (data == NULL) {
+            b->failed = 1;
+            return NULL;
+        }
+        b->data = data;
+        b->size = size;
+    }
+    return b->data + b->len;
+}
+
+static void sbin_put_varint(sbin_buf *b, uint64_t v)
+{
+    uint8_t *p = sbin_room(b, 10);
+
+    if (p == NULL)
+        return;
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    b->len = p - b->data;
+}
+
+static void sbin_put_bytes(sbin_buf *b, const void *data, size_t n)
+{
+    uint8_t *p = sbin_room(b, n);
+
+    if (p == NULL)
+        return;
+    memcpy(p, data, n);
+    b->len += n;
+}
+
+static uint64_t sbin_load(const uint8_t *p, int size)
+{
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    switch (size) {
+    case 1: memcpy(&v8, p, 1); return v8;
+    case 2: memcpy(&v16, p, 2); return v16;
+    case 4: memcpy(&v32, p, 4); return v32;
+    default: memcpy(&v64, p, 8); return v64;
+    }
+}
+
+static void sbin_store(uint8_t *p, int size, uint64_t v)
+{
+    uint8_t v8 = v;
+    uint16_t v16 = v;
+    uint32_t v32 = v;
+
+    switch (size) {
+    case 1: memcpy(p, &v8, 1); break;
+    case 2: memcpy(p, &v16, 2); break;
+    case 4: memcpy(p, &v32, 4); break;
+    default: memcpy(p, &v, 8); break;
+    }
+}
+
+static int64_t sbin_extend(uint64_t v, int size)
+{
+    int shift = 64 - size * 8;
+    return shift ? (int64_t)(v << shift) >> shift : (int64_t)v;
+}
+
+/* index + 1 of a structure, added to the list when first seen; the lists
+ * are a handful of structures, so a linear search does */
+static uint32_t sbin_ref(sbin_objs *o, void *ptr, uint32_t type)
+{
+    sbin_obj *obj;
+    uint32_t i;
+
+    if (ptr == NULL)
+        return 0;
+    for (i = 0; i < o->n; i++) {
+        if (o->obj[i].ptr == ptr)
+            return o->obj[i].type == type ? i + 1 : UINT32_MAX;
+    }
+    if (o->n == o->size) {
+        obj = realloc(o->obj, (o->size * 2 + 4) * sizeof(sbin_obj));
+        if (obj == NULL)
+            return UINT32_MAX;
+        o->obj = obj;
+        o->size = o->size * 2 + 4;
+    }
+    o->obj[o->n].ptr = ptr;
+    o->obj[o->n].type = type;
+    return ++o->n;
+}
+
+static int sbin_put_struct(sbin_schema *s, sbin_buf *b, sbin_objs *o,
+                           const uint8_t *thing, sbin_type *type)
+{
+    sbin_field *f, *end;
+    const char *str;
+    const tagstr *bstr;
+    void *ptr;
+    uint64_t v;
+    uint32_t ref;
+
+    end = &s->fields[type->first + type->nfields];
+    for (f = &s->fields[type->first]; f < end; f++) {
+        switch (f->kind) {
+        case SBIN_UINT:
+            sbin_put_varint(b, sbin_load(thing + f->offset, f->size));
+            break;
+        case SBIN_SINT:
+            v = sbin_extend(sbin_load(thing + f->offset, f->size), f->size);
+            sbin_put_varint(b, (v << 1) ^ (uint64_t)((int64_t)v >> 63));
+            break;
+        case SBIN_RAW:
+            sbin_put_bytes(b, thing + f->offset, f->size);
+            break;
+        case SBIN_STRING:
+            memcpy(&str, thing + f->offset, sizeof(str));
+            if (str == NULL) {
+                sbin_put_varint(b, 0);
+            } else {
+                v = strlen(str);
+                sbin_put_varint(b, v + 1);
+                sbin_put_bytes(b, str, v);
+            }
+            break;
+        case SBIN_BSTRING:
+            memcpy(&bstr, thing + f->offset, sizeof(bstr));
+            if (bstr == NULL || bstr->data == NULL || bstr->slen < 0) {
+                sbin_put_varint(b, 0);
+            } else {
+                sbin_put_varint(b, (uint64_t)bstr->slen + 1);
+                sbin_put_bytes(b, bstr->data, bstr->slen);
+            }
+            break;
+        case SBIN_REF:
+            memcpy(&ptr, thing + f->offset, sizeof(ptr));
+            ref = sbin_ref(o, ptr, f->type);
+            if (ref == UINT32_MAX)
+                return -1;
+            sbin_put_varint(b, ref);
+            break;
+        }
+    }
+    return b->failed ? -1 : 0;
+}
+
+/* encodes 'thing' and every structure it reaches; NULL if the graph does
+ * not fit the schema (a structure reached as two types) */
+uint8_t *sbin_encode(sbin_schema *s, const char *type, void *thing,
+                     size_t *len)
+{
+    sbin_buf body = { NULL, 0, 0, 0 }, b = { NULL, 0, 0, 0 };
+    sbin_objs o = { NULL, 0, 0 };
+    uint32_t i;
+    int root;
+
+    root = -1;
+    for (i = 0; i < s->ntypes; i++)
+        if (strcmp(s->types[i].id, type) == 0)
+            root = i;
+    if (root < 0 || thing == NULL)
+        return NULL;
+
+    /* values first, which finds the structures to list in the header */
+    body.size = 256;
+    body.data = malloc(body.size);
+    if (body.data == NULL)
+        return NULL;
+    sbin_ref(&o, thing, root);
+    for (i = 0; i < o.n; i++) {
+        if (sbin_put_struct(s, &body, &o, o.obj[i].ptr,
+                            &s->types[o.obj[i].type]) < 0) {
+            free(body.data);
+            free(o.obj);
+            return NULL;
+        }
+    }
+
+    b.size = SBIN_HEADER + 10 + 5 * o.n + body.len;
+    b.data = malloc(b.size);
+    if (b.data != NULL) {
+        b.data[0] = SBIN_MAGIC0;
+        b.data[1] = SBIN_MAGIC1;
+        b.data[2] = SBIN_VERSION;
+        memcpy(b.data + 3, &s->hash, sizeof(s->hash));
+        b.len = SBIN_HEADER;
+        sbin_put_varint(&b, root);
+        sbin_put_varint(&b, o.n);
+        for (i = 1; i < o.n; i++)
+            sbin_put_varint(&b, o.obj[i].type);
+        sbin_put_bytes(&b, body.data, body.len);
+        if (b.failed) {
+            free(b.data);
+            b.data = NULL;
+        }
+    }
+    free(body.data);
+    free(o.obj);
+    *len = b.len;
+    return b.data;
+}
+
+///// Decoding ////////////////////////////////////////////////////////////
+
+typedef struct _sbin_reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    int failed;
+} sbin_reader;
+
+static uint64_t sbin_get_varint(sbin_reader *r)
+{
+    uint64_t v = 0;
+    int shift;
+
+    for (shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        v |= (uint64_t)(*r->p & 0x7F) << shift;
+        if (!(*r->p++ & 0x80))
+            return v;
+    }
+    r->failed = 1;
+    return 0;
+}
+
+static const uint8_t *sbin_get_bytes(sbin_reader *r, uint64_t n)
+{
+    const uint8_t *p = r->p;
+
+    if (n > (uint64_t)(r->end - r->p)) {
+        r->failed = 1;
+        return NULL;
+    }
+    r->p += n;
+    return p;
+}
+
+/* frees what a failed decode allocated: strings, then the structures */
+static void sbin_discard(sbin_schema *s, void **obj, uint32_t *types,
+                         uint32_t n)
+{
+    sbin_field *f, *end;
+    sbin_type *type;
+    void *ptr;
+    uint32_t i;
+
+    for (i = 0; i < n && obj[i] != NULL; i++) {
+        type = &s->types[types[i]];
+        end = &s->fields[type->first + type->nfields];
+        for (f = &s->fields[type->first]; f < end; f++) {
+            if (f->kind != SBIN_STRING && f->kind != SBIN_BSTRING)
+                continue;
+            memcpy(&ptr, (uint8_t *)obj[i] + f->offset, sizeof(ptr));
+            if (f->kind == SBIN_STRING)
+                free(ptr);
+            else
+                bdestroy(ptr);
+        }
+        free(obj[i]);
+    }
+}
+
+/* 'reached' counts the structures referenced so far; the encoder lists
+ * them in the order it first meets them, so anything else, which could
+ * leave one unreachable, is refused */
+static int sbin_get_struct(sbin_schema *s, sbin_reader *r, void **obj,
+                           uint32_t *types, uint32_t n, uint32_t *reached,
+                           uint8_t *thing, sbin_type *type)
+{
+    sbin_field *f, *end;
+    const uint8_t *data;
+    uint64_t v;
+    int64_t sv;
+    void *ptr;
+
+    end = &s->fields[type->first + type->nfields];
+    for (f = &s->fields[type->first]; f < end && !r->failed; f++) {
+        switch (f->kind) {
+        case SBIN_UINT:
+            v = sbin_get_varint(r);
+            if (f->size < 8 && v >> (f->size * 8))
+                return -1;
+            sbin_store(thing + f->offset, f->size, v);
+            break;
+        case SBIN_SINT:
+            v = sbin_get_varint(r);
+            sv = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+            if (sbin_extend(sv, f->size) != sv)
+                return -1;
+            sbin_store(thing + f->offset, f->size, sv);
+            break;
+        case SBIN_RAW:
+            data = sbin_get_bytes(r, f->size);
+            if (data != NULL)
+                memcpy(thing + f->offset, data, f->size);
+            break;
+        case SBIN_STRING:
+        case SBIN_BSTRING:
+            v = sbin_get_varint(r);
+            if (v == 0 || r->failed)
+                break;
+            data = sbin_get_bytes(r, v - 1);
+            if (data == NULL || v - 1 > INT32_MAX)
+                return -1;
+            if (f->kind == SBIN_BSTRING) {
+                ptr = blk2bstr(data, v - 1);
+            } else {
+                ptr = malloc(v);
+                if (ptr != NULL) {
+                    memcpy(ptr, data, v - 1);
+                    ((char *)ptr)[v - 1] = '\0';
+                }
+            }
+            if (ptr == NULL)
+                return -1;
+            memcpy(thing + f->offset, &ptr, sizeof(ptr));
+            break;
+        case SBIN_REF:
+            v = sbin_get_varint(r);
+            if (v == 0)
+                break;
+            if (v > n || v > *reached + 1 || types[v - 1] != f->type)
+                return -1;
+            if (v == *reached + 1)
+                (*reached)++;
+            memcpy(thing + f->offset, &obj[v - 1], sizeof(void *));
+            break;
+        }
+    }
+    return r->failed ? -1 : 0;
+}
+
+/* rebuilds what sbin_encode wrote, as freshly allocated structures; NULL
+ * if it is malformed, of another type or from another schema */
+void *sbin_decode(sbin_schema *s, const char *type, const uint8_t *buf,
+                  size_t len)
+{
+    sbin_reader r = { buf + SBIN_HEADER, buf + len, 0 };
+    uint32_t *types = NULL, hash, i, reached = 1;
+    void **obj = NULL, *root;
+    uint64_t n, t;
+
+    if (len < SBIN_HEADER || buf[0] != SBIN_MAGIC0 || buf[1] != SBIN_MAGIC1
+        || buf[2] != SBIN_VERSION)
+        return NULL;
+    memcpy(&hash, buf + 3, sizeof(hash));
+    if (hash != s->hash)
+        return NULL;
+
+    /* every structure after the root takes at least its type byte */
+    t = sbin_get_varint(&r);
+    n = sbin_get_varint(&r);
+    if (r.failed || t >= s->ntypes || strcmp(s->types[t].id, type) != 0
+        || n == 0 || n - 1 > (uint64_t)(r.end - r.p))
+        return NULL;
+    types = malloc(n * sizeof(uint32_t));
+    obj = calloc(n, sizeof(void *));
+    if (types == NULL || obj == NULL)
+        goto fail;
+    types[0] = t;
+    for (i = 1; i < n; i++) {
+        t = sbin_get_varint(&r);
+        if (r.failed || t >= s->ntypes)
+            goto fail;
+        types[i] = t;
+    }
+    for (i = 0; i < n; i++) {
+        obj[i] = calloc(1, s->types[types[i]].size);
+        if (obj[i] == NULL)
+            goto fail;
+    }
+    for (i = 0; i < n; i++)
+        if (i >= reached
+            || sbin_get_struct(s, &r, obj, types, n, &reached, obj[i],
+                               &s->types[types[i]]) < 0)
+            goto fail;
+    if (r.p != r.end || reached != n)
+        goto fail;
+
+    root = obj[0];
+    free(types);
+    free(obj);
+    return root;
+
+fail:
+    if (obj != NULL)
+        sbin_discard(s, obj, types, n);
+    free(types);
+    free(obj);
+    return NULL;
+}
+
+///// SDMBN state /////////////////////////////////////////////////////////
+
+char *sbin_ialize(sbin_schema *s, ser_tra_t *tra, char *type, void *thing)
+{
+    uint8_t *buf;
+    size_t len;
+    char *state;
+
+    /* text for peers that did not agree on the binary encoding */
+    if (s != NULL && sdmbn_state_binary()) {
+        buf = sbin_encode(s, type, thing, &len);
+        if (buf != NULL) {
+            state = sdmbn_base64_encode(buf, len);
+            free(buf);
+            if (state != NULL)
+                return state;
+        }
+    }
+    return ser_ialize(tra, type, thing, NULL, 0);
+}
+
+void *sbin_parse(sbin_schema *s, ser_tra_t *tra, const char *type,
+                 char *state)
+{
+    uint8_t *buf;
+    void *thing;
+    int len;
+
+    if (state[0] != SBIN_TEXT_MARK)
+        return ser_parse(tra, type, state, NULL);
+    if (s == NULL)
+        return NULL;
+    buf = sdmbn_base64_decode_len(state, &len);
+    if (buf == NULL)
+        return NULL;
+    thing = sbin_decode(s, type, buf, len);
+    free(buf);
+    return thing;
+}
+
+///// PRADS translators ///////////////////////////////////////////////////
+
+ser_tra_t* setup_serialize_translators()
+{
+
+    // printf("[Debug]: Setting up serializer translator/n");
+    ser_tra_t *tra1, *tra2, *tra3, *tra4;
+    ser_field_t * field;
+
+    // translator for connection
+    head_tra = ser_new_tra("connection",sizeof(connection),NULL);
+    ser_new_field(head_tra,"time_t",0,"start_time",offsetof(connection,start_time));
+    ser_new_field(head_tra,"time_t",0,"last_pkt_time",offsetof(connection,last_pkt_time));
+    ser_new_field(head_tra,"uint32_t",0,"cxid",offsetof(connection,cxid));
+    ser_new_field(head_tra,"uint8_t",0,"reversed",offsetof(connection,reversed));
+    ser_new_field(head_tra,"uint32_t",0,"af",offsetof(connection,af));
+    ser_new_field(head_tra,"uint16_t",0,"hw_proto",offsetof(connection,hw_proto));
+    ser_new_field(head_tra,"uint8_t",0,"proto",offsetof(connection,proto));
+    ser_new_field(head_tra,"in6",0,"s_ip",offsetof(connection,s_ip));
+    ser_new_field(head_tra,"in6",0,"d_ip",offsetof(connection,d_ip));
+    ser_new_field(head_tra,"uint16_t",0,"s_port",offsetof(connection,s_port));
+    ser_new_field(head_tra,"uint16_t",0,"d_port",offsetof(connection,d_port));
+    ser_new_field(head_tra,"uint32_t",0,"s_total_pkts",offsetof(connection,s_total_pkts));
+    ser_new_field(head_tra,"uint32_t",0,"s_total_bytes",offsetof(connection,s_total_bytes));
+    ser_new_field(head_tra,"uint32_t",0,"d_total_pkts",offsetof(connection,d_total_pkts));
+    ser_new_field(head_tra,"uint32_t",0,"d_total_bytes",offsetof(connection,d_total_bytes));
+    ser_new_field(head_tra,"uint8_t",0,"s_tcpFlags",offsetof(connection,s_tcpFlags));
+    ser_new_field(head_tra,"uint8_t",0,"__pad__",offsetof(connection,__pad__));
+    ser_new_field(head_tra,"uint8_t",0,"d_tcpFlags",offsetof(connection,d_tcpFlags));
+    ser_new_field(head_tra,"uint8_t",0,"check",offsetof(connection,check));
+    ser_new_field(head_tra,"asset",1,"c_asset",offsetof(connection,c_asset));
+    ser_new_field(head_tra,"asset",1,"s_asset",offsetof(connection,s_asset));
+    ser_new_field(head_tra,"uint32_t",0,"gotten",offsetof(connection,gotten));
+
+    // translator for asset
+    tra0 = ser_new_tra("asset",sizeof(asset),head_tra);
+    //ser_new_field(tra0,"asset",1,"prev",offsetof(asset,prev));
+    ser_new_field(tra0,"time_t",0,"first_seen",offsetof(asset,first_seen));
+    ser_new_field(tra0,"time_t",0,"last_seen",offsetof(asset,last_seen));
+    ser_new_field(tra0,"ushort",0,"i_attempts",offsetof(asset,i_attempts));
+    ser_new_field(tra0,"int",0,"af",offsetof(asset,af));
+    ser_new_field(tra0,"uint16_t",0,"vlan",offsetof(asset,vlan));
+    ser_new_field(tra0,"in6",0,"ip_addr",offsetof(asset,ip_addr));
+    ser_new_field(tra0,"serv_asset",1,"services",offsetof(asset,services));
+    ser_new_field(tra0,"os_asset",1,"os",offsetof(asset,os));
+
+    // translator for bstring
+    tra1 = ser_new_tra("tagstr",sizeof(tagstr),tra0);
+    ser_new_field(tra1,"int",0,"mlen",offsetof(tagstr,mlen));
+    ser_new_field(tra1,"int",0,"slen",offsetof(tagstr,slen));
+    ser_new_field(tra1,"string",0,"data",offsetof(tagstr,data));
+
+    // translator for serv_asset
+    tra2 = ser_new_tra("serv_asset",sizeof(serv_asset),tra1);
+    ser_new_field(tra2,"serv_asset",1,"prev",offsetof(serv_asset,prev));
+    ser_new_field(tra2,"serv_asset",1,"next",offsetof(serv_asset,next));
+    ser_new_field(tra2,"time_t",0,"first_seen",offsetof(serv_asset,first_seen));
+    ser_new_field(tra2,"time_t",0,"last_seen",offsetof(serv_asset,last_seen));
+    ser_new_field(tra2,"ushort",0,"i_attempts",offsetof(serv_asset,i_attempts));
+    ser_new_field(tra2,"ushort",0,"proto",offsetof(serv_asset,proto));
+    ser_new_field(tra2,"uint16_t",0,"port",offsetof(serv_asset,port));
+    ser_new_field(tra2,"uint8_t",0,"ttl",offsetof(serv_asset,ttl));
+    ser_new_field(tra2,"tagstr",1,"service",offsetof(serv_asset,service));
+    ser_new_field(tra2,"tagstr",1,"application",offsetof(serv_asset,application));
+    ser_new_field(tra2,"int",0,"role",offsetof(serv_asset,role));
+    ser_new_field(tra2,"int",0,"unknown",offsetof(serv_asset,unknown));
+
+    // translator for os_asset
+    tra3 = ser_new_tra("os_asset",sizeof(os_asset),tra2);
+    ser_new_field(tra3,"os_asset",1,"prev",offsetof(os_asset,prev));
+    ser_new_field(tra3,"os_asset",1,"next",offsetof(os_asset,next));
+    ser_new_field(tra3,"time_t",0,"first_seen",offsetof(os_asset,first_seen));
+    ser_new_field(tra3,"time_t",0,"last_seen",offsetof(os_asset,last_seen));
+    ser_new_field(tra3,"ushort",0,"i_attempts",offsetof(os_asset,i_attempts));
+    ser_new_field(tra3,"tagstr",1,"vendor",offsetof(os_asset,vendor));
+    ser_new_field(tra3,"tagstr",1,"os",offsetof(os_asset,os));
+    ser_new_field(tra3,"uint8_t",0,"detection",offsetof(os_asset,detection));
+    ser_new_field(tra3,"tagstr",1,"raw_fp",offsetof(os_asset,raw_fp));
+    ser_new_field(tra3,"tagstr",1,"matched_fp",offsetof(os_asset,matched_fp));
+    ser_new_field(tra3,"string",0,"match_os",offsetof(os_asset,match_os));
+    ser_new_field(tra3,"string",0,"match_desc",offsetof(os_asset,match_desc));
+    ser_new_field(tra3,"int16_t",0,"port",offsetof(os_asset,port));
+    ser_new_field(tra3,"int16_t",0,"mtu",offsetof(os_asset,mtu));
+    ser_new_field(tra3,"int8_t",0,"ttl",offsetof(os_asset,ttl));
+    ser_new_field(tra3,"int32_t",0,"uptime",offsetof(os_asset,uptime));
+
+    //translator for in6_addr
+    tra4 = ser_new_tra("in6", sizeof(uint8_t) * 4, tra3);
+    field = ser_new_field(tra4, "uint8_t", 0, "value", 0);
+    field->repeat = 4;
+    // #ifdef SER_DEBUG
+    //   ser_tra_list(tra0);
+    //#endif
+
+    // and the same, compiled for the binary encoding
+    head_sbin = sbin_compile(head_tra);
+    return head_tra;
+}
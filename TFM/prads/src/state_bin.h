@@ -0,0 +1,71 @@
+#ifndef STATE_BIN_H
+#define STATE_BIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "serialize.h"
+
+/* Binary encoding of the structures described by the serialize.c
+ * translators.  sbin_compile turns the translators into flat tables once:
+ * per type, the offset, size and kind of every value, with embedded
+ * structures inlined and primitive type names resolved.  Encoding then
+ * walks those tables instead of comparing type names.
+ *
+ * An encoding is a header (magic, version and a hash of the schema, so
+ * peers with different translators refuse each other's state), the root
+ * type, the number of structures and the type of each one after the root,
+ * then the values of every structure in turn.  Integers are varints,
+ * signed ones zigzagged; pointers to structures are indices into the
+ * list, 0 for NULL, so shared and circular references survive; strings
+ * and bstrings are a length + 1 (0 for NULL) and their bytes.
+ *
+ * sbin_ialize and sbin_parse carry an encoding as base64 text like the
+ * other SDMBN state.  sbin_ialize writes ser_ialize text instead unless it
+ * has a schema and sdmbn_state_binary says the peers agreed on binary
+ * state; sbin_parse hands such text to ser_parse. */
+
+#define SBIN_VERSION      1
+#define SBIN_MAX_DEPTH    8       /* nesting of embedded structures */
+
+enum {
+    SBIN_UINT,                    /* unsigned varint */
+    SBIN_SINT,                    /* zigzag varint */
+    SBIN_RAW,                     /* bytes as stored */
+    SBIN_STRING,                  /* char *, NUL terminated */
+    SBIN_BSTRING,                 /* bstring (the "tagstr" translator) */
+    SBIN_REF                      /* pointer to a structure */
+};
+
+typedef struct _sbin_field {
+    uint32_t offset;
+    uint16_t size;                /* of the value; of the run for SBIN_RAW */
+    uint8_t kind;
+    uint16_t type;                /* SBIN_REF: index of the target type */
+} sbin_field;
+
+typedef struct _sbin_type {
+    const char *id;
+    size_t size;
+    uint32_t first;               /* its fields in schema->fields */
+    uint32_t nfields;
+} sbin_type;
+
+typedef struct _sbin_schema {
+    sbin_type *types;
+    uint32_t ntypes;
+    sbin_field *fields;
+    uint32_t nfields;
+    uint32_t hash;
+} sbin_schema;
+
+sbin_schema *sbin_compile(ser_tra_t *first);
+void sbin_free(sbin_schema *s);
+uint8_t *sbin_encode(sbin_schema *s, const char *type, void *thing,
+                     size_t *len);
+void *sbin_decode(sbin_schema *s, const char *type, const uint8_t *buf,
+                  size_t len);
+char *sbin_ialize(sbin_schema *s, ser_tra_t *tra, char *type, void *thing);
+void *sbin_parse(sbin_schema *s, ser_tra_t *tra, const char *type,
+                 char *state);
+
+#endif // STATE_BIN_H
@@ -0,0 +1,469 @@
+#include "SDMBN.h"
+#include "SDMBNDebug.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BASE64_X86
+#include <immintrin.h>
+#endif
+
+// Two encodings share sdmbn_base64_encode/decode:
+//   SDMBN_BASE64_LEGACY  two characters per byte, one per nibble, drawn from
+//                        'A'..'P'; what every peer understands
+//   SDMBN_BASE64_V1      RFC 4648 base64 with padding, prefixed with
+//                        BASE64_V1_PREFIX
+// The prefix cannot occur in legacy output, so the decoder tells the two
+// apart by looking at the string and always accepts both.  The encoder
+// writes whichever sdmbn_base64_set_version selected.
+
+///// DEFINES ////////////////////////////////////////////////////////////////
+#define BASE64_V1_PREFIX        "~1"
+#define BASE64_V1_PREFIX_LEN    2
+#define BASE64_INVALID          0xFF
+// Vector decoders store 16 or 32 bytes to produce 12 or 24
+#define BASE64_DECODE_SLACK     8
+
+///// GLOBALS ////////////////////////////////////////////////////////////////
+static int base64_version = SDMBN_BASE64_LEGACY;
+
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint8_t base64_reverse[256];
+
+// Fast paths picked once for the CPU we run on
+static size_t (*base64_encode_fast)(const uint8_t *, size_t, char *);
+static size_t (*base64_decode_fast)(const char *, size_t, uint8_t *);
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+///// SCALAR /////////////////////////////////////////////////////////////////
+// Encode whole 3-byte groups; returns the number of input bytes consumed
+static size_t base64_encode_scalar(const uint8_t *in, size_t len, char *out)
+{
+    size_t i;
+    for (i = 0; i + 3 <= len; i += 3)
+    {
+        uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *out++ = base64_alphabet[(v >> 18) & 0x3F];
+        *out++ = base64_alphabet[(v >> 12) & 0x3F];
+        *out++ = base64_alphabet[(v >> 6) & 0x3F];
+        *out++ = base64_alphabet[v & 0x3F];
+    }
+    return i;
+}
+
+// Decode whole 4-character groups without padding; returns the number of
+// characters consumed, stopping early at the first invalid character
+static size_t base64_decode_scalar(const char *in, size_t len, uint8_t *out)
+{
+    size_t i;
+    for (i = 0; i + 4 <= len; i += 4)
+    {
+        uint8_t a = base64_reverse[(uint8_t)in[i]];
+        uint8_t b = base64_reverse[(uint8_t)in[i + 1]];
+        uint8_t c = base64_reverse[(uint8_t)in[i + 2]];
+        uint8_t d = base64_reverse[(uint8_t)in[i + 3]];
+        // Valid values fit in 6 bits; BASE64_INVALID does not
+        if ((a | b | c | d) & 0xC0)
+        { break; }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        *out++ = v >> 16;
+        *out++ = v >> 8;
+        *out++ = v;
+    }
+    return i;
+}
+
+#ifdef BASE64_X86
+///// SSSE3 //////////////////////////////////////////////////////////////////
+// Split 12 bytes into 16 6-bit indices, one per byte lane
+__attribute__((target("ssse3")))
+static inline __m128i base64_sse_split(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+// Map indices to characters by adding a per-range offset
+__attribute__((target("ssse3")))
+static inline __m128i base64_sse_lookup(__m128i idx)
+{
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const uint8_t *in, size_t len, char *out)
+{
+    size_t i = 0;
+    // Each step reads 16 bytes but consumes 12
+    for (; i + 16 <= len; i += 12, out += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)out,
+                base64_sse_lookup(base64_sse_split(v)));
+    }
+    return i + base64_encode_scalar(in + i, len - i, out);
+}
+
+// Translate 16 characters to 6-bit values; returns 0 if any is invalid
+__attribute__((target("ssse3")))
+static inline int base64_sse_translate(__m128i in, __m128i *values)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+            0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+            0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+            0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), mask);
+    __m128i lo = _mm_and_si128(in, mask);
+    __m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+            _mm_shuffle_epi8(lut_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(bad, _mm_setzero_si128())) != 0)
+    { return 0; }
+
+    __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2F));
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi));
+    *values = _mm_add_epi8(in, roll);
+    return 1;
+}
+
+// Pack 16 6-bit values into 12 bytes at the start of the register
+__attribute__((target("ssse3")))
+static inline __m128i base64_sse_pack(__m128i values)
+{
+    __m128i ab = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i abc = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(abc, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const char *in, size_t len, uint8_t *out)
+{
+    size_t i = 0;
+    // Leave the last group, which may be padded, to the scalar code
+    for (; i + 16 + 4 <= len; i += 16, out += 12)
+    {
+        __m128i values;
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        if (!base64_sse_translate(v, &values))
+        { break; }
+        _mm_storeu_si128((__m128i *)out, base64_sse_pack(values));
+    }
+    return i + base64_decode_scalar(in + i, len - i, out);
+}
+
+///// AVX2 ///////////////////////////////////////////////////////////////////
+// Same steps as SSSE3, on two lanes of 12 bytes / 16 characters at once
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(const uint8_t *in, size_t len, char *out)
+{
+    const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+            4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7, 8, 6, 7,
+            4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+            '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    // Each step reads 28 bytes but consumes 24
+    for (; i + 28 <= len; i += 24, out += 32)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(in + i + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),
+                hi, 1);
+        v = _mm256_shuffle_epi8(v, shuf);
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t1, t3);
+
+        __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+        r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx);
+        _mm256_storeu_si256((__m256i *)out, r);
+    }
+    return i + base64_encode_ssse3(in + i, len - i, out);
+}
+
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(const char *in, size_t len, uint8_t *out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+            0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13,
+            0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+            0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10,
+            0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+            -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4, -65, -65, -71, -71,
+            0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+            14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+            14, 13, 12, -1, -1, -1, -1);
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    // Leave the last group, which may be padded, to the narrower code
+    for (; i + 32 + 4 <= len; i += 32, out += 24)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask);
+        __m256i lo = _mm256_and_si256(v, mask);
+        __m256i bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+                _mm256_shuffle_epi8(lut_hi, hi));
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(bad,
+                        _mm256_setzero_si256())) != 0)
+        { break; }
+
+        __m256i eq_2f = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x2F));
+        __m256i roll = _mm256_shuffle_epi8(lut_roll,
+                _mm256_add_epi8(eq_2f, hi));
+        __m256i values = _mm256_add_epi8(v, roll);
+
+        __m256i ab = _mm256_maddubs_epi16(values,
+                _mm256_set1_epi32(0x01400140));
+        __m256i abc = _mm256_madd_epi16(ab, _mm256_set1_epi32(0x00011000));
+        abc = _mm256_shuffle_epi8(abc, pack);
+        // Close the gap between the two 12-byte lanes
+        abc = _mm256_permutevar8x32_epi32(abc,
+                _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)out, abc);
+    }
+    return i + base64_decode_ssse3(in + i, len - i, out);
+}
+#endif
+
+///// DISPATCH ///////////////////////////////////////////////////////////////
+static void base64_init()
+{
+    int i;
+    memset(base64_reverse, BASE64_INVALID, sizeof(base64_reverse));
+    for (i = 0; i < 64; i++)
+    { base64_reverse[(uint8_t)base64_alphabet[i]] = i; }
+
+    base64_encode_fast = base64_encode_scalar;
+    base64_decode_fast = base64_decode_scalar;
+#ifdef BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        base64_encode_fast = base64_encode_avx2;
+        base64_decode_fast = base64_decode_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        base64_encode_fast = base64_encode_ssse3;
+        base64_decode_fast = base64_decode_ssse3;
+    }
+#endif
+}
+
+/**
+  * Select the implementation used by the base64 functions.
+  * @param impl One of SDMBN_BASE64_IMPL_*; implementations the CPU lacks
+  *     fall back to the best one it has
+  * @return Implementation selected
+  */
+int sdmbn_base64_set_impl(int impl)
+{
+    pthread_once(&base64_once, base64_init);
+#ifdef BASE64_X86
+    if (impl >= SDMBN_BASE64_IMPL_AVX2 && __builtin_cpu_supports("avx2"))
+    {
+        base64_encode_fast = base64_encode_avx2;
+        base64_decode_fast = base64_decode_avx2;
+        return SDMBN_BASE64_IMPL_AVX2;
+    }
+    if (impl >= SDMBN_BASE64_IMPL_SSSE3 && __builtin_cpu_supports("ssse3"))
+    {
+        base64_encode_fast = base64_encode_ssse3;
+        base64_decode_fast = base64_decode_ssse3;
+        return SDMBN_BASE64_IMPL_SSSE3;
+    }
+#endif
+    base64_encode_fast = base64_encode_scalar;
+    base64_decode_fast = base64_decode_scalar;
+    return SDMBN_BASE64_IMPL_SCALAR;
+}
+
+/**
+  * Select the encoding written by sdmbn_base64_encode.  Decoding accepts
+  * both encodings regardless.
+  * @param version SDMBN_BASE64_LEGACY or SDMBN_BASE64_V1
+  */
+void sdmbn_base64_set_version(int version)
+{ base64_version = version; }
+
+int sdmbn_base64_get_version()
+{ return base64_version; }
+
+///// LEGACY /////////////////////////////////////////////////////////////////
+static char *base64_encode_legacy(const uint8_t *blob, int size)
+{
+    char *result = (char *)malloc(size*2+1);
+    if (NULL == result)
+    { return NULL; }
+    char *ptrResult = result;
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        *ptrResult++ = 'A' + (blob[i] & 0x0F);
+        *ptrResult++ = 'A' + (blob[i] >> 4);
+    }
+    *ptrResult = 0;
+    return result;
+}
+
+static void *base64_decode_legacy(const char *blob, int size)
+{
+    uint8_t *result = (uint8_t *)malloc(size/2);
+    if (NULL == result)
+    { return NULL; }
+    int i;
+    for (i = 0; i + 1 < size; i += 2)
+    {
+        // Nibbles are always 'A'..'P'; the mask keeps stray input in range
+        uint8_t lower = (blob[i] - 'A') & 0x0F;
+        uint8_t upper = (blob[i + 1] - 'A') & 0x0F;
+        result[i / 2] = (upper << 4) | lower;
+    }
+    return result;
+}
+
+///// ENCODE / DECODE ////////////////////////////////////////////////////////
+static char *base64_encode_v1(const uint8_t *blob, int size)
+{
+    size_t len = 4 * ((size + 2) / 3);
+    char *result = (char *)malloc(BASE64_V1_PREFIX_LEN + len + 1);
+    if (NULL == result)
+    { return NULL; }
+    memcpy(result, BASE64_V1_PREFIX, BASE64_V1_PREFIX_LEN);
+    char *out = result + BASE64_V1_PREFIX_LEN;
+
+    size_t done = base64_encode_fast(blob, size, out);
+    out += 4 * (done / 3);
+
+    // Pad the final partial group
+    size_t left = size - done;
+    if (left > 0)
+    {
+        uint32_t v = blob[done] << 16;
+        if (left > 1)
+        { v |= blob[done + 1] << 8; }
+        *out++ = base64_alphabet[(v >> 18) & 0x3F];
+        *out++ = base64_alphabet[(v >> 12) & 0x3F];
+        *out++ = (left > 1 ? base64_alphabet[(v >> 6) & 0x3F] : '=');
+        *out++ = '=';
+    }
+    *out = 0;
+    return result;
+}
+
+static void *base64_decode_v1(const char *blob, int size, int *outsize)
+{
+    if (size % 4 != 0)
+    {
+        ERROR_PRINT("Base64 string length %d is not a multiple of 4", size);
+        return NULL;
+    }
+
+    int pad = 0;
+    if (size > 0 && '=' == blob[size - 1])
+    { pad++; }
+    if (size > 1 && '=' == blob[size - 2])
+    { pad++; }
+    int len = (size / 4) * 3 - pad;
+
+    uint8_t *result = (uint8_t *)malloc(len + BASE64_DECODE_SLACK);
+    if (NULL == result)
+    { return NULL; }
+
+    // Fast path stops before the last group or at the first bad character
+    int body = (pad > 0 ? size - 4 : size);
+    size_t done = base64_decode_fast(blob, body, result);
+    if ((int)done != body)
+    {
+        ERROR_PRINT("Invalid base64 character near offset %zu", done);
+        free(result);
+        return NULL;
+    }
+
+    if (pad > 0)
+    {
+        uint8_t a = base64_reverse[(uint8_t)blob[size - 4]];
+        uint8_t b = base64_reverse[(uint8_t)blob[size - 3]];
+        uint8_t c = (2 == pad ? 0 : base64_reverse[(uint8_t)blob[size - 2]]);
+        if (BASE64_INVALID == a || BASE64_INVALID == b ||
+                BASE64_INVALID == c)
+        {
+            ERROR_PRINT("Invalid base64 character in final group");
+            free(result);
+            return NULL;
+        }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6);
+        uint8_t *out = result + (done / 4) * 3;
+        out[0] = v >> 16;
+        if (1 == pad)
+        { out[1] = v >> 8; }
+    }
+
+    if (outsize != NULL)
+    { *outsize = len; }
+    return result;
+}
+
+char *sdmbn_base64_encode_version(void *blob, int size, int version)
+{
+    if (NULL == blob || size < 1)
+    { return NULL; }
+    pthread_once(&base64_once, base64_init);
+    if (SDMBN_BASE64_V1 == version)
+    { return base64_encode_v1((const uint8_t *)blob, size); }
+    return base64_encode_legacy((const uint8_t *)blob, size);
+}
+
+char *sdmbn_base64_encode(void *blob, int size)
+{ return sdmbn_base64_encode_version(blob, size, base64_version); }
+
+void *sdmbn_base64_decode_len(char *blob, int *size)
+{
+    if (NULL == blob)
+    { return NULL; }
+    pthread_once(&base64_once, base64_init);
+    int len = strlen(blob);
+    if (0 == strncmp(blob, BASE64_V1_PREFIX, BASE64_V1_PREFIX_LEN))
+    {
+        return base64_decode_v1(blob + BASE64_V1_PREFIX_LEN,
+                len - BASE64_V1_PREFIX_LEN, size);
+    }
+    if (size != NULL)
+    { *size = len / 2; }
+    return base64_decode_legacy(blob, len);
+}
+
+void *sdmbn_base64_decode(char *blob)
+{ return sdmbn_base64_decode_len(blob, NULL); }
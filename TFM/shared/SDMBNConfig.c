@@ -19,6 +19,17 @@ int sdmbn_parse_config()
     sdmbn_config.release_get_pkts = CONF_RELEASE_GET_PKTS_DEFAULT;
     sdmbn_config.release_get_flows = CONF_RELEASE_GET_FLOWS_DEFAULT;
     sdmbn_config.max_get_flows = CONF_MAX_GET_FLOWS_DEFAULT;
+    sdmbn_config.batch_bytes = CONF_BATCH_BYTES_DEFAULT;
+    sdmbn_config.batch_usec = CONF_BATCH_USEC_DEFAULT;
+    sdmbn_config.base64_version = CONF_BASE64_VERSION_DEFAULT;
+    sdmbn_config.state_binary = CONF_STATE_BINARY_DEFAULT;
+    sdmbn_config.drain_usec = CONF_DRAIN_USEC_DEFAULT;
+    sdmbn_config.drain_timeout_usec = CONF_DRAIN_TIMEOUT_USEC_DEFAULT;
+    sdmbn_config.state_workers = CONF_STATE_WORKERS_DEFAULT;
+    sdmbn_config.trace_enable = CONF_TRACE_ENABLE_DEFAULT;
+    sdmbn_config.trace_records = CONF_TRACE_RECORDS_DEFAULT;
+    snprintf(sdmbn_config.trace_file, CONF_TRACE_FILE_LEN, "%s",
+            CONF_TRACE_FILE_DEFAULT);
 
 #define FILEPATH_LEN 256
     char filepath[FILEPATH_LEN];
@@ -34,7 +45,7 @@ int sdmbn_parse_config()
 
     char key[CONF_KEY_LEN];
     char value[CONF_VALUE_LEN];
-    while (2 == fscanf(file, "%s = %s\n", key, value))
+    while (2 == fscanf(file, "%31s = %255s\n", key, value))
     {
         if (0 == strncmp(key, CONF_CTRL_IP, 7))
         { strncpy(sdmbn_config.ctrl_ip, value, CONF_CTRL_IP_LEN); } 
@@ -48,6 +59,29 @@ int sdmbn_parse_config()
         { sdmbn_config.release_get_flows = atoi(value); }
         else if (0 == strncmp(key, CONF_MAX_GET_FLOWS, 13))
         { sdmbn_config.max_get_flows = atoi(value); }
+        else if (0 == strncmp(key, CONF_BATCH_BYTES, 11))
+        { sdmbn_config.batch_bytes = atoi(value); }
+        else if (0 == strncmp(key, CONF_BATCH_USEC, 10))
+        { sdmbn_config.batch_usec = atoi(value); }
+        else if (0 == strncmp(key, CONF_BASE64_VERSION, 14))
+        { sdmbn_config.base64_version = atoi(value); }
+        else if (0 == strncmp(key, CONF_STATE_BINARY, 12))
+        { sdmbn_config.state_binary = atoi(value); }
+        else if (0 == strncmp(key, CONF_DRAIN_USEC, 10))
+        { sdmbn_config.drain_usec = atoi(value); }
+        else if (0 == strncmp(key, CONF_DRAIN_TIMEOUT_USEC, 18))
+        { sdmbn_config.drain_timeout_usec = atoi(value); }
+        else if (0 == strncmp(key, CONF_STATE_WORKERS, 13))
+        { sdmbn_config.state_workers = atoi(value); }
+        else if (0 == strncmp(key, CONF_TRACE_ENABLE, 12))
+        { sdmbn_config.trace_enable = atoi(value); }
+        else if (0 == strncmp(key, CONF_TRACE_RECORDS, 13))
+        { sdmbn_config.trace_records = atoi(value); }
+        else if (0 == strncmp(key, CONF_TRACE_FILE, 10))
+        { 
+            strncpy(sdmbn_config.trace_file, value, CONF_TRACE_FILE_LEN - 1); 
+            sdmbn_config.trace_file[CONF_TRACE_FILE_LEN - 1] = '\0';
+        }
     }
 
     if (fclose(file) != 0)
@@ -12,7 +12,7 @@ extern "C" {
 ///// DEFINES ////////////////////////////////////////////////////////////////
 #define CONFIG_FILE "sdmbn.conf"
 #define CONF_KEY_LEN    32
-#define CONF_VALUE_LEN  32
+#define CONF_VALUE_LEN  256
 
 #define CONF_CTRL_IP_DEFAULT            "127.0.0.1"
 #define CONF_CTRL_PORT_STATE_DEFAULT    7790
@@ -20,8 +20,19 @@ extern "C" {
 #define CONF_RELEASE_GET_PKTS_DEFAULT   -1
 #define CONF_RELEASE_GET_FLOWS_DEFAULT  -1
 #define CONF_MAX_GET_FLOWS_DEFAULT      -1
+#define CONF_BATCH_BYTES_DEFAULT        (256 * 1024)
+#define CONF_BATCH_USEC_DEFAULT         1000
+#define CONF_BASE64_VERSION_DEFAULT     0
+#define CONF_STATE_BINARY_DEFAULT       0
+#define CONF_DRAIN_USEC_DEFAULT         1000
+#define CONF_DRAIN_TIMEOUT_USEC_DEFAULT 100000
+#define CONF_STATE_WORKERS_DEFAULT      4
+#define CONF_TRACE_ENABLE_DEFAULT       0
+#define CONF_TRACE_RECORDS_DEFAULT      65536
+#define CONF_TRACE_FILE_DEFAULT         ""
 
 #define CONF_CTRL_IP_LEN  16
+#define CONF_TRACE_FILE_LEN CONF_VALUE_LEN
 
 #define CONF_CTRL_IP            "ctrl_ip"
 #define CONF_CTRL_PORT_STATE    "ctrl_port_state"
@@ -29,6 +40,16 @@ extern "C" {
 #define CONF_RELEASE_GET_PKTS   "release_get_pkts"
 #define CONF_RELEASE_GET_FLOWS  "release_get_flows"
 #define CONF_MAX_GET_FLOWS      "max_get_flows"
+#define CONF_BATCH_BYTES        "batch_bytes"
+#define CONF_BATCH_USEC         "batch_usec"
+#define CONF_BASE64_VERSION     "base64_version"
+#define CONF_STATE_BINARY       "state_binary"
+#define CONF_DRAIN_USEC         "drain_usec"
+#define CONF_DRAIN_TIMEOUT_USEC "drain_timeout_usec"
+#define CONF_STATE_WORKERS      "state_workers"
+#define CONF_TRACE_ENABLE       "trace_enable"
+#define CONF_TRACE_RECORDS      "trace_records"
+#define CONF_TRACE_FILE         "trace_file"
 
 ///// STRUCTURES /////////////////////////////////////////////////////////////
 typedef struct {
@@ -38,6 +59,16 @@ typedef struct {
     int release_get_pkts;
     int release_get_flows;
     int max_get_flows;
+    int batch_bytes;
+    int batch_usec;
+    int base64_version;
+    int state_binary;
+    int drain_usec;
+    int drain_timeout_usec;
+    int state_workers;
+    int trace_enable;
+    int trace_records;
+    char trace_file[CONF_TRACE_FILE_LEN];
 } SDMBNConfig;
 
 ///// FUNCTION PROTOTYPES ////////////////////////////////////////////////////
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -127,6 +128,16 @@ int conn_close(int conn)
 }
 
 char *conn_read(int conn)
+{ return conn_read_len(conn, NULL); }
+
+/**
+  * Read one length-prefixed message.
+  * @param conn Connection to read from
+  * @param len Location to store the message length; may be NULL
+  * @return Message, NUL-terminated for callers expecting a string; NULL on
+  *     error or when the peer closed the connection
+  */
+char *conn_read_len(int conn, int *len)
 {
     int readlen = 0, result = 0;
 
@@ -141,14 +152,19 @@ char *conn_read(int conn)
             perror("Failure in conn_read");
         	return NULL;
         }
+        if (0 == result)
+        { return NULL; }
         count += result;
     }
     int strlen = ntohl(*((int *)lenchars));
     DEBUG_PRINT("Should read %d bytes", strlen);
    
     // Limit read size 
-    #define SDMBN_CONN_READ_MAX (1024 * 1024 * 1024)
-    assert(strlen < SDMBN_CONN_READ_MAX);
+    if (strlen < 0 || strlen >= SDMBN_CONN_READ_MAX)
+    {
+        ERROR_PRINT("Message of %d bytes exceeds limit", strlen);
+        return NULL;
+    }
 
     // Allocate buffer for string
     char *buf = (char *)malloc(strlen+1);
@@ -162,7 +178,7 @@ char *conn_read(int conn)
         result = read(conn, cur, strlen - readlen);
 
         // Encountered error
-        if (result < 0)
+        if (result <= 0)
         { 
             ERROR_PRINT("Error reading from socket: %d", result);
             free(buf);
@@ -174,9 +190,167 @@ char *conn_read(int conn)
         readlen += result;
     }
     buf[readlen] = '\0';
+    if (len != NULL)
+    { *len = readlen; }
     return buf;
 }
 
+///// BUFFERED READS /////////////////////////////////////////////////////////
+// A reader receives as much as the socket holds with each recv and splits
+// messages out of its buffer, so a burst of small messages costs one system
+// call and no allocations.  Messages are handed out in place; the byte after
+// a message, which belongs to the next length prefix, is swapped for a NUL
+// until the message is released.  Consumed bytes are dropped by moving the
+// unread remainder to the front once a message would run past the end, and
+// the buffer only grows for a message larger than it.
+
+/**
+  * Set up a buffered reader.
+  * @param reader Reader to set up
+  * @param conn Connection the reader owns reads from
+  * @return 0 on success; -1 on error
+  */
+int conn_reader_init(SDMBNReader *reader, int conn)
+{
+    bzero(reader, sizeof(*reader));
+    reader->conn = conn;
+    reader->buf = (char *)malloc(SDMBN_CONN_READER_SIZE);
+    if (NULL == reader->buf)
+    { return -1; }
+    reader->size = SDMBN_CONN_READER_SIZE;
+    return 0;
+}
+
+void conn_reader_destroy(SDMBNReader *reader)
+{
+    free(reader->buf);
+    reader->buf = NULL;
+    reader->size = 0;
+}
+
+// Make room for need bytes from start, plus a NUL after them
+static int conn_reader_reserve(SDMBNReader *reader, int need)
+{
+    // Largest buffer: longest message, its length and the NUL
+    const size_t max = SDMBN_CONN_READ_MAX + sizeof(int) + 1;
+    if (need < 0 || (size_t)need >= max)
+    { return -1; }
+    if ((size_t)reader->start + need < (size_t)reader->size)
+    { return 0; }
+
+    int unread = reader->end - reader->start;
+    if (need >= reader->size)
+    {
+        size_t size = reader->size;
+        while (size <= (size_t)need)
+        { size *= 2; }
+        if (size > max)
+        { size = max; }
+        char *buf = (char *)malloc(size);
+        if (NULL == buf)
+        { return -1; }
+        memcpy(buf, reader->buf + reader->start, unread);
+        free(reader->buf);
+        reader->buf = buf;
+        reader->size = size;
+    }
+    else
+    { memmove(reader->buf, reader->buf + reader->start, unread); }
+    reader->start = 0;
+    reader->end = unread;
+    return 0;
+}
+
+/**
+  * Get the next length-prefixed message, receiving more data if needed.
+  * @param reader Reader with no message held
+  * @param len Location to store the message length; may be NULL
+  * @return Message, NUL-terminated and valid until conn_reader_release; NULL
+  *     on error or when the peer closed the connection
+  */
+char *conn_reader_next(SDMBNReader *reader, int *len)
+{
+    if (reader->held > 0)
+    { conn_reader_release(reader); }
+
+    while (1)
+    {
+        int avail = reader->end - reader->start;
+        int need = sizeof(int);
+        if (avail >= need)
+        {
+            int msglen;
+            memcpy(&msglen, reader->buf + reader->start, sizeof(int));
+            msglen = ntohl(msglen);
+            if (msglen < 0 || msglen >= SDMBN_CONN_READ_MAX)
+            {
+                ERROR_PRINT("Message of %d bytes exceeds limit", msglen);
+                return NULL;
+            }
+            need += msglen;
+            if (avail >= need)
+            {
+                char *msg = reader->buf + reader->start + sizeof(int);
+                reader->held = need;
+                reader->saved = msg[msglen];
+                msg[msglen] = '\0';
+                if (len != NULL)
+                { *len = msglen; }
+                return msg;
+            }
+        }
+
+        // Receive whatever is available, at least up to the next message
+        if (conn_reader_reserve(reader, need) < 0)
+        {
+            ERROR_PRINT("Failed to grow receive buffer to %d bytes", need);
+            return NULL;
+        }
+        ssize_t result = recv(reader->conn, reader->buf + reader->end,
+                reader->size - reader->end - 1, 0);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+            { continue; }
+            ERROR_PRINT("Error reading from socket: %s", strerror(errno));
+            return NULL;
+        }
+        if (0 == result)
+        { return NULL; }
+        reader->end += result;
+    }
+}
+
+/**
+  * Release the message returned by conn_reader_next.
+  */
+void conn_reader_release(SDMBNReader *reader)
+{
+    if (0 == reader->held)
+    { return; }
+    reader->buf[reader->start + reader->held] = reader->saved;
+    reader->start += reader->held;
+    reader->held = 0;
+
+    if (reader->start == reader->end)
+    {
+        reader->start = 0;
+        reader->end = 0;
+
+        // Give back memory grown for an exceptionally large message
+        if (reader->size > SDMBN_CONN_READER_SIZE * 16)
+        {
+            char *buf = (char *)malloc(SDMBN_CONN_READER_SIZE);
+            if (buf != NULL)
+            {
+                free(reader->buf);
+                reader->buf = buf;
+                reader->size = SDMBN_CONN_READER_SIZE;
+            }
+        }
+    }
+}
+
 int conn_write(int conn, char *buf, int len)
 {
     pthread_mutex_lock(&sdmbn_lock_conn);
@@ -185,13 +359,102 @@ int conn_write(int conn, char *buf, int len)
     return result;
 }
 
-int conn_write_append_newline(int conn, char *buf, int len)
+
+// Write every buffer in full; caller holds sdmbn_lock_conn
+static int conn_writev_all(int conn, struct iovec *cur, int curcnt)
 {
+    while (curcnt > 0)
+    {
+        ssize_t result = writev(conn, cur, curcnt);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+            { continue; }
+            ERROR_PRINT("Error writing to socket: %s", strerror(errno));
+            return -1;
+        }
+
+        // Skip what was written and resume mid-buffer if needed
+        while (curcnt > 0 && (size_t)result >= cur->iov_len)
+        {
+            result -= cur->iov_len;
+            cur++;
+            curcnt--;
+        }
+        if (curcnt > 0)
+        {
+            cur->iov_base = (char *)cur->iov_base + result;
+            cur->iov_len -= result;
+        }
+    }
+    return 0;
+}
+
+/**
+  * Write buffers that already hold complete length-prefixed messages.
+  * @param conn Connection to write to
+  * @param iov Buffers to write, in order
+  * @param iovcnt Number of buffers; at most SDMBN_CONN_IOV_MAX
+  * @return Number of bytes written; -1 on error
+  */
+int conn_writev(int conn, const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 0 || iovcnt > SDMBN_CONN_IOV_MAX)
+    { return -1; }
+
+    struct iovec vec[SDMBN_CONN_IOV_MAX];
+    int len = 0, i;
+    for (i = 0; i < iovcnt; i++)
+    {
+        vec[i] = iov[i];
+        len += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&sdmbn_lock_conn);
+    int result = conn_writev_all(conn, vec, iovcnt);
+    pthread_mutex_unlock(&sdmbn_lock_conn);
+    return (result < 0 ? -1 : len);
+}
+
+/**
+  * Write one length-prefixed message gathered from several buffers.
+  * @param conn Connection to write to
+  * @param iov Buffers holding the message, in order
+  * @param iovcnt Number of buffers; at most SDMBN_CONN_IOV_MAX
+  * @return Message length; -1 on error
+  */
+int conn_writev_frame(int conn, const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 0 || iovcnt > SDMBN_CONN_IOV_MAX)
+    { return -1; }
+
+    // Length prefix goes out with the message in a single system call
+    struct iovec vec[SDMBN_CONN_IOV_MAX + 1];
+    int len = 0, i;
+    for (i = 0; i < iovcnt; i++)
+    {
+        vec[i + 1] = iov[i];
+        len += iov[i].iov_len;
+    }
     int tmplen = htonl(len);
+    vec[0].iov_base = &tmplen;
+    vec[0].iov_len = sizeof(tmplen);
+
     pthread_mutex_lock(&sdmbn_lock_conn);
-    write(conn, &tmplen, sizeof(tmplen));
-    int result = write(conn, (void *)buf, len);
-    //write(conn, "\n", 1);
+    int result = conn_writev_all(conn, vec, iovcnt + 1);
     pthread_mutex_unlock(&sdmbn_lock_conn);
-    return result;
+    return (result < 0 ? -1 : len);
+}
+
+/**
+  * Write one length-prefixed message; the length and message go out in a
+  * single system call.
+  * @return Message length; -1 on error
+  */
+int conn_write_append_newline(int conn, char *buf, int len)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return conn_writev_frame(conn, &iov, 1);
 }
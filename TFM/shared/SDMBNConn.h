@@ -6,6 +6,26 @@ extern "C" {
 #define _SDMBNConn_H_
 
 #include <pthread.h>
+#include <sys/uio.h>
+
+///// DEFINES ////////////////////////////////////////////////////////////////
+#define SDMBN_CONN_IOV_MAX      8   // buffers per conn_writev call
+#define SDMBN_CONN_READ_MAX     (1024 * 1024 * 1024)    // longest message
+#define SDMBN_CONN_READER_SIZE  (64 * 1024) // initial receive buffer
+
+///// TYPEDEFS ///////////////////////////////////////////////////////////////
+// Buffered reader for one connection, used by a single thread.  Received
+// bytes are kept in buf[start, end); a message handed out by conn_reader_next
+// is a view into buf that stays valid until conn_reader_release.
+typedef struct {
+    int conn;
+    char *buf;
+    int size;
+    int start;
+    int end;
+    int held;           // bytes of the message handed out, with its length
+    char saved;         // byte overwritten to NUL-terminate that message
+} SDMBNReader;
 
 extern pthread_mutex_t sdmbn_lock_conn;
 
@@ -14,8 +34,15 @@ int conn_active_open(const char *host, unsigned short port);
 int conn_passive_open(unsigned short port);
 int conn_close(int conn);
 char *conn_read(int conn);
+char *conn_read_len(int conn, int *len);
+int conn_reader_init(SDMBNReader *reader, int conn);
+void conn_reader_destroy(SDMBNReader *reader);
+char *conn_reader_next(SDMBNReader *reader, int *len);
+void conn_reader_release(SDMBNReader *reader);
 int conn_write(int conn, char *buf, int len);
 int conn_write_append_newline(int conn, char *buf, int len);
+int conn_writev(int conn, const struct iovec *iov, int iovcnt);
+int conn_writev_frame(int conn, const struct iovec *iov, int iovcnt);
 
 #endif
 
@@ -4,6 +4,7 @@
 #include "SDMBNDebug.h"
 #include "SDMBNJson.h"
 #include "SDMBNConfig.h"
+#include "SDMBNTrace.h"
 #include "event.h"
 #include "state.h"
 #include "discovery.h"
@@ -23,12 +24,17 @@ SDMBNLocals *sdmbn_locals = NULL;
 // Global statistics variables
 SDMBNStatistics sdmbn_stats;
 
-// Hack for benchmarking
-pthread_mutex_t sdmbn_lock_get;
+// Hack for benchmarking: gets wait until enough packets or flows are seen
+static int sdmbn_get_released = 1;
+static pthread_mutex_t sdmbn_lock_get = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sdmbn_cond_get = PTHREAD_COND_INITIALIZER;
 
 // Thread for sending discovery packets
 static pthread_t discovery_thread;
 
+// Whether every peer parses the binary state encoding of the MB
+static int sdmbn_binary_state = 0;
+
 int sdmbn_init(SDMBNLocals *locals)
 {
     // Check arguments
@@ -40,6 +46,9 @@ int sdmbn_init(SDMBNLocals *locals)
 
     // Parse configuration
     sdmbn_parse_config();
+    sdmbn_base64_set_version(sdmbn_config.base64_version);
+    sdmbn_state_set_binary(sdmbn_config.state_binary);
+    sdmbn_trace_enable(sdmbn_config.trace_enable);
 
     // Store list of MB-specific functions
     sdmbn_locals = locals;
@@ -61,11 +70,10 @@ int sdmbn_init(SDMBNLocals *locals)
         return -1;
     }
 
-    // Create get lock
-    assert(0 == pthread_mutex_init(&sdmbn_lock_get, NULL));
+    // Hold gets until the release threshold is reached
     if (sdmbn_config.release_get_pkts > 0 
             || sdmbn_config.release_get_flows > 0) 
-    { pthread_mutex_lock(&sdmbn_lock_get); }
+    { sdmbn_get_released = 0; }
 
     // Create discovery packet sending thread
     if (sdmbn_locals->device != NULL)
@@ -80,9 +88,6 @@ int sdmbn_init(SDMBNLocals *locals)
 
 int sdmbn_cleanup()
 {
-    // Destroy get lock
-    pthread_mutex_destroy(&sdmbn_lock_get);
-
     // Clean-up state
     if (state_cleanup() < 0)
     { ERROR_PRINT("Failed to cleanup state"); }
@@ -91,6 +96,10 @@ int sdmbn_cleanup()
     if (events_cleanup() < 0)
     { ERROR_PRINT("Failed to cleanup events"); }
 
+    // Write out trace records
+    if (sdmbn_config.trace_file[0] != '\0')
+    { sdmbn_trace_dump(sdmbn_config.trace_file); }
+
     // Call local cleanup function
     if (sdmbn_locals->cleanup != NULL)
     { sdmbn_locals->cleanup(); }
@@ -103,9 +112,44 @@ int sdmbn_cleanup()
     return 1;
 }
 
+/**
+  * Allow MBs to send state in their binary encoding.  Enable it only when
+  * every peer parses it.  Binary state travels as SDMBN_BASE64_V1, whose
+  * prefix sets it apart from text, so it also needs that version.
+  */
+void sdmbn_state_set_binary(int enable)
+{ sdmbn_binary_state = (enable != 0); }
+
+int sdmbn_state_binary()
+{
+    return sdmbn_binary_state
+        && SDMBN_BASE64_V1 == sdmbn_base64_get_version();
+}
+
+static void release_gets()
+{
+    pthread_mutex_lock(&sdmbn_lock_get);
+    __atomic_store_n(&sdmbn_get_released, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&sdmbn_cond_get);
+    pthread_mutex_unlock(&sdmbn_lock_get);
+}
+
+// Blocks until release_get_pkts or release_get_flows is reached; unlike the
+// lock it replaces, any number of gets may wait and proceed at once
+void sdmbn_wait_get_release()
+{
+    if (__atomic_load_n(&sdmbn_get_released, __ATOMIC_ACQUIRE))
+    { return; }
+    pthread_mutex_lock(&sdmbn_lock_get);
+    while (!sdmbn_get_released)
+    { pthread_cond_wait(&sdmbn_cond_get, &sdmbn_lock_get); }
+    pthread_mutex_unlock(&sdmbn_lock_get);
+}
+
 void sdmbn_notify_packet_received(char *type, struct timeval *recv_time)
 {
-    sdmbn_stats.pkts_received++;
+    // Called from every packet processing thread
+    int received = __sync_add_and_fetch(&(sdmbn_stats.pkts_received), 1);
     //double releaseTime;
     //releaseTime = recv_time->tv_sec + 0.000001 * recv_time->tv_usec; 
     //INFO_PRINT("pkts_received=%d, flows_active=%d,received_time=%f"
@@ -119,104 +163,26 @@ void sdmbn_notify_packet_received(char *type, struct timeval *recv_time)
     if (sdmbn_config.release_get_pkts > 0 
             || sdmbn_config.release_get_flows > 0) 
     {
-        if (sdmbn_config.release_get_pkts == sdmbn_stats.pkts_received)
+        if (sdmbn_config.release_get_pkts == received)
         {
             INFO_PRINT("Reached packet threshold => Get lock released");
-            pthread_mutex_unlock(&sdmbn_lock_get);
+            release_gets();
         }
         else if (sdmbn_config.release_get_flows == sdmbn_stats.flows_active)
         {
             INFO_PRINT("Reached active flows threshold => Get lock released");
-            pthread_mutex_unlock(&sdmbn_lock_get);
+            release_gets();
         }
     }
 }
 
 void sdmbn_notify_flow_created()
 {
-    sdmbn_stats.flows_active++;
+    __sync_fetch_and_add(&(sdmbn_stats.flows_active), 1);
 }
 
 void sdmbn_notify_flow_destroyed()
 {
-    sdmbn_stats.flows_active--;
-}
-
-static byte base64_encode_bits(byte data)
-{
-    if (data < 26)
-        return (data + 'A');
-    if (data < 52)
-        return (data - 26 + 'a');
-    if (data < 62)
-        return (data - 52 + '0');
-    if (data == 62)
-        return '+';
-    if (data == 63)
-        return '/';
-    return 0;
-}
-
-char *sdmbn_base64_encode(void *blob, int size)
-{
-    if (NULL == blob || size < 1)
-    { return NULL; }
-    byte *ptrBlob = (byte *)blob;
-    char *result = (char *)malloc(size*2+1);
-    if (NULL == result)
-    { return NULL; }
-    char *ptrResult = result;
-    while (size > 0)
-    {
-        byte lower = *ptrBlob & 0x0F;
-        byte upper = (*ptrBlob & 0xF0) >> 4;
-        *ptrResult = base64_encode_bits(lower);
-        ptrResult++;
-        *ptrResult = base64_encode_bits(upper);
-        ptrResult++;
-        ptrBlob++;
-        size += -1;
-    }
-    *ptrResult = 0;
-    return result;
-}
-
-static byte base64_decode_bits(byte data)
-{
-    if (data >= 'A' && data <= 'Z')
-        return (data - 'A');
-    if (data >= 'a' && data <= 'z')
-        return (data + 26 - 'a');
-    if (data >= '0' && data <= '9')
-        return (data + 52 - '0');
-    if (data == '+')
-        return 62;
-    if (data == '/')
-        return 63;
-    return 0;
-}
-
-void *sdmbn_base64_decode(char *blob)
-{
-    if (NULL == blob)
-    { return NULL; }
-    byte *ptrBlob = (byte *)blob;
-    int size = strlen(blob);
-    void *result = malloc(size/2);
-    if (NULL == result)
-    { return NULL; }
-    char *ptrResult = (char *)result;
-    while (size > 0)
-    {
-        byte lower = base64_decode_bits(*ptrBlob);
-        ptrBlob++;
-        byte upper = base64_decode_bits(*ptrBlob);
-        ptrBlob++;
-        *ptrResult = (upper << 4) | lower;
-        ptrResult++;
-        size += -2;
-    }
-//    *ptrResult = 0;
-    return result;
+    __sync_fetch_and_sub(&(sdmbn_stats.flows_active), 1);
 }
 
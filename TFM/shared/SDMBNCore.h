@@ -37,7 +37,9 @@ typedef struct {
 extern SDMBNLocals *sdmbn_locals;
 extern SDMBNStatistics sdmbn_stats;
 extern SDMBNConfig sdmbn_config;
-extern pthread_mutex_t sdmbn_lock_get;
+
+///// FUNCTION PROTOTYPES ////////////////////////////////////////////////////
+void sdmbn_wait_get_release();
 
 #endif
 
@@ -261,9 +261,34 @@ json_object* json_compose_syn()
     json_object_object_add(msg, FIELD_HOST, json_object_new_string(hostname));
     json_object_object_add(msg, FIELD_PID, json_object_new_int(getpid()));
 
+    // Offer the binary wire format; controllers that do not know it ignore
+    // the field and keep talking JSON
+    json_object_object_add(msg, FIELD_WIRE, 
+            json_object_new_string(CONSTANT_WIRE_BINARY));
+
     return msg;
 }
 
+/**
+  * Check for the controller's answer to the SYN.
+  * @param msg Message received from the controller
+  * @return 1 if it is a syn-ack accepting the binary wire format; 0 if it is
+  *     a syn-ack keeping JSON; -1 if it is not a syn-ack
+  */
+int json_parse_syn_ack(json_object *msg)
+{
+    json_object *type_field = json_object_object_get(msg, FIELD_TYPE);
+    if (NULL == type_field || strcmp(json_object_get_string(type_field),
+                RESPONSE_SYN_ACK) != 0)
+    { return -1; }
+
+    json_object *wire_field = json_object_object_get(msg, FIELD_WIRE);
+    if (NULL == wire_field)
+    { return 0; }
+    return (0 == strcmp(json_object_get_string(wire_field), 
+                CONSTANT_WIRE_BINARY));
+}
+
 json_object* json_compose_delete_perflow_ack(int id, int count)
 {
     json_object *msg;
@@ -394,7 +419,7 @@ json_object* json_compose_put_config_ack(int id, int hashkey)
     return msg;
 }
 
-json_object* json_compose_events_ack(int id)
+json_object* json_compose_events_ack(int id, int64_t quiesce, uint64_t seq)
 {
     json_object *msg;
     msg = json_object_new_object();
@@ -402,6 +427,28 @@ json_object* json_compose_events_ack(int id)
             json_object_new_int(id));
     json_object_object_add(msg, FIELD_TYPE, 
             json_object_new_string(RESPONSE_EVENTS_ACK));
+    if (quiesce >= 0)
+    {
+        json_object_object_add(msg, FIELD_QUIESCE, 
+                json_object_new_int64(quiesce));
+        json_object_object_add(msg, FIELD_AFTER, 
+                json_object_new_int64(seq));
+    }
+    return msg;
+}
+
+json_object* json_compose_trace_ack(int id, int enabled, int count)
+{
+    json_object *msg;
+    msg = json_object_new_object();
+    json_object_object_add(msg, FIELD_ID, 
+            json_object_new_int(id));
+    json_object_object_add(msg, FIELD_TYPE, 
+            json_object_new_string(RESPONSE_TRACE_ACK));
+    json_object_object_add(msg, FIELD_ENABLE, 
+            json_object_new_int(enabled));
+    json_object_object_add(msg, FIELD_COUNT, 
+            json_object_new_int(count));
     return msg;
 }
 
@@ -25,6 +25,12 @@ extern "C" {
 #define FIELD_PID               "pid"
 #define FIELD_DELTYPE           "deltype"
 #define FIELD_ACTION            "action"
+#define FIELD_WIRE              "wire"
+#define FIELD_AFTER             "after"
+#define FIELD_DRAIN             "drain"
+#define FIELD_QUIESCE           "quiesce"
+#define FIELD_ENABLE            "enable"
+#define FIELD_FILE              "file"
 
 #define COMMAND_GET_PERFLOW     	"get-perflow"
 #define COMMAND_PUT_PERFLOW     	"put-perflow"
@@ -38,6 +44,7 @@ extern "C" {
 #define COMMAND_DELETE_MULTIFLOW  	"delete-multiflow"
 #define COMMAND_ENABLE_EVENTS       "enable-events"
 #define COMMAND_DISABLE_EVENTS      "disable-events"
+#define COMMAND_TRACE               "trace"
 
 
 #define RESPONSE_DELETE_PERFLOW_ACK     "delete-perflow-ack"
@@ -51,7 +58,9 @@ extern "C" {
 #define RESPONSE_GET_CONFIG_ACK        	"get-config-ack"
 #define RESPONSE_PUT_CONFIG_ACK        	"put-config-ack"
 #define RESPONSE_EVENTS_ACK        	    "events-ack"
+#define RESPONSE_TRACE_ACK              "trace-ack"
 #define RESPONSE_SYN            		"syn"
+#define RESPONSE_SYN_ACK        		"syn-ack"
 #define RESPONSE_ERROR           		"error"
 #define RESPONSE_STATE_PERFLOW  		"state-perflow"
 #define RESPONSE_STATE_MULTIFLOW  		"state-multiflow"
@@ -65,6 +74,9 @@ extern "C" {
 #define CONSTANT_ACTION_BUFFER          "buffer"
 #define CONSTANT_ACTION_PROCESS         "process"
 
+#define CONSTANT_WIRE_JSON              "json"
+#define CONSTANT_WIRE_BINARY            "binary-1"
+
 #define ERROR_MALFORMED          "malformed"
 #define ERROR_UNSUPPORTED        "unsupported"
 #define ERROR_INTERNAL           "internal-failure"
@@ -82,6 +94,7 @@ json_object* json_compose_multiflow_state(int id, PerflowKey *key,
         char *state, int hashkey, int seq);
 json_object* json_compose_config_state(int id, char *state, int seq);
 json_object* json_compose_syn();
+int json_parse_syn_ack(json_object *msg);
 json_object* json_compose_delete_perflow_ack(int id, int count);
 json_object* json_compose_delete_multiflow_ack(int id, int count);
 json_object* json_compose_get_perflow_ack(int id, int count);
@@ -92,7 +105,8 @@ json_object* json_compose_put_perflow_ack(int id, int hashkey);
 json_object* json_compose_put_multiflow_ack(int id, int hashkey);
 json_object* json_compose_put_allflows_ack(int id, int hashkey);
 json_object* json_compose_put_config_ack(int id, int hashkey);
-json_object* json_compose_events_ack(int id);
+json_object* json_compose_events_ack(int id, int64_t quiesce, uint64_t seq);
+json_object* json_compose_trace_ack(int id, int enabled, int count);
 json_object* json_compose_error(int id, int hashkey, char *reason);
 json_object* json_compose_reprocess_event(int id, int hashkey, 
         const struct pcap_pkthdr *hdr, const unsigned char *pkt);
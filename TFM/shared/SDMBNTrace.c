@@ -0,0 +1,216 @@
+#include "SDMBN.h"
+#include "SDMBNCore.h"
+#include "SDMBNDebug.h"
+#include "SDMBNTrace.h"
+#include <pcap.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Each recording thread owns a ring it alone writes.  head counts every
+// record the thread ever wrote; a record is published by advancing head
+// past it, and once the ring is full the oldest record is overwritten.
+// A dump copies a ring without stopping its writer and then discards the
+// records the writer may have overwritten meanwhile.
+
+///// GLOBALS ////////////////////////////////////////////////////////////////
+int sdmbn_trace_enabled = 0;
+
+typedef struct _TraceRing {
+    uint64_t head;
+    uint64_t mask;
+    uint16_t thread;
+    struct _TraceRing *next;
+    TraceRecord records[];
+} TraceRing;
+
+static TraceRing *sdmbn_trace_rings = NULL;
+static int sdmbn_trace_ring_count = 0;
+static pthread_mutex_t lock_trace_rings = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceRing *trace_ring = NULL;
+
+///// RECORDING //////////////////////////////////////////////////////////////
+static TraceRing *trace_ring_create()
+{
+    uint64_t size = 1;
+    while (size < (uint64_t)sdmbn_config.trace_records)
+    { size <<= 1; }
+
+    TraceRing *ring = (TraceRing *)malloc(sizeof(TraceRing)
+            + size * sizeof(TraceRecord));
+    if (NULL == ring)
+    {
+        ERROR_PRINT("Failed to allocate trace ring of %lu records",
+                (unsigned long)size);
+        return NULL;
+    }
+    ring->head = 0;
+    ring->mask = size - 1;
+
+    pthread_mutex_lock(&lock_trace_rings);
+    ring->thread = sdmbn_trace_ring_count++;
+    ring->next = sdmbn_trace_rings;
+    __atomic_store_n(&sdmbn_trace_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock_trace_rings);
+
+    trace_ring = ring;
+    return ring;
+}
+
+/**
+  * Get the time trace records are stamped with.
+  * @return Nanoseconds since the epoch
+  */
+int64_t sdmbn_trace_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+  * Add a record to the calling thread's ring, if tracing is enabled.
+  */
+void sdmbn_trace_record(int type, int action, int id, int64_t ts,
+        int64_t elapsed)
+{
+    if (!sdmbn_trace_on())
+    { return; }
+
+    TraceRing *ring = trace_ring;
+    if (NULL == ring && NULL == (ring = trace_ring_create()))
+    { return; }
+
+    uint64_t head = ring->head;
+    TraceRecord *rec = &(ring->records[head & ring->mask]);
+    rec->ts = ts;
+    rec->elapsed = elapsed;
+    rec->id = id;
+    rec->type = type;
+    rec->action = action;
+    rec->thread = ring->thread;
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+  * Record an operation that began at start and ends now.
+  * @param start Value of sdmbn_trace_clock when the operation began
+  * @return Nanoseconds the operation took
+  */
+int64_t sdmbn_trace_span(int type, int id, int64_t start)
+{
+    int64_t now = sdmbn_trace_clock();
+    sdmbn_trace_record(type, TRACE_ACTION_NONE, id, start, now - start);
+    return now - start;
+}
+
+/**
+  * Record what happened to a packet, with the time since it was captured.
+  */
+void sdmbn_trace_packet(int action, int id, const struct pcap_pkthdr *hdr)
+{
+    if (!sdmbn_trace_on())
+    { return; }
+
+    int64_t now = sdmbn_trace_clock();
+    int64_t captured = (int64_t)hdr->ts.tv_sec * 1000000000
+        + (int64_t)hdr->ts.tv_usec * 1000;
+    int64_t elapsed = now - captured;
+    if (0 == hdr->ts.tv_sec || elapsed < 0)
+    { elapsed = 0; }
+    sdmbn_trace_record(TRACE_PACKET, action, id, now, elapsed);
+}
+
+///// CONTROL ////////////////////////////////////////////////////////////////
+/**
+  * Turn tracing on or off.  Rings are allocated by each thread the first
+  * time it records and hold trace_records records.
+  * @return Whether tracing was on before the call
+  */
+int sdmbn_trace_enable(int enable)
+{ return __atomic_exchange_n(&sdmbn_trace_enabled, (enable != 0),
+        __ATOMIC_RELAXED); }
+
+// Copies the records a ring still holds; returns how many
+static uint64_t trace_ring_copy(TraceRing *ring, TraceRecord *out,
+        uint64_t *dropped)
+{
+    uint64_t size = ring->mask + 1;
+    uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    uint64_t first = (head > size) ? head - size : 0;
+    uint64_t i;
+    for (i = first; i < head; i++)
+    { out[i - first] = ring->records[i & ring->mask]; }
+
+    // The writer may have reused slots while they were copied
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    uint64_t valid = (now >= size) ? now - size + 1 : 0;
+    if (valid > first)
+    {
+        uint64_t skip = (valid < head ? valid : head) - first;
+        memmove(out, out + skip, (head - first - skip) * sizeof(TraceRecord));
+        first += skip;
+    }
+    *dropped += first;
+    return head - first;
+}
+
+/**
+  * Write every record held in the trace rings to a file.
+  * @param path File to write; replaced if it exists
+  * @return Number of records written; -1 on error
+  */
+int sdmbn_trace_dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (NULL == file)
+    {
+        ERROR_PRINT("Failed to open trace file '%s'", path);
+        return -1;
+    }
+
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    fwrite(&header, sizeof(header), 1, file);
+
+    TraceRecord *records = NULL;
+    uint64_t capacity = 0;
+    uint64_t count = 0, dropped = 0;
+    TraceRing *ring = __atomic_load_n(&sdmbn_trace_rings, __ATOMIC_ACQUIRE);
+    while (ring != NULL)
+    {
+        if (capacity < ring->mask + 1)
+        {
+            free(records);
+            capacity = ring->mask + 1;
+            records = (TraceRecord *)malloc(capacity * sizeof(TraceRecord));
+            if (NULL == records)
+            {
+                fclose(file);
+                return -1;
+            }
+        }
+        uint64_t copied = trace_ring_copy(ring, records, &dropped);
+        fwrite(records, sizeof(TraceRecord), copied, file);
+        count += copied;
+        ring = ring->next;
+    }
+    free(records);
+    header.count = count;
+    header.dropped = dropped;
+
+    // Fill in the totals
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    if (fclose(file) != 0)
+    { return -1; }
+    INFO_PRINT("Dumped %lu trace records to '%s' (%lu dropped)",
+            (unsigned long)count, path, (unsigned long)dropped);
+    return count;
+}
@@ -0,0 +1,77 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _SDMBNTrace_H_
+#define _SDMBNTrace_H_
+
+#include <stdint.h>
+
+struct pcap_pkthdr;
+
+// Trace records are kept in a ring per recording thread and written out by
+// sdmbn_trace_dump as a TraceFileHeader followed by header.count records,
+// in host byte order.  Records of one thread are in order; records of
+// different threads are not interleaved by time.
+
+///// DEFINES ////////////////////////////////////////////////////////////////
+#define TRACE_MAGIC             "SDMBNTR1"
+#define TRACE_VERSION           1
+
+// Record types; elapsed is how long the operation took
+#define TRACE_PACKET            1   // elapsed is the time since capture
+#define TRACE_GET_PERFLOW       2
+#define TRACE_PUT_PERFLOW       3
+#define TRACE_GET_MULTIFLOW     4
+#define TRACE_PUT_MULTIFLOW     5
+#define TRACE_DELETE_PERFLOW    6
+#define TRACE_DELETE_MULTIFLOW  7
+#define TRACE_ENABLE_EVENTS     8   // elapsed is the install barrier
+
+// What happened to a traced packet
+#define TRACE_ACTION_NONE       0
+#define TRACE_ACTION_NOFILTER   1   // matched no filter in effect
+#define TRACE_ACTION_PROCESS    2   // processed and raised as an event
+#define TRACE_ACTION_BUFFER     3   // buffered by a filter
+#define TRACE_ACTION_NOBUFFER   4   // flagged not to be buffered or dropped
+#define TRACE_ACTION_DROP       5   // dropped and raised as an event
+#define TRACE_ACTION_INJECTED   6   // passed back through after release
+#define TRACE_ACTION_RELEASE    7   // released from a filter's buffer
+#define TRACE_ACTION_REPROCESS  8   // sent back by the controller
+
+///// TYPEDEFS ///////////////////////////////////////////////////////////////
+typedef struct __attribute__((packed)) {
+    int64_t ts;         // nanoseconds since the epoch
+    int64_t elapsed;    // nanoseconds
+    int32_t id;         // filter or operation id; 0 for none
+    uint8_t type;
+    uint8_t action;
+    uint16_t thread;    // ring the record came from
+} TraceRecord;
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t dropped;   // records overwritten before they were dumped
+} TraceFileHeader;
+
+///// GLOBALS ////////////////////////////////////////////////////////////////
+extern int sdmbn_trace_enabled;
+
+///// FUNCTION PROTOTYPES ////////////////////////////////////////////////////
+static inline int sdmbn_trace_on()
+{ return __atomic_load_n(&sdmbn_trace_enabled, __ATOMIC_RELAXED); }
+
+int64_t sdmbn_trace_clock();
+void sdmbn_trace_record(int type, int action, int id, int64_t ts,
+        int64_t elapsed);
+int64_t sdmbn_trace_span(int type, int id, int64_t start);
+void sdmbn_trace_packet(int action, int id, const struct pcap_pkthdr *hdr);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
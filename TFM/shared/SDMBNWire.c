@@ -0,0 +1,241 @@
+#include "SDMBNConn.h"
+#include "SDMBNDebug.h"
+#include "SDMBNWire.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/uio.h>
+
+static void wire_compose_key(const PerflowKey *key, WireKey *wkey)
+{
+    memset(wkey, 0, sizeof(*wkey));
+    if (NULL == key)
+    {
+        wkey->wildcards = WILDCARD_ALL;
+        return;
+    }
+    wkey->nw_src = key->nw_src;
+    wkey->nw_src_mask = htonl(key->nw_src_mask);
+    wkey->nw_dst = key->nw_dst;
+    wkey->nw_dst_mask = htonl(key->nw_dst_mask);
+    wkey->tp_src = key->tp_src;
+    wkey->tp_dst = key->tp_dst;
+    wkey->dl_type = htons(key->dl_type);
+    wkey->nw_proto = key->nw_proto;
+    wkey->wildcards = key->wildcards;
+    wkey->tp_flip = key->tp_flip;
+}
+
+static void wire_parse_key(const WireKey *wkey, PerflowKey *key)
+{
+    bzero(key, sizeof(*key));
+    key->nw_src = wkey->nw_src;
+    key->nw_src_mask = ntohl(wkey->nw_src_mask);
+    key->nw_dst = wkey->nw_dst;
+    key->nw_dst_mask = ntohl(wkey->nw_dst_mask);
+    key->tp_src = wkey->tp_src;
+    key->tp_dst = wkey->tp_dst;
+    key->dl_type = ntohs(wkey->dl_type);
+    key->nw_proto = wkey->nw_proto;
+    key->wildcards = wkey->wildcards;
+    key->tp_flip = wkey->tp_flip;
+}
+
+static void wire_compose_header(WireHeader *hdr, int type, int id,
+        int hashkey, int seq, const PerflowKey *key, int len)
+{
+    hdr->magic = WIRE_MAGIC;
+    hdr->version = WIRE_VERSION;
+    hdr->type = type;
+    hdr->flags = 0;
+    hdr->id = htonl(id);
+    hdr->hashkey = htonl(hashkey);
+    hdr->seq = htonl(seq);
+    wire_compose_key(key, &hdr->key);
+    hdr->len = htonl(len);
+}
+
+/**
+  * Check whether a frame holds a binary message.
+  * @param frame Frame read from a connection
+  * @param len Length of the frame
+  * @return 1 if binary; 0 otherwise
+  */
+int wire_is_binary(const char *frame, int len)
+{ return (len > 0 && WIRE_MAGIC == (unsigned char)frame[0]); }
+
+/**
+  * Parse a binary message.
+  * @param frame Frame read with conn_reader_next or conn_read_len, which
+  *     NUL-terminate it
+  * @param len Length of the frame
+  * @param msg Location to store the message
+  * @return 1 on success; -1 if the frame is malformed
+  */
+int wire_parse(char *frame, int len, WireMsg *msg)
+{
+    if (NULL == frame || NULL == msg || len < (int)sizeof(WireHeader))
+    { return -1; }
+
+    WireHeader hdr;
+    memcpy(&hdr, frame, sizeof(hdr));
+    if (hdr.magic != WIRE_MAGIC || hdr.version != WIRE_VERSION)
+    {
+        ERROR_PRINT("Unsupported wire version %d", hdr.version);
+        return -1;
+    }
+    if (ntohl(hdr.len) != len - sizeof(hdr))
+    {
+        ERROR_PRINT("Wire payload length %u does not match frame length %d",
+                ntohl(hdr.len), len);
+        return -1;
+    }
+
+    msg->type = hdr.type;
+    msg->id = ntohl(hdr.id);
+    msg->hashkey = ntohl(hdr.hashkey);
+    msg->seq = ntohl(hdr.seq);
+    wire_parse_key(&hdr.key, &msg->key);
+    msg->payload = frame + sizeof(hdr);
+    msg->len = len - sizeof(hdr);
+    return 1;
+}
+
+/**
+  * Get the packet carried by a reprocess message.
+  * @param msg Parsed reprocess message
+  * @param hdr Location to store the packet header
+  * @param pkt Location to store a pointer to the packet, inside the frame
+  * @return 1 on success; -1 if the payload is malformed
+  */
+int wire_parse_packet(WireMsg *msg, struct pcap_pkthdr *hdr,
+        unsigned char **pkt)
+{
+    if (msg->len < (int)sizeof(WirePktHdr))
+    { return -1; }
+
+    WirePktHdr whdr;
+    memcpy(&whdr, msg->payload, sizeof(whdr));
+    bzero(hdr, sizeof(*hdr));
+    hdr->ts.tv_sec = ntohl(whdr.ts_sec);
+    hdr->ts.tv_usec = ntohl(whdr.ts_usec);
+    hdr->caplen = ntohl(whdr.caplen);
+    hdr->len = ntohl(whdr.len);
+    if (hdr->caplen != msg->len - sizeof(whdr))
+    { return -1; }
+
+    *pkt = (unsigned char *)msg->payload + sizeof(whdr);
+    return 1;
+}
+
+/**
+  * Get the next record of a state-batch message.
+  * @param batch Parsed state-batch message
+  * @param offset Offset of the next record in the batch payload; start at 0
+  * @param msg Location to store the record
+  * @return 1 if a record was stored; 0 at the end of the batch; -1 if the
+  *     batch is malformed
+  */
+int wire_parse_batch(WireMsg *batch, int *offset, WireMsg *msg)
+{
+    if (*offset >= batch->len)
+    { return 0; }
+
+    char *record = batch->payload + *offset;
+    int left = batch->len - *offset;
+    if (left < (int)(sizeof(WireHeader) + 1))
+    { return -1; }
+
+    WireHeader hdr;
+    memcpy(&hdr, record, sizeof(hdr));
+    int len = ntohl(hdr.len);
+    if (len < 0 || len > left - (int)sizeof(hdr) - 1)
+    { return -1; }
+
+    // Records are parsed like frames of their own, minus the trailing NUL
+    if (wire_parse(record, sizeof(hdr) + len, msg) < 0)
+    { return -1; }
+    *offset += wire_record_size(len);
+    return 1;
+}
+
+/**
+  * Get the number of bytes a state occupies in a state-batch message.
+  * @param statelen Length of the state, without its NUL
+  */
+int wire_record_size(int statelen)
+{ return sizeof(WireHeader) + statelen + 1; }
+
+/**
+  * Write one state-batch record.
+  * @param buf Location to write the record; wire_record_size bytes
+  * @return Number of bytes written
+  */
+int wire_compose_record(char *buf, int type, int id, PerflowKey *key,
+        const char *state, int statelen, int hashkey, int seq)
+{
+    WireHeader hdr;
+    wire_compose_header(&hdr, type, id, hashkey, seq, key, statelen);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), state, statelen);
+    buf[sizeof(hdr) + statelen] = '\0';
+    return wire_record_size(statelen);
+}
+
+/**
+  * Write the header of a state-batch message.
+  * @param buf Location to write the header; sizeof(WireHeader) bytes
+  * @param count Number of records following the header
+  * @param len Total length of the records
+  */
+void wire_compose_batch(char *buf, int id, int count, int len)
+{
+    WireHeader hdr;
+    wire_compose_header(&hdr, WIRE_STATE_BATCH, id, -1, count, NULL, len);
+    memcpy(buf, &hdr, sizeof(hdr));
+}
+
+/**
+  * Send state, or a put of state, as a binary message.
+  * @return Number of bytes sent; -1 on error
+  */
+int wire_send_state(int conn, int type, int id, PerflowKey *key,
+        char *state, int hashkey, int seq)
+{
+    int len = strlen(state);
+    WireHeader hdr;
+    wire_compose_header(&hdr, type, id, hashkey, seq, key, len);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = state;
+    iov[1].iov_len = len;
+    return conn_writev_frame(conn, iov, 2);
+}
+
+/**
+  * Send a reprocess event as a binary message.
+  * @return Number of bytes sent; -1 on error
+  */
+int wire_send_reprocess(int conn, int id, int hashkey,
+        const struct pcap_pkthdr *hdr, const unsigned char *pkt)
+{
+    WireHeader whdr;
+    wire_compose_header(&whdr, WIRE_REPROCESS, id, hashkey, 0, NULL,
+            sizeof(WirePktHdr) + hdr->caplen);
+
+    WirePktHdr phdr;
+    phdr.ts_sec = htonl(hdr->ts.tv_sec);
+    phdr.ts_usec = htonl(hdr->ts.tv_usec);
+    phdr.caplen = htonl(hdr->caplen);
+    phdr.len = htonl(hdr->len);
+
+    struct iovec iov[3];
+    iov[0].iov_base = &whdr;
+    iov[0].iov_len = sizeof(whdr);
+    iov[1].iov_base = &phdr;
+    iov[1].iov_len = sizeof(phdr);
+    iov[2].iov_base = (void *)pkt;
+    iov[2].iov_len = hdr->caplen;
+    return conn_writev_frame(conn, iov, 3);
+}
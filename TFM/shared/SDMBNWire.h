@@ -0,0 +1,104 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _SDMBNWire_H_
+#define _SDMBNWire_H_
+
+#include "SDMBN.h"
+#include <stdint.h>
+#include <pcap.h>
+
+// Binary messages travel in the same length-prefixed frames as JSON ones.
+// A frame holds a WireHeader followed by header.len bytes of payload:
+//   state-perflow, state-multiflow, put-perflow, put-multiflow
+//       the state string, without its terminating NUL
+//   reprocess
+//       a WirePktHdr followed by caplen bytes of packet
+//   state-batch
+//       seq records, each a state-perflow or state-multiflow message whose
+//       state is followed by a NUL not counted in its header.len
+// JSON frames always start with '{', so receivers tell the two apart by the
+// first byte.  Binary frames are only sent on a channel once the controller
+// has answered the SYN with a syn-ack naming CONSTANT_WIRE_BINARY.
+
+///// DEFINES ////////////////////////////////////////////////////////////////
+#define WIRE_MAGIC                  0xB5
+#define WIRE_VERSION                1
+
+#define WIRE_STATE_PERFLOW          1
+#define WIRE_STATE_MULTIFLOW        2
+#define WIRE_PUT_PERFLOW            3
+#define WIRE_PUT_MULTIFLOW          4
+#define WIRE_REPROCESS              5
+#define WIRE_STATE_BATCH            6
+
+///// TYPEDEFS ///////////////////////////////////////////////////////////////
+// PerflowKey with a fixed layout; addresses and ports are already in network
+// byte order, the remaining multi-byte fields are converted
+typedef struct __attribute__((packed)) {
+    uint32_t nw_src;
+    uint32_t nw_src_mask;
+    uint32_t nw_dst;
+    uint32_t nw_dst_mask;
+    uint16_t tp_src;
+    uint16_t tp_dst;
+    uint16_t dl_type;
+    uint8_t nw_proto;
+    uint8_t wildcards;
+    uint8_t tp_flip;
+    uint8_t pad[3];
+} WireKey;
+
+// All fields in network byte order
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    int32_t id;
+    int32_t hashkey;
+    int32_t seq;
+    WireKey key;
+    uint32_t len;       // payload bytes following the header
+} WireHeader;
+
+// struct pcap_pkthdr differs between 32 and 64 bit hosts; this does not
+typedef struct __attribute__((packed)) {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t caplen;
+    uint32_t len;
+} WirePktHdr;
+
+// A received binary message, in host byte order
+typedef struct {
+    int type;
+    int id;
+    int hashkey;
+    int seq;
+    PerflowKey key;
+    char *payload;      // points into the frame; NUL-terminated
+    int len;
+} WireMsg;
+
+///// FUNCTION PROTOTYPES ////////////////////////////////////////////////////
+int wire_is_binary(const char *frame, int len);
+int wire_parse(char *frame, int len, WireMsg *msg);
+int wire_parse_packet(WireMsg *msg, struct pcap_pkthdr *hdr,
+        unsigned char **pkt);
+int wire_parse_batch(WireMsg *batch, int *offset, WireMsg *msg);
+int wire_record_size(int statelen);
+int wire_compose_record(char *buf, int type, int id, PerflowKey *key,
+        const char *state, int statelen, int hashkey, int seq);
+void wire_compose_batch(char *buf, int id, int count, int len);
+int wire_send_state(int conn, int type, int id, PerflowKey *key,
+        char *state, int hashkey, int seq);
+int wire_send_reprocess(int conn, int id, int hashkey,
+        const struct pcap_pkthdr *hdr, const unsigned char *pkt);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,18 +5,25 @@
 #include "SDMBNJson.h"
 #include "SDMBNDebug.h"
 #include "SDMBNConn.h"
+#include "SDMBNWire.h"
+#include "SDMBNTrace.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pcap/pcap.h>
 #include <errno.h>
+#include <time.h>
 
 // Thread for handling event messages
 static pthread_t event_thread;
@@ -24,27 +31,29 @@ static pthread_t event_thread;
 // Connection for event messages
 int sdmbn_conn_event = -1;
 
-// List of event filters
-static EventFilter *sdmbn_event_filters = NULL;
+// Whether the controller accepted binary messages on the event channel
+int sdmbn_wire_event = 0;
 
-static pthread_mutex_t lock_processing_pkt;
-//static pthread_mutex_t lock_event_filters;
-//wangynag
-typedef struct {
-    int pkt_num;
-    struct timeval ts;
-    int type;    //0:infly  1:redirect   2:dst
-}Timeinfo;
-static Timeinfo pkttime[1000000];
-int pkt_num = 0;
-inline wy_record_pkt_time(struct timeval ts,int type)
-{
-    pkttime[pkt_num].ts = ts;
-    pkttime[pkt_num].type = type;
-    pkttime[pkt_num].pkt_num = pkt_num + 1;
-    pkt_num++;
-    return;
-}
+// Number of installed event filters
+static int sdmbn_event_filter_count = 0;
+
+// Packet counters are updated by every processing thread
+#define STATS_INC(field)    __sync_fetch_and_add(&(sdmbn_stats.field), 1)
+
+// Install order of event filters
+static unsigned int sdmbn_event_filter_seq = 0;
+
+// Packets seen by sdmbn_preprocess_packet; install barriers are expressed
+// in this sequence
+static uint64_t sdmbn_pkt_seq = 0;
+
+// Idle buffer chunks
+static BufferChunk *sdmbn_buffer_pool = NULL;
+static int sdmbn_buffer_pool_count = 0;
+static pthread_mutex_t lock_buffer_pool = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while this thread re-injects buffered packets
+static __thread int sdmbn_releasing = 0;
 
 static void send_error(int id, int hashkey, char *cause)
 {
@@ -53,156 +62,1040 @@ static void send_error(int id, int hashkey, char *cause)
     json_object_put(error);
 }
 
-static void send_events_ack(int id)
+static void send_events_ack(int id, int64_t quiesce, uint64_t seq)
 {
-    json_object *ack = json_compose_events_ack(id);
+    json_object *ack = json_compose_events_ack(id, quiesce, seq);
     json_send(ack, sdmbn_conn_state);
     json_object_put(ack);
 }
 
-static int events_add_filter(PerflowKey *key, char *action, int id)
+///// EPOCHS ////////////////////////////////////////////////////////////////
+// The packet path reads the filter table without locks.  Each reading
+// thread publishes the global epoch it entered in; writers unlink objects,
+// retire them with the current epoch and advance it.  A retired object is
+// freed once every thread inside a read section entered in a later epoch.
+
+#define RCU_LOAD(p)         __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define RCU_STORE(p, v)     __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+typedef struct _EpochSlot {
+    uint64_t epoch;     // 0 outside a read section
+    struct _EpochSlot *next;
+} EpochSlot;
+
+typedef struct _EpochRetired {
+    void *ptr;
+    void (*destroy)(void *);
+    uint64_t epoch;
+    struct _EpochRetired *next;
+} EpochRetired;
+
+static uint64_t sdmbn_epoch = 1;
+
+// Reader slots, one per thread that ever processed a packet
+static EpochSlot *sdmbn_epoch_slots = NULL;
+static pthread_mutex_t lock_epoch_slots = PTHREAD_MUTEX_INITIALIZER;
+static __thread EpochSlot *epoch_slot = NULL;
+static __thread int epoch_depth = 0;
+
+// Objects waiting to be freed; only touched with lock_event_filters held
+static EpochRetired *sdmbn_epoch_retired = NULL;
+
+static void epoch_enter()
 {
+    if (epoch_depth++ > 0)
+    { return; }
 
-    struct timeval ts;
-    gettimeofday(&ts, NULL);
-    double s;
-    double m;
-    m = ts.tv_usec+100*1000;
-    s = ts.tv_sec;
-    if (m > 1000000)
+    EpochSlot *slot = epoch_slot;
+    if (NULL == slot)
     {
-	 s++;
-         m = m - 1000000;
+        slot = (EpochSlot *)calloc(1, sizeof(EpochSlot));
+        assert(slot != NULL);
+        pthread_mutex_lock(&lock_epoch_slots);
+        slot->next = sdmbn_epoch_slots;
+        RCU_STORE(sdmbn_epoch_slots, slot);
+        pthread_mutex_unlock(&lock_epoch_slots);
+        epoch_slot = slot;
     }
-    do 
+    __atomic_store_n(&(slot->epoch), RCU_LOAD(sdmbn_epoch), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void epoch_exit()
+{
+    if (--epoch_depth > 0)
+    { return; }
+    __atomic_store_n(&(epoch_slot->epoch), 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_retire(void *ptr, void (*destroy)(void *))
+{
+    EpochRetired *retired = (EpochRetired *)malloc(sizeof(EpochRetired));
+    if (NULL == retired)
     {
-        gettimeofday(&ts, NULL);
-        STATS_PRINT("wait");
-        if(ts.tv_sec >=s && ts.tv_usec >= m)
-            break;
-    }while(1);
+        // Leak rather than free something a reader may hold
+        ERROR_PRINT("Failed to retire %p", ptr);
+        return;
+    }
+    retired->ptr = ptr;
+    retired->destroy = destroy;
+    retired->epoch = __atomic_fetch_add(&sdmbn_epoch, 1, __ATOMIC_SEQ_CST);
+    retired->next = sdmbn_epoch_retired;
+    sdmbn_epoch_retired = retired;
+}
 
-    printf("function:events_add_filter");
-    EventFilter* filter = (EventFilter*)malloc(sizeof(EventFilter));
-    memcpy(&(filter->key), key, sizeof(PerflowKey));
-    if (0 == strcmp(action, CONSTANT_ACTION_DROP))
-    { filter->action = EVENT_ACTION_DROP; }
-    else if (0 == strcmp(action, CONSTANT_ACTION_BUFFER))
-    { filter->action = EVENT_ACTION_BUFFER; }
-    else if (0 == strcmp(action, CONSTANT_ACTION_PROCESS))
-    { filter->action = EVENT_ACTION_PROCESS; }
-    filter->id = id;
+// Waits until every read section entered before the call has exited
+static void epoch_synchronize()
+{
+    uint64_t target = __atomic_add_fetch(&sdmbn_epoch, 1, __ATOMIC_SEQ_CST);
+    EpochSlot *slot = RCU_LOAD(sdmbn_epoch_slots);
+    while (slot != NULL)
+    {
+        uint64_t epoch = __atomic_load_n(&(slot->epoch), __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < target)
+        { 
+            sched_yield(); 
+            continue;
+        }
+        slot = slot->next;
+    }
+}
 
-    filter->bufferHead = NULL;
-    filter->bufferTail = NULL;
-    if (pthread_mutex_init(&(filter->bufferLock), NULL) < 0)
+// Frees retired objects no reader can still hold
+static void epoch_reclaim()
+{
+    if (NULL == sdmbn_epoch_retired)
+    { return; }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t oldest = UINT64_MAX;
+    EpochSlot *slot = RCU_LOAD(sdmbn_epoch_slots);
+    while (slot != NULL)
+    {
+        uint64_t epoch = __atomic_load_n(&(slot->epoch), __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < oldest)
+        { oldest = epoch; }
+        slot = slot->next;
+    }
+
+    EpochRetired **prev = &sdmbn_epoch_retired;
+    while (*prev != NULL)
+    {
+        EpochRetired *retired = *prev;
+        if (retired->epoch < oldest)
+        {
+            *prev = retired->next;
+            retired->destroy(retired->ptr);
+            free(retired);
+        }
+        else
+        { prev = &(retired->next); }
+    }
+}
+
+///// FILTER TABLE //////////////////////////////////////////////////////////
+// Event filters are indexed by tuple space search.  Filters that specify the
+// same fields with the same prefix lengths share a tuple, and each tuple is
+// a hash table keyed on those fields after masking.  Matching a packet costs
+// one probe per tuple, so an exact 5-tuple filter per migrated flow keeps
+// lookup O(1) however many flows are moving.  A filter with tp_flip set is
+// indexed a second time with its ports swapped.
+//
+// Keys are compared in the byte order the controller uses for PerflowKey:
+// addresses and ports in network order, dl_type in host order.
+//
+// Lookups run inside an epoch read section and take no locks.  Writers
+// hold lock_event_filters, publish every link with RCU_STORE and retire
+// what they unlink.  Growing a tuple copies its entries into a new bucket
+// array, so a reader never follows a chain that is being relinked.
+
+typedef struct {
+    uint32_t nw_src;
+    uint32_t nw_dst;
+    uint16_t tp_src;
+    uint16_t tp_dst;
+    uint16_t dl_type;
+    uint8_t nw_proto;
+    uint8_t pad;
+} FilterKey;
+
+typedef struct _FilterEntry {
+    FilterKey key;
+    EventFilter *filter;
+    struct _FilterEntry *next;
+} FilterEntry;
+
+typedef struct {
+    unsigned int nbuckets;
+    FilterEntry *buckets[];
+} FilterBuckets;
+
+typedef struct _FilterTuple {
+    FilterKey mask;
+    uint8_t fields;     // WILDCARD_* bits a packet must have to match
+    int count;
+    FilterBuckets *table;
+    struct _FilterTuple *next;
+} FilterTuple;
+
+#define FILTER_TUPLE_MIN_BUCKETS    16
+
+// List of filter tuples
+static FilterTuple *sdmbn_filter_tuples = NULL;
+
+// Serializes changes to the filter table
+static pthread_mutex_t lock_event_filters = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t filter_prefix_mask(int wildcard, uint32_t len)
+{
+    if (wildcard || len >= 32)
+    { return 0xFFFFFFFF; }
+    if (0 == len)
+    { return 0; }
+    return htonl(0xFFFFFFFF << (32 - len));
+}
+
+static void filter_key_from_perflow(const PerflowKey *pkey, FilterKey *key)
+{
+    key->nw_src = pkey->nw_src;
+    key->nw_dst = pkey->nw_dst;
+    key->tp_src = pkey->tp_src;
+    key->tp_dst = pkey->tp_dst;
+    key->dl_type = pkey->dl_type;
+    key->nw_proto = pkey->nw_proto;
+    key->pad = 0;
+}
+
+static void filter_mask_from_perflow(const PerflowKey *pkey, FilterKey *mask)
+{
+    bzero(mask, sizeof(*mask));
+    if (!(pkey->wildcards & WILDCARD_DL_TYPE))
+    { mask->dl_type = 0xFFFF; }
+    if (!(pkey->wildcards & WILDCARD_NW_SRC))
     { 
-        ERROR_PRINT("Failed to initialize buffer lock for filter"); 
-        return -1;
+        mask->nw_src = filter_prefix_mask(
+                pkey->wildcards & WILDCARD_NW_SRC_MASK, pkey->nw_src_mask); 
     }
+    if (!(pkey->wildcards & WILDCARD_NW_DST))
+    { 
+        mask->nw_dst = filter_prefix_mask(
+                pkey->wildcards & WILDCARD_NW_DST_MASK, pkey->nw_dst_mask); 
+    }
+    if (!(pkey->wildcards & WILDCARD_NW_PROTO))
+    { mask->nw_proto = 0xFF; }
+    if (!(pkey->wildcards & WILDCARD_TP_SRC))
+    { mask->tp_src = 0xFFFF; }
+    if (!(pkey->wildcards & WILDCARD_TP_DST))
+    { mask->tp_dst = 0xFFFF; }
+}
 
-//    pthread_mutex_lock(&lock_event_filters);
-    filter->next = sdmbn_event_filters;
-    sdmbn_event_filters = filter;
-//    pthread_mutex_unlock(&lock_event_filters);
-    return 1;
+static void filter_key_apply(const FilterKey *key, const FilterKey *mask,
+        FilterKey *result)
+{
+    result->nw_src = key->nw_src & mask->nw_src;
+    result->nw_dst = key->nw_dst & mask->nw_dst;
+    result->tp_src = key->tp_src & mask->tp_src;
+    result->tp_dst = key->tp_dst & mask->tp_dst;
+    result->dl_type = key->dl_type & mask->dl_type;
+    result->nw_proto = key->nw_proto & mask->nw_proto;
+    result->pad = 0;
 }
 
-static void events_remove_filter(PerflowKey *key)
+static void filter_key_swap_ports(FilterKey *key)
 {
-    //STATS_PRINT("function:events_remove_filter");
-    double receiveTime, releaseTime;
-    int write_len = -1;
+    uint16_t tmp = key->tp_src;
+    key->tp_src = key->tp_dst;
+    key->tp_dst = tmp;
+}
 
-    // Find filter
-//    pthread_mutex_lock(&lock_event_filters);
-    EventFilter *filter = sdmbn_event_filters;
-    while (filter != NULL)
+static uint32_t filter_key_hash(const FilterKey *key)
+{
+    uint64_t a, b;
+    memcpy(&a, key, sizeof(a));
+    memcpy(&b, (const char *)key + sizeof(a), sizeof(b));
+    uint64_t h = (a * 0x9E3779B97F4A7C15ULL) ^ b;
+    h ^= h >> 32;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 29;
+    return (uint32_t)h;
+}
+
+static FilterBuckets *filter_buckets_alloc(unsigned int nbuckets)
+{
+    FilterBuckets *table = (FilterBuckets *)calloc(1, sizeof(FilterBuckets) 
+            + nbuckets * sizeof(FilterEntry *));
+    if (table != NULL)
+    { table->nbuckets = nbuckets; }
+    return table;
+}
+
+// Destroys a bucket array and the entries chained from it
+static void filter_buckets_destroy(void *ptr)
+{
+    FilterBuckets *table = (FilterBuckets *)ptr;
+    unsigned int i;
+    for (i = 0; i < table->nbuckets; i++)
     {
-        if (0 == memcmp(&(filter->key), key, sizeof(PerflowKey)))
-        { break; }
-        filter = filter->next;
+        FilterEntry *entry = table->buckets[i];
+        while (entry != NULL)
+        {
+            FilterEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
     }
-//    pthread_mutex_unlock(&lock_event_filters);
+    free(table);
+}
 
-    if (filter != NULL)
+static void filter_tuple_destroy(void *ptr)
+{
+    FilterTuple *tuple = (FilterTuple *)ptr;
+    filter_buckets_destroy(tuple->table);
+    free(tuple);
+}
+
+static FilterTuple *filter_tuple_find(const FilterKey *mask)
+{
+    FilterTuple *tuple = sdmbn_filter_tuples;
+    while (tuple != NULL)
     {
-        // Release bufferred events
-        pthread_mutex_lock(&(filter->bufferLock));
-        INFO_PRINT("Release buffered events (head=%p)", filter->bufferHead);
-        while (filter->bufferHead != NULL)
-        {
-            BufferedPkt *entry = filter->bufferHead;
-            pthread_mutex_unlock(&(filter->bufferLock));
+        if (0 == memcmp(&(tuple->mask), mask, sizeof(FilterKey)))
+        { return tuple; }
+        tuple = tuple->next;
+    }
+    return NULL;
+}
 
-            if (sdmbn_locals->process_packet != NULL)
-            {
-	        //context->injected = 1;
-                write_len = sdmbn_locals->process_packet(&(entry->hdr), 
-                        entry->pkt);
-            }
+static FilterTuple *filter_tuple_create(const FilterKey *mask)
+{
+    FilterTuple *tuple = (FilterTuple *)malloc(sizeof(FilterTuple));
+    if (NULL == tuple)
+    { return NULL; }
+    memcpy(&(tuple->mask), mask, sizeof(FilterKey));
+    tuple->fields = 0;
+    if (mask->dl_type)
+    { tuple->fields |= WILDCARD_DL_TYPE; }
+    if (mask->nw_src)
+    { tuple->fields |= WILDCARD_NW_SRC; }
+    if (mask->nw_dst)
+    { tuple->fields |= WILDCARD_NW_DST; }
+    if (mask->nw_proto)
+    { tuple->fields |= WILDCARD_NW_PROTO; }
+    if (mask->tp_src)
+    { tuple->fields |= WILDCARD_TP_SRC; }
+    if (mask->tp_dst)
+    { tuple->fields |= WILDCARD_TP_DST; }
+    tuple->count = 0;
+    tuple->table = filter_buckets_alloc(FILTER_TUPLE_MIN_BUCKETS);
+    if (NULL == tuple->table)
+    {
+        free(tuple);
+        return NULL;
+    }
+    tuple->next = sdmbn_filter_tuples;
+    RCU_STORE(sdmbn_filter_tuples, tuple);
+    return tuple;
+}
 
-            if (write_len < 0)
+static void filter_tuple_unlink(FilterTuple *tuple)
+{
+    FilterTuple **prev = &sdmbn_filter_tuples;
+    while (*prev != NULL && *prev != tuple)
+    { prev = &((*prev)->next); }
+    if (*prev != NULL)
+    { RCU_STORE(*prev, tuple->next); }
+    epoch_retire(tuple, filter_tuple_destroy);
+}
+
+static void filter_tuple_grow(FilterTuple *tuple)
+{
+    FilterBuckets *old = tuple->table;
+    FilterBuckets *table = filter_buckets_alloc(old->nbuckets * 2);
+    if (NULL == table)
+    { return; }
+
+    // Copy entries, keeping equal keys in newest-first order
+    unsigned int i;
+    for (i = 0; i < old->nbuckets; i++)
+    {
+        FilterEntry *entry;
+        FilterEntry **tails[2] = { NULL, NULL };
+        for (entry = old->buckets[i]; entry != NULL; entry = entry->next)
+        {
+            FilterEntry *copy = (FilterEntry *)malloc(sizeof(FilterEntry));
+            if (NULL == copy)
             {
-                ERROR_PRINT("Failed to release buffered packet of len %d",
-                        entry->hdr.caplen)
+                filter_buckets_destroy(table);
+                return;
             }
+            memcpy(copy, entry, sizeof(FilterEntry));
+            copy->next = NULL;
+
+            unsigned int b = filter_key_hash(&(copy->key)) 
+                & (table->nbuckets - 1);
+            int half = (b != i);
+            if (NULL == tails[half])
+            { table->buckets[b] = copy; }
             else
+            { *tails[half] = copy; }
+            tails[half] = &(copy->next);
+        }
+    }
+
+    RCU_STORE(tuple->table, table);
+    epoch_retire(old, filter_buckets_destroy);
+}
+
+static int filter_tuple_insert(const FilterKey *mask, const FilterKey *key,
+        EventFilter *filter)
+{
+    FilterTuple *tuple = filter_tuple_find(mask);
+    if (NULL == tuple)
+    { tuple = filter_tuple_create(mask); }
+    if (NULL == tuple)
+    { return -1; }
+
+    FilterEntry *entry = (FilterEntry *)malloc(sizeof(FilterEntry));
+    if (NULL == entry)
+    { 
+        if (0 == tuple->count)
+        { filter_tuple_unlink(tuple); }
+        return -1; 
+    }
+    filter_key_apply(key, mask, &(entry->key));
+    entry->filter = filter;
+
+    if (tuple->count >= (int)tuple->table->nbuckets)
+    { filter_tuple_grow(tuple); }
+    FilterBuckets *table = tuple->table;
+    unsigned int b = filter_key_hash(&(entry->key)) & (table->nbuckets - 1);
+    entry->next = table->buckets[b];
+    RCU_STORE(table->buckets[b], entry);
+    tuple->count++;
+    return 1;
+}
+
+static void filter_tuple_remove(const FilterKey *mask, const FilterKey *key,
+        EventFilter *filter)
+{
+    FilterTuple *tuple = filter_tuple_find(mask);
+    if (NULL == tuple)
+    { return; }
+
+    FilterKey mkey;
+    filter_key_apply(key, mask, &mkey);
+    FilterBuckets *table = tuple->table;
+    unsigned int b = filter_key_hash(&mkey) & (table->nbuckets - 1);
+    FilterEntry **prev = &(table->buckets[b]);
+    while (*prev != NULL)
+    {
+        FilterEntry *entry = *prev;
+        if (entry->filter == filter)
+        {
+            RCU_STORE(*prev, entry->next);
+            epoch_retire(entry, free);
+            tuple->count--;
+            break;
+        }
+        prev = &(entry->next);
+    }
+
+    if (0 == tuple->count)
+    { filter_tuple_unlink(tuple); }
+}
+
+// Computes the index positions of a filter: its own, and for tp_flip filters
+// the one with ports swapped.  Returns the number of positions.
+static int filter_positions(const PerflowKey *pkey, FilterKey masks[2],
+        FilterKey keys[2])
+{
+    filter_mask_from_perflow(pkey, &masks[0]);
+    filter_key_from_perflow(pkey, &keys[0]);
+    if (!pkey->tp_flip || (0 == masks[0].tp_src && 0 == masks[0].tp_dst))
+    { return 1; }
+
+    masks[1] = masks[0];
+    keys[1] = keys[0];
+    filter_key_swap_ports(&masks[1]);
+    filter_key_swap_ports(&keys[1]);
+
+    FilterKey a, b;
+    filter_key_apply(&keys[0], &masks[0], &a);
+    filter_key_apply(&keys[1], &masks[1], &b);
+    if (0 == memcmp(&masks[0], &masks[1], sizeof(FilterKey))
+            && 0 == memcmp(&a, &b, sizeof(FilterKey)))
+    { return 1; }
+    return 2;
+}
+
+// Must be called with lock_event_filters held
+static int filter_table_insert(EventFilter *filter)
+{
+    FilterKey masks[2], keys[2];
+    int n = filter_positions(&(filter->key), masks, keys);
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (filter_tuple_insert(&masks[i], &keys[i], filter) < 0)
+        {
+            while (--i >= 0)
+            { filter_tuple_remove(&masks[i], &keys[i], filter); }
+            return -1;
+        }
+    }
+    __atomic_add_fetch(&sdmbn_event_filter_count, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Must be called with lock_event_filters held
+static void filter_table_remove(EventFilter *filter)
+{
+    FilterKey masks[2], keys[2];
+    int n = filter_positions(&(filter->key), masks, keys);
+    int i;
+    for (i = 0; i < n; i++)
+    { filter_tuple_remove(&masks[i], &keys[i], filter); }
+    __atomic_sub_fetch(&sdmbn_event_filter_count, 1, __ATOMIC_RELEASE);
+}
+
+// Finds the newest filter installed with exactly this key.  Must be called
+// with lock_event_filters held.
+static EventFilter *filter_table_find(PerflowKey *pkey)
+{
+    FilterKey mask, key, mkey;
+    filter_mask_from_perflow(pkey, &mask);
+    filter_key_from_perflow(pkey, &key);
+    FilterTuple *tuple = filter_tuple_find(&mask);
+    if (NULL == tuple)
+    { return NULL; }
+
+    filter_key_apply(&key, &mask, &mkey);
+    FilterBuckets *table = tuple->table;
+    unsigned int b = filter_key_hash(&mkey) & (table->nbuckets - 1);
+    FilterEntry *entry = table->buckets[b];
+    while (entry != NULL)
+    {
+        if (0 == memcmp(&(entry->filter->key), pkey, sizeof(PerflowKey)))
+        { return entry->filter; }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+// Finds the newest filter matching a packet.  Must be called inside an
+// epoch read section, which the returned filter stays valid for.
+static EventFilter *filter_table_lookup(const PerflowKey *pkey)
+{
+    FilterKey key, mkey;
+    filter_key_from_perflow(pkey, &key);
+    uint8_t fields = ~pkey->wildcards;
+
+    EventFilter *match = NULL;
+    FilterTuple *tuple = RCU_LOAD(sdmbn_filter_tuples);
+    while (tuple != NULL)
+    {
+        if ((tuple->fields & fields) != tuple->fields)
+        { 
+            tuple = RCU_LOAD(tuple->next);
+            continue; 
+        }
+
+        filter_key_apply(&key, &(tuple->mask), &mkey);
+        FilterBuckets *table = RCU_LOAD(tuple->table);
+        unsigned int b = filter_key_hash(&mkey) & (table->nbuckets - 1);
+        FilterEntry *entry = RCU_LOAD(table->buckets[b]);
+        while (entry != NULL)
+        {
+            if (0 == memcmp(&(entry->key), &mkey, sizeof(FilterKey)))
             {
-                //DEBUG_PRINT("Released buffered packet of len %d", 
-                //        entry->hdr.caplen);
-                //
-                /*           
-                receiveTime = entry->hdr.ts.tv_sec +
-                        0.000001 * entry->hdr.ts.tv_usec;
-                struct timeval ts;
-                gettimeofday(&ts, NULL);
-                releaseTime = ts.tv_sec + 0.000001 * ts.tv_usec;
-                INFO_PRINT("WAIT TIME = %f = RELEASE TIME = %f", releaseTime - receiveTime,releaseTime);
-                */
-                sdmbn_stats.pkts_release_count++;
+                if (NULL == match || entry->filter->seq > match->seq)
+                { match = entry->filter; }
+                break;
             }
+            entry = RCU_LOAD(entry->next);
+        }
+        tuple = RCU_LOAD(tuple->next);
+    }
+    return match;
+}
 
-	    free((void*)entry->pkt);
-            pthread_mutex_lock(&(filter->bufferLock));
-            filter->bufferHead  = entry->next;
-            if (NULL == filter->bufferHead)
-            { filter->bufferTail = NULL; }
-            free(entry);
+///// PACKET BUFFERS ////////////////////////////////////////////////////////
+// Packets buffered by a filter are copied back to back into a chain of
+// chunks.  Standard chunks come from a shared pool and go back to it when
+// released; a packet too large for one gets a chunk of its own, which is
+// freed.  Releasing a filter's buffer detaches the whole chain under one
+// lock and re-injects it without holding any.
+
+#define BUFFER_CHUNK_DATA   (BUFFER_CHUNK_SIZE - sizeof(BufferChunk))
+
+static unsigned int buffer_record_size(unsigned int caplen)
+{
+    return (sizeof(BufferedPkt) + caplen + BUFFER_ALIGN - 1) 
+        & ~(BUFFER_ALIGN - 1);
+}
+
+static BufferChunk *buffer_chunk_alloc(unsigned int need)
+{
+    BufferChunk *chunk = NULL;
+    if (need <= BUFFER_CHUNK_DATA)
+    {
+        pthread_mutex_lock(&lock_buffer_pool);
+        chunk = sdmbn_buffer_pool;
+        if (chunk != NULL)
+        {
+            sdmbn_buffer_pool = chunk->next;
+            sdmbn_buffer_pool_count--;
         }
+        pthread_mutex_unlock(&lock_buffer_pool);
+
+        if (NULL == chunk)
+        { chunk = (BufferChunk *)malloc(BUFFER_CHUNK_SIZE); }
+        if (NULL == chunk)
+        { return NULL; }
+        chunk->size = BUFFER_CHUNK_DATA;
+    }
+    else
+    {
+        chunk = (BufferChunk *)malloc(sizeof(BufferChunk) + need);
+        if (NULL == chunk)
+        { return NULL; }
+        chunk->size = need;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    return chunk;
+}
+
+// Returns a chain of chunks to the pool
+static void buffer_chunks_free(BufferChunk *chain)
+{
+    BufferChunk *keep = NULL, *keepTail = NULL;
+    int nkeep = 0;
+    while (chain != NULL)
+    {
+        BufferChunk *chunk = chain;
+        chain = chunk->next;
+        if (chunk->size != BUFFER_CHUNK_DATA)
+        { 
+            free(chunk); 
+            continue;
+        }
+        chunk->next = keep;
+        keep = chunk;
+        if (NULL == keepTail)
+        { keepTail = chunk; }
+        nkeep++;
+    }
+    if (NULL == keep)
+    { return; }
+
+    pthread_mutex_lock(&lock_buffer_pool);
+    while (keep != NULL && sdmbn_buffer_pool_count + nkeep > BUFFER_POOL_MAX)
+    {
+        BufferChunk *chunk = keep;
+        keep = chunk->next;
+        free(chunk);
+        nkeep--;
+    }
+    if (keep != NULL)
+    {
+        keepTail->next = sdmbn_buffer_pool;
+        sdmbn_buffer_pool = keep;
+        sdmbn_buffer_pool_count += nkeep;
+    }
+    pthread_mutex_unlock(&lock_buffer_pool);
+}
+
+static int buffer_pool_init()
+{
+    BufferChunk *chain = NULL;
+    int i;
+    for (i = 0; i < BUFFER_POOL_PREALLOC; i++)
+    {
+        BufferChunk *chunk = (BufferChunk *)malloc(BUFFER_CHUNK_SIZE);
+        if (NULL == chunk)
+        { break; }
+        chunk->size = BUFFER_CHUNK_DATA;
+        chunk->next = chain;
+        chain = chunk;
+    }
+    buffer_chunks_free(chain);
+    return (i == BUFFER_POOL_PREALLOC ? 1 : -1);
+}
+
+static void buffer_pool_cleanup()
+{
+    pthread_mutex_lock(&lock_buffer_pool);
+    while (sdmbn_buffer_pool != NULL)
+    {
+        BufferChunk *chunk = sdmbn_buffer_pool;
+        sdmbn_buffer_pool = chunk->next;
+        free(chunk);
+    }
+    sdmbn_buffer_pool_count = 0;
+    pthread_mutex_unlock(&lock_buffer_pool);
+}
+
+// Returns 1 if the packet was buffered, 0 if the buffer is already closed,
+// or -1 if no space could be allocated
+static int buffer_append(EventFilter *filter, const struct pcap_pkthdr *hdr,
+        const unsigned char *pkt)
+{
+    unsigned int size = buffer_record_size(hdr->caplen);
+
+    pthread_mutex_lock(&(filter->bufferLock));
+    if (filter->bufferClosed)
+    {
+        pthread_mutex_unlock(&(filter->bufferLock));
+        return 0;
+    }
+    BufferChunk *chunk = filter->bufferTail;
+    if (NULL == chunk || chunk->used + size > chunk->size)
+    {
+        chunk = buffer_chunk_alloc(size);
+        if (NULL == chunk)
+        {
+            pthread_mutex_unlock(&(filter->bufferLock));
+            return -1;
+        }
+        if (NULL == filter->bufferTail)
+        { filter->bufferHead = chunk; }
+        else
+        { filter->bufferTail->next = chunk; }
+        filter->bufferTail = chunk;
+    }
+
+    BufferedPkt *entry = (BufferedPkt *)(chunk->data + chunk->used);
+    memcpy(&(entry->hdr), hdr, sizeof(struct pcap_pkthdr));
+    memcpy(entry->pkt, pkt, hdr->caplen);
+    chunk->used += size;
+    pthread_mutex_unlock(&(filter->bufferLock));
+    return 1;
+}
+
+// Re-injects everything buffered by a filter, in arrival order, then
+// closes the buffer.  It is closed only once seen empty, so a packet that
+// finds it closed is processed after every packet buffered before it.
+static void buffer_release(EventFilter *filter)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&(filter->bufferLock));
+        BufferChunk *chain = filter->bufferHead;
+        filter->bufferHead = NULL;
+        filter->bufferTail = NULL;
+        if (NULL == chain)
+        { filter->bufferClosed = 1; }
         pthread_mutex_unlock(&(filter->bufferLock));
+        if (NULL == chain)
+        { break; }
 
-        // Remove filter
-        EventFilter *prev = NULL;
-//        pthread_mutex_lock(&lock_event_filters);
-        EventFilter *curr = sdmbn_event_filters;
-        while (curr != NULL)
+        INFO_PRINT("Release buffered events (head=%p)", chain);
+        sdmbn_releasing = 1;
+        BufferChunk *chunk;
+        for (chunk = chain; chunk != NULL; chunk = chunk->next)
         {
-            if (curr == filter)
+            unsigned int off = 0;
+            while (off < chunk->used)
             {
-                if (NULL == prev)
-                { sdmbn_event_filters = curr->next; }
+                BufferedPkt *entry = (BufferedPkt *)(chunk->data + off);
+                off += buffer_record_size(entry->hdr.caplen);
+
+                int write_len = -1;
+                if (sdmbn_locals->process_packet != NULL)
+                {
+                    write_len = sdmbn_locals->process_packet(&(entry->hdr), 
+                            entry->pkt);
+                }
+
+                if (write_len < 0)
+                {
+                    ERROR_PRINT("Failed to release buffered packet of len %d",
+                            entry->hdr.caplen)
+                }
                 else
-                { prev->next = curr->next; }
-                break;
+                { 
+                    STATS_INC(pkts_release_count); 
+                    if (sdmbn_trace_on())
+                    { 
+                        sdmbn_trace_packet(TRACE_ACTION_RELEASE, filter->id,
+                                &(entry->hdr));
+                    }
+                }
             }
-            prev = curr;
-            curr = curr->next;
         }
-//        pthread_mutex_unlock(&lock_event_filters);
+        sdmbn_releasing = 0;
+        buffer_chunks_free(chain);
+    }
+}
+
+///// INSTALL BARRIER ///////////////////////////////////////////////////////
+// A new filter is indexed straight away but only applies to packets numbered
+// above its activeSeq, which stays at UINT64_MAX until the barrier passes.
+// Until then matching packets are processed as if there were no filter and
+// stamp lastMatch.  The barrier passes once the packet sequence has reached
+// the requested one and no matching packet has arrived for the requested
+// drain time, or after drain_timeout_usec.  It then waits for packets that
+// may have missed the filter to leave sdmbn_preprocess_packet, so every
+// packet preprocessed after the events-ack sees the filter.
+//
+// Barriers are watched by a thread of their own: enable-events returns as
+// soon as the filter is indexed, so a long drain does not hold back other
+// control commands, and the events-ack is sent when the barrier passes.
+
+#define BARRIER_POLL_USEC   100
+
+typedef struct _PendingInstall {
+    EventFilter *filter;
+    int id;
+    uint64_t after;     // packet sequence the filter must not apply at
+    int64_t drain;      // microseconds without a match that count as drained
+    int64_t start;      // now_usec() when the install was requested
+    int64_t traced;     // sdmbn_trace_clock() at the same time
+    struct _PendingInstall *next;
+} PendingInstall;
+
+// Installs whose barrier has not passed; the barrier thread sleeps on
+// cond_pending_installs while there are none
+static PendingInstall *sdmbn_pending_installs = NULL;
+static pthread_mutex_t lock_pending_installs = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_pending_installs = PTHREAD_COND_INITIALIZER;
+static pthread_t barrier_thread;
+
+static int64_t now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+  * Make a pending filter effective and acknowledge its install.  Must be
+  * called with lock_pending_installs held.
+  * @param install Install whose barrier has passed
+  * @param current Packet sequence when it passed
+  * @param synchronize Whether to wait for packets that may have missed the
+  *     filter; not needed for a filter being removed
+  */
+static void barrier_pass(PendingInstall *install, uint64_t current,
+        int synchronize)
+{
+    EventFilter *filter = install->filter;
+    uint64_t seq = (current > install->after) ? current : install->after;
+    __atomic_store_n(&(filter->activeSeq), seq, __ATOMIC_SEQ_CST);
+    if (synchronize)
+    { epoch_synchronize(); }
+
+    int64_t quiesce = now_usec() - install->start;
+    sdmbn_trace_span(TRACE_ENABLE_EVENTS, install->id, install->traced);
+    DEBUG_PRINT("Filter %d applies after packet %lu; quiesced in %ld us",
+            install->id, (unsigned long)seq, (long)quiesce);
+    send_events_ack(install->id, quiesce, seq);
+}
+
+/**
+  * Check whether the barrier of a pending install has passed.
+  * @param install Pending install
+  * @param now Current time from now_usec
+  * @param current Current packet sequence
+  * @param wait Lowered to the microseconds until it is worth checking again
+  * @return 1 if the barrier has passed, otherwise 0
+  */
+static int barrier_check(PendingInstall *install, int64_t now,
+        uint64_t current, int64_t *wait)
+{
+    int64_t last = __atomic_load_n(&(install->filter->lastMatch), 
+            __ATOMIC_RELAXED);
+    if (last < install->start)
+    { last = install->start; }
+    if (current >= install->after && now - last >= install->drain)
+    { return 1; }
+    if (now - install->start >= sdmbn_config.drain_timeout_usec)
+    {
+        INFO_PRINT("Install barrier for filter %d timed out at packet %lu",
+                install->id, (unsigned long)current);
+        return 1;
+    }
+
+    // Sleep out the rest of the drain interval, if that is what is left
+    if (current >= install->after && last + install->drain - now < *wait)
+    { *wait = last + install->drain - now; }
+    return 0;
+}
+
+static void *barrier_handler(void *arg)
+{
+    INFO_PRINT("Install barrier thread started");
+
+    pthread_mutex_lock(&lock_pending_installs);
+    while (1)
+    {
+        while (NULL == sdmbn_pending_installs)
+        { pthread_cond_wait(&cond_pending_installs, &lock_pending_installs); }
+
+        int64_t now = now_usec();
+        int64_t wait = BARRIER_POLL_USEC;
+        uint64_t current = __atomic_load_n(&sdmbn_pkt_seq, __ATOMIC_ACQUIRE);
+        PendingInstall **prev = &sdmbn_pending_installs;
+        while (*prev != NULL)
+        {
+            PendingInstall *install = *prev;
+            if (barrier_check(install, now, current, &wait))
+            {
+                *prev = install->next;
+                barrier_pass(install, current, 1);
+                free(install);
+            }
+            else
+            { prev = &(install->next); }
+        }
+
+        if (sdmbn_pending_installs != NULL)
+        {
+            pthread_mutex_unlock(&lock_pending_installs);
+            usleep(wait);
+            pthread_mutex_lock(&lock_pending_installs);
+        }
+    }
+    return NULL;
+}
+
+/**
+  * Start the barrier of a newly added filter; the events-ack is sent once
+  * it has passed and the filter is effective.
+  * @param filter Filter returned by events_add_filter
+  * @param id Id of the enable-events command
+  * @param after Packet sequence the filter must not apply at or before
+  * @param drain Microseconds without a matching packet that count as drained;
+  *     0 to not wait for in-flight packets
+  * @return 0 on success, -1 on error
+  */
+static int events_install_barrier(EventFilter *filter, int id, 
+        uint64_t after, int64_t drain)
+{
+    PendingInstall *install = (PendingInstall *)malloc(
+            sizeof(PendingInstall));
+    if (NULL == install)
+    { return -1; }
+    install->filter = filter;
+    install->id = id;
+    install->after = after;
+    install->drain = drain;
+    install->start = now_usec();
+    install->traced = sdmbn_trace_clock();
+
+    pthread_mutex_lock(&lock_pending_installs);
+    install->next = sdmbn_pending_installs;
+    sdmbn_pending_installs = install;
+    pthread_cond_signal(&cond_pending_installs);
+    pthread_mutex_unlock(&lock_pending_installs);
+    return 0;
+}
+
+/**
+  * Pass the barrier of a filter that is being removed, if it has not passed
+  * yet, so its events-ack precedes the removal and the barrier thread lets
+  * go of it.
+  * @param filter Filter being removed
+  */
+static void events_cancel_barrier(EventFilter *filter)
+{
+    pthread_mutex_lock(&lock_pending_installs);
+    PendingInstall **prev = &sdmbn_pending_installs;
+    while (*prev != NULL)
+    {
+        PendingInstall *install = *prev;
+        if (install->filter == filter)
+        {
+            *prev = install->next;
+            barrier_pass(install, 
+                    __atomic_load_n(&sdmbn_pkt_seq, __ATOMIC_ACQUIRE), 0);
+            free(install);
+            break;
+        }
+        prev = &(install->next);
+    }
+    pthread_mutex_unlock(&lock_pending_installs);
+}
+
+static EventFilter *events_add_filter(PerflowKey *key, char *action, int id)
+{
+    EventFilter* filter = (EventFilter*)malloc(sizeof(EventFilter));
+    if (NULL == filter)
+    { return NULL; }
+    memcpy(&(filter->key), key, sizeof(PerflowKey));
+    if (0 == strcmp(action, CONSTANT_ACTION_DROP))
+    { filter->action = EVENT_ACTION_DROP; }
+    else if (0 == strcmp(action, CONSTANT_ACTION_BUFFER))
+    { filter->action = EVENT_ACTION_BUFFER; }
+    else if (0 == strcmp(action, CONSTANT_ACTION_PROCESS))
+    { filter->action = EVENT_ACTION_PROCESS; }
+    filter->id = id;
+    filter->activeSeq = UINT64_MAX;
+    filter->lastMatch = 0;
 
-        // Free filter
-//        pthread_mutex_lock(&lock_processing_pkt);
+    filter->bufferHead = NULL;
+    filter->bufferTail = NULL;
+    filter->bufferClosed = 0;
+    if (pthread_mutex_init(&(filter->bufferLock), NULL) < 0)
+    { 
+        ERROR_PRINT("Failed to initialize buffer lock for filter"); 
+        free(filter);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock_event_filters);
+    filter->seq = ++sdmbn_event_filter_seq;
+    int result = filter_table_insert(filter);
+    epoch_reclaim();
+    pthread_mutex_unlock(&lock_event_filters);
+    if (result < 0)
+    {
+        ERROR_PRINT("Failed to index filter");
         pthread_mutex_destroy(&(filter->bufferLock));
         free(filter);
-//        pthread_mutex_unlock(&lock_processing_pkt);
+        return NULL;
     }
+    return filter;
+}
+
+static void event_filter_destroy(void *ptr)
+{
+    EventFilter *filter = (EventFilter *)ptr;
+    pthread_mutex_destroy(&(filter->bufferLock));
+    free(filter);
+}
 
+static void events_remove_filter(PerflowKey *key)
+{
+    //STATS_PRINT("function:events_remove_filter");
+
+    pthread_mutex_lock(&lock_event_filters);
+
+    // Find filter
+    EventFilter *filter = filter_table_find(key);
+    if (filter != NULL)
+    {
+        // An install still waiting on its barrier is acknowledged first
+        events_cancel_barrier(filter);
+
+        // Release bufferred events
+        buffer_release(filter);
+
+        // Remove filter; it is freed once no packet can still hold it
+        filter_table_remove(filter);
+        epoch_retire(filter, event_filter_destroy);
+    }
+    epoch_reclaim();
+
+    pthread_mutex_unlock(&lock_event_filters);
     return;
 }
 
+// Addresses and ports are left in network order, like controller keys
 static void build_packet_key(const unsigned char* pkt, PerflowKey* key)
 {
+    bzero(key, sizeof(*key));
     key->wildcards = WILDCARD_ALL;
     unsigned char *nxthdr = (unsigned char*)pkt;
 
@@ -220,8 +1113,8 @@ static void build_packet_key(const unsigned char* pkt, PerflowKey* key)
     case ETHERTYPE_IP:
         {
         struct iphdr* ip = (struct iphdr*)nxthdr;
-        key->nw_src = ntohl(ip->saddr);
-        key->nw_dst = ntohl(ip->daddr);
+        key->nw_src = ip->saddr;
+        key->nw_dst = ip->daddr;
         key->nw_proto = ip->protocol;
         key->wildcards &= ~(WILDCARD_NW_SRC | WILDCARD_NW_DST 
                 | WILDCARD_NW_PROTO);
@@ -240,8 +1133,8 @@ static void build_packet_key(const unsigned char* pkt, PerflowKey* key)
     case IPPROTO_TCP:
         {
         struct tcphdr* tcp = (struct tcphdr*)nxthdr;
-        key->tp_src = ntohs(tcp->source);
-        key->tp_dst = ntohs(tcp->dest);
+        key->tp_src = tcp->source;
+        key->tp_dst = tcp->dest;
         key->wildcards &= ~(WILDCARD_TP_SRC | WILDCARD_TP_DST);
         nxthdr += tcp->doff * 4;
         break; 
@@ -249,8 +1142,8 @@ static void build_packet_key(const unsigned char* pkt, PerflowKey* key)
     case IPPROTO_UDP:
         {
         struct udphdr* udp = (struct udphdr*)nxthdr;
-        key->tp_src = ntohs(udp->source);
-        key->tp_dst = ntohs(udp->dest);
+        key->tp_src = udp->source;
+        key->tp_dst = udp->dest;
         key->wildcards &= ~(WILDCARD_TP_SRC | WILDCARD_TP_DST);
         nxthdr += sizeof(struct udphdr);
         break; 
@@ -264,83 +1157,12 @@ static EventFilter* matches_filter(const struct pcap_pkthdr* hdr,
         const unsigned char* pkt)
 {
     //STATS_PRINT("function:matches_filter");
-    if (NULL == sdmbn_event_filters)
+    if (0 == __atomic_load_n(&sdmbn_event_filter_count, __ATOMIC_ACQUIRE))
     { return NULL; }
 
     PerflowKey pKey;
     build_packet_key(pkt, &pKey);
-
-//    pthread_mutex_lock(&lock_event_filters);
-
-    EventFilter *filter = sdmbn_event_filters;
-    while (filter != NULL)
-    {
-        PerflowKey* fKey = &(filter->key);
-
-        // Check dl_type
-        if (!(fKey->wildcards & WILDCARD_DL_TYPE)
-                && (fKey->dl_type != pKey.dl_type))
-        { 
-            filter = filter->next;
-            continue; 
-        }
-
-        // Check nw_src
-        int nw_src_mask = 0xFFFFFFFF;
-        if (!(fKey->wildcards & WILDCARD_NW_SRC_MASK))
-        { nw_src_mask = nw_src_mask << (32 - fKey->nw_src_mask); }
-        if (!(fKey->wildcards & WILDCARD_NW_SRC)
-                && ((fKey->nw_src & nw_src_mask) 
-                    != (pKey.nw_src & nw_src_mask)))
-        { 
-            filter = filter->next;
-            continue; 
-        }
-
-        // Check nw_dst
-        int nw_dst_mask = 0xFFFFFFFF;
-        if (!(fKey->wildcards & WILDCARD_NW_DST_MASK))
-        { nw_dst_mask = nw_dst_mask << (32 - fKey->nw_dst_mask); }
-        if (!(fKey->wildcards & WILDCARD_NW_DST)
-                && ((fKey->nw_dst & nw_dst_mask) 
-                    != (pKey.nw_dst & nw_dst_mask)))
-        { 
-            filter = filter->next;
-            continue; 
-        }
-
-        // Check nw_proto
-        if (!(fKey->wildcards & WILDCARD_NW_PROTO)
-                && (fKey->nw_proto != pKey.nw_proto))
-        { 
-            filter = filter->next;
-            continue; 
-        }
-
-        // Check tp_src
-        if (!(fKey->wildcards & WILDCARD_TP_SRC) &&
-                !(fKey->tp_src == pKey.tp_src
-                    || (pKey.tp_flip && fKey->tp_dst == pKey.tp_src)))
-        { 
-            filter = filter->next;
-            continue; 
-        }
-
-        // Check tp_dst
-        if (!(fKey->wildcards & WILDCARD_TP_DST) &&
-                !(fKey->tp_dst == pKey.tp_dst
-                    || (pKey.tp_flip && fKey->tp_src == pKey.tp_dst)))
-        { 
-            filter = filter->next;
-            continue; 
-        }
-
-//        pthread_mutex_unlock(&lock_event_filters);
-        return filter;
-    }
-
-//    pthread_mutex_unlock(&lock_event_filters);
-    return NULL;
+    return filter_table_lookup(&pKey);
 }
 
 static int is_packet_flag_set(const unsigned char* pkt, int flag)
@@ -371,22 +1193,25 @@ static int is_packet_flag_set(const unsigned char* pkt, int flag)
 void sdmbn_preprocess_packet(const struct pcap_pkthdr *hdr, 
         const unsigned char *pkt, ProcessContext *context)
 {
-    pthread_mutex_lock(&lock_processing_pkt);
-    //STATS_PRINT("function:sdmbn_preprocess_packet");
-    //STATS_PRINT("111-inject:%d",context->injected);
-    //STATS_PRINT("111-%d-%d-%d",context->event,context->stop,context->injected);
-        
-    struct timeval ts;
-    gettimeofday(&ts, NULL);
+    epoch_enter();
+    context->injected = sdmbn_releasing;
+    int action = TRACE_ACTION_NONE;
+    uint64_t seq = __atomic_add_fetch(&sdmbn_pkt_seq, 1, __ATOMIC_RELAXED);
     EventFilter* filter = matches_filter(hdr, pkt);
+    if (filter != NULL 
+            && seq <= __atomic_load_n(&(filter->activeSeq), __ATOMIC_ACQUIRE))
+    {
+        // Still draining; the install barrier waits for these to stop
+        __atomic_store_n(&(filter->lastMatch), now_usec(), __ATOMIC_RELAXED);
+        filter = NULL;
+    }
     if (NULL == filter)
     { 
         //DEBUG_PRINT("Packet does not match filter"); 
         context->stop = 0;
         context->event = 0;
-        //STATS_PRINT("normal,%ld.%ld", ts.tv_sec,ts.tv_usec);
-	wy_record_pkt_time(ts,0);
-        sdmbn_stats.pkts_nofilter_count++;
+        action = TRACE_ACTION_NOFILTER;
+        STATS_INC(pkts_nofilter_count);
     }
     else
     {
@@ -395,15 +1220,14 @@ void sdmbn_preprocess_packet(const struct pcap_pkthdr *hdr,
         {
         case EVENT_ACTION_BUFFER:
             {
-	    //STATS_PRINT("111-inject:%d",context->injected);
             // Check if packet should not be buffered
             if (is_packet_flag_set(pkt, PACKET_FLAG_DO_NOT_BUFFER))
             { 
                 context->stop = 0;
                 context->event = filter->id; 
                 //DEBUG_PRINT("Packet should not be buffered");
-                sdmbn_stats.pkts_nobuffer_count++;
-		wy_record_pkt_time(ts,1);
+                action = TRACE_ACTION_NOBUFFER;
+                STATS_INC(pkts_nobuffer_count);
                 break;
             }
 
@@ -413,32 +1237,33 @@ void sdmbn_preprocess_packet(const struct pcap_pkthdr *hdr,
                 context->stop = 0;
                 context->event = 0; 
                 //DEBUG_PRINT("Packet was just dequeued; do not buffer");
-		wy_record_pkt_time(ts,2);
+                action = TRACE_ACTION_INJECTED;
                 break; 
             }
 
-            // Create buffer entry
-            BufferedPkt *entry = (BufferedPkt *)malloc(sizeof(BufferedPkt));
-            memcpy((void *)&(entry->hdr), hdr, sizeof(struct pcap_pkthdr));
-            entry->pkt = (unsigned char *)malloc(hdr->caplen);
-            memcpy((void *)entry->pkt, pkt, hdr->caplen);
-            entry->next = NULL;
-
             // Add to buffer
-            pthread_mutex_lock(&(filter->bufferLock));
-            if (NULL == filter->bufferTail)
+            int buffered = buffer_append(filter, hdr, pkt);
+            if (0 == buffered)
             {
-                filter->bufferHead = entry;
-                filter->bufferTail = entry;
+                // Buffer already released; the filter is being removed
+                context->stop = 0;
+                context->event = 0;
+                action = TRACE_ACTION_NOFILTER;
+                STATS_INC(pkts_nofilter_count);
+                break;
             }
-            else
+            if (buffered < 0)
             {
-                filter->bufferTail->next = entry;
-                filter->bufferTail = entry;
+                ERROR_PRINT("Failed to buffer packet of len %d; dropped",
+                        hdr->caplen);
+                action = TRACE_ACTION_DROP;
+                STATS_INC(pkts_drop_count);
+            }
+            else
+            { 
+                action = TRACE_ACTION_BUFFER;
+                STATS_INC(pkts_buffer_count); 
             }
-            pthread_mutex_unlock(&(filter->bufferLock));
-            //STATS_PRINT("BUF,%ld.%ld", ts.tv_sec,ts.tv_usec);
-            sdmbn_stats.pkts_buffer_count++;
 
 //            sdmbn_raise_reprocess(filter->id, -1, hdr, pkt);
             context->stop = 1; 
@@ -453,24 +1278,27 @@ void sdmbn_preprocess_packet(const struct pcap_pkthdr *hdr,
                 context->stop = 0;
                 context->event = filter->id; 
                 DEBUG_PRINT("Packet should not be dropped");
+                action = TRACE_ACTION_NOBUFFER;
                 break;
             }
             sdmbn_raise_reprocess(filter->id, -1, hdr, pkt);
             context->stop = 1; 
             context->event = -1;
-            STATS_PRINT("DROP,%ld.%ld", ts.tv_sec,ts.tv_usec);
-            sdmbn_stats.pkts_drop_count++;
+            action = TRACE_ACTION_DROP;
+            STATS_INC(pkts_drop_count);
             break;
         case EVENT_ACTION_PROCESS:
             context->stop = 0;
             context->event = filter->id; 
-            sdmbn_stats.pkts_process_count++;
+            action = TRACE_ACTION_PROCESS;
+            STATS_INC(pkts_process_count);
             break;
         }
     }
 
-    if (context->stop)
-    { pthread_mutex_unlock(&lock_processing_pkt); }
+    if (sdmbn_trace_on())
+    { sdmbn_trace_packet(action, (filter != NULL ? filter->id : 0), hdr); }
+    epoch_exit();
 }
 
 void sdmbn_postprocess_packet(const struct pcap_pkthdr *hdr, 
@@ -478,8 +1306,6 @@ void sdmbn_postprocess_packet(const struct pcap_pkthdr *hdr,
 {
     if (context->event > 0)
     { sdmbn_raise_reprocess(context->event, -1, hdr, pkt); }
-
-    pthread_mutex_unlock(&lock_processing_pkt);
 }
 
 int sdmbn_raise_reprocess(int id, int hashkey, 
@@ -493,25 +1319,30 @@ int sdmbn_raise_reprocess(int id, int hashkey,
     //TMPHACK
 
     // Send reprocess event
-    json_object *event = json_compose_reprocess_event(id, hashkey, header, 
-            packet);
-    int result = json_send(event, sdmbn_conn_event);
+    int result;
+    if (__atomic_load_n(&sdmbn_wire_event, __ATOMIC_RELAXED))
+    { 
+        result = wire_send_reprocess(sdmbn_conn_event, id, hashkey, header, 
+                packet); 
+    }
+    else
+    {
+        json_object *event = json_compose_reprocess_event(id, hashkey, 
+                header, packet);
+        result = json_send(event, sdmbn_conn_event);
 
-    // Free JSON object
-    json_object_put(event);
+        // Free JSON object
+        json_object_put(event);
+    }
 
     // Update statistics 
-    sdmbn_stats.reprocess_raised++;
-    struct timeval evt_time;
-    gettimeofday(&evt_time, NULL);
-    //STATS_PRINT("EVTPRO,%ld.%ld", evt_time.tv_sec, evt_time.tv_usec);
+    STATS_INC(reprocess_raised);
 
     return result;
 }
 
 int handle_enable_events(json_object *msg, int id)
 {
-    STATS_PRINT("function:handle_enable_events");
     DEBUG_PRINT("Got enable-events");
 
     // Parse key
@@ -535,16 +1366,36 @@ int handle_enable_events(json_object *msg, int id)
     }
     char *action = (char *)json_object_get_string(action_field);
 
+    // Parse barrier; without one, wait for in-flight packets to drain
+    uint64_t after = 0;
+    int64_t drain = sdmbn_config.drain_usec;
+    json_object *after_field = json_object_object_get(msg, FIELD_AFTER);
+    if (after_field != NULL)
+    { 
+        after = json_object_get_int64(after_field); 
+        drain = 0;
+    }
+    json_object *drain_field = json_object_object_get(msg, FIELD_DRAIN);
+    if (drain_field != NULL)
+    { drain = json_object_get_int64(drain_field); }
+
     // Add event filter
-    if (events_add_filter(&key, action, id) < 0)
+    EventFilter *filter = events_add_filter(&key, action, id);
+    if (NULL == filter)
     {
         ERROR_PRINT("Failed to add event filter");
         send_error(id, -1, ERROR_INTERNAL);
         return -1;
     }
 
-    // Send ACK
-    send_events_ack(id);
+    // The barrier thread sends the ACK once the filter is effective
+    if (events_install_barrier(filter, id, after, drain) < 0)
+    {
+        ERROR_PRINT("Failed to start install barrier");
+        events_remove_filter(&key);
+        send_error(id, -1, ERROR_INTERNAL);
+        return -1;
+    }
 
     return 1;
 }
@@ -552,7 +1403,6 @@ int handle_enable_events(json_object *msg, int id)
 int handle_disable_events(json_object *msg, int id)
 {
     DEBUG_PRINT("Got disable-events");
-    STATS_PRINT("function:handle_disable_events");
 
     // Parse key
     json_object *key_field = json_object_object_get(msg, FIELD_KEY);
@@ -569,14 +1419,35 @@ int handle_disable_events(json_object *msg, int id)
     events_remove_filter(&key);
 
     // Send ACK
-    send_events_ack(id);
+    send_events_ack(id, -1, 0);
 
     return 1;
 }
 
+static int reprocess_packet(int id, int hashkey, 
+        const struct pcap_pkthdr *header, const unsigned char *packet)
+{
+    sdmbn_stats.events_count++;
+
+    int write_len = -1;
+    if (sdmbn_locals->process_packet != NULL)
+    { write_len = sdmbn_locals->process_packet(header, packet); }
+
+    if (write_len < 0)
+    {
+        ERROR_PRINT("Failed to inject packet");
+        return -1;
+    }
+    if (sdmbn_trace_on())
+    { sdmbn_trace_packet(TRACE_ACTION_REPROCESS, id, header); }
+
+    INFO_PRINT("Injected packet id=%d hashkey=0x%08X len=%d", 
+            id, hashkey, write_len); 
+    return write_len;
+}
+
 static int handle_reprocess_event(json_object *msg, int id)
 {
-    STATS_PRINT("function:handle_reprocess_event");
     // Parse hashkey
     json_object *hashkey_field = json_object_object_get(msg, FIELD_HASHKEY);
     if (NULL == hashkey_field)
@@ -611,53 +1482,95 @@ static int handle_reprocess_event(json_object *msg, int id)
     unsigned char *packet = (unsigned char *)sdmbn_base64_decode(
             encoded_packet);
 
-    sdmbn_stats.events_count++;
+    return reprocess_packet(id, hashkey, header, packet);
+}
 
-    int write_len = -1;
-    if (sdmbn_locals->process_packet != NULL)
-    { write_len = sdmbn_locals->process_packet(header, packet); }
+static void handle_wire_message(char *frame, int len)
+{
+    WireMsg msg;
+    if (wire_parse(frame, len, &msg) < 0)
+    {
+        ERROR_PRINT("Malformed binary message from controller");
+        send_error(-1, -1, ERROR_MALFORMED);
+        return;
+    }
 
-    if (write_len < 0)
+    if (msg.type != WIRE_REPROCESS)
     {
-        ERROR_PRINT("Failed to inject packet");
-        return -1;
+        ERROR_PRINT("Unknown binary type: %d", msg.type);
+        send_error(msg.id, msg.hashkey, ERROR_MALFORMED);
+        return;
     }
 
-    INFO_PRINT("Injected packet id=%d hashkey=0x%08X len=%d", 
-            id, hashkey, write_len); 
-    return write_len;
+    struct pcap_pkthdr header;
+    unsigned char *packet;
+    if (wire_parse_packet(&msg, &header, &packet) < 0)
+    {
+        ERROR_PRINT("Reprocess event has a malformed packet");
+        send_error(msg.id, msg.hashkey, ERROR_MALFORMED);
+        return;
+    }
+    reprocess_packet(msg.id, msg.hashkey, &header, packet);
 }
 
 static void *events_handler(void *arg)
 {
     INFO_PRINT("Event handling thread started");
 
+    SDMBNReader reader;
+    if (conn_reader_init(&reader, sdmbn_conn_event) < 0)
+    {
+        ERROR_PRINT("Failed to allocate event receive buffer");
+        pthread_exit(NULL);
+    }
+
     while (1)
     {
-        // Attempt to read a JSON string
-        char* buffer =  conn_read(sdmbn_conn_event);
+        // Attempt to read a JSON string or binary message
+        int len = 0;
+        char* buffer =  conn_reader_next(&reader, &len);
         if (NULL == buffer)
         {
             ERROR_PRINT("Failed to read from event socket");
             break;
         }
+        if (wire_is_binary(buffer, len))
+        {
+            // Reprocessed in place; the packet is copied if buffered again
+            handle_wire_message(buffer, len);
+            conn_reader_release(&reader);
+            continue;
+        }
 
         // Attempt to parse the JSON string
         struct json_object *msg;
         msg = json_tokener_parse(buffer);
-        free(buffer);
         if (NULL == msg)
         {
             ERROR_PRINT("Failed to parse JSON from controller: %s", buffer);
+            conn_reader_release(&reader);
             continue;
         }
+        conn_reader_release(&reader);
         DEBUG_PRINT("Parsed msg");
 
+        // Controller's answer to the SYN selects the wire format
+        int wire = json_parse_syn_ack(msg);
+        if (wire >= 0)
+        {
+            INFO_PRINT("Event channel uses %s messages", 
+                    (wire ? CONSTANT_WIRE_BINARY : CONSTANT_WIRE_JSON));
+            __atomic_store_n(&sdmbn_wire_event, wire, __ATOMIC_RELAXED);
+            json_object_put(msg);
+            continue;
+        }
+
         // Get message id
         json_object *id_field = json_object_object_get(msg, FIELD_ID);
         if (NULL == id_field)
         {
-            ERROR_PRINT("JSON from controller has no id: %s", buffer);
+            ERROR_PRINT("JSON from controller has no id: %s", 
+                    json_object_to_json_string(msg));
             send_error(-1, -1, ERROR_MALFORMED);
             // Free JSON object
             json_object_put(msg);
@@ -669,7 +1582,8 @@ static void *events_handler(void *arg)
         json_object *type_field = json_object_object_get(msg, FIELD_TYPE);
         if (NULL == type_field)
         {
-            ERROR_PRINT("JSON from controller has no type: %s", buffer);
+            ERROR_PRINT("JSON from controller has no type: %s", 
+                    json_object_to_json_string(msg));
             send_error(id, -1, ERROR_MALFORMED);
             // Free JSON object
             json_object_put(msg);
@@ -691,6 +1605,8 @@ static void *events_handler(void *arg)
         json_object_put(msg);
     }
 
+    conn_reader_destroy(&reader);
+
     INFO_PRINT("Event handling thread finished");
     pthread_exit(NULL);
 }
@@ -715,18 +1631,22 @@ int events_init()
     // Free JSON object
     json_object_put(syn);
 
-    int result = pthread_mutex_init(&lock_processing_pkt, NULL);
+    if (buffer_pool_init() < 0)
+    { ERROR_PRINT("Failed to preallocate packet buffers"); }
+
+    // Create SDMBN event handling thread
+    int result = pthread_create(&event_thread, NULL, events_handler, NULL);
     if (result != 0)
     { 
-        ERROR_PRINT("Failed to initialize processing packet lock");
+        ERROR_PRINT("Failed to initialize event handling thread");
         return result;
     }
 
-    // Create SDMBN event handling thread
-    result = pthread_create(&event_thread, NULL, events_handler, NULL);
+    // Create install barrier thread
+    result = pthread_create(&barrier_thread, NULL, barrier_handler, NULL);
     if (result != 0)
     { 
-        ERROR_PRINT("Failed to initialize event handling thread");
+        ERROR_PRINT("Failed to initialize install barrier thread");
         return result;
     }
 
@@ -751,21 +1671,8 @@ int events_cleanup()
     STATS_PRINT("PKTS_RELEASE=%d", sdmbn_stats.pkts_release_count);
     STATS_PRINT("PKTS_PROCESS=%d", sdmbn_stats.pkts_process_count);
     STATS_PRINT("EVENTS=%d", sdmbn_stats.events_count);
-    int i;
-    double releasetime;
-    FILE *fp;
-    fp=fopen("dst.txt","w+");
-    if(!fp)
-    {
-        STATS_PRINT("failed to open file ");
-        return 1;
-    }
-    for(i = 0;i < pkt_num;i++)
-    {
-        releasetime = pkttime[i].ts.tv_sec + 0.000001 *pkttime[i].ts.tv_usec;
-        fprintf(fp,"%d,%f,%d\n",pkttime[i].pkt_num,releasetime,pkttime[i].type);
-    }
-    fclose(fp);    
+
+    buffer_pool_cleanup();
 
     // Destroy events thread
     //pthread_kill(events_thread, SIGKILL);
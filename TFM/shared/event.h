@@ -8,30 +8,47 @@ extern "C" {
 #include "SDMBN.h"
 #include "SDMBNJson.h"
 #include <pthread.h>
-
-struct _BufferedPkt {
-    const struct pcap_pkthdr hdr;
-    const unsigned char *pkt;
-    struct _BufferedPkt *next;
-};
-typedef struct _BufferedPkt BufferedPkt;
+#include <stdint.h>
+
+// Buffered packets are packed back to back into chunks, each packet stored
+// as a BufferedPkt followed by its data, padded to BUFFER_ALIGN
+typedef struct _BufferedPkt {
+    struct pcap_pkthdr hdr;
+    unsigned char pkt[];
+} BufferedPkt;
+
+typedef struct _BufferChunk {
+    struct _BufferChunk *next;
+    unsigned int size;      // bytes available in data
+    unsigned int used;      // bytes of data holding packets
+    unsigned char data[];
+} BufferChunk;
 
 typedef struct _EventFilter {
     PerflowKey key;
     enum {EVENT_ACTION_DROP,EVENT_ACTION_BUFFER,EVENT_ACTION_PROCESS} action;
     int id;
-    BufferedPkt *bufferHead;
-    BufferedPkt *bufferTail;
+    unsigned int seq;   // install order; the newest matching filter wins
+    uint64_t activeSeq; // applies to packets numbered above this
+    int64_t lastMatch;  // usec; last match while the filter did not apply
+    BufferChunk *bufferHead;
+    BufferChunk *bufferTail;
+    int bufferClosed;   // set once released; later packets are not buffered
     pthread_mutex_t bufferLock;
-    struct _EventFilter *next;
 } EventFilter;
 
 ///// DEFINES ///////////////////////////////////////////////////////////////
 #define PACKET_FLAG_DO_NOT_BUFFER    (1 << 2)
 #define PACKET_FLAG_DO_NOT_DROP    (1 << 3)
 
+#define BUFFER_ALIGN               8
+#define BUFFER_CHUNK_SIZE          (64 * 1024)  // standard chunk, with header
+#define BUFFER_POOL_PREALLOC       16           // chunks allocated at init
+#define BUFFER_POOL_MAX            256          // idle chunks kept for reuse
+
 ///// GLOBALS ///////////////////////////////////////////////////////////////
 extern int sdmbn_conn_event;
+extern int sdmbn_wire_event;
 
 ///// FUNCTION PROTOTYPES ///////////////////////////////////////////////////
 int handle_enable_events(json_object *msg, int id);
@@ -4,12 +4,18 @@
 #include "SDMBNDebug.h"
 #include "SDMBNJson.h"
 #include "SDMBNConfig.h"
+#include "SDMBNWire.h"
+#include "SDMBNTrace.h"
 #include "event.h"
 #include "state.h"
 #include <json/json.h>
 #include <pthread.h>
+#include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
 // Thread for handling state messages
 static pthread_t state_thread;
@@ -17,6 +23,9 @@ static pthread_t state_thread;
 // Connection for state messages
 int sdmbn_conn_state = -1;
 
+// Whether the controller accepted binary messages on the state channel
+int sdmbn_wire_state = 0;
+
 static void send_delete_perflow_ack(int id, int count)
 {
     json_object *ack = json_compose_delete_perflow_ack(id, count);
@@ -124,16 +133,12 @@ static int handle_get_perflow(json_object *msg, int id)
 	}
 	int raiseEvents = json_object_get_int(raiseEvents_field);
 
-    // Wait for get lock to release
+    // Wait for gets to be released
     INFO_PRINT("Wait for get lock to release");
-    pthread_mutex_lock(&sdmbn_lock_get);
+    sdmbn_wait_get_release();
     INFO_PRINT("Get lock released");
 
-#ifdef SDMBN_STATS
-    // Update statistics
-    struct timeval start_get, end_get;
-    gettimeofday(&start_get, NULL);
-#endif 
+    int64_t start = sdmbn_trace_clock();
 
     // Set up extensions
     SDMBNExt *exts = NULL;
@@ -157,22 +162,11 @@ static int handle_get_perflow(json_object *msg, int id)
     // Send ACK
     send_get_perflow_ack(id, count);
 
-    // Release get lock
-    pthread_mutex_unlock(&sdmbn_lock_get);
-
-#ifdef SDMBN_STATS
     // Update statistics
-    gettimeofday(&end_get, NULL);
-    long sec = end_get.tv_sec - start_get.tv_sec;
-    long usec = end_get.tv_usec - start_get.tv_usec;
-    long total = (sec * 1000 * 1000) + usec;
-    sdmbn_stats.gets_per_time += total;
-    sdmbn_stats.gets_per_count++;
-    STATS_PRINT("STATS: gets_per_count=%d, gets_per_time=%ldus", 
-            sdmbn_stats.gets_per_count, sdmbn_stats.gets_per_time);
-    STATS_PRINT("STATS: num_states_moved = %d", count);
-    STATS_PRINT("GETPER,%ld.%ld,%ld.%ld,",start_get.tv_sec,start_get.tv_usec,
-            end_get.tv_sec,end_get.tv_usec);
+    int64_t elapsed = sdmbn_trace_span(TRACE_GET_PERFLOW, id, start);
+#ifdef SDMBN_STATS
+    __sync_fetch_and_add(&(sdmbn_stats.gets_per_time), elapsed / 1000);
+    __sync_fetch_and_add(&(sdmbn_stats.gets_per_count), 1);
 #endif
 
     return 1;
@@ -185,6 +179,11 @@ int sdmbn_send_perflow(int id, PerflowKey *key, char *state, int hashkey,
     { return -1; }
 
     // Send perflow support state
+    if (__atomic_load_n(&sdmbn_wire_state, __ATOMIC_RELAXED))
+    { 
+        return wire_send_state(sdmbn_conn_state, WIRE_STATE_PERFLOW, id, key,
+                state, hashkey, seq); 
+    }
     json_object *msg = json_compose_perflow_state(id, key, state, hashkey, 
             seq);
     int result = json_send(msg, sdmbn_conn_state);
@@ -195,7 +194,7 @@ int sdmbn_send_perflow(int id, PerflowKey *key, char *state, int hashkey,
     return result;
 }
 
-static int handle_put_perflow(json_object *msg, int id)
+static int put_perflow(int id, int hashkey, PerflowKey *key, char *state)
 {
     // Check if command is supported 
     if (NULL == sdmbn_locals->put_perflow)
@@ -204,12 +203,35 @@ static int handle_put_perflow(json_object *msg, int id)
         return -1; 
     }
 
-#ifdef SDMBN_STATS
+    int64_t start = sdmbn_trace_clock();
+
+    // Call MB-specific function
+    int result = sdmbn_locals->put_perflow(hashkey, key, state);
+    if (result < 0)
+    {
+        ERROR_PRINT("Local put perflow function failed");
+        send_error(id, hashkey, ERROR_INTERNAL);
+        return -1; 
+    }
+
+    // Increment number of active flows
+    __sync_fetch_and_add(&(sdmbn_stats.flows_active), 1);
+
+    // Send ACK
+    send_put_perflow_ack(id, hashkey);
+
     // Update statistics
-    struct timeval start_put, end_put;
-    gettimeofday(&start_put, NULL);
+    int64_t elapsed = sdmbn_trace_span(TRACE_PUT_PERFLOW, id, start);
+#ifdef SDMBN_STATS
+    __sync_fetch_and_add(&(sdmbn_stats.puts_per_time), elapsed / 1000);
+    __sync_fetch_and_add(&(sdmbn_stats.puts_per_count), 1);
 #endif
 
+    return result;
+}
+
+static int handle_put_perflow(json_object *msg, int id)
+{
     // Parse hashkey
     json_object *hashkey_field = json_object_object_get(msg, FIELD_HASHKEY);
     if (NULL == hashkey_field)
@@ -241,36 +263,7 @@ static int handle_put_perflow(json_object *msg, int id)
     }
     char *state = (char *)json_object_get_string(state_field);
 
-    // Call MB-specific function
-    int result = sdmbn_locals->put_perflow(hashkey, &key, state);
-    if (result < 0)
-    {
-        ERROR_PRINT("Local put perflow function failed");
-        send_error(id, hashkey, ERROR_INTERNAL);
-        return -1; 
-    }
-
-    // Increment number of active flows
-    sdmbn_stats.flows_active++;
-
-    // Send ACK
-    send_put_perflow_ack(id, hashkey);
-
-#ifdef SDMBN_STATS
-    // Update statistics
-    gettimeofday(&end_put, NULL);
-    long sec = end_put.tv_sec - start_put.tv_sec;
-    long usec = end_put.tv_usec - start_put.tv_usec;
-    long total = (sec * 1000 * 1000) + usec;
-    sdmbn_stats.puts_per_time += total;
-    sdmbn_stats.puts_per_count++;
-    STATS_PRINT("STATS: puts_per_count=%d, puts_per_time=%ldus", 
-            sdmbn_stats.puts_per_count, sdmbn_stats.puts_per_time);
-    STATS_PRINT("PUTPER,%ld.%ld,%ld.%ld", start_put.tv_sec,
-            start_put.tv_usec, end_put.tv_sec, end_put.tv_usec);
-#endif
-
-    return result;
+    return put_perflow(id, hashkey, &key, state);
 }
 
 static int handle_get_multiflow(json_object *msg, int id)
@@ -294,11 +287,7 @@ static int handle_get_multiflow(json_object *msg, int id)
         keyPtr = &key;
     }
     
-#ifdef SDMBN_STATS
-	// Update statistics
-    struct timeval start_get, end_get;
-    gettimeofday(&start_get, NULL);
-#endif
+    int64_t start = sdmbn_trace_clock();
 
     int count = sdmbn_locals->get_multiflow(keyPtr, id);
     if (count < 0)
@@ -311,19 +300,11 @@ static int handle_get_multiflow(json_object *msg, int id)
     // Send ACK
     send_get_multiflow_ack(id, count);
 
-#ifdef SDMBN_STATS
     // Update statistics
-    gettimeofday(&end_get, NULL);
-    long sec = end_get.tv_sec - start_get.tv_sec;
-    long usec = end_get.tv_usec - start_get.tv_usec;
-    long total = (sec * 1000 * 1000) + usec;
-    sdmbn_stats.gets_mul_time += total;
-    sdmbn_stats.gets_mul_count++;
-    STATS_PRINT("STATS: gets_mul_count=%d, gets_mul_time=%ldus",
-	        sdmbn_stats.gets_mul_count, sdmbn_stats.gets_mul_time);
-    STATS_PRINT("STATS: num_multiflow_states_moved = %d", count);
-    STATS_PRINT("GETMUL,%ld.%ld,%ld.%ld",start_get.tv_sec,start_get.tv_usec,
-            end_get.tv_sec,end_get.tv_usec);
+    int64_t elapsed = sdmbn_trace_span(TRACE_GET_MULTIFLOW, id, start);
+#ifdef SDMBN_STATS
+    __sync_fetch_and_add(&(sdmbn_stats.gets_mul_time), elapsed / 1000);
+    __sync_fetch_and_add(&(sdmbn_stats.gets_mul_count), 1);
 #endif
 
     return 1;
@@ -336,6 +317,11 @@ int sdmbn_send_multiflow(int id, PerflowKey *key, char *state, int hashkey,
     { return -1; }
 
     // Send multiflow support state
+    if (__atomic_load_n(&sdmbn_wire_state, __ATOMIC_RELAXED))
+    { 
+        return wire_send_state(sdmbn_conn_state, WIRE_STATE_MULTIFLOW, id, 
+                key, state, hashkey, seq); 
+    }
     json_object *msg = json_compose_multiflow_state(id, key, state, hashkey, 
             seq);
     int result = json_send(msg, sdmbn_conn_state);
@@ -346,7 +332,7 @@ int sdmbn_send_multiflow(int id, PerflowKey *key, char *state, int hashkey,
     return result;
 }
 
-static int handle_put_multiflow(json_object *msg, int id)
+static int put_multiflow(int id, int hashkey, PerflowKey *key, char *state)
 {
     // Check if command is supported 
     if (NULL == sdmbn_locals->put_multiflow)
@@ -355,12 +341,32 @@ static int handle_put_multiflow(json_object *msg, int id)
         return -1; 
     }
 
-#ifdef SDMBN_STATS
+    int64_t start = sdmbn_trace_clock();
+
+    // Call MB-specific function
+    int result = sdmbn_locals->put_multiflow(hashkey, key, state);
+    if (result < 0)
+    {
+        ERROR_PRINT("Local put multiflow function failed");
+        send_error(id, hashkey, ERROR_INTERNAL);
+        return -1; 
+    }
+
+    // Send ACK
+    send_put_multiflow_ack(id, hashkey);
+
     // Update statistics
-    struct timeval start_put, end_put;
-    gettimeofday(&start_put, NULL);
+    int64_t elapsed = sdmbn_trace_span(TRACE_PUT_MULTIFLOW, id, start);
+#ifdef SDMBN_STATS
+    __sync_fetch_and_add(&(sdmbn_stats.puts_mul_time), elapsed / 1000);
+    __sync_fetch_and_add(&(sdmbn_stats.puts_mul_count), 1);
 #endif
 
+    return result;
+}
+
+static int handle_put_multiflow(json_object *msg, int id)
+{
     // Parse hashkey
     json_object *hashkey_field = json_object_object_get(msg, FIELD_HASHKEY);
     if (NULL == hashkey_field)
@@ -392,33 +398,7 @@ static int handle_put_multiflow(json_object *msg, int id)
     }
     char *state = (char *)json_object_get_string(state_field);
 
-    // Call MB-specific function
-    int result = sdmbn_locals->put_multiflow(hashkey, &key, state);
-    if (result < 0)
-    {
-        ERROR_PRINT("Local put multiflow function failed");
-        send_error(id, hashkey, ERROR_INTERNAL);
-        return -1; 
-    }
-
-    // Send ACK
-    send_put_multiflow_ack(id, hashkey);
-
-#ifdef SDMBN_STATS
-    // Update statistics
-    gettimeofday(&end_put, NULL);
-    long sec = end_put.tv_sec - start_put.tv_sec;
-    long usec = end_put.tv_usec - start_put.tv_usec;
-    long total = (sec * 1000 * 1000) + usec;
-    sdmbn_stats.puts_mul_time += total;
-    sdmbn_stats.puts_mul_count++;
-    STATS_PRINT("STATS: puts_mul_count=%d, puts_mul_time=%ldus",
-            sdmbn_stats.puts_mul_count, sdmbn_stats.puts_mul_time);
-    STATS_PRINT("PUTMUL,%ld.%ld,%ld.%ld",start_put.tv_sec,start_put.tv_usec,
-            end_put.tv_sec,end_put.tv_usec);
-#endif
-
-    return result;
+    return put_multiflow(id, hashkey, &key, state);
 }
 
 static int handle_get_allflows(json_object *msg, int id)
@@ -543,6 +523,183 @@ int sdmbn_send_config(int id, char *state, int seq)
     return result;
 }
 
+///// BATCHED STATE //////////////////////////////////////////////////////////
+// States are appended to buf as they would go on the wire: length-prefixed
+// JSON messages, or records behind one state-batch header in binary mode
+struct SDMBNBatch {
+    int id;
+    int binary;                 // wire format, fixed when the batch opens
+    char *buf;
+    int size;
+    int used;
+    int count;                  // states in buf
+    struct timeval first;       // when the oldest state in buf was added
+};
+
+// Frame length and state-batch header, filled in on flush
+#define BATCH_HEADER_LEN    (int)(sizeof(int) + sizeof(WireHeader))
+
+static void batch_reset(SDMBNBatch *batch)
+{
+    batch->used = (batch->binary ? BATCH_HEADER_LEN : 0);
+    batch->count = 0;
+}
+
+static int batch_reserve(SDMBNBatch *batch, int need)
+{
+    if (batch->used + need <= batch->size)
+    { return 1; }
+
+    // Send what is buffered before growing, so the buffer only grows for
+    // states larger than batch_bytes
+    if (batch->count > 0 && sdmbn_batch_flush(batch) < 0)
+    { return -1; }
+    if (batch->used + need <= batch->size)
+    { return 1; }
+
+    char *buf = (char *)realloc(batch->buf, batch->used + need);
+    if (NULL == buf)
+    { return -1; }
+    batch->buf = buf;
+    batch->size = batch->used + need;
+    return 1;
+}
+
+static int batch_add(SDMBNBatch *batch, int type, PerflowKey *key, 
+        char *state, int hashkey, int seq)
+{
+    if (NULL == batch || NULL == key || NULL == state || seq < 0)
+    { return -1; }
+
+    if (batch->binary)
+    {
+        int statelen = strlen(state);
+        if (batch_reserve(batch, wire_record_size(statelen)) < 0)
+        { return -1; }
+        batch->used += wire_compose_record(batch->buf + batch->used, type, 
+                batch->id, key, state, statelen, hashkey, seq);
+    }
+    else
+    {
+        json_object *msg;
+        if (WIRE_STATE_PERFLOW == type)
+        { 
+            msg = json_compose_perflow_state(batch->id, key, state, hashkey, 
+                    seq); 
+        }
+        else
+        { 
+            msg = json_compose_multiflow_state(batch->id, key, state, 
+                    hashkey, seq); 
+        }
+        const char *jsonstr = json_object_to_json_string(msg);
+        int len = strlen(jsonstr);
+        if (batch_reserve(batch, sizeof(int) + len) < 0)
+        {
+            json_object_put(msg);
+            return -1;
+        }
+        int tmplen = htonl(len);
+        memcpy(batch->buf + batch->used, &tmplen, sizeof(tmplen));
+        memcpy(batch->buf + batch->used + sizeof(tmplen), jsonstr, len);
+        batch->used += sizeof(tmplen) + len;
+        json_object_put(msg);
+    }
+
+    if (0 == batch->count)
+    { gettimeofday(&batch->first, NULL); }
+    batch->count++;
+
+    // Flush once enough is buffered or the oldest state has waited too long
+    if (batch->used >= sdmbn_config.batch_bytes)
+    { return (sdmbn_batch_flush(batch) < 0 ? -1 : 1); }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long waited = (now.tv_sec - batch->first.tv_sec) * 1000 * 1000 
+        + (now.tv_usec - batch->first.tv_usec);
+    if (waited >= sdmbn_config.batch_usec)
+    { return (sdmbn_batch_flush(batch) < 0 ? -1 : 1); }
+    return 1;
+}
+
+/**
+  * Start coalescing the states sent for a get call.
+  * @param id Operation id of the get call
+  * @return Batch to pass to sdmbn_send_perflow_batch; NULL on error
+  */
+SDMBNBatch *sdmbn_batch_open(int id)
+{
+    SDMBNBatch *batch = (SDMBNBatch *)malloc(sizeof(SDMBNBatch));
+    if (NULL == batch)
+    { return NULL; }
+    batch->id = id;
+    batch->binary = __atomic_load_n(&sdmbn_wire_state, __ATOMIC_RELAXED);
+    batch->size = BATCH_HEADER_LEN 
+        + (sdmbn_config.batch_bytes > 0 ? sdmbn_config.batch_bytes : 0);
+    batch->buf = (char *)malloc(batch->size);
+    if (NULL == batch->buf)
+    {
+        free(batch);
+        return NULL;
+    }
+    batch_reset(batch);
+    return batch;
+}
+
+int sdmbn_send_perflow_batch(SDMBNBatch *batch, PerflowKey *key, 
+        char *state, int hashkey, int seq)
+{ return batch_add(batch, WIRE_STATE_PERFLOW, key, state, hashkey, seq); }
+
+int sdmbn_send_multiflow_batch(SDMBNBatch *batch, PerflowKey *key, 
+        char *state, int hashkey, int seq)
+{ return batch_add(batch, WIRE_STATE_MULTIFLOW, key, state, hashkey, seq); }
+
+/**
+  * Send the states buffered in a batch.
+  * @return Number of states sent; -1 on error
+  */
+int sdmbn_batch_flush(SDMBNBatch *batch)
+{
+    if (NULL == batch)
+    { return -1; }
+    if (0 == batch->count)
+    { return 0; }
+
+    if (batch->binary)
+    {
+        int len = batch->used - BATCH_HEADER_LEN;
+        int tmplen = htonl(sizeof(WireHeader) + len);
+        memcpy(batch->buf, &tmplen, sizeof(tmplen));
+        wire_compose_batch(batch->buf + sizeof(tmplen), batch->id, 
+                batch->count, len);
+    }
+
+    // Every buffered state goes out in one system call
+    struct iovec iov;
+    iov.iov_base = batch->buf;
+    iov.iov_len = batch->used;
+    int result = conn_writev(sdmbn_conn_state, &iov, 1);
+
+    int count = batch->count;
+    batch_reset(batch);
+    return (result < 0 ? -1 : count);
+}
+
+/**
+  * Send the states still buffered in a batch and free it.  Must be called
+  * before the get call returns, so the states precede the get ack.
+  * @return Number of states sent; -1 on error
+  */
+int sdmbn_batch_close(SDMBNBatch *batch)
+{
+    if (NULL == batch)
+    { return -1; }
+    int result = sdmbn_batch_flush(batch);
+    free(batch->buf);
+    free(batch);
+    return result;
+}
+
 static int handle_put_config(json_object *msg, int id)
 {
     // Check if command is supported 
@@ -608,11 +765,7 @@ static int handle_delete_perflow(json_object *msg, int id)
         keyPtr = &key;
     }
 
-#ifdef SDMBN_STATS
-    // Update statistics
-    struct timeval start_del, end_del;
-    gettimeofday(&start_del, NULL);
-#endif
+    int64_t start = sdmbn_trace_clock();
 
     // Call MB-specific function
     int count = sdmbn_locals->delete_perflow(keyPtr, id);
@@ -624,21 +777,13 @@ static int handle_delete_perflow(json_object *msg, int id)
     }
 
     // Decrement number of active flows
-    sdmbn_stats.flows_active--;
+    __sync_fetch_and_sub(&(sdmbn_stats.flows_active), 1);
 
     // Send ACK
     send_delete_perflow_ack(id, count);
 
-#ifdef SDMBN_STATS
     // Update statistics
-    gettimeofday(&end_del, NULL);
-    long sec = end_del.tv_sec - start_del.tv_sec;
-    long usec = end_del.tv_usec - start_del.tv_usec;
-    long total = (sec * 1000 * 1000) + usec;
-    STATS_PRINT("STATS: delete_perflow_count=%d, get_time_sum=%ldus", count, total);
-    STATS_PRINT("DELPER,%ld.%ld,%ld.%ld",start_del.tv_sec,start_del.tv_usec,
-            end_del.tv_sec,end_del.tv_usec);
-#endif
+    sdmbn_trace_span(TRACE_DELETE_PERFLOW, id, start);
 
     return 1;
 }
@@ -673,11 +818,7 @@ static int handle_delete_multiflow(json_object *msg, int id) {
     }
     int deltype = json_object_get_int(deltype_field);
 
-#ifdef SDMBN_STATS
-    // Update statistics
-    struct timeval start_del, end_del;
-    gettimeofday(&start_del, NULL);
-#endif
+    int64_t start = sdmbn_trace_clock();
 
     int count = sdmbn_locals->delete_multiflow(keyPtr, id, deltype);
     if (count < 0)
@@ -690,109 +831,499 @@ static int handle_delete_multiflow(json_object *msg, int id) {
     // Send ACK
     send_delete_multiflow_ack(id, count);
 
-#ifdef SDMBN_STATS
     // Update statistics
-    gettimeofday(&end_del, NULL);
-    long sec = end_del.tv_sec - start_del.tv_sec;
-    long usec = end_del.tv_usec - start_del.tv_usec;
-    long total = (sec * 1000 * 1000) + usec;
-    STATS_PRINT("STATS: delete_multiflow_count=%d, get_time_sum=%ldus", count, total);
-    STATS_PRINT("DELMUL,%ld.%ld,%ld.%ld",start_del.tv_sec,start_del.tv_usec,
-            end_del.tv_sec,end_del.tv_usec);
-#endif
+    sdmbn_trace_span(TRACE_DELETE_MULTIFLOW, id, start);
+
+    return 1;
+}
+
+static int handle_trace(json_object *msg, int id)
+{
+    // Turn tracing on or off, if asked
+    json_object *enable_field = json_object_object_get(msg, FIELD_ENABLE);
+    if (enable_field != NULL)
+    { sdmbn_trace_enable(json_object_get_int(enable_field)); }
+
+    // Dump the trace rings, if asked
+    int count = -1;
+    json_object *file_field = json_object_object_get(msg, FIELD_FILE);
+    if (file_field != NULL)
+    {
+        count = sdmbn_trace_dump(json_object_get_string(file_field));
+        if (count < 0)
+        {
+            ERROR_PRINT("Failed to dump trace records");
+            send_error(id, -1, ERROR_INTERNAL);
+            return -1;
+        }
+    }
+
+    // Send ACK
+    json_object *ack = json_compose_trace_ack(id, sdmbn_trace_on(), count);
+    json_send(ack, sdmbn_conn_state);
+    json_object_put(ack);
 
     return 1;
 }
 
+///// DISPATCH ///////////////////////////////////////////////////////////////
+// The state thread only reads and parses commands.  Each command is queued
+// on the strand for its operation id, so an operation's commands run in the
+// order they arrived while different operations run side by side.  A strand
+// whose next command is a get or put waits on the bulk lane, served by
+// state_workers threads; deletes, event and trace commands go to the control
+// lane, served by a thread of its own, so they never wait behind another
+// operation's transfer and always run one at a time.  With state_workers set
+// to 0 every command runs on the state thread, as it used to.
+
+typedef enum {
+    STATE_CMD_UNKNOWN = 0,
+    STATE_CMD_GET_PERFLOW,
+    STATE_CMD_PUT_PERFLOW,
+    STATE_CMD_GET_MULTIFLOW,
+    STATE_CMD_PUT_MULTIFLOW,
+    STATE_CMD_GET_ALLFLOWS,
+    STATE_CMD_PUT_ALLFLOWS,
+    STATE_CMD_GET_CONFIG,
+    STATE_CMD_PUT_CONFIG,
+    STATE_CMD_DELETE_PERFLOW,
+    STATE_CMD_DELETE_MULTIFLOW,
+    STATE_CMD_ENABLE_EVENTS,
+    STATE_CMD_DISABLE_EVENTS,
+    STATE_CMD_TRACE,
+    STATE_CMD_SYN_ACK,
+    STATE_CMD_COUNT
+} StateCommand;
+
+static const char *state_command_names[STATE_CMD_COUNT] = {
+    [STATE_CMD_GET_PERFLOW] = COMMAND_GET_PERFLOW,
+    [STATE_CMD_PUT_PERFLOW] = COMMAND_PUT_PERFLOW,
+    [STATE_CMD_GET_MULTIFLOW] = COMMAND_GET_MULTIFLOW,
+    [STATE_CMD_PUT_MULTIFLOW] = COMMAND_PUT_MULTIFLOW,
+    [STATE_CMD_GET_ALLFLOWS] = COMMAND_GET_ALLFLOWS,
+    [STATE_CMD_PUT_ALLFLOWS] = COMMAND_PUT_ALLFLOWS,
+    [STATE_CMD_GET_CONFIG] = COMMAND_GET_CONFIG,
+    [STATE_CMD_PUT_CONFIG] = COMMAND_PUT_CONFIG,
+    [STATE_CMD_DELETE_PERFLOW] = COMMAND_DELETE_PERFLOW,
+    [STATE_CMD_DELETE_MULTIFLOW] = COMMAND_DELETE_MULTIFLOW,
+    [STATE_CMD_ENABLE_EVENTS] = COMMAND_ENABLE_EVENTS,
+    [STATE_CMD_DISABLE_EVENTS] = COMMAND_DISABLE_EVENTS,
+    [STATE_CMD_TRACE] = COMMAND_TRACE,
+    [STATE_CMD_SYN_ACK] = RESPONSE_SYN_ACK,
+};
+
+// Command names hashed by state_command_hash; 0 marks an empty slot
+#define STATE_CMD_SLOTS     32
+static unsigned char state_command_slots[STATE_CMD_SLOTS];
+
+// Perfect over the command names: each lands in a slot of its own, which
+// state_command_init checks
+static unsigned int state_command_hash(const char *type, size_t len)
+{ 
+    return (len + (unsigned char)type[1] + (unsigned char)type[2]) 
+        & (STATE_CMD_SLOTS - 1);
+}
+
+static void state_command_init()
+{
+    int cmd;
+    for (cmd = STATE_CMD_UNKNOWN + 1; cmd < STATE_CMD_COUNT; cmd++)
+    {
+        const char *name = state_command_names[cmd];
+        unsigned int slot = state_command_hash(name, strlen(name));
+        assert(0 == state_command_slots[slot]);
+        state_command_slots[slot] = cmd;
+    }
+}
+
+static StateCommand state_command_parse(const char *type)
+{
+    size_t len = strlen(type);
+    if (len < 3)
+    { return STATE_CMD_UNKNOWN; }
+    StateCommand cmd = state_command_slots[state_command_hash(type, len)];
+    if (cmd != STATE_CMD_UNKNOWN 
+            && strcmp(state_command_names[cmd], type) != 0)
+    { return STATE_CMD_UNKNOWN; }
+    return cmd;
+}
+
+static int state_command_is_control(StateCommand cmd)
+{
+    switch (cmd)
+    {
+    case STATE_CMD_DELETE_PERFLOW:
+    case STATE_CMD_DELETE_MULTIFLOW:
+    case STATE_CMD_ENABLE_EVENTS:
+    case STATE_CMD_DISABLE_EVENTS:
+    case STATE_CMD_TRACE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+typedef struct _StateJob {
+    int id;
+    StateCommand cmd;
+    json_object *msg;       // NULL for binary commands
+    char *frame;            // binary commands; wire points into it
+    WireMsg wire;
+    struct _StateJob *next;
+} StateJob;
+
+// Queued commands of one operation; exists while any is queued or running
+typedef struct _StateStrand {
+    int id;
+    StateJob *head;         // next command to run
+    StateJob *tail;         // valid while head is set
+    struct _StateStrand *next;      // in its state_strands bucket
+    struct _StateStrand *runNext;   // in its lane
+} StateStrand;
+
+typedef struct {
+    StateStrand *head;
+    StateStrand *tail;
+    pthread_cond_t ready;
+} StateLane;
+
+#define STATE_STRAND_BUCKETS    64
+
+// Strands and lanes are only touched with lock_state_queue held; a strand
+// is in a lane while its next command waits and in no lane while one runs
+static StateStrand *state_strands[STATE_STRAND_BUCKETS];
+static StateLane state_lane_control = { NULL, NULL, PTHREAD_COND_INITIALIZER };
+static StateLane state_lane_bulk = { NULL, NULL, PTHREAD_COND_INITIALIZER };
+static pthread_mutex_t lock_state_queue = PTHREAD_MUTEX_INITIALIZER;
+static int state_stopping = 0;
+
+// Threads serving the lanes
+static pthread_t state_control_thread;
+static pthread_t *state_worker_threads = NULL;
+
+static void state_job_free(StateJob *job)
+{
+    if (job->msg != NULL)
+    { json_object_put(job->msg); }
+    free(job->frame);
+    free(job);
+}
+
+static void state_job_run(StateJob *job)
+{
+    json_object *msg = job->msg;
+    int id = job->id;
+    DEBUG_PRINT("Message: id=%d, type=%s", id, 
+            state_command_names[job->cmd]);
+
+    // Take appropriate action
+    switch (job->cmd)
+    {
+    case STATE_CMD_GET_PERFLOW:
+        handle_get_perflow(msg, id);
+        break;
+    case STATE_CMD_PUT_PERFLOW:
+        if (NULL == msg)
+        { 
+            put_perflow(id, job->wire.hashkey, &(job->wire.key), 
+                    job->wire.payload); 
+        }
+        else
+        { handle_put_perflow(msg, id); }
+        break;
+    case STATE_CMD_GET_MULTIFLOW:
+        handle_get_multiflow(msg, id);
+        break;
+    case STATE_CMD_PUT_MULTIFLOW:
+        if (NULL == msg)
+        { 
+            put_multiflow(id, job->wire.hashkey, &(job->wire.key), 
+                    job->wire.payload); 
+        }
+        else
+        { handle_put_multiflow(msg, id); }
+        break;
+    case STATE_CMD_GET_ALLFLOWS:
+        handle_get_allflows(msg, id);
+        break;
+    case STATE_CMD_PUT_ALLFLOWS:
+        handle_put_allflows(msg, id);
+        break;
+    case STATE_CMD_GET_CONFIG:
+        handle_get_config(msg, id);
+        break;
+    case STATE_CMD_PUT_CONFIG:
+        handle_put_config(msg, id);
+        break;
+    case STATE_CMD_DELETE_PERFLOW:
+        handle_delete_perflow(msg, id);
+        break;
+    case STATE_CMD_DELETE_MULTIFLOW:
+        handle_delete_multiflow(msg, id);
+        break;
+    case STATE_CMD_ENABLE_EVENTS:
+        handle_enable_events(msg, id);
+        break;
+    case STATE_CMD_DISABLE_EVENTS:
+        handle_disable_events(msg, id);
+        break;
+    case STATE_CMD_TRACE:
+        handle_trace(msg, id);
+        break;
+    default:
+        ERROR_PRINT("Unexpected command %d", job->cmd);
+        send_error(id, -1, ERROR_MALFORMED);
+        break;
+    }
+}
+
+// Caller holds lock_state_queue
+static void state_lane_push(StateStrand *strand)
+{
+    StateLane *lane = &state_lane_bulk;
+    if (state_command_is_control(strand->head->cmd))
+    { lane = &state_lane_control; }
+
+    strand->runNext = NULL;
+    if (NULL == lane->tail)
+    { lane->head = strand; }
+    else
+    { lane->tail->runNext = strand; }
+    lane->tail = strand;
+    pthread_cond_signal(&(lane->ready));
+}
+
+static void state_dispatch(StateJob *job)
+{
+    if (sdmbn_config.state_workers <= 0)
+    {
+        state_job_run(job);
+        state_job_free(job);
+        return;
+    }
+
+    job->next = NULL;
+    pthread_mutex_lock(&lock_state_queue);
+    StateStrand **bucket = 
+        &(state_strands[(unsigned int)job->id % STATE_STRAND_BUCKETS]);
+    StateStrand *strand = *bucket;
+    while (strand != NULL && strand->id != job->id)
+    { strand = strand->next; }
+
+    if (NULL == strand)
+    {
+        strand = (StateStrand *)calloc(1, sizeof(StateStrand));
+        assert(strand != NULL);
+        strand->id = job->id;
+        strand->head = job;
+        strand->tail = job;
+        strand->next = *bucket;
+        *bucket = strand;
+        state_lane_push(strand);
+    }
+    else
+    {
+        // Runs once the operation's earlier commands are done
+        if (NULL == strand->head)
+        { strand->head = job; }
+        else
+        { strand->tail->next = job; }
+        strand->tail = job;
+    }
+    pthread_mutex_unlock(&lock_state_queue);
+}
+
+static void *state_worker(void *arg)
+{
+    StateLane *lane = (StateLane *)arg;
+
+    pthread_mutex_lock(&lock_state_queue);
+    while (1)
+    {
+        StateStrand *strand = lane->head;
+        if (NULL == strand)
+        {
+            if (state_stopping)
+            { break; }
+            pthread_cond_wait(&(lane->ready), &lock_state_queue);
+            continue;
+        }
+        lane->head = strand->runNext;
+        if (NULL == lane->head)
+        { lane->tail = NULL; }
+        StateJob *job = strand->head;
+        strand->head = job->next;
+        pthread_mutex_unlock(&lock_state_queue);
+
+        state_job_run(job);
+        state_job_free(job);
+
+        pthread_mutex_lock(&lock_state_queue);
+        if (strand->head != NULL)
+        { state_lane_push(strand); }
+        else
+        {
+            StateStrand **prev = 
+                &(state_strands[(unsigned int)strand->id 
+                        % STATE_STRAND_BUCKETS]);
+            while (*prev != strand)
+            { prev = &((*prev)->next); }
+            *prev = strand->next;
+            free(strand);
+        }
+    }
+    pthread_mutex_unlock(&lock_state_queue);
+    return NULL;
+}
+
 static void *state_handler(void *arg)
 {
     INFO_PRINT("State handling thread started");
 
     json_tokener_new();
 
+    SDMBNReader reader;
+    if (conn_reader_init(&reader, sdmbn_conn_state) < 0)
+    {
+        ERROR_PRINT("Failed to allocate state receive buffer");
+        pthread_exit(NULL);
+    }
+
     while (1)
     {
-        // Attempt to read a JSON string
-        char* buffer =  conn_read(sdmbn_conn_state);
+        // Attempt to read a JSON string or binary message
+        int len = 0;
+        char* buffer =  conn_reader_next(&reader, &len);
         if (NULL == buffer)
         {
             ERROR_PRINT("Failed to read from state socket");
             break; 
         }
 
+        StateJob *job = (StateJob *)calloc(1, sizeof(StateJob));
+        if (NULL == job)
+        {
+            ERROR_PRINT("Failed to allocate command");
+            send_error(-1, -1, ERROR_INTERNAL);
+            conn_reader_release(&reader);
+            continue;
+        }
+
+        // Only the commands carrying state have a binary form.  They may
+        // run after the next read, so they keep a copy of their frame.
+        if (wire_is_binary(buffer, len))
+        {
+            job->frame = (char *)malloc(len + 1);
+            if (NULL == job->frame)
+            {
+                ERROR_PRINT("Failed to allocate command");
+                send_error(-1, -1, ERROR_INTERNAL);
+                conn_reader_release(&reader);
+                free(job);
+                continue;
+            }
+            memcpy(job->frame, buffer, len + 1);
+            conn_reader_release(&reader);
+            if (wire_parse(job->frame, len, &(job->wire)) < 0)
+            {
+                ERROR_PRINT("Malformed binary message from controller");
+                send_error(-1, -1, ERROR_MALFORMED);
+                state_job_free(job);
+                continue;
+            }
+            job->id = job->wire.id;
+            if (WIRE_PUT_PERFLOW == job->wire.type)
+            { job->cmd = STATE_CMD_PUT_PERFLOW; }
+            else if (WIRE_PUT_MULTIFLOW == job->wire.type)
+            { job->cmd = STATE_CMD_PUT_MULTIFLOW; }
+            else
+            {
+                ERROR_PRINT("Unknown binary type: %d", job->wire.type);
+                send_error(job->id, job->wire.hashkey, ERROR_MALFORMED);
+                state_job_free(job);
+                continue;
+            }
+            state_dispatch(job);
+            continue;
+        }
+
         // Attempt to parse the JSON string
         struct json_object *msg;
         msg = json_tokener_parse(buffer);
-        free(buffer);
         if (NULL == msg)
         {
             ERROR_PRINT("Failed to parse JSON from controller: %s", buffer);
+            conn_reader_release(&reader);
+            free(job);
             continue;
         }
+        job->msg = msg;
         DEBUG_PRINT("Parsed msg");
 
+        // Get message type
+        json_object *type_field = json_object_object_get(msg, FIELD_TYPE);
+        if (type_field != NULL)
+        { 
+            job->cmd = state_command_parse(
+                    json_object_get_string(type_field)); 
+        }
+
+        // Controller's answer to the SYN selects the wire format
+        if (STATE_CMD_SYN_ACK == job->cmd)
+        {
+            int wire = json_parse_syn_ack(msg);
+            INFO_PRINT("State channel uses %s messages", 
+                    (wire ? CONSTANT_WIRE_BINARY : CONSTANT_WIRE_JSON));
+            __atomic_store_n(&sdmbn_wire_state, wire, __ATOMIC_RELAXED);
+            conn_reader_release(&reader);
+            state_job_free(job);
+            continue;
+        }
+
         // Get message id
         json_object *id_field = json_object_object_get(msg, FIELD_ID);
         if (NULL == id_field)
         {
             ERROR_PRINT("JSON from controller has no id: %s", buffer);
             send_error(-1, -1, ERROR_MALFORMED);
-            // Free JSON object
-            json_object_put(msg);
+            conn_reader_release(&reader);
+            state_job_free(job);
             continue;
         }
-        int id = json_object_get_int(id_field);
+        job->id = json_object_get_int(id_field);
 
-        // Get message type
-        json_object *type_field = json_object_object_get(msg, FIELD_TYPE);
         if (NULL == type_field)
         {
             ERROR_PRINT("JSON from controller has no type: %s", buffer);
-            send_error(id, -1, ERROR_MALFORMED);
-            // Free JSON object
-            json_object_put(msg);
+            send_error(job->id, -1, ERROR_MALFORMED);
+            conn_reader_release(&reader);
+            state_job_free(job);
             continue;
         }
-        char *type = (char *)json_object_get_string(type_field);
-                
-        DEBUG_PRINT("Message: id=%d, type=%s", id, type);
-
-        // Take appropriate action
         // TODO: Check whether we support the action
-        if (0 == strcmp(type, COMMAND_GET_PERFLOW))
-        { handle_get_perflow(msg, id); }
-        else if (0 == strcmp(type, COMMAND_PUT_PERFLOW))
-        {INFO_PRINT("put perflow"); handle_put_perflow(msg, id); }
-        else if (0 == strcmp(type, COMMAND_GET_MULTIFLOW))
-	{ handle_get_multiflow(msg, id); }
-	else if (0 == strcmp(type, COMMAND_PUT_MULTIFLOW))
-	{ handle_put_multiflow(msg, id); }
-        else if (0 == strcmp(type, COMMAND_GET_ALLFLOWS))
-        { handle_get_allflows(msg, id); }
-        else if (0 == strcmp(type, COMMAND_PUT_ALLFLOWS))
-        { handle_put_allflows(msg, id); }
-        else if (0 == strcmp(type, COMMAND_GET_CONFIG))
-        { handle_get_config(msg, id); }
-        else if (0 == strcmp(type, COMMAND_PUT_CONFIG))
-        { handle_put_config(msg, id); }
-        else if (0 == strcmp(type, COMMAND_DELETE_PERFLOW))
-        { handle_delete_perflow(msg, id); }
-        else if (0 == strcmp(type, COMMAND_DELETE_MULTIFLOW))
-        { handle_delete_multiflow(msg, id); }
-        else if (0 == strcmp(type, COMMAND_ENABLE_EVENTS))
-        { handle_enable_events(msg, id); }
-        else if (0 == strcmp(type, COMMAND_DISABLE_EVENTS))
-        { handle_disable_events(msg, id); }
-        else
+        if (STATE_CMD_UNKNOWN == job->cmd)
         { 
-            ERROR_PRINT("Unknown type: %s", type);
-            send_error(id, -1, ERROR_MALFORMED);
+            ERROR_PRINT("Unknown type: %s", 
+                    json_object_get_string(type_field));
+            send_error(job->id, -1, ERROR_MALFORMED);
+            conn_reader_release(&reader);
+            state_job_free(job);
+            continue;
         }
+        conn_reader_release(&reader);
 
-        // Free JSON object
-        json_object_put(msg);
+        state_dispatch(job);
     }
 
+    conn_reader_destroy(&reader);
+
+    // Let the lanes drain and their threads exit
+    pthread_mutex_lock(&lock_state_queue);
+    state_stopping = 1;
+    pthread_cond_broadcast(&(state_lane_control.ready));
+    pthread_cond_broadcast(&(state_lane_bulk.ready));
+    pthread_mutex_unlock(&lock_state_queue);
+
     INFO_PRINT("State handling thread finished");
     pthread_exit(NULL);
 }
@@ -817,6 +1348,23 @@ int state_init()
     // Free JSON object
     json_object_put(syn);
 
+    // Create command lanes
+    state_command_init();
+    if (sdmbn_config.state_workers > 0)
+    {
+        pthread_create(&state_control_thread, NULL, state_worker, 
+                &state_lane_control);
+        state_worker_threads = (pthread_t *)malloc(
+                sdmbn_config.state_workers * sizeof(pthread_t));
+        assert(state_worker_threads != NULL);
+        int i;
+        for (i = 0; i < sdmbn_config.state_workers; i++)
+        { 
+            pthread_create(&(state_worker_threads[i]), NULL, state_worker, 
+                    &state_lane_bulk); 
+        }
+    }
+
     // Create SDMBN state handling thread
     pthread_create(&state_thread, NULL, state_handler, NULL);
     return 1;
@@ -10,6 +10,7 @@ extern "C" {
 
 ///// GLOBALS ///////////////////////////////////////////////////////////////
 extern int sdmbn_conn_state;
+extern int sdmbn_wire_state;
 
 ///// FUNCTION PROTOTYPES ///////////////////////////////////////////////////
 int state_init();
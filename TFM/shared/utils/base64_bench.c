@@ -0,0 +1,132 @@
+/*
+ * base64_bench -- throughput of the libsdmbn blob encodings.
+ *
+ * Compares the original nibble encoder with the legacy and base64 encodings
+ * of sdmbn_base64_encode/decode under every implementation the CPU
+ * supports, after checking that each round-trips.
+ *
+ * usage: base64_bench [size] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../SDMBN.h"
+
+typedef unsigned char byte;
+
+/* sdmbn_base64_encode as it was before the table-driven codec */
+static byte reference_encode_bits(byte data)
+{
+	if (data < 26)
+		return (data + 'A');
+	if (data < 52)
+		return (data - 26 + 'a');
+	if (data < 62)
+		return (data - 52 + '0');
+	if (data == 62)
+		return '+';
+	if (data == 63)
+		return '/';
+	return 0;
+}
+
+static char *reference_encode(void *blob, int size)
+{
+	byte *ptrBlob = (byte *)blob;
+	char *result = (char *)malloc(size*2+1);
+	char *ptrResult = result;
+	while (size > 0) {
+		*ptrResult++ = reference_encode_bits(*ptrBlob & 0x0F);
+		*ptrResult++ = reference_encode_bits((*ptrBlob & 0xF0) >> 4);
+		ptrBlob++;
+		size--;
+	}
+	*ptrResult = 0;
+	return result;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void check(byte *blob, int size, int version)
+{
+	int len, n;
+	for (n = 0; n <= size; n += (n < 100 ? 1 : 37)) {
+		char *enc = sdmbn_base64_encode_version(blob, n, version);
+		if (n == 0)
+			continue;
+		byte *dec = sdmbn_base64_decode_len(enc, &len);
+		if (dec == NULL || len != n || memcmp(dec, blob, n) != 0) {
+			fprintf(stderr, "round trip failed: version %d, %d bytes\n",
+					version, n);
+			exit(1);
+		}
+		free(enc);
+		free(dec);
+	}
+}
+
+static void run(const char *name, byte *blob, int size, int iters,
+		int version)
+{
+	double start, enc_time, dec_time;
+	char *enc = NULL;
+	void *dec;
+	int i;
+
+	start = now();
+	for (i = 0; i < iters; i++) {
+		free(enc);
+		if (version < 0)
+			enc = reference_encode(blob, size);
+		else
+			enc = sdmbn_base64_encode_version(blob, size, version);
+	}
+	enc_time = now() - start;
+
+	start = now();
+	for (i = 0; i < iters; i++) {
+		dec = sdmbn_base64_decode(enc);
+		free(dec);
+	}
+	dec_time = now() - start;
+
+	printf("%-20s encode %6.3f GB/s  decode %6.3f GB/s  %5.2f chars/byte\n",
+			name, (double)size * iters / enc_time / 1e9,
+			(double)size * iters / dec_time / 1e9,
+			(double)strlen(enc) / size);
+	free(enc);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *impls[] = { "scalar", "ssse3", "avx2" };
+	int size = argc > 1 ? atoi(argv[1]) : 1500;
+	int iters = argc > 2 ? atoi(argv[2]) : 100000;
+	byte *blob = malloc(size);
+	char name[32];
+	int i, impl;
+
+	srandom(1);
+	for (i = 0; i < size; i++)
+		blob[i] = random();
+
+	printf("%d byte blobs, %d iterations\n", size, iters);
+	run("reference", blob, size, iters, -1);
+	run("legacy", blob, size, iters, SDMBN_BASE64_LEGACY);
+	for (i = SDMBN_BASE64_IMPL_SCALAR; i <= SDMBN_BASE64_IMPL_AVX2; i++) {
+		impl = sdmbn_base64_set_impl(i);
+		if (impl != i)
+			continue;
+		check(blob, size, SDMBN_BASE64_V1);
+		snprintf(name, sizeof(name), "base64 %s", impls[impl]);
+		run(name, blob, size, iters, SDMBN_BASE64_V1);
+	}
+	free(blob);
+	return 0;
+}
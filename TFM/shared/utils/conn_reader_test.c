@@ -0,0 +1,154 @@
+/*
+ * conn_reader_test -- checks the buffered controller message reader.
+ *
+ * A writer thread sends messages of 20 bytes to 3 MB over a socketpair,
+ * first whole with conn_write_append_newline, then dribbled in odd-sized
+ * fragments that split length prefixes and payloads.  Every message must
+ * come out of conn_reader_next intact, in order and NUL terminated.  A
+ * length prefix above SDMBN_CONN_READ_MAX must be refused.
+ *
+ * usage: conn_reader_test [messages]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "../SDMBNConn.h"
+
+#define LARGEST	(3 * 1024 * 1024)
+
+static int sv[2];
+static int count = 200000;
+
+static int message_size(int i)
+{
+	if (i % 50000 == 7)
+		return LARGEST;
+	if (i % 1000 == 3)
+		return 70000 + i % 5000;
+	return 20 + i % 200;
+}
+
+static void fill(char *buf, int n, int i)
+{
+	int k;
+	for (k = 0; k < n; k++)
+		buf[k] = (char)(i * 31 + k);
+}
+
+static void *writer(void *arg)
+{
+	int fragments = *(int *)arg;
+	char *buf = malloc(LARGEST + sizeof(int));
+	int i, n, off, chunk, len;
+
+	for (i = 0; i < count; i++) {
+		n = message_size(i);
+		if (!fragments) {
+			fill(buf, n, i);
+			conn_write_append_newline(sv[0], buf, n);
+			continue;
+		}
+		len = htonl(n);
+		memcpy(buf, &len, sizeof(int));
+		fill(buf + sizeof(int), n, i);
+		for (off = 0; off < n + (int)sizeof(int); off += chunk) {
+			chunk = 1 + (i + off) % 7777;
+			if (off + chunk > n + (int)sizeof(int))
+				chunk = n + sizeof(int) - off;
+			if (write(sv[0], buf + off, chunk) != chunk) {
+				perror("write");
+				exit(1);
+			}
+		}
+	}
+	shutdown(sv[0], SHUT_WR);
+	free(buf);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void run(int fragments)
+{
+	char *expect = malloc(LARGEST);
+	SDMBNReader reader;
+	pthread_t thread;
+	double start;
+	char *msg;
+	int i, len, n;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	pthread_create(&thread, NULL, writer, &fragments);
+	conn_reader_init(&reader, sv[1]);
+
+	start = now();
+	for (i = 0; (msg = conn_reader_next(&reader, &len)) != NULL; i++) {
+		n = message_size(i);
+		fill(expect, n, i);
+		if (len != n || memcmp(msg, expect, n) != 0 || msg[n] != '\0') {
+			fprintf(stderr, "message %d damaged\n", i);
+			exit(1);
+		}
+		conn_reader_release(&reader);
+	}
+	pthread_join(thread, NULL);
+	if (i != count) {
+		fprintf(stderr, "%d of %d messages arrived\n", i, count);
+		exit(1);
+	}
+	printf("%-10s %d messages in %.3fs, buffer %d bytes\n",
+			fragments ? "fragments" : "whole", i, now() - start,
+			reader.size);
+
+	conn_reader_destroy(&reader);
+	close(sv[0]);
+	close(sv[1]);
+	free(expect);
+}
+
+static void oversized(void)
+{
+	SDMBNReader reader;
+	int len = htonl(SDMBN_CONN_READ_MAX);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	if (write(sv[0], &len, sizeof(int)) != sizeof(int)) {
+		perror("write");
+		exit(1);
+	}
+	conn_reader_init(&reader, sv[1]);
+	if (conn_reader_next(&reader, &len) != NULL) {
+		fprintf(stderr, "oversized message accepted\n");
+		exit(1);
+	}
+	conn_reader_destroy(&reader);
+	close(sv[0]);
+	close(sv[1]);
+	printf("oversized  refused\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		count = atoi(argv[1]);
+	run(0);
+	run(1);
+	oversized();
+	return 0;
+}
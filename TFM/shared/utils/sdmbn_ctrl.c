@@ -0,0 +1,231 @@
+/*
+ * sdmbn_ctrl -- stand-in controller for testing libsdmbn without Floodlight.
+ *
+ * Accepts one middlebox on the state and event ports, answers its SYNs and
+ * prints every message it sends, JSON or binary.  Lines read from stdin are
+ * sent to the middlebox's state channel as JSON commands, e.g.
+ *
+ *   {"type":"get-perflow","id":1,"key":{},"raiseEvents":0}
+ *
+ * usage: sdmbn_ctrl [-j] [-r] [-s state_port] [-e event_port]
+ *   -j  answer the SYN with JSON only, as the Floodlight controller does
+ *   -r  send received state and reprocess events back to the middlebox as
+ *       puts and reprocess events, in the format they arrived in
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <json/json.h>
+#include "../SDMBNConn.h"
+#include "../SDMBNJson.h"
+#include "../SDMBNWire.h"
+
+static int binary = 1;
+static int reflect = 0;
+static int conn_state = -1;
+static int conn_event = -1;
+
+static int listen_on(unsigned short port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0)
+		return -1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(server, 1) < 0) {
+		perror("listen");
+		close(server);
+		return -1;
+	}
+	return server;
+}
+
+static int accept_on(int server, const char *name)
+{
+	int client = accept(server, NULL, NULL);
+	close(server);
+	if (client < 0) {
+		perror("accept");
+		return -1;
+	}
+
+	/* first message is the SYN */
+	char *syn = conn_read(client);
+	if (syn == NULL)
+		return -1;
+	printf("%s: %s\n", name, syn);
+	free(syn);
+
+	json_object *ack = json_object_new_object();
+	json_object_object_add(ack, FIELD_TYPE,
+			json_object_new_string(RESPONSE_SYN_ACK));
+	json_object_object_add(ack, FIELD_WIRE, json_object_new_string(
+			binary ? CONSTANT_WIRE_BINARY : CONSTANT_WIRE_JSON));
+	const char *str = json_object_to_json_string(ack);
+	conn_write_append_newline(client, (char *)str, strlen(str));
+	json_object_put(ack);
+	return client;
+}
+
+static void print_key(const PerflowKey *key)
+{
+	struct in_addr src, dst;
+	char srcstr[INET_ADDRSTRLEN], dststr[INET_ADDRSTRLEN];
+	src.s_addr = key->nw_src;
+	dst.s_addr = key->nw_dst;
+	inet_ntop(AF_INET, &src, srcstr, sizeof(srcstr));
+	inet_ntop(AF_INET, &dst, dststr, sizeof(dststr));
+	printf(" key=%s/%u:%u->%s/%u:%u proto=%u wildcards=0x%02x", srcstr,
+			key->nw_src_mask, ntohs(key->tp_src), dststr,
+			key->nw_dst_mask, ntohs(key->tp_dst), key->nw_proto,
+			key->wildcards);
+}
+
+static void handle_record(const char *name, int conn, WireMsg *msg)
+{
+	printf("%s: binary type=%d id=%d hashkey=%d seq=%d bytes=%d", name,
+			msg->type, msg->id, msg->hashkey, msg->seq, msg->len);
+	if (msg->type != WIRE_REPROCESS)
+		print_key(&msg->key);
+	printf("\n");
+
+	if (!reflect)
+		return;
+	if (msg->type == WIRE_STATE_PERFLOW || msg->type == WIRE_STATE_MULTIFLOW)
+		wire_send_state(conn, msg->type == WIRE_STATE_PERFLOW ?
+				WIRE_PUT_PERFLOW : WIRE_PUT_MULTIFLOW, msg->id,
+				&msg->key, msg->payload, msg->hashkey, 0);
+	else if (msg->type == WIRE_REPROCESS) {
+		struct pcap_pkthdr hdr;
+		unsigned char *pkt;
+		if (wire_parse_packet(msg, &hdr, &pkt) > 0)
+			wire_send_reprocess(conn, msg->id, msg->hashkey, &hdr, pkt);
+	}
+}
+
+static void handle_binary(const char *name, int conn, char *frame, int len)
+{
+	WireMsg msg, record;
+	int offset = 0, result;
+
+	if (wire_parse(frame, len, &msg) < 0) {
+		printf("%s: malformed binary message (%d bytes)\n", name, len);
+		return;
+	}
+	if (msg.type != WIRE_STATE_BATCH) {
+		handle_record(name, conn, &msg);
+		return;
+	}
+
+	/* a batch is handled as if its records had arrived one by one */
+	printf("%s: batch id=%d states=%d bytes=%d\n", name, msg.id, msg.seq,
+			msg.len);
+	while ((result = wire_parse_batch(&msg, &offset, &record)) > 0)
+		handle_record(name, conn, &record);
+	if (result < 0)
+		printf("%s: malformed batch at offset %d\n", name, offset);
+}
+
+static void handle_json(const char *name, int conn, char *frame)
+{
+	printf("%s: %s\n", name, frame);
+	if (!reflect)
+		return;
+
+	json_object *msg = json_tokener_parse(frame);
+	if (msg == NULL)
+		return;
+	json_object *type_field = json_object_object_get(msg, FIELD_TYPE);
+	const char *type = type_field ? json_object_get_string(type_field) : "";
+	const char *put = NULL;
+	if (strcmp(type, RESPONSE_STATE_PERFLOW) == 0)
+		put = COMMAND_PUT_PERFLOW;
+	else if (strcmp(type, RESPONSE_STATE_MULTIFLOW) == 0)
+		put = COMMAND_PUT_MULTIFLOW;
+	else if (strcmp(type, EVENT_REPROCESS) == 0)
+		put = EVENT_REPROCESS;
+
+	if (put != NULL) {
+		json_object_object_add(msg, FIELD_TYPE,
+				json_object_new_string(put));
+		const char *str = json_object_to_json_string(msg);
+		conn_write_append_newline(conn, (char *)str, strlen(str));
+	}
+	json_object_put(msg);
+}
+
+static void *reader(void *arg)
+{
+	int conn = *(int *)arg;
+	const char *name = (conn == conn_state) ? "state" : "event";
+	SDMBNReader frames;
+	int len;
+	char *frame;
+
+	if (conn_reader_init(&frames, conn) < 0)
+		exit(1);
+	while ((frame = conn_reader_next(&frames, &len)) != NULL) {
+		if (wire_is_binary(frame, len))
+			handle_binary(name, conn, frame, len);
+		else
+			handle_json(name, conn, frame);
+		fflush(stdout);
+		conn_reader_release(&frames);
+	}
+	printf("%s: connection closed\n", name);
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned short port_state = 7790, port_event = 7791;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jrs:e:")) != -1) {
+		switch (opt) {
+		case 'j': binary = 0; break;
+		case 'r': reflect = 1; break;
+		case 's': port_state = atoi(optarg); break;
+		case 'e': port_event = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-j] [-r] [-s state_port] "
+					"[-e event_port]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* the middlebox opens the event channel right after the state one */
+	int server_state = listen_on(port_state);
+	int server_event = listen_on(port_event);
+	if (server_state < 0 || server_event < 0)
+		return 1;
+	if ((conn_state = accept_on(server_state, "state")) < 0
+			|| (conn_event = accept_on(server_event, "event")) < 0)
+		return 1;
+	fflush(stdout);
+
+	pthread_t state_thread, event_thread;
+	pthread_create(&state_thread, NULL, reader, &conn_state);
+	pthread_create(&event_thread, NULL, reader, &conn_event);
+
+	char line[65536];
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		int len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len > 0)
+			conn_write_append_newline(conn_state, line, len);
+	}
+	return 0;
+}
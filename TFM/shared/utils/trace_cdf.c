@@ -0,0 +1,154 @@
+/*
+ * trace_cdf -- latency distributions from a libsdmbn trace dump.
+ *
+ * Reads a file written by sdmbn_trace_dump (the trace_file setting or a
+ * trace command) and prints, for every record type and packet action, the
+ * number of records and percentiles of their elapsed time in microseconds.
+ * With -c it prints the CDF of the selected records instead, one
+ * "microseconds fraction" pair per line, ready for gnuplot.
+ *
+ * usage: trace_cdf [-c] [-t type] [-a action] file
+ *   -t  only records of this type, e.g. packet or get-perflow
+ *   -a  only packet records with this action, e.g. buffer or release
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../SDMBNTrace.h"
+
+static const char *types[] = { "", "packet", "get-perflow", "put-perflow",
+	"get-multiflow", "put-multiflow", "delete-perflow", "delete-multiflow",
+	"enable-events" };
+static const char *actions[] = { "", "nofilter", "process", "buffer",
+	"nobuffer", "drop", "injected", "release", "reprocess" };
+#define NTYPES   (int)(sizeof(types) / sizeof(types[0]))
+#define NACTIONS (int)(sizeof(actions) / sizeof(actions[0]))
+
+static int lookup(const char **names, int count, const char *name)
+{
+	int i;
+	for (i = 1; i < count; i++)
+		if (strcmp(names[i], name) == 0)
+			return i;
+	fprintf(stderr, "unknown name '%s'\n", name);
+	exit(1);
+}
+
+static int compare(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(int64_t *sorted, uint64_t n, double p)
+{
+	uint64_t i = (uint64_t)(p * (n - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+static void summary(const char *name, int64_t *sorted, uint64_t n)
+{
+	printf("%-26s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+			(unsigned long)n, percentile(sorted, n, 0),
+			percentile(sorted, n, 0.5), percentile(sorted, n, 0.9),
+			percentile(sorted, n, 0.99), percentile(sorted, n, 0.999),
+			percentile(sorted, n, 1));
+}
+
+static void cdf(int64_t *sorted, uint64_t n)
+{
+	uint64_t i;
+	for (i = 0; i < n; i++) {
+		/* one point per distinct value */
+		if (i + 1 < n && sorted[i + 1] == sorted[i])
+			continue;
+		printf("%.3f %.6f\n", sorted[i] / 1000.0, (double)(i + 1) / n);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	TraceFileHeader header;
+	TraceRecord *records;
+	int64_t *elapsed;
+	int type = 0, action = 0, print_cdf = 0, opt, t, a;
+	uint64_t i, n;
+	FILE *file;
+
+	while ((opt = getopt(argc, argv, "ct:a:")) != -1) {
+		switch (opt) {
+		case 'c': print_cdf = 1; break;
+		case 't': type = lookup(types, NTYPES, optarg); break;
+		case 'a': action = lookup(actions, NACTIONS, optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-c] [-t type] [-a action] file\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-c] [-t type] [-a action] file\n",
+				argv[0]);
+		return 1;
+	}
+
+	file = fopen(argv[optind], "r");
+	if (file == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != TRACE_VERSION
+			|| header.record_size != sizeof(TraceRecord)) {
+		fprintf(stderr, "%s: not a version %d trace\n", argv[optind],
+				TRACE_VERSION);
+		return 1;
+	}
+	records = malloc((header.count + 1) * sizeof(TraceRecord));
+	elapsed = malloc((header.count + 1) * sizeof(int64_t));
+	if (records == NULL || elapsed == NULL
+			|| fread(records, sizeof(TraceRecord), header.count, file)
+				!= header.count) {
+		fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+		return 1;
+	}
+	fclose(file);
+
+	if (print_cdf) {
+		for (i = 0, n = 0; i < header.count; i++)
+			if ((type == 0 || records[i].type == type)
+					&& (action == 0 || records[i].action == action))
+				elapsed[n++] = records[i].elapsed;
+		qsort(elapsed, n, sizeof(int64_t), compare);
+		cdf(elapsed, n);
+		return 0;
+	}
+
+	printf("%lu records, %lu dropped\n", (unsigned long)header.count,
+			(unsigned long)header.dropped);
+	printf("%-26s %9s %9s %9s %9s %9s %9s %9s\n", "usec", "count", "min",
+			"p50", "p90", "p99", "p99.9", "max");
+	for (t = 1; t < NTYPES; t++) {
+		if (type != 0 && t != type)
+			continue;
+		for (a = 0; a < NACTIONS; a++) {
+			char name[64];
+			if (action != 0 && a != action)
+				continue;
+			for (i = 0, n = 0; i < header.count; i++)
+				if (records[i].type == t && records[i].action == a)
+					elapsed[n++] = records[i].elapsed;
+			if (n == 0)
+				continue;
+			qsort(elapsed, n, sizeof(int64_t), compare);
+			snprintf(name, sizeof(name), "%s%s%s", types[t],
+					a ? " " : "", actions[a]);
+			summary(name, elapsed, n);
+		}
+	}
+	free(records);
+	free(elapsed);
+	return 0;
+}